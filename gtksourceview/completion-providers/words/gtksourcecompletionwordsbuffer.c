@@ -22,6 +22,7 @@
 #include "gtksourcecompletionwordsbuffer.h"
 #include "gtksourcecompletionwordsutils.h"
 
+#include <gtksourceview/gtksourcebuffer.h>
 #include <glib.h>
 
 #define GTK_SOURCE_COMPLETION_WORDS_BUFFER_GET_PRIVATE(object)(G_TYPE_INSTANCE_GET_PRIVATE((object), GTK_TYPE_SOURCE_COMPLETION_WORDS_BUFFER, GtkSourceCompletionWordsBufferPrivate))
@@ -66,6 +67,7 @@ struct _GtkSourceCompletionWordsBufferPrivate
 
 	guint lock_handler_id;
 	guint unlock_handler_id;
+	gulong large_file_tier_handler_id;
 
 	GtkTextMark *mark;
 	GHashTable *words;
@@ -191,6 +193,13 @@ gtk_source_completion_words_buffer_dispose (GObject *object)
 			                             buffer->priv->ext_signal_handlers[i]);
 		}
 
+		if (buffer->priv->large_file_tier_handler_id != 0)
+		{
+			g_signal_handler_disconnect (buffer->priv->buffer,
+			                             buffer->priv->large_file_tier_handler_id);
+			buffer->priv->large_file_tier_handler_id = 0;
+		}
+
 		g_object_unref (buffer->priv->buffer);
 		buffer->priv->buffer = NULL;
 	}
@@ -453,11 +462,30 @@ initiate_scan (GtkSourceCompletionWordsBuffer *buffer)
 	return FALSE;
 }
 
+/* Big buffers are not scanned, see GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS.
+ * The scan regions are kept so that scanning resumes if the buffer gets
+ * out of this tier. */
+static gboolean
+scan_deferred (GtkSourceCompletionWordsBuffer *buffer)
+{
+	GtkSourceLargeFileTier tier;
+
+	if (!GTK_IS_SOURCE_BUFFER (buffer->priv->buffer))
+	{
+		return FALSE;
+	}
+
+	tier = gtk_source_buffer_get_large_file_tier (GTK_SOURCE_BUFFER (buffer->priv->buffer));
+
+	return (tier & GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS) != 0;
+}
+
 static void
 install_initiate_scan (GtkSourceCompletionWordsBuffer *buffer)
 {
 	if (buffer->priv->batch_scan_id == 0 &&
-	    buffer->priv->initiate_scan_id == 0)
+	    buffer->priv->initiate_scan_id == 0 &&
+	    !scan_deferred (buffer))
 	{
 		buffer->priv->initiate_scan_id =
 			g_timeout_add_seconds_full (G_PRIORITY_LOW,
@@ -675,6 +703,32 @@ on_delete_range_cb (GtkTextBuffer                  *text_buffer,
 	}
 }
 
+static void
+on_large_file_tier_cb (GtkSourceCompletionWordsBuffer *buffer)
+{
+	if (!scan_deferred (buffer))
+	{
+		if (buffer->priv->scan_regions != NULL)
+		{
+			install_initiate_scan (buffer);
+		}
+
+		return;
+	}
+
+	if (buffer->priv->batch_scan_id != 0)
+	{
+		g_source_remove (buffer->priv->batch_scan_id);
+		buffer->priv->batch_scan_id = 0;
+	}
+
+	if (buffer->priv->initiate_scan_id != 0)
+	{
+		g_source_remove (buffer->priv->initiate_scan_id);
+		buffer->priv->initiate_scan_id = 0;
+	}
+}
+
 static void
 connect_buffer (GtkSourceCompletionWordsBuffer *buffer)
 {
@@ -693,6 +747,15 @@ connect_buffer (GtkSourceCompletionWordsBuffer *buffer)
 		                  G_CALLBACK (on_delete_range_cb),
 		                  buffer);
 
+	if (GTK_IS_SOURCE_BUFFER (buffer->priv->buffer))
+	{
+		buffer->priv->large_file_tier_handler_id =
+			g_signal_connect_swapped (buffer->priv->buffer,
+			                          "notify::large-file-tier",
+			                          G_CALLBACK (on_large_file_tier_cb),
+			                          buffer);
+	}
+
 	gtk_text_buffer_get_bounds (buffer->priv->buffer,
 	                            &start,
 	                            &end);
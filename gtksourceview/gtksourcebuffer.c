@@ -90,6 +90,7 @@ enum {
 	UNDO,
 	REDO,
 	BRACKET_MATCHED,
+	HIGHLIGHT_DEGRADED,
 	LAST_SIGNAL
 };
 
@@ -103,7 +104,10 @@ enum {
 	PROP_MAX_UNDO_LEVELS,
 	PROP_LANGUAGE,
 	PROP_STYLE_SCHEME,
-	PROP_UNDO_MANAGER
+	PROP_UNDO_MANAGER,
+	PROP_DEGRADED_LINES,
+	PROP_LARGE_FILE_POLICY,
+	PROP_LARGE_FILE_TIER
 };
 
 struct _GtkSourceBufferPrivate
@@ -129,6 +133,14 @@ struct _GtkSourceBufferPrivate
 	gint                   max_undo_levels;
 
 	gint                   allow_bracket_match:1;
+
+	guint                  degraded_lines;
+
+	GtkSourceLargeFilePolicy *large_file_policy;
+	GtkSourceLargeFileTier large_file_tier;
+	/* Number of lines longer than the policy allows, see
+	 * count_long_lines(). */
+	gint                   long_lines;
 };
 
 G_DEFINE_TYPE (GtkSourceBuffer, gtk_source_buffer, GTK_TYPE_TEXT_BUFFER)
@@ -176,6 +188,9 @@ static void 	 gtk_source_buffer_real_apply_tag	(GtkTextBuffer		 *buffer,
 
 static void 	 gtk_source_buffer_real_mark_deleted	(GtkTextBuffer		 *buffer,
 							 GtkTextMark		 *mark);
+static void	 gtk_source_buffer_real_begin_user_action
+							(GtkTextBuffer		 *buffer);
+static void	 gtk_source_buffer_real_end_user_action	(GtkTextBuffer		 *buffer);
 static gboolean	 gtk_source_buffer_find_bracket_match_with_limit (GtkSourceBuffer *buffer,
 								  GtkTextIter     *orig,
 								  GtkSourceBracketMatchType *result,
@@ -183,6 +198,20 @@ static gboolean	 gtk_source_buffer_find_bracket_match_with_limit (GtkSourceBuffe
 
 static void	 gtk_source_buffer_real_undo		(GtkSourceBuffer	 *buffer);
 static void	 gtk_source_buffer_real_redo		(GtkSourceBuffer	 *buffer);
+static void	 gtk_source_buffer_real_highlight_degraded
+							(GtkSourceBuffer	 *buffer,
+							 GtkTextIter		 *start,
+							 GtkTextIter		 *end);
+static gint	 count_long_lines			(GtkSourceBuffer	 *buffer,
+							 gint			  start_line,
+							 gint			  end_line);
+static void	 long_lines_changed			(GtkSourceBuffer	 *buffer,
+							 gint			  old_long_lines,
+							 gint			  start_line,
+							 gint			  end_line);
+static void	 update_large_file_tier			(GtkSourceBuffer	 *buffer);
+static void	 large_file_policy_notify_cb		(GtkSourceBuffer	 *buffer);
+static gint	 get_effective_max_undo_levels		(GtkSourceBuffer	 *buffer);
 
 static void
 gtk_source_buffer_class_init (GtkSourceBufferClass *klass)
@@ -209,6 +238,9 @@ gtk_source_buffer_class_init (GtkSourceBufferClass *klass)
 	tb_class->mark_set	= gtk_source_buffer_real_mark_set;
 	tb_class->mark_deleted	= gtk_source_buffer_real_mark_deleted;
 
+	tb_class->begin_user_action = gtk_source_buffer_real_begin_user_action;
+	tb_class->end_user_action   = gtk_source_buffer_real_end_user_action;
+
 	klass->undo = gtk_source_buffer_real_undo;
 	klass->redo = gtk_source_buffer_real_redo;
 
@@ -306,6 +338,62 @@ gtk_source_buffer_class_init (GtkSourceBufferClass *klass)
 	                                                      GTK_TYPE_SOURCE_UNDO_MANAGER,
 	                                                      G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
 
+	/**
+	 * GtkSourceBuffer:degraded-lines:
+	 *
+	 * Number of lines analyzing which took too much time, so that
+	 * they were highlighted only partially, see
+	 * #GtkSourceBuffer::highlight-degraded. A line is counted again
+	 * only if it is still too slow after it is edited.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_DEGRADED_LINES,
+					 g_param_spec_uint ("degraded-lines",
+							    _("Degraded lines"),
+							    _("Number of lines highlighted "
+							      "only partially"),
+							    0,
+							    G_MAXUINT,
+							    0,
+							    G_PARAM_READABLE));
+
+	/**
+	 * GtkSourceBuffer:large-file-policy:
+	 *
+	 * The #GtkSourceLargeFilePolicy deciding which features to turn
+	 * off when the buffer gets big, or %NULL to keep all of them.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LARGE_FILE_POLICY,
+					 g_param_spec_object ("large-file-policy",
+							      _("Large file policy"),
+							      _("Thresholds for turning off "
+								"features in large buffers"),
+							      GTK_TYPE_SOURCE_LARGE_FILE_POLICY,
+							      G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceBuffer:large-file-tier:
+	 *
+	 * The features currently turned off or restricted because of the
+	 * size of the buffer, see #GtkSourceBuffer:large-file-policy.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LARGE_FILE_TIER,
+					 g_param_spec_flags ("large-file-tier",
+							     _("Large file tier"),
+							     _("Features turned off because "
+							       "of the size of the buffer"),
+							     GTK_TYPE_SOURCE_LARGE_FILE_TIER,
+							     GTK_SOURCE_LARGE_FILE_TIER_NONE,
+							     G_PARAM_READABLE));
+
 	param_types[0] = GTK_TYPE_TEXT_ITER | G_SIGNAL_TYPE_STATIC_SCOPE;
 	param_types[1] = GTK_TYPE_TEXT_ITER | G_SIGNAL_TYPE_STATIC_SCOPE;
 
@@ -377,6 +465,30 @@ gtk_source_buffer_class_init (GtkSourceBufferClass *klass)
 			  GTK_TYPE_TEXT_ITER,
 			  GTK_TYPE_SOURCE_BRACKET_MATCH_TYPE);
 
+	/**
+	 * GtkSourceBuffer::highlight-degraded:
+	 * @buffer: the buffer that received the signal
+	 * @start: the start of the line
+	 * @end: the end of the line
+	 *
+	 * The ::highlight-degraded signal is emitted when analyzing a line
+	 * took too much time. The highlighting engine gives up on the rest
+	 * of the line, which keeps the style of the context it was in, and
+	 * goes on with the next line. Until the line is edited, it is not
+	 * analyzed again and the signal is not emitted for it again.
+	 *
+	 * Since: 3.0
+	 */
+	buffer_signals[HIGHLIGHT_DEGRADED] =
+	    g_signal_new_class_handler ("highlight-degraded",
+					G_OBJECT_CLASS_TYPE (object_class),
+					G_SIGNAL_RUN_LAST,
+					G_CALLBACK (gtk_source_buffer_real_highlight_degraded),
+					NULL, NULL,
+					_gtksourceview_marshal_VOID__BOXED_BOXED,
+					G_TYPE_NONE,
+					2, param_types[0], param_types[1]);
+
 	g_type_class_add_private (object_class, sizeof (GtkSourceBufferPrivate));
 }
 
@@ -444,6 +556,9 @@ gtk_source_buffer_init (GtkSourceBuffer *buffer)
 
 	if (priv->style_scheme != NULL)
 		g_object_ref (priv->style_scheme);
+
+	priv->large_file_policy = NULL;
+	priv->large_file_tier = GTK_SOURCE_LARGE_FILE_TIER_NONE;
 }
 
 static GObject *
@@ -504,6 +619,15 @@ gtk_source_buffer_dispose (GObject *object)
 		set_undo_manager (buffer, NULL);
 	}
 
+	if (buffer->priv->large_file_policy != NULL)
+	{
+		g_signal_handlers_disconnect_by_func (buffer->priv->large_file_policy,
+						      G_CALLBACK (large_file_policy_notify_cb),
+						      buffer);
+		g_object_unref (buffer->priv->large_file_policy);
+		buffer->priv->large_file_policy = NULL;
+	}
+
 	if (buffer->priv->highlight_engine != NULL)
 	{
 		_gtk_source_engine_attach_buffer (buffer->priv->highlight_engine, NULL);
@@ -570,6 +694,11 @@ gtk_source_buffer_set_property (GObject      *object,
 			                                    g_value_get_object (value));
 			break;
 
+		case PROP_LARGE_FILE_POLICY:
+			gtk_source_buffer_set_large_file_policy (source_buffer,
+								 g_value_get_object (value));
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -625,6 +754,18 @@ gtk_source_buffer_get_property (GObject    *object,
 			g_value_set_object (value, source_buffer->priv->undo_manager);
 			break;
 
+		case PROP_DEGRADED_LINES:
+			g_value_set_uint (value, source_buffer->priv->degraded_lines);
+			break;
+
+		case PROP_LARGE_FILE_POLICY:
+			g_value_set_object (value, source_buffer->priv->large_file_policy);
+			break;
+
+		case PROP_LARGE_FILE_TIER:
+			g_value_set_flags (value, source_buffer->priv->large_file_tier);
+			break;
+
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 			break;
@@ -817,7 +958,8 @@ gtk_source_buffer_move_cursor (GtkTextBuffer     *buffer,
 					    &end);
 	}
 
-	if (!source_buffer->priv->highlight_brackets)
+	if (!source_buffer->priv->highlight_brackets ||
+	    (source_buffer->priv->large_file_tier & GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING))
 		return;
 
 	start = *iter;
@@ -926,6 +1068,8 @@ gtk_source_buffer_real_insert_text (GtkTextBuffer *buffer,
 				    gint           len)
 {
 	gint start_offset;
+	gint start_line;
+	gint old_long_lines;
 
 	g_return_if_fail (GTK_IS_SOURCE_BUFFER (buffer));
 	g_return_if_fail (iter != NULL);
@@ -933,6 +1077,9 @@ gtk_source_buffer_real_insert_text (GtkTextBuffer *buffer,
 	g_return_if_fail (gtk_text_iter_get_buffer (iter) == buffer);
 
 	start_offset = gtk_text_iter_get_offset (iter);
+	start_line = gtk_text_iter_get_line (iter);
+	old_long_lines = count_long_lines (GTK_SOURCE_BUFFER (buffer),
+					   start_line, start_line);
 
 	/*
 	 * iter is invalidated when
@@ -945,6 +1092,11 @@ gtk_source_buffer_real_insert_text (GtkTextBuffer *buffer,
 	gtk_source_buffer_content_inserted (buffer,
 					    start_offset,
 					    gtk_text_iter_get_offset (iter));
+
+	long_lines_changed (GTK_SOURCE_BUFFER (buffer),
+			    old_long_lines,
+			    start_line,
+			    gtk_text_iter_get_line (iter));
 }
 
 /* insert_pixbuf and insert_child_anchor do nothing except notifying
@@ -956,12 +1108,16 @@ gtk_source_buffer_real_insert_pixbuf (GtkTextBuffer *buffer,
 				      GdkPixbuf     *pixbuf)
 {
 	gint start_offset;
+	gint line;
+	gint old_long_lines;
 
 	g_return_if_fail (GTK_IS_SOURCE_BUFFER (buffer));
 	g_return_if_fail (iter != NULL);
 	g_return_if_fail (gtk_text_iter_get_buffer (iter) == buffer);
 
 	start_offset = gtk_text_iter_get_offset (iter);
+	line = gtk_text_iter_get_line (iter);
+	old_long_lines = count_long_lines (GTK_SOURCE_BUFFER (buffer), line, line);
 
 	/*
 	 * iter is invalidated when
@@ -974,6 +1130,8 @@ gtk_source_buffer_real_insert_pixbuf (GtkTextBuffer *buffer,
 	gtk_source_buffer_content_inserted (buffer,
 					    start_offset,
 					    gtk_text_iter_get_offset (iter));
+
+	long_lines_changed (GTK_SOURCE_BUFFER (buffer), old_long_lines, line, line);
 }
 
 static void
@@ -982,12 +1140,16 @@ gtk_source_buffer_real_insert_anchor (GtkTextBuffer      *buffer,
 				      GtkTextChildAnchor *anchor)
 {
 	gint start_offset;
+	gint line;
+	gint old_long_lines;
 
 	g_return_if_fail (GTK_IS_SOURCE_BUFFER (buffer));
 	g_return_if_fail (iter != NULL);
 	g_return_if_fail (gtk_text_iter_get_buffer (iter) == buffer);
 
 	start_offset = gtk_text_iter_get_offset (iter);
+	line = gtk_text_iter_get_line (iter);
+	old_long_lines = count_long_lines (GTK_SOURCE_BUFFER (buffer), line, line);
 
 	/*
 	 * iter is invalidated when
@@ -1000,6 +1162,8 @@ gtk_source_buffer_real_insert_anchor (GtkTextBuffer      *buffer,
 	gtk_source_buffer_content_inserted (buffer,
 					    start_offset,
 					    gtk_text_iter_get_offset (iter));
+
+	long_lines_changed (GTK_SOURCE_BUFFER (buffer), old_long_lines, line, line);
 }
 
 static void
@@ -1008,6 +1172,8 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 				     GtkTextIter   *end)
 {
 	gint offset, length;
+	gint line;
+	gint old_long_lines;
 	GtkTextMark *mark;
 	GtkTextIter iter;
 	GtkSourceBuffer *source_buffer = GTK_SOURCE_BUFFER (buffer);
@@ -1021,6 +1187,10 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 	gtk_text_iter_order (start, end);
 	offset = gtk_text_iter_get_offset (start);
 	length = gtk_text_iter_get_offset (end) - offset;
+	line = gtk_text_iter_get_line (start);
+	old_long_lines = count_long_lines (source_buffer,
+					   line,
+					   gtk_text_iter_get_line (end));
 
 	GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->delete_range (buffer, start, end);
 
@@ -1032,6 +1202,9 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 	if (source_buffer->priv->highlight_engine != NULL)
 		_gtk_source_engine_text_deleted (source_buffer->priv->highlight_engine,
 						 offset, length);
+
+	/* The lines the deleted text was on are joined into one */
+	long_lines_changed (source_buffer, old_long_lines, line, line);
 }
 
 /* This describes a mask of relevant context classes for highlighting matching
@@ -1302,7 +1475,7 @@ gtk_source_buffer_set_max_undo_levels (GtkSourceBuffer *buffer,
 	if (GTK_IS_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager))
 	{
 		gtk_source_undo_manager_default_set_max_undo_levels (GTK_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager),
-		                                                     max_undo_levels);
+		                                                     get_effective_max_undo_levels (buffer));
 	}
 
 	g_object_notify (G_OBJECT (buffer), "max-undo-levels");
@@ -1575,6 +1748,286 @@ gtk_source_buffer_ensure_highlight (GtkSourceBuffer   *buffer,
 					     TRUE);
 }
 
+static void
+gtk_source_buffer_real_highlight_degraded (GtkSourceBuffer *buffer,
+					   G_GNUC_UNUSED GtkTextIter *start,
+					   G_GNUC_UNUSED GtkTextIter *end)
+{
+	buffer->priv->degraded_lines++;
+	g_object_notify (G_OBJECT (buffer), "degraded-lines");
+}
+
+/**
+ * gtk_source_buffer_get_degraded_lines:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Returns how many lines the highlighting engine gave up on because
+ * analyzing them took too much time, see
+ * #GtkSourceBuffer::highlight-degraded. A line is counted again only
+ * if it is still too slow after it is edited.
+ *
+ * Return value: the number of lines highlighted only partially.
+ *
+ * Since: 3.0
+ **/
+guint
+gtk_source_buffer_get_degraded_lines (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_BUFFER (buffer), 0);
+
+	return buffer->priv->degraded_lines;
+}
+
+/**
+ * count_long_lines:
+ *
+ * @buffer: a #GtkSourceBuffer.
+ * @start_line: first line to check.
+ * @end_line: last line to check.
+ *
+ * Returns: how many of the given lines are longer than the policy
+ * allows.
+ */
+static gint
+count_long_lines (GtkSourceBuffer *buffer,
+		  gint             start_line,
+		  gint             end_line)
+{
+	GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
+	GtkTextIter iter;
+	gint max_line_length;
+	gint count = 0;
+
+	if (buffer->priv->large_file_policy == NULL)
+		return 0;
+
+	max_line_length = gtk_source_large_file_policy_get_max_line_length (buffer->priv->large_file_policy);
+
+	if (max_line_length < 0)
+		return 0;
+
+	gtk_text_buffer_get_iter_at_line (text_buffer, &iter, start_line);
+
+	do
+	{
+		if (gtk_text_iter_get_chars_in_line (&iter) > max_line_length)
+			++count;
+	}
+	while (gtk_text_iter_get_line (&iter) < end_line &&
+	       gtk_text_iter_forward_line (&iter));
+
+	return count;
+}
+
+/**
+ * long_lines_changed:
+ *
+ * @buffer: a #GtkSourceBuffer.
+ * @old_long_lines: number of long lines the edit replaced.
+ * @start_line: first line of the edited text.
+ * @end_line: last line of the edited text.
+ *
+ * Updates the number of long lines after an edit, looking only at the
+ * lines it touched, and the tier for the new size of the buffer.
+ */
+static void
+long_lines_changed (GtkSourceBuffer *buffer,
+		    gint             old_long_lines,
+		    gint             start_line,
+		    gint             end_line)
+{
+	buffer->priv->long_lines += count_long_lines (buffer, start_line, end_line) -
+				    old_long_lines;
+	g_assert (buffer->priv->long_lines >= 0);
+
+	update_large_file_tier (buffer);
+}
+
+static gint
+get_effective_max_undo_levels (GtkSourceBuffer *buffer)
+{
+	gint max_undo_levels = buffer->priv->max_undo_levels;
+
+	if (buffer->priv->large_file_tier & GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO)
+	{
+		gint cap;
+
+		cap = gtk_source_large_file_policy_get_max_undo_levels (buffer->priv->large_file_policy);
+
+		if (cap >= 0 && (max_undo_levels < 0 || max_undo_levels > cap))
+			max_undo_levels = cap;
+	}
+
+	return max_undo_levels;
+}
+
+/**
+ * update_large_file_tier:
+ *
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Asks the policy which features the buffer should turn off with its
+ * current size, and turns them off or back on. The highlighting engine
+ * and the completion providers watch the #GtkSourceBuffer:large-file-tier
+ * property for the features they implement.
+ */
+static void
+update_large_file_tier (GtkSourceBuffer *buffer)
+{
+	GtkSourceLargeFileTier tier = GTK_SOURCE_LARGE_FILE_TIER_NONE;
+	GtkSourceLargeFileTier changed;
+
+	if (buffer->priv->large_file_policy != NULL)
+	{
+		tier = gtk_source_large_file_policy_get_tier (buffer->priv->large_file_policy,
+							      gtk_text_buffer_get_char_count (GTK_TEXT_BUFFER (buffer)),
+							      buffer->priv->long_lines > 0);
+	}
+
+	changed = tier ^ buffer->priv->large_file_tier;
+
+	if (changed == 0)
+		return;
+
+	buffer->priv->large_file_tier = tier;
+
+	if ((changed & GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO) &&
+	    GTK_IS_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager))
+	{
+		gtk_source_undo_manager_default_set_max_undo_levels (GTK_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager),
+		                                                     get_effective_max_undo_levels (buffer));
+	}
+
+	/* Remove or bring back the bracket match tag */
+	if ((changed & GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING) &&
+	    buffer->priv->constructed)
+	{
+		GtkTextMark *mark;
+		GtkTextIter iter;
+
+		mark = gtk_text_buffer_get_insert (GTK_TEXT_BUFFER (buffer));
+		gtk_text_buffer_get_iter_at_mark (GTK_TEXT_BUFFER (buffer), &iter, mark);
+		gtk_source_buffer_move_cursor (GTK_TEXT_BUFFER (buffer), &iter, mark);
+	}
+
+	g_object_notify (G_OBJECT (buffer), "large-file-tier");
+}
+
+static void
+large_file_policy_notify_cb (GtkSourceBuffer *buffer)
+{
+	buffer->priv->long_lines = 0;
+
+	/* Before the tag table is set the buffer is empty, see
+	 * gtk_source_buffer_set_highlight_matching_brackets() */
+	if (!buffer->priv->constructed)
+		return;
+
+	/* The thresholds changed, this is the only time all the lines
+	 * are looked at */
+	buffer->priv->long_lines =
+		count_long_lines (buffer,
+				  0,
+				  gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)) - 1);
+	update_large_file_tier (buffer);
+
+	/* The tier may be the same but the cap on undo levels not */
+	if ((buffer->priv->large_file_tier & GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO) &&
+	    GTK_IS_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager))
+	{
+		gtk_source_undo_manager_default_set_max_undo_levels (GTK_SOURCE_UNDO_MANAGER_DEFAULT (buffer->priv->undo_manager),
+		                                                     get_effective_max_undo_levels (buffer));
+	}
+}
+
+/**
+ * gtk_source_buffer_get_large_file_policy:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Returns the policy deciding which features to turn off when the
+ * buffer gets big, see gtk_source_buffer_set_large_file_policy().
+ *
+ * Returns: (transfer none): the #GtkSourceLargeFilePolicy of the buffer,
+ * or %NULL.
+ *
+ * Since: 3.0
+ **/
+GtkSourceLargeFilePolicy *
+gtk_source_buffer_get_large_file_policy (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_BUFFER (buffer), NULL);
+
+	return buffer->priv->large_file_policy;
+}
+
+/**
+ * gtk_source_buffer_set_large_file_policy:
+ * @buffer: a #GtkSourceBuffer.
+ * @policy: (allow-none): a #GtkSourceLargeFilePolicy or %NULL.
+ *
+ * Sets the policy deciding which features to turn off when the buffer
+ * gets big. Buffers have no policy by default, and with %NULL all
+ * features stay on whatever the size of the buffer. A policy may be
+ * shared by several buffers, changing its thresholds affects all of
+ * them.
+ *
+ * Since: 3.0
+ **/
+void
+gtk_source_buffer_set_large_file_policy (GtkSourceBuffer          *buffer,
+					 GtkSourceLargeFilePolicy *policy)
+{
+	g_return_if_fail (GTK_IS_SOURCE_BUFFER (buffer));
+	g_return_if_fail (policy == NULL || GTK_IS_SOURCE_LARGE_FILE_POLICY (policy));
+
+	if (policy == buffer->priv->large_file_policy)
+		return;
+
+	if (buffer->priv->large_file_policy != NULL)
+	{
+		g_signal_handlers_disconnect_by_func (buffer->priv->large_file_policy,
+						      G_CALLBACK (large_file_policy_notify_cb),
+						      buffer);
+		g_object_unref (buffer->priv->large_file_policy);
+	}
+
+	buffer->priv->large_file_policy = policy;
+
+	if (policy != NULL)
+	{
+		g_object_ref (policy);
+		g_signal_connect_swapped (policy,
+					  "notify",
+					  G_CALLBACK (large_file_policy_notify_cb),
+					  buffer);
+	}
+
+	large_file_policy_notify_cb (buffer);
+
+	g_object_notify (G_OBJECT (buffer), "large-file-policy");
+}
+
+/**
+ * gtk_source_buffer_get_large_file_tier:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Returns the features currently turned off or restricted because of
+ * the size of the buffer, see gtk_source_buffer_set_large_file_policy().
+ * Applications can watch #GtkSourceBuffer:large-file-tier to tell the
+ * user about it.
+ *
+ * Returns: the active #GtkSourceLargeFileTier flags.
+ *
+ * Since: 3.0
+ **/
+GtkSourceLargeFileTier
+gtk_source_buffer_get_large_file_tier (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_BUFFER (buffer), GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	return buffer->priv->large_file_tier;
+}
+
 /**
  * gtk_source_buffer_set_style_scheme:
  * @buffer: a #GtkSourceBuffer.
@@ -1792,6 +2245,33 @@ gtk_source_buffer_real_mark_deleted (GtkTextBuffer *buffer,
 		GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->mark_deleted (buffer, mark);
 }
 
+static void
+gtk_source_buffer_real_begin_user_action (GtkTextBuffer *buffer)
+{
+	GtkSourceBuffer *source_buffer = GTK_SOURCE_BUFFER (buffer);
+
+	/* A user action, e.g. replacing all occurrences of a word, may
+	 * change text in many places, let the engine collect the edits
+	 * and process them at once. */
+	if (source_buffer->priv->highlight_engine != NULL)
+		_gtk_source_engine_begin_batch (source_buffer->priv->highlight_engine);
+
+	if (GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->begin_user_action != NULL)
+		GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->begin_user_action (buffer);
+}
+
+static void
+gtk_source_buffer_real_end_user_action (GtkTextBuffer *buffer)
+{
+	GtkSourceBuffer *source_buffer = GTK_SOURCE_BUFFER (buffer);
+
+	if (source_buffer->priv->highlight_engine != NULL)
+		_gtk_source_engine_end_batch (source_buffer->priv->highlight_engine);
+
+	if (GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->end_user_action != NULL)
+		GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->end_user_action (buffer);
+}
+
 static void
 gtk_source_buffer_real_undo (GtkSourceBuffer *buffer)
 {
@@ -2408,7 +2888,7 @@ gtk_source_buffer_set_undo_manager (GtkSourceBuffer      *buffer,
 	{
 		manager = g_object_new (GTK_TYPE_SOURCE_UNDO_MANAGER_DEFAULT,
 		                        "buffer", buffer,
-		                        "max-undo-levels", buffer->priv->max_undo_levels,
+		                        "max-undo-levels", get_effective_max_undo_levels (buffer),
 		                        NULL);
 	}
 	else
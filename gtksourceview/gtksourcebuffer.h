@@ -27,6 +27,7 @@
 
 #include <gtk/gtk.h>
 #include <gtksourceview/gtksourcelanguage.h>
+#include <gtksourceview/gtksourcelargefilepolicy.h>
 #include <gtksourceview/gtksourcemark.h>
 #include <gtksourceview/gtksourcestylescheme.h>
 #include <gtksourceview/gtksourceundomanager.h>
@@ -179,6 +180,15 @@ GtkSourceUndoManager	*gtk_source_buffer_get_undo_manager	(GtkSourceBuffer	*buffe
 void			 gtk_source_buffer_set_undo_manager	(GtkSourceBuffer	*buffer,
 								 GtkSourceUndoManager	*manager);
 
+guint			 gtk_source_buffer_get_degraded_lines	(GtkSourceBuffer	*buffer);
+
+GtkSourceLargeFilePolicy *gtk_source_buffer_get_large_file_policy
+								(GtkSourceBuffer	*buffer);
+void			 gtk_source_buffer_set_large_file_policy
+								(GtkSourceBuffer	*buffer,
+								 GtkSourceLargeFilePolicy *policy);
+GtkSourceLargeFileTier	 gtk_source_buffer_get_large_file_tier	(GtkSourceBuffer	*buffer);
+
 /* private */
 void			 _gtk_source_buffer_update_highlight	(GtkSourceBuffer        *buffer,
 								 const GtkTextIter      *start,
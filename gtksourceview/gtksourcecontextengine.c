@@ -26,11 +26,15 @@
 #include "gtksourcelanguage-private.h"
 #include "gtksourcebuffer.h"
 #include "gtksourcestyle-private.h"
+#include "gtksourcehighlighter.h"
 
 #include <glib.h>
 
 #include <errno.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #undef ENABLE_DEBUG
 #undef ENABLE_PROFILE
@@ -66,18 +70,64 @@
 #define FIRST_UPDATE_TIME_SLICE		10
 /* Priority of long running idle which is used to analyze whole buffer, if
  * the engine wasn't quick enough to analyze it in one shot. */
-/* FIXME this priority is low, since we don't want to block other gui stuff.
- * But, e.g. if we have a big file, and scroll down, we do want the engine
- * to analyze quickly. Perhaps we want to reinstall first_update in case
- * of expose events or something. */
+/* This priority is low, since we don't want to block other gui stuff. */
 #define INCREMENTAL_UPDATE_PRIORITY	G_PRIORITY_LOW
+/* Priority of the idle worker while the view waits for some region which
+ * is not analyzed yet (e.g. after scrolling down in a big file). It is
+ * lower than GDK redraw priority so that typing and scrolling stay
+ * responsive, but higher than INCREMENTAL_UPDATE_PRIORITY. */
+#define VIEWPORT_UPDATE_PRIORITY	(G_PRIORITY_HIGH_IDLE + 30)
 /* Maximal amount of time allowed to spent in one cycle of background idle. */
 #define INCREMENTAL_UPDATE_TIME_SLICE	30
 
 /* Maximal amount of time allowed to spent highlihting a single line. If it
- * is not enough, then highlighting is disabled. */
+ * is not enough, the rest of the line is left in the context it got to,
+ * see analyze_line(), and the line is not analyzed again until it is
+ * edited, see SlowLine. */
 #define MAX_TIME_FOR_ONE_LINE		2000
 
+/* If at least this many characters are left to analyze, the buffer is
+ * analyzed in a separate thread instead of in idle, see BACKGROUND
+ * ANALYSIS below. */
+#define BACKGROUND_ANALYSIS_MIN_CHARS	(1 << 20)
+/* The background analysis splits the text into at most this many chunks,
+ * of at least PARALLEL_ANALYSIS_MIN_CHUNK bytes each, and analyzes them
+ * in parallel. */
+#define PARALLEL_ANALYSIS_MAX_CHUNKS	16
+#define PARALLEL_ANALYSIS_MIN_CHUNK	(1 << 19)
+/* While the background analysis runs, text the view asks for is analyzed
+ * starting this many lines before it, see background_job_window(). */
+#define BACKGROUND_WINDOW_MARGIN_LINES	200
+
+/* Maximal number of resolved end regexes cached by a definition,
+ * see regex_resolve(). */
+#define END_CACHE_MAX_SIZE		256
+
+/* Maximal number of unreferenced contexts kept for reuse among the
+ * children of a context with the same definition, see context_release(). */
+#define CONTEXT_CACHE_MAX_IDLE		32
+
+/* A checkpoint is recorded at every CHECKPOINT_INTERVAL-th line. */
+#define CHECKPOINT_INTERVAL		64
+
+/* When this many edits are not applied to the whole tree yet, they are
+ * applied to all segments at once, see pending_edits_add(). */
+#define PENDING_EDITS_MAX		256
+
+/* Number of nodes in one block of a NodePool. */
+#define NODE_POOL_BLOCK_NODES		256
+
+/* update_syntax() fetches text from the buffer in chunks of this many
+ * lines, see LineChunk. */
+#define LINE_CHUNK_LINES		128
+
+/* In buffers with at least this many lines, or when the buffer is in the
+ * GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT tier, syntax tags are kept
+ * only on text near the region the view shows, at most
+ * TAGS_WINDOW_MARGIN_LINES lines away from it, see evict_tags(). */
+#define TAGS_WINDOW_MIN_LINES		200000
+#define TAGS_WINDOW_MARGIN_LINES	500
+
 #define GTK_SOURCE_CONTEXT_ENGINE_ERROR (gtk_source_context_engine_error_quark ())
 
 /* Returns the definition corrsponding to the specified id. */
@@ -124,6 +174,7 @@
 typedef struct _RegexInfo RegexInfo;
 typedef struct _RegexAndMatch RegexAndMatch;
 typedef struct _Regex Regex;
+typedef struct _RegexPrefilter RegexPrefilter;
 typedef struct _SubPatternDefinition SubPatternDefinition;
 typedef struct _SubPattern SubPattern;
 typedef struct _Segment Segment;
@@ -133,8 +184,20 @@ typedef struct _ContextDefinition ContextDefinition;
 typedef struct _DefinitionChild DefinitionChild;
 typedef struct _DefinitionsIter DefinitionsIter;
 typedef struct _LineInfo LineInfo;
+typedef struct _LineChunk LineChunk;
 typedef struct _InvalidRegion InvalidRegion;
 typedef struct _ContextClassTag ContextClassTag;
+typedef struct _BackgroundJob BackgroundJob;
+typedef struct _BackgroundChunk BackgroundChunk;
+typedef struct _Checkpoint Checkpoint;
+typedef struct _PendingEdit PendingEdit;
+typedef struct _NodePool NodePool;
+typedef struct _EditMapPiece EditMapPiece;
+typedef struct _TagSpan TagSpan;
+typedef struct _PartialLine PartialLine;
+typedef struct _BatchRange BatchRange;
+typedef struct _SlowLine SlowLine;
+typedef struct _DefinitionStats DefinitionStats;
 
 typedef enum {
 	GTK_SOURCE_CONTEXT_ENGINE_ERROR_DUPLICATED_ID = 0,
@@ -170,6 +233,18 @@ struct _RegexAndMatch
 {
 	GRegex			*regex;
 	GMatchInfo		*match;
+	/* See regex_prefilter_new(), NULL for most regexes. */
+	RegexPrefilter		*prefilter;
+};
+
+struct _RegexPrefilter
+{
+	/* Bitmask of bytes a match may start with. */
+	guint8			 bytes[32];
+	/* The only byte in bytes, or -1. */
+	gint			 single_byte;
+	/* Whether the regex may match the empty string at the end. */
+	gboolean		 at_end;
 };
 
 /* We do not use directly GRegex to allow the use of "\%{...@start}". */
@@ -179,7 +254,9 @@ struct _Regex
 		RegexAndMatch	 regex;
 		RegexInfo	 info;
 	} u;
-	guint			 ref_count;
+	/* Regexes stored in definitions are shared between engines, which may
+	 * run in different threads, so it is changed atomically. */
+	volatile gint		 ref_count;
 	guint			 resolved : 1;
 };
 
@@ -214,10 +291,31 @@ struct _ContextDefinition
 	 * context. */
 	Regex			*reg_all;
 
+	/* End regexes resolved by regex_resolve(), indexed by the
+	 * expanded pattern. Created when first needed. */
+	GHashTable		*end_cache;
+	guint			 end_cache_hits;
+	guint			 end_cache_misses;
+
+	/* Contexts of this definition found unreferenced in the cache,
+	 * and dropped from it, see context_release(). Shared by engines
+	 * in different threads, so updated atomically. */
+	volatile gint		 context_cache_reused;
+	volatile gint		 context_cache_evicted;
+
 	guint                    flags : 8;
 	guint                    ref_count : 24;
 };
 
+/* Matches tried with regexes of a definition and the time they took,
+ * in microseconds, see regex_match(). */
+struct _DefinitionStats
+{
+	const gchar		*id;
+	guint64			 matches;
+	gint64			 usec;
+};
+
 struct _SubPatternDefinition
 {
 #ifdef NEED_DEBUG_ID
@@ -297,6 +395,8 @@ struct _Context
 	guint			 ref_count;
 	/* see context_freeze() */
 	guint                    frozen : 1;
+	/* Unreferenced and kept for reuse, see context_release() */
+	guint			 idle : 1;
 	/* Do all the ancestors extend their parent? */
 	guint			 all_ancestors_extend : 1;
 	/* Do not apply styles to children contexts */
@@ -313,6 +413,8 @@ struct _ContextPtr
 		Context		*context;
 		GHashTable	*hash; /* char* -> Context* */
 	} u;
+	/* Idle contexts in hash, most recently released first. */
+	GQueue			*idle;
 	guint			 fixed : 1;
 };
 
@@ -349,6 +451,11 @@ struct _Segment
 	/* Whether this segment is a whole good segment, or it's an
 	 * an end of bigger one left after erase_segments() call. */
 	guint			 is_start : 1;
+	/* Whether some checkpoint points to this segment. */
+	guint			 checkpoint : 1;
+
+	/* Number of edits applied to the offsets, see segment_sync(). */
+	guint			 stamp;
 };
 
 struct _SubPattern
@@ -359,6 +466,61 @@ struct _SubPattern
 	SubPattern		*next;
 };
 
+/* The state analysis was in at the start of a line, remembered so that
+ * analysis can resume there and searches in the tree near that line
+ * don't need to start from the root. */
+struct _Checkpoint
+{
+	/* Offset of the line start, updated lazily like segment offsets. */
+	gint			 offset;
+	/* Number of edits applied to offset, see segment_sync(). */
+	guint			 stamp;
+	/* Innermost segment at the line start, its contexts and those of
+	 * its ancestors are the context stack there. */
+	Segment			*state;
+};
+
+/* Text inserted or deleted at offset, see segment_sync(). */
+struct _PendingEdit
+{
+	gint			 offset;
+	/* Length of inserted text, or minus length of deleted text. */
+	gint			 delta;
+};
+
+/* Memory for segments and subpatterns of an engine. Nodes are allocated
+ * from big blocks, and freed nodes are kept in a list to be reused, so
+ * that the tree doesn't get scattered all over the heap, see
+ * node_pool_alloc(). */
+struct _NodePool
+{
+	gsize			 node_size;
+	GSList			*blocks;
+	/* Unused part of the last allocated block. */
+	gchar			*next;
+	gchar			*end;
+	/* Freed nodes, linked through their first pointer. */
+	gpointer		 free_list;
+};
+
+/* Offsets in [start; end] are mapped to offset + value, or to value
+ * if the text around them was deleted, see edit_map_new(). */
+struct _EditMapPiece
+{
+	gint			 start;
+	gint			 end;
+	gint			 value;
+	gboolean		 deleted;
+};
+
+/* Text in [start; end) which should have the tag, see highlight_region(). */
+struct _TagSpan
+{
+	GtkTextTag		*tag;
+	gint			 start;
+	gint			 end;
+};
+
 /* Line terminator characters (\n, \r, \r\n, or unicode paragraph separator)
  * are removed from the line text. The problem is that pcre does not understand
  * arbitrary line terminators, so $ in pcre means (?=\n) (not quite, it's also
@@ -391,6 +553,50 @@ struct _LineInfo
 	gint			 byte_length;
 };
 
+/* A line update_syntax() stopped analyzing in the middle of, so that a very
+ * long line doesn't block the main loop for longer than a time slice. The
+ * analysis goes on from here in the next slice, see analyze_line_from_().
+ * The tree must not change meanwhile, so any change to the buffer throws
+ * it away, see partial_line_drop(). */
+struct _PartialLine
+{
+	LineInfo		 line;
+	/* Where to go on, byte index in line.text. */
+	gint			 line_pos;
+	/* The state at line_pos. */
+	Segment			*state;
+	/* Zero-length segments at the end of line, see analyze_line(). */
+	GList			*end_segments;
+	/* Seconds spent on the line in previous slices, they count
+	 * against MAX_TIME_FOR_ONE_LINE too. */
+	gdouble			 elapsed;
+};
+
+/* A line analyze_line_from_() gave up on. Analyzing it again would take
+ * as long for the same result, so the line keeps the context it starts
+ * in until it's edited, see slow_lines_edit_(). */
+struct _SlowLine
+{
+	gint			 start_at;
+	gint			 char_length;
+};
+
+/* Text of several consecutive lines, fetched from the buffer at once.
+ * update_syntax() takes lines out of it with line_chunk_get_line(), so
+ * that it does not need to copy text from the buffer for every line. */
+struct _LineChunk
+{
+	gchar			*text;
+	gint			 byte_length;
+	/* Character offsets of the text in the buffer. */
+	gint			 start_at;
+	gint			 end_at;
+	/* Position of the next line to be taken out: byte index
+	 * in text and character offset in the buffer. */
+	gint			 pos;
+	gint			 pos_offset;
+};
+
 struct _InvalidRegion
 {
 	gboolean		 empty;
@@ -401,6 +607,15 @@ struct _InvalidRegion
 	gint			 delta;
 };
 
+/* Text changed during a batch of edits, see batch_add_edit_().
+ * Like InvalidRegion: end - delta is the end in the tree. */
+struct _BatchRange
+{
+	gint			 start;
+	gint			 end;
+	gint			 delta;
+};
+
 struct _GtkSourceContextClass
 {
 	gchar    *name;
@@ -415,7 +630,9 @@ struct _ContextClassTag
 
 struct _GtkSourceContextData
 {
-	guint			 ref_count;
+	/* Engines and highlighters in different threads may share the
+	 * data, so it's updated atomically. */
+	volatile gint		 ref_count;
 
 	GtkSourceLanguage	*lang;
 
@@ -423,6 +640,57 @@ struct _GtkSourceContextData
 	GHashTable		*definitions;
 };
 
+/* Part of the text analyzed speculatively by its own thread as if
+ * it started in the root context. */
+struct _BackgroundChunk
+{
+	BackgroundJob		*job;
+	GThread			*thread;
+	/* Engine which owns the tree built for this chunk. NULL for the
+	 * first chunk, which is analyzed by the job thread itself. */
+	GtkSourceContextEngine	*shadow;
+
+	gint			 byte_start;
+	gint			 byte_end;
+	gint			 char_start;
+	gint			 char_end;
+
+	/* State at the end of the chunk, NULL if the job was cancelled. */
+	Segment			*state;
+	gint			 n_lines;
+};
+
+/* Analysis of a snapshot of the whole buffer done in a separate thread,
+ * see BACKGROUND ANALYSIS below. */
+struct _BackgroundJob
+{
+	/* The engine which started the job, NULL if it was detached
+	 * from the buffer while the thread was running. */
+	GtkSourceContextEngine	*ce;
+	/* Engine without buffer which owns the tree built by the thread. */
+	GtkSourceContextEngine	*shadow;
+
+	/* Buffer text at the moment the job was started. */
+	gchar			*text;
+	gint			 byte_length;
+	gint			 char_count;
+
+	/* Changes made to the buffer after the snapshot was taken,
+	 * same as GtkSourceContextEnginePrivate::invalid_region. */
+	InvalidRegion		 edits;
+
+	/* Start of the text the main thread analyzes for the view until
+	 * the job is done, NULL if there is none. Text before it is taken
+	 * for unanalyzed, see background_job_window(). */
+	GtkTextMark		*window_start;
+
+	/* The text split at line boundaries. */
+	BackgroundChunk		*chunks;
+	gint			 n_chunks;
+
+	volatile gint		 cancelled;
+};
+
 struct _GtkSourceContextEnginePrivate
 {
 	GtkSourceContextData	*ctx_data;
@@ -440,12 +708,13 @@ struct _GtkSourceContextEnginePrivate
 
 	/* Whether or not to actually highlight the buffer. */
 	gboolean		 highlight;
-
-	/* Whether highlighting was disabled because of errors. */
-	gboolean		 disabled;
+	/* GtkSourceBuffer:large-file-tier of the buffer. */
+	GtkSourceLargeFileTier	 large_file_tier;
 
 	/* Region covering the unhighlighted text. */
 	GtkTextRegion		*refresh_region;
+	/* Region which may have syntax tags, see evict_tags(). */
+	GtkTextRegion		*tagged_region;
 
 	/* Tree of contexts. */
 	Context			*root_context;
@@ -454,11 +723,57 @@ struct _GtkSourceContextEnginePrivate
         Segment                 *hint2;
 	/* list of Segment* */
 	GSList			*invalid;
+	/* Link of the last segment added to invalid, see add_invalid(). */
+	GSList			*invalid_hint;
+	/* Line analyzed only partially, it's before all invalid segments. */
+	PartialLine		*partial_line;
 	InvalidRegion		 invalid_region;
+	/* Array of BatchRange, sorted and disjoint, collected between
+	 * begin_batch() and end_batch() instead of invalid_region. */
+	GArray			*batch_ranges;
+	gint			 batch_depth;
+	/* Array of Checkpoint, sorted by offset. */
+	GArray			*checkpoints;
+	/* Destroyed segments some checkpoint points to, and how deep
+	 * segment_destroy() is, see checkpoints_remove_segment(). */
+	GHashTable		*dead_checkpoints;
+	gint			 destroy_depth;
+	/* Array of PendingEdit, and the number of all edits made so far. */
+	GArray			*pending_edits;
+	guint			 stamp;
+	/* Offsets of lines analyze_line() gave up on, to be reported by
+	 * emit_degraded_lines(). */
+	GArray			*degraded_lines;
+	/* Array of SlowLine, sorted by offset. */
+	GArray			*slow_lines;
+
+	/* Memory for nodes of the tree. */
+	NodePool		 segment_pool;
+	NodePool		 sub_pattern_pool;
 
 	guint			 first_update;
 	guint			 incremental_update;
 
+	/* End of the region the view asked to highlight last time. While
+	 * viewport_pending is set, the idle worker runs with higher priority
+	 * and analyzes only up to this mark. */
+	GtkTextMark		*viewport_end;
+	gboolean		 viewport_pending;
+	GTimer			*viewport_timer;
+	/* Milliseconds it took analysis to get past the end of the last
+	 * requested region. */
+	gdouble			 viewport_catch_up_time;
+
+	/* Thread analyzing the buffer, if any. */
+	BackgroundJob		*background_job;
+
+	/* Counters collected while GtkSourceContextEngine:profile is set.
+	 * Regexes are accounted to their definition, ContextDefinition ->
+	 * DefinitionStats, by the engine using them, and the counters of
+	 * background engines are added when their tree is taken. */
+	gboolean		 profile;
+	GtkSourceContextEngineStats stats;
+	GHashTable		*definition_stats;
 
 #ifdef ENABLE_MEMORY_DEBUG
 	guint			 mem_usage_timeout;
@@ -466,6 +781,14 @@ struct _GtkSourceContextEnginePrivate
 };
 
 
+/* Definitions are shared by engines which may analyze text in different
+ * threads: ContextDefinition::reg_all is created lazily under this lock,
+ * and match data is kept per thread, see regex_match_info(). */
+G_LOCK_DEFINE_STATIC (definition_reg_all);
+G_LOCK_DEFINE_STATIC (definition_end_cache);
+G_LOCK_DEFINE (context_data);
+static GStaticPrivate thread_matches = G_STATIC_PRIVATE_INIT;
+
 #ifdef ENABLE_CHECK_TREE
 static void check_tree (GtkSourceContextEngine *ce);
 static void check_segment_list (Segment *segment);
@@ -501,6 +824,7 @@ static Context	       *context_new		(Context		*parent,
 						 const gchar		*style,
 						 gboolean                ignore_children_style);
 static void		context_unref		(Context		*context);
+static void		context_destroy		(Context		*context);
 static void		context_freeze		(Context		*context);
 static void		context_thaw		(Context		*context);
 static void		erase_segments		(GtkSourceContextEngine *ce,
@@ -509,8 +833,11 @@ static void		erase_segments		(GtkSourceContextEngine *ce,
 						 Segment                *hint);
 static void		segment_remove		(GtkSourceContextEngine *ce,
 						 Segment                *segment);
+static inline Segment  *segment_sync		(GtkSourceContextEngine *ce,
+						 Segment                *segment);
 
-static void		find_insertion_place	(Segment		*segment,
+static void		find_insertion_place	(GtkSourceContextEngine *ce,
+						 Segment		*segment,
 						 gint			 offset,
 						 Segment	       **parent,
 						 Segment	       **prev,
@@ -523,7 +850,8 @@ static void		context_definition_unref(ContextDefinition	*definition);
 
 static void		segment_extend		(Segment		*state,
 						 gint			 end_at);
-static Context	       *ancestor_context_ends_here (Context		*state,
+static Context	       *ancestor_context_ends_here (GtkSourceContextEngine *ce,
+						 Context		*state,
 						 LineInfo		*line,
 						 gint			 pos);
 static void		definition_iter_init	(DefinitionsIter	*iter,
@@ -536,6 +864,16 @@ static void		update_syntax		(GtkSourceContextEngine	*ce,
 						 gint			 time);
 static void		install_idle_worker	(GtkSourceContextEngine	*ce);
 static void		install_first_update	(GtkSourceContextEngine	*ce);
+static gboolean		background_analysis_start (GtkSourceContextEngine *ce);
+static gboolean		viewport_check		(GtkSourceContextEngine	*ce);
+static void		request_viewport	(GtkSourceContextEngine	*ce,
+						 const GtkTextIter	*end);
+static void		background_analysis_cancel (GtkSourceContextEngine *ce);
+static void		background_job_window	(GtkSourceContextEngine	*ce,
+						 const GtkTextIter	*start);
+static void		partial_line_drop	(GtkSourceContextEngine *ce,
+						 gboolean		 invalidate);
+static GMatchInfo     **regex_match_info	(Regex			*regex);
 
 #ifdef ENABLE_MEMORY_DEBUG
 static gboolean		mem_usage_timeout	(GtkSourceContextEngine *ce);
@@ -816,15 +1154,27 @@ get_context_tag (GtkSourceContextEngine *ce,
 	return context->tag;
 }
 
+/**
+ * get_tag_spans:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @segment: segment to look at.
+ * @start_offset: the beginning of the region.
+ * @end_offset: the end of the region.
+ * @spans: array of #TagSpan.
+ *
+ * Appends to @spans the tags which @segment and its children
+ * put on text between @start_offset and @end_offset.
+ */
 static void
-apply_tags (GtkSourceContextEngine *ce,
-	    Segment                *segment,
-	    gint                    start_offset,
-	    gint                    end_offset)
+get_tag_spans (GtkSourceContextEngine *ce,
+	       Segment                *segment,
+	       gint                    start_offset,
+	       gint                    end_offset,
+	       GArray                 *spans)
 {
 	GtkTextTag *tag;
-	GtkTextIter start_iter, end_iter;
-	GtkTextBuffer *buffer = ce->priv->buffer;
+	TagSpan span;
 	SubPattern *sp;
 	Segment *child;
 
@@ -833,6 +1183,8 @@ apply_tags (GtkSourceContextEngine *ce,
 	if (SEGMENT_IS_INVALID (segment))
 		return;
 
+	segment_sync (ce, segment);
+
 	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
 		return;
 
@@ -858,43 +1210,260 @@ apply_tags (GtkSourceContextEngine *ce,
 		{
 			g_critical ("%s: oops", G_STRLOC);
 		}
-		else
+		else if (style_start_at < style_end_at)
 		{
-			gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, style_start_at);
-			end_iter = start_iter;
-			gtk_text_iter_forward_chars (&end_iter, style_end_at - style_start_at);
-			gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
+			span.tag = tag;
+			span.start = style_start_at;
+			span.end = style_end_at;
+			g_array_append_val (spans, span);
 		}
 	}
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		if (sp->start_at >= start_offset && sp->end_at <= end_offset)
+		if (sp->start_at >= start_offset && sp->end_at <= end_offset &&
+		    sp->start_at < sp->end_at)
 		{
-			gint start = MAX (start_offset, sp->start_at);
-			gint end = MIN (end_offset, sp->end_at);
-
 			tag = get_subpattern_tag (ce, segment->context, sp->definition);
 
 			if (tag != NULL)
 			{
-				gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start);
-				end_iter = start_iter;
-				gtk_text_iter_forward_chars (&end_iter, end - start);
-				gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
+				span.tag = tag;
+				span.start = sp->start_at;
+				span.end = sp->end_at;
+				g_array_append_val (spans, span);
 			}
 		}
 	}
 
 	for (child = segment->children;
-	     child != NULL && child->start_at < end_offset;
+	     child != NULL && segment_sync (ce, child)->start_at < end_offset;
 	     child = child->next)
 	{
 		if (child->end_at > start_offset)
-			apply_tags (ce, child, start_offset, end_offset);
+			get_tag_spans (ce, child, start_offset, end_offset, spans);
+	}
+}
+
+static gint
+tag_span_cmp (const TagSpan *span1,
+	      const TagSpan *span2)
+{
+	if (span1->tag != span2->tag)
+		return span1->tag < span2->tag ? -1 : 1;
+	if (span1->start != span2->start)
+		return span1->start < span2->start ? -1 : 1;
+	return 0;
+}
+
+/**
+ * tag_spans_subtract_:
+ *
+ * @spans: sorted non-overlapping spans.
+ * @n_spans: number of elements in @spans.
+ * @other: sorted non-overlapping spans.
+ * @n_other: number of elements in @other.
+ * @result: array to append the result to.
+ *
+ * Appends to @result the parts of @spans which are not covered by @other.
+ */
+static void
+tag_spans_subtract_ (const TagSpan *spans,
+		     guint          n_spans,
+		     const TagSpan *other,
+		     guint          n_other,
+		     GArray        *result)
+{
+	guint i, j = 0;
+
+	for (i = 0; i < n_spans; ++i)
+	{
+		TagSpan span = spans[i];
+
+		while (j < n_other && other[j].end <= span.start)
+			j++;
+
+		while (j < n_other && other[j].start < span.end)
+		{
+			if (other[j].start > span.start)
+			{
+				TagSpan piece = span;
+				piece.end = other[j].start;
+				g_array_append_val (result, piece);
+			}
+
+			span.start = MAX (span.start, other[j].end);
+
+			if (other[j].end > span.end)
+				break;
+
+			j++;
+		}
+
+		if (span.start < span.end)
+			g_array_append_val (result, span);
+	}
+}
+
+/**
+ * update_tag_:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @tag: the tag.
+ * @spans: sorted spans of @tag, may overlap.
+ * @n_spans: number of elements in @spans.
+ * @start_offset: the beginning of the region.
+ * @end_offset: the end of the region.
+ *
+ * Makes @tag cover exactly @spans between @start_offset and
+ * @end_offset. Text which already has the tag where it should,
+ * or doesn't have it where it shouldn't, is not touched, so
+ * that rehighlighting text which didn't change doesn't make
+ * the buffer shuffle tag toggles and the view redraw.
+ */
+static void
+update_tag_ (GtkSourceContextEngine *ce,
+	     GtkTextTag             *tag,
+	     const TagSpan          *spans,
+	     guint                   n_spans,
+	     gint                    start_offset,
+	     gint                    end_offset)
+{
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	GArray *wanted, *current, *changes;
+	GtkTextIter iter, end_iter;
+	TagSpan span;
+	guint i, n_removed;
+
+	wanted = g_array_sized_new (FALSE, FALSE, sizeof (TagSpan), n_spans);
+	current = g_array_new (FALSE, FALSE, sizeof (TagSpan));
+	changes = g_array_new (FALSE, FALSE, sizeof (TagSpan));
+
+	for (i = 0; i < n_spans; ++i)
+	{
+		TagSpan *last = wanted->len != 0 ?
+			&g_array_index (wanted, TagSpan, wanted->len - 1) : NULL;
+
+		if (last != NULL && spans[i].start <= last->end)
+			last->end = MAX (last->end, spans[i].end);
+		else
+			g_array_append_val (wanted, spans[i]);
+	}
+
+	/* Collect what the buffer has now before changing anything,
+	 * changing tags invalidates iterators. */
+	span.tag = tag;
+	gtk_text_buffer_get_iter_at_offset (buffer, &iter, start_offset);
+
+	if (!gtk_text_iter_has_tag (&iter, tag))
+		gtk_text_iter_forward_to_tag_toggle (&iter, tag);
+
+	while (gtk_text_iter_get_offset (&iter) < end_offset)
+	{
+		span.start = gtk_text_iter_get_offset (&iter);
+		gtk_text_iter_forward_to_tag_toggle (&iter, tag);
+		span.end = MIN (gtk_text_iter_get_offset (&iter), end_offset);
+		g_array_append_val (current, span);
+
+		if (!gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+			break;
+	}
+
+	tag_spans_subtract_ ((TagSpan*) current->data, current->len,
+			     (TagSpan*) wanted->data, wanted->len,
+			     changes);
+	n_removed = changes->len;
+	tag_spans_subtract_ ((TagSpan*) wanted->data, wanted->len,
+			     (TagSpan*) current->data, current->len,
+			     changes);
+
+	for (i = 0; i < changes->len; ++i)
+	{
+		TagSpan *change = &g_array_index (changes, TagSpan, i);
+
+		gtk_text_buffer_get_iter_at_offset (buffer, &iter, change->start);
+		end_iter = iter;
+		gtk_text_iter_forward_chars (&end_iter, change->end - change->start);
+
+		if (i < n_removed)
+			gtk_text_buffer_remove_tag (buffer, tag, &iter, &end_iter);
+		else
+			gtk_text_buffer_apply_tag (buffer, tag, &iter, &end_iter);
+	}
+
+	g_array_free (changes, TRUE);
+	g_array_free (current, TRUE);
+	g_array_free (wanted, TRUE);
+}
+
+struct UpdateTagsData {
+	GtkSourceContextEngine	*ce;
+	GArray			*spans;
+	gint			 start_offset;
+	gint			 end_offset;
+};
+
+static void
+update_tags_cb (G_GNUC_UNUSED gpointer style,
+		GSList   *tags,
+		gpointer  user_data)
+{
+	struct UpdateTagsData *data = user_data;
+	TagSpan *spans = (TagSpan*) data->spans->data;
+	guint n_spans = data->spans->len;
+
+	for ( ; tags != NULL; tags = tags->next)
+	{
+		GtkTextTag *tag = tags->data;
+		guint lo = 0, hi = n_spans, end;
+
+		/* spans are sorted by tag, find the ones of this tag. */
+		while (lo < hi)
+		{
+			guint mid = (lo + hi) / 2;
+
+			if (spans[mid].tag < tag)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (end = lo; end < n_spans && spans[end].tag == tag; ++end)
+			;
+
+		update_tag_ (data->ce, tag, spans + lo, end - lo,
+			     data->start_offset, data->end_offset);
 	}
 }
 
+/**
+ * profile_time_:
+ *
+ * Returns: current time in microseconds, for profiling.
+ */
+static gint64
+profile_time_ (void)
+{
+	return g_get_monotonic_time ();
+}
+
+/**
+ * profile_add_slice_:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @start: profile_time_() when the slice started.
+ *
+ * Accounts an idle callback which started at @start.
+ */
+static void
+profile_add_slice_ (GtkSourceContextEngine *ce,
+		    gint64                  start)
+{
+	ce->priv->stats.idle_slices++;
+	ce->priv->stats.idle_time += (profile_time_ () - start) /
+				     (gdouble) G_USEC_PER_SEC;
+}
+
 /**
  * highlight_region:
  *
@@ -909,6 +1478,8 @@ highlight_region (GtkSourceContextEngine *ce,
 		  GtkTextIter            *start,
 		  GtkTextIter            *end)
 {
+	struct UpdateTagsData data;
+	gint64 profile_start = 0;
 #ifdef ENABLE_PROFILE
 	GTimer *timer;
 #endif
@@ -918,16 +1489,36 @@ highlight_region (GtkSourceContextEngine *ce,
 	if (gtk_text_iter_compare (start, end) >= 0)
 		return;
 
+	if (ce->priv->profile)
+		profile_start = profile_time_ ();
+
 #ifdef ENABLE_PROFILE
 	timer = g_timer_new ();
 #endif
 
-	/* First we need to delete tags in the regions. */
-	unhighlight_region (ce, start, end);
+	data.ce = ce;
+	data.spans = g_array_new (FALSE, FALSE, sizeof (TagSpan));
+	data.start_offset = gtk_text_iter_get_offset (start);
+	data.end_offset = gtk_text_iter_get_offset (end);
+
+	get_tag_spans (ce, ce->priv->root_segment,
+		       data.start_offset, data.end_offset,
+		       data.spans);
+	g_array_sort (data.spans, (GCompareFunc) tag_span_cmp);
+
+	/* Only touch text whose tags actually change. */
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) update_tags_cb, &data);
 
-	apply_tags (ce, ce->priv->root_segment,
-		    gtk_text_iter_get_offset (start),
-		    gtk_text_iter_get_offset (end));
+	g_array_free (data.spans, TRUE);
+
+	/* Changing tags invalidated the iterators. */
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, start, data.start_offset);
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, end, data.end_offset);
+	gtk_text_region_add (ce->priv->tagged_region, start, end);
+
+	if (ce->priv->profile)
+		ce->priv->stats.tags_time += (profile_time_ () - profile_start) /
+					     (gdouble) G_USEC_PER_SEC;
 
 #ifdef ENABLE_PROFILE
 	g_print ("highlight (from %d to %d), %g ms elapsed\n",
@@ -983,6 +1574,84 @@ ensure_highlighted (GtkSourceContextEngine *ce,
 	gtk_text_region_subtract (ce->priv->refresh_region, start, end);
 }
 
+static void
+evict_tags_range_ (GtkSourceContextEngine *ce,
+		   gint                    start_offset,
+		   gint                    end_offset)
+{
+	GtkTextRegion *region;
+	GtkTextRegionIterator reg_iter;
+	GtkTextIter start, end;
+
+	if (start_offset >= end_offset)
+		return;
+
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &start, start_offset);
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &end, end_offset);
+	region = gtk_text_region_intersect (ce->priv->tagged_region, &start, &end);
+
+	if (region == NULL)
+		return;
+
+	gtk_text_region_get_iterator (region, &reg_iter, 0);
+
+	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	{
+		GtkTextIter s, e;
+		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+		unhighlight_region (ce, &s, &e);
+		gtk_text_region_add (ce->priv->refresh_region, &s, &e);
+		gtk_text_region_iterator_next (&reg_iter);
+	}
+
+	gtk_text_region_destroy (region, TRUE);
+
+	/* Iterators were invalidated by removing tags. */
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &start, start_offset);
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &end, end_offset);
+	gtk_text_region_subtract (ce->priv->tagged_region, &start, &end);
+}
+
+/**
+ * evict_tags:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @start: the beginning of the region the view shows.
+ * @end: the end of the region the view shows.
+ *
+ * In big buffers, removes syntax tags from text far from the region
+ * the view shows, so that the number of tag toggles in the buffer
+ * depends on the size of the view and not on the size of the buffer.
+ * The syntax tree still has everything, the text is put back into
+ * refresh_region, and ensure_highlighted() applies the tags again
+ * when the view gets back to it.
+ */
+static void
+evict_tags (GtkSourceContextEngine *ce,
+	    const GtkTextIter      *start,
+	    const GtkTextIter      *end)
+{
+	GtkTextIter keep_start, keep_end;
+	gint keep_start_offset, keep_end_offset;
+
+	if (!(ce->priv->large_file_tier & GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT) &&
+	    gtk_text_buffer_get_line_count (ce->priv->buffer) < TAGS_WINDOW_MIN_LINES)
+		return;
+
+	gtk_text_buffer_get_iter_at_line (ce->priv->buffer, &keep_start,
+					  MAX (0, gtk_text_iter_get_line (start) -
+						  TAGS_WINDOW_MARGIN_LINES));
+	keep_end = *end;
+	gtk_text_iter_forward_lines (&keep_end, TAGS_WINDOW_MARGIN_LINES);
+
+	keep_start_offset = gtk_text_iter_get_offset (&keep_start);
+	keep_end_offset = gtk_text_iter_get_offset (&keep_end);
+
+	evict_tags_range_ (ce, 0, keep_start_offset);
+	evict_tags_range_ (ce, keep_end_offset,
+			   gtk_text_buffer_get_char_count (ce->priv->buffer));
+}
+
 static GtkTextTag *
 get_context_class_tag (GtkSourceContextEngine *ce,
                        gchar const            *name)
@@ -1112,6 +1781,8 @@ add_region_context_classes (GtkSourceContextEngine *ce,
 		return;
 	}
 
+	segment_sync (ce, segment);
+
 	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
 	{
 		return;
@@ -1153,7 +1824,7 @@ add_region_context_classes (GtkSourceContextEngine *ce,
 	}
 
 	for (child = segment->children;
-	     child != NULL && child->start_at < end_offset;
+	     child != NULL && segment_sync (ce, child)->start_at < end_offset;
 	     child = child->next)
 	{
 		if (child->end_at > start_offset)
@@ -1203,6 +1874,12 @@ refresh_context_classes (GtkSourceContextEngine *ce,
 	GTimer *timer;
 #endif
 	GtkTextIter realend = *end;
+	gint64 profile_start = 0;
+
+	if (ce->priv->large_file_tier & GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES)
+	{
+		return;
+	}
 
 	if (gtk_text_iter_starts_line (&realend))
 	{
@@ -1218,6 +1895,9 @@ refresh_context_classes (GtkSourceContextEngine *ce,
 	timer = g_timer_new ();
 #endif
 
+	if (ce->priv->profile)
+		profile_start = profile_time_ ();
+
 	/* First we need to delete tags in the regions. */
 	remove_region_context_classes (ce, start, &realend);
 
@@ -1226,6 +1906,10 @@ refresh_context_classes (GtkSourceContextEngine *ce,
 	                            gtk_text_iter_get_offset (start),
 	                            gtk_text_iter_get_offset (&realend));
 
+	if (ce->priv->profile)
+		ce->priv->stats.tags_time += (profile_time_ () - profile_start) /
+					     (gdouble) G_USEC_PER_SEC;
+
 #ifdef ENABLE_PROFILE
 	g_print ("applied context classes (from %d to %d), %g ms elapsed\n",
 		 gtk_text_iter_get_offset (start),
@@ -1277,4641 +1961,9088 @@ refresh_range (GtkSourceContextEngine *ce,
 
 /* SEGMENT TREE ----------------------------------------------------------- */
 
+static void
+node_pool_init (NodePool *pool,
+		gsize     node_size)
+{
+	g_assert (node_size >= sizeof (gpointer));
+
+	pool->node_size = node_size;
+	pool->blocks = NULL;
+	pool->next = pool->end = NULL;
+	pool->free_list = NULL;
+}
+
 /**
- * segment_cmp:
- *
- * @s1: first segment.
- * @s2: second segment.
+ * node_pool_clear:
  *
- * Compares segments by their offset, used to sort list of invalid segments.
+ * @pool: #NodePool.
  *
- * Returns: an integer like strcmp() does.
+ * Frees all memory of @pool at once. Nodes allocated from @pool
+ * must not be used after this.
  */
-static gint
-segment_cmp (Segment *s1,
-	     Segment *s2)
+static void
+node_pool_clear (NodePool *pool)
 {
-	if (s1->start_at < s2->start_at)
-		return -1;
-	else if (s1->start_at > s2->start_at)
-		return 1;
-	/* one of them must be zero-length */
-	g_assert (s1->start_at == s1->end_at || s2->start_at == s2->end_at);
-#ifdef ENABLE_DEBUG
-	/* A new zero-length segment should never be created if there is
-	 * already an invalid segment. */
-	g_assert_not_reached ();
-#endif
-	g_return_val_if_reached (s1->end_at < s2->end_at ? -1 :
-                                 (s1->end_at > s2->end_at ? 1 : 0));
+	g_slist_foreach (pool->blocks, (GFunc) g_free, NULL);
+	g_slist_free (pool->blocks);
+	node_pool_init (pool, pool->node_size);
 }
 
 /**
- * add_invalid:
+ * node_pool_alloc:
  *
- * @ce: the engine.
- * @segment: segment.
+ * @pool: #NodePool.
  *
- * Inserts segment into the list of invalid segments.
- * Called whenever new invalid segment is created or when
- * a segment is marked invalid.
+ * Allocates a zero-filled node, reusing a freed one if possible.
+ * Nodes which are freed and allocated again while a part of the
+ * file is reanalyzed stay close to each other this way.
+ *
+ * Returns: the node.
  */
-static void
-add_invalid (GtkSourceContextEngine *ce,
-	     Segment                *segment)
+static gpointer
+node_pool_alloc (NodePool *pool)
 {
-#ifdef ENABLE_CHECK_TREE
-	g_assert (!g_slist_find (ce->priv->invalid, segment));
-#endif
-	g_return_if_fail (SEGMENT_IS_INVALID (segment));
-
-	ce->priv->invalid = g_slist_insert_sorted (ce->priv->invalid,
-						   segment,
-						   (GCompareFunc) segment_cmp);
+	gpointer node;
 
-	DEBUG (g_print ("%d invalid\n", g_slist_length (ce->priv->invalid)));
+	if (pool->free_list != NULL)
+	{
+		node = pool->free_list;
+		pool->free_list = *(gpointer *) node;
+		memset (node, 0, pool->node_size);
+		return node;
+	}
+
+	if (pool->next == pool->end)
+	{
+		gsize size = pool->node_size * NODE_POOL_BLOCK_NODES;
+
+		pool->next = g_malloc (size);
+		pool->end = pool->next + size;
+		pool->blocks = g_slist_prepend (pool->blocks, pool->next);
+	}
+
+	node = pool->next;
+	pool->next += pool->node_size;
+	memset (node, 0, pool->node_size);
+
+	return node;
+}
+
+static void
+node_pool_free (NodePool *pool,
+		gpointer  node)
+{
+#ifdef ENABLE_DEBUG
+	/* Never reuse nodes so that dangling pointers are noticed. */
+	memset (node, 1, pool->node_size);
+#else
+	*(gpointer *) node = pool->free_list;
+	pool->free_list = node;
+#endif
 }
 
 /**
- * remove_invalid:
+ * node_pool_merge:
  *
- * @ce: the engine.
- * @segment: segment.
+ * @pool: #NodePool.
+ * @other: #NodePool with nodes of the same size.
  *
- * Removes segment from the list of invalid segments;
- * Called when an invalid segment is destroyed (invalid
- * segments never become valid).
+ * Makes @pool own the memory of @other, so that nodes allocated from
+ * @other can be moved to a tree which uses @pool. Free nodes of
+ * @other are not reused. @other becomes empty.
  */
 static void
-remove_invalid (GtkSourceContextEngine *ce,
-		Segment                *segment)
+node_pool_merge (NodePool *pool,
+		 NodePool *other)
 {
-	g_assert (g_slist_find (ce->priv->invalid, segment) != NULL);
-	ce->priv->invalid = g_slist_remove (ce->priv->invalid, segment);
+	g_assert (pool->node_size == other->node_size);
+
+	pool->blocks = g_slist_concat (pool->blocks, other->blocks);
+	other->blocks = NULL;
+	node_pool_init (other, other->node_size);
 }
 
+/* Offsets in the tree are updated lazily. Inserted and deleted text is
+ * recorded in ce->priv->pending_edits, and Segment::stamp tells how many
+ * edits were applied to offsets of the segment and its subpatterns.
+ * segment_sync() applies the rest, so a segment must be synced before
+ * its offsets are used. This way an edit touches only the segments
+ * around it; the rest of the tree is updated when it's needed, or all
+ * at once when there are too many pending edits. */
+
 /**
- * fix_offsets_insert_:
+ * edit_fix_offset_:
+ *
+ * @offset: an offset.
+ * @edit: #PendingEdit.
+ *
+ * Returns: @offset after @edit. Offsets right at inserted text stay
+ * where they are, insert_range() takes care of those which must move.
+ */
+static inline gint
+edit_fix_offset_ (gint         offset,
+		  PendingEdit *edit)
+{
+	if (offset <= edit->offset)
+		return offset;
+	else if (edit->delta > 0)
+		return offset + edit->delta;
+	else if (offset >= edit->offset - edit->delta)
+		return offset + edit->delta;
+	else
+		return edit->offset;
+}
+
+/**
+ * segment_apply_edits_:
  *
+ * @ce: the engine.
  * @segment: segment.
- * @start: start offset.
- * @delta: length of inserted text.
+ * @stamp: stamp to sync @segment to.
  *
- * Recursively updates offsets after inserting text. To be called
- * only from insert_range().
+ * Applies pending edits up to @stamp to offsets of @segment and
+ * its subpatterns. Ancestors of @segment are synced first, so a synced
+ * segment always has synced ancestors, and code which walks up the
+ * tree from a synced segment doesn't need to sync anything.
  */
 static void
-fix_offsets_insert_ (Segment *segment,
-		     gint     start,
-		     gint     delta)
+segment_apply_edits_ (GtkSourceContextEngine *ce,
+		      Segment                *segment,
+		      guint                   stamp)
 {
-	Segment *child;
-	SubPattern *sp;
+	GArray *edits = ce->priv->pending_edits;
+	guint first = ce->priv->stamp - edits->len;
+	guint i;
 
-	g_assert (segment->start_at >= start);
-
-	if (delta == 0)
+	if (segment->stamp >= stamp)
 		return;
 
-	segment->start_at += delta;
-	segment->end_at += delta;
+	g_assert (segment->stamp >= first && stamp <= ce->priv->stamp);
 
-	for (child = segment->children; child != NULL; child = child->next)
-		fix_offsets_insert_ (child, start, delta);
+	if (segment->parent != NULL)
+		segment_apply_edits_ (ce, segment->parent, stamp);
 
-	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+	for (i = segment->stamp; i < stamp; ++i)
 	{
-		sp->start_at += delta;
-		sp->end_at += delta;
+		PendingEdit *edit = &g_array_index (edits, PendingEdit, i - first);
+		SubPattern *sp;
+
+		segment->start_at = edit_fix_offset_ (segment->start_at, edit);
+		segment->end_at = edit_fix_offset_ (segment->end_at, edit);
+
+		for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+		{
+			sp->start_at = edit_fix_offset_ (sp->start_at, edit);
+			sp->end_at = edit_fix_offset_ (sp->end_at, edit);
+		}
 	}
+
+	segment->stamp = stamp;
 }
 
 /**
- * find_insertion_place_forward_:
+ * segment_sync:
  *
- * @segment: (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @next: initialized with the next sibling of new segment.
+ * @ce: the engine.
+ * @segment: segment.
  *
- * Auxiliary function used in find_insertion_place().
+ * Brings offsets of @segment and its subpatterns up to date.
+ *
+ * Returns: @segment.
  */
-static void
-find_insertion_place_forward_ (Segment  *segment,
-			       gint      offset,
-			       Segment  *start,
-			       Segment **parent,
-			       Segment **prev,
-			       Segment **next)
+static inline Segment *
+segment_sync (GtkSourceContextEngine *ce,
+	      Segment                *segment)
 {
-	Segment *child;
+	if (G_UNLIKELY (segment->stamp != ce->priv->stamp))
+		segment_apply_edits_ (ce, segment, ce->priv->stamp);
+	return segment;
+}
 
-	g_assert (start->end_at < offset);
+/**
+ * edit_map_new:
+ *
+ * @edits: array of #PendingEdit.
+ *
+ * Composes @edits into one map, so that offsets which were not
+ * synced since the first of @edits can be updated with a binary
+ * search instead of applying the edits one by one.
+ *
+ * Returns: array of #EditMapPiece sorted by offset, covering
+ * all offsets.
+ */
+static GArray *
+edit_map_new (GArray *edits)
+{
+	GArray *map, *new_map;
+	EditMapPiece piece;
+	guint i, j;
 
-	for (child = start; child != NULL; child = child->next)
+	map = g_array_new (FALSE, FALSE, sizeof (EditMapPiece));
+	new_map = g_array_new (FALSE, FALSE, sizeof (EditMapPiece));
+
+	piece.start = 0;
+	piece.end = G_MAXINT;
+	piece.value = 0;
+	piece.deleted = FALSE;
+	g_array_append_val (map, piece);
+
+	for (i = 0; i < edits->len; ++i)
 	{
-		if (child->start_at <= offset && child->end_at >= offset)
-		{
-			find_insertion_place (child, offset, parent, prev, next, NULL);
-			return;
-		}
+		PendingEdit *edit = &g_array_index (edits, PendingEdit, i);
+		GArray *tmp;
 
-		if (child->end_at == offset)
+		g_array_set_size (new_map, 0);
+
+		for (j = 0; j < map->len; ++j)
 		{
-			if (SEGMENT_IS_INVALID (child))
+			EditMapPiece *p = &g_array_index (map, EditMapPiece, j);
+			/* Where the edit offset is in the old coordinates. */
+			gint at = edit->offset - p->value;
+			gint start = p->start;
+
+			if (p->deleted)
 			{
-				*parent = child;
-				*prev = NULL;
-				*next = NULL;
+				piece = *p;
+				piece.value = edit_fix_offset_ (p->value, edit);
+				g_array_append_val (new_map, piece);
+				continue;
 			}
-			else
+
+			if (start <= at)
 			{
-				*prev = child;
-				*next = child->next;
-				*parent = segment;
+				piece = *p;
+				piece.end = MIN (p->end, at);
+				g_array_append_val (new_map, piece);
+				start = piece.end + 1;
 			}
 
-			return;
-		}
+			if (edit->delta < 0 && start <= p->end &&
+			    start < at - edit->delta)
+			{
+				piece.start = start;
+				piece.end = MIN (p->end, at - edit->delta - 1);
+				piece.value = edit->offset;
+				piece.deleted = TRUE;
+				g_array_append_val (new_map, piece);
+				start = piece.end + 1;
+			}
 
-		if (child->end_at < offset)
-		{
-			*prev = child;
-			continue;
+			if (start <= p->end)
+			{
+				piece.start = start;
+				piece.end = p->end;
+				piece.value = p->value + edit->delta;
+				piece.deleted = FALSE;
+				g_array_append_val (new_map, piece);
+			}
 		}
 
-		if (child->start_at > offset)
-		{
-			*next = child;
-			break;
-		}
+		tmp = map;
+		map = new_map;
+		new_map = tmp;
+	}
 
-		g_assert_not_reached ();
+	g_array_free (new_map, TRUE);
+	return map;
+}
+
+static gint
+edit_map_apply (GArray *map,
+		gint    offset)
+{
+	guint lo = 0, hi = map->len;
+
+	while (hi - lo > 1)
+	{
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index (map, EditMapPiece, mid).start <= offset)
+			lo = mid;
+		else
+			hi = mid;
 	}
 
-	*parent = segment;
+	if (g_array_index (map, EditMapPiece, lo).deleted)
+		return g_array_index (map, EditMapPiece, lo).value;
+	else
+		return offset + g_array_index (map, EditMapPiece, lo).value;
 }
 
 /**
- * find_insertion_place_backward_:
+ * segment_sync_tree_:
  *
- * @segment: (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @next: initialized with the next sibling of new segment.
+ * @ce: the engine.
+ * @segment: segment.
+ * @map: all pending edits composed by edit_map_new().
+ * @first: stamp of the first pending edit.
  *
- * Auxiliary function used in find_insertion_place().
+ * Syncs @segment and all its descendants.
  */
 static void
-find_insertion_place_backward_ (Segment  *segment,
-				gint      offset,
-				Segment  *start,
-				Segment **parent,
-				Segment **prev,
-				Segment **next)
+segment_sync_tree_ (GtkSourceContextEngine *ce,
+		    Segment                *segment,
+		    GArray                 *map,
+		    guint                   first)
 {
 	Segment *child;
 
-	g_assert (start->end_at >= offset);
-
-	for (child = start; child != NULL; child = child->prev)
+	if (segment->stamp == first)
 	{
-		if (child->start_at <= offset && child->end_at >= offset)
-		{
-			find_insertion_place (child, offset, parent, prev, next, NULL);
-			return;
-		}
-
-		if (child->end_at == offset)
-		{
-			if (SEGMENT_IS_INVALID (child))
-			{
-				*parent = child;
-				*prev = NULL;
-				*next = NULL;
-			}
-			else
-			{
-				*prev = child;
-				*next = child->next;
-				*parent = segment;
-			}
-
-			return;
-		}
+		SubPattern *sp;
 
-		if (child->end_at < offset)
-		{
-			*prev = child;
-			*next = child->next;
-			break;
-		}
+		segment->start_at = edit_map_apply (map, segment->start_at);
+		segment->end_at = edit_map_apply (map, segment->end_at);
 
-		if (child->start_at > offset)
+		for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 		{
-			*next = child;
-			continue;
+			sp->start_at = edit_map_apply (map, sp->start_at);
+			sp->end_at = edit_map_apply (map, sp->end_at);
 		}
 
-		g_assert_not_reached ();
+		segment->stamp = ce->priv->stamp;
+	}
+	else
+	{
+		segment_sync (ce, segment);
 	}
 
-	*parent = segment;
+	for (child = segment->children; child != NULL; child = child->next)
+		segment_sync_tree_ (ce, child, map, first);
 }
 
 /**
- * find_insertion_place:
+ * checkpoint_sync_:
  *
- * @segment: (grand)parent segment the new one should be inserted into.
- * @offset: offset at which text is inserted.
- * @start: segment from which to start search (to avoid
- * walking whole tree).
- * @parent: initialized with the parent of new segment.
- * @prev: initialized with the previous sibling of new segment.
- * @hint: a segment somewhere near insertion place to optimize search.
+ * @ce: the engine.
+ * @cp: #Checkpoint.
  *
- * After text is inserted, a new invalid segment is created and inserted
- * into the tree. This function finds an appropriate position for the new
- * segment. To make it faster, it uses hint and calls
- * find_insertion_place_forward_ or find_insertion_place_backward_ depending
- * on position of offset relative to hint.
- * There is no return value, it always succeeds (or crashes).
+ * Brings the offset of @cp up to date, like segment_sync() does for
+ * segments. Edits don't change the order of offsets, so checkpoints
+ * stay sorted.
+ *
+ * Returns: @cp.
  */
-static void
-find_insertion_place (Segment  *segment,
-		      gint      offset,
-		      Segment **parent,
-		      Segment **prev,
-		      Segment **next,
-		      Segment  *hint)
+static Checkpoint *
+checkpoint_sync_ (GtkSourceContextEngine *ce,
+		  Checkpoint             *cp)
 {
-	g_assert (segment->start_at <= offset && segment->end_at >= offset);
+	GArray *edits = ce->priv->pending_edits;
+	guint first = ce->priv->stamp - edits->len;
 
-	*prev = NULL;
-	*next = NULL;
+	g_assert (cp->stamp >= first);
 
-	if (SEGMENT_IS_INVALID (segment) || segment->children == NULL)
-	{
-		*parent = segment;
-		return;
-	}
+	for ( ; cp->stamp < ce->priv->stamp; ++cp->stamp)
+		cp->offset = edit_fix_offset_ (cp->offset,
+					       &g_array_index (edits, PendingEdit,
+							       cp->stamp - first));
 
-	if (segment->start_at == offset)
-	{
-#ifdef ENABLE_CHECK_TREE
-		g_assert (!segment->children ||
-			  !SEGMENT_IS_INVALID (segment->children) ||
-			  segment->children->start_at > offset);
-#endif
+	return cp;
+}
 
-		*parent = segment;
-		*next = segment->children;
+/**
+ * checkpoints_sync_all_:
+ *
+ * @ce: the engine.
+ * @map: all pending edits composed by edit_map_new().
+ * @first: stamp of the first pending edit.
+ *
+ * Syncs all checkpoints, see segment_sync_tree_().
+ */
+static void
+checkpoints_sync_all_ (GtkSourceContextEngine *ce,
+		       GArray                 *map,
+		       guint                   first)
+{
+	GArray *checkpoints = ce->priv->checkpoints;
+	guint i;
 
+	if (checkpoints == NULL)
 		return;
-	}
-
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != segment)
-			hint = hint->parent;
 
-	if (hint == NULL)
-		hint = segment->children;
+	for (i = 0; i < checkpoints->len; ++i)
+	{
+		Checkpoint *cp = &g_array_index (checkpoints, Checkpoint, i);
 
-	if (hint->end_at < offset)
-		find_insertion_place_forward_ (segment, offset, hint, parent, prev, next);
-	else
-		find_insertion_place_backward_ (segment, offset, hint, parent, prev, next);
+		if (cp->stamp == first)
+		{
+			cp->offset = edit_map_apply (map, cp->offset);
+			cp->stamp = ce->priv->stamp;
+		}
+		else
+		{
+			checkpoint_sync_ (ce, cp);
+		}
+	}
 }
 
 /**
- * get_invalid_at:
+ * pending_edits_add:
  *
  * @ce: the engine.
- * @offset: the offset.
- *
- * Finds invalid segment adjacent to offset (i.e. such that start <= offset <= end),
- * if any.
+ * @offset: where text was inserted or deleted.
+ * @delta: length of inserted text, or minus length of deleted text.
  *
- * Returns: invalid segment or %NULL.
+ * Records an edit to be applied to the tree lazily. If there are too
+ * many pending edits already, syncs the whole tree first.
  */
-static Segment *
-get_invalid_at (GtkSourceContextEngine *ce,
-		gint                    offset)
+static void
+pending_edits_add (GtkSourceContextEngine *ce,
+		   gint                    offset,
+		   gint                    delta)
 {
-	GSList *link = ce->priv->invalid;
+	GArray *edits = ce->priv->pending_edits;
+	PendingEdit edit;
 
-	while (link != NULL)
+	if (edits->len >= PENDING_EDITS_MAX)
 	{
-		Segment *segment = link->data;
-
-		link = link->next;
+		GArray *map = edit_map_new (edits);
 
-		if (segment->start_at > offset)
-			break;
+		if (ce->priv->root_segment != NULL)
+			segment_sync_tree_ (ce, ce->priv->root_segment, map,
+					    ce->priv->stamp - edits->len);
 
-		if (segment->end_at < offset)
-			continue;
+		checkpoints_sync_all_ (ce, map, ce->priv->stamp - edits->len);
 
-		return segment;
+		g_array_set_size (edits, 0);
+		g_array_free (map, TRUE);
 	}
 
-	return NULL;
+	edit.offset = offset;
+	edit.delta = delta;
+	g_array_append_val (edits, edit);
+	ce->priv->stamp++;
 }
 
 /**
- * segment_add_subpattern:
+ * segment_cmp:
  *
- * @state: the segment.
- * @sp: subpattern.
+ * @s1: first segment.
+ * @s2: second segment.
+ * @ce: the engine.
  *
- * Prepends subpattern to subpatterns list in the segment.
+ * Compares segments by their offset, used to sort list of invalid segments.
+ *
+ * Returns: an integer like strcmp() does.
  */
-static void
-segment_add_subpattern (Segment    *state,
-			SubPattern *sp)
+static gint
+segment_cmp (Segment                *s1,
+	     Segment                *s2,
+	     GtkSourceContextEngine *ce)
 {
-	sp->next = state->sub_patterns;
-	state->sub_patterns = sp;
+	segment_sync (ce, s1);
+	segment_sync (ce, s2);
+
+	if (s1->start_at < s2->start_at)
+		return -1;
+	else if (s1->start_at > s2->start_at)
+		return 1;
+	/* one of them must be zero-length */
+	g_assert (s1->start_at == s1->end_at || s2->start_at == s2->end_at);
+#ifdef ENABLE_DEBUG
+	/* A new zero-length segment should never be created if there is
+	 * already an invalid segment. */
+	g_assert_not_reached ();
+#endif
+	g_return_val_if_reached (s1->end_at < s2->end_at ? -1 :
+                                 (s1->end_at > s2->end_at ? 1 : 0));
 }
 
 /**
- * sub_pattern_new:
- *
- * @segment: the segment.
- * @start_at: start offset of the subpattern.
- * @end_at: end offset of the subpattern.
- * @sp_def: the subppatern definition.
+ * add_invalid:
  *
- * Creates new subpattern and adds it to the segment's
- * subpatterns list.
+ * @ce: the engine.
+ * @segment: segment.
  *
- * Returns: new subpattern.
+ * Inserts segment into the list of invalid segments.
+ * Called whenever new invalid segment is created or when
+ * a segment is marked invalid.
  */
-static SubPattern *
-sub_pattern_new (Segment              *segment,
-		 gint                  start_at,
-		 gint                  end_at,
-		 SubPatternDefinition *sp_def)
+static void
+add_invalid (GtkSourceContextEngine *ce,
+	     Segment                *segment)
 {
-	SubPattern *sp;
+	GSList *link;
 
-	sp = g_slice_new0 (SubPattern);
-	sp->start_at = start_at;
-	sp->end_at = end_at;
-	sp->definition = sp_def;
+#ifdef ENABLE_CHECK_TREE
+	g_assert (!g_slist_find (ce->priv->invalid, segment));
+#endif
+	g_return_if_fail (SEGMENT_IS_INVALID (segment));
 
-	segment_add_subpattern (segment, sp);
+	/* Edits of a batch are applied left to right, so the new segment
+	 * usually goes right after the last one added: start looking
+	 * there instead of at the head of the list. */
+	link = ce->priv->invalid_hint;
 
-	return sp;
-}
+	if (link == NULL || segment_cmp (link->data, segment, ce) > 0)
+	{
+		link = ce->priv->invalid;
 
-/**
- * sub_pattern_free:
- *
- * @sp: subppatern.
- *
- * Calls g_free on subpattern, was useful for debugging.
- */
-static inline void
-sub_pattern_free (SubPattern *sp)
-{
-#ifdef ENABLE_DEBUG
-	memset (sp, 1, sizeof (SubPattern));
-#else
-	g_slice_free (SubPattern, sp);
-#endif
+		if (link == NULL || segment_cmp (link->data, segment, ce) > 0)
+		{
+			ce->priv->invalid = g_slist_prepend (ce->priv->invalid, segment);
+			ce->priv->invalid_hint = ce->priv->invalid;
+			return;
+		}
+	}
+
+	while (link->next != NULL && segment_cmp (link->next->data, segment, ce) < 0)
+		link = link->next;
+
+	link->next = g_slist_prepend (link->next, segment);
+	ce->priv->invalid_hint = link->next;
+
+	DEBUG (g_print ("%d invalid\n", g_slist_length (ce->priv->invalid)));
 }
 
 /**
- * segment_make_invalid_:
+ * remove_invalid:
  *
  * @ce: the engine.
- * @segment: segment to invalidate.
+ * @segment: segment.
  *
- * Invalidates segment. Called only from insert_range().
+ * Removes segment from the list of invalid segments;
+ * Called when an invalid segment is destroyed (invalid
+ * segments never become valid).
  */
 static void
-segment_make_invalid_ (GtkSourceContextEngine *ce,
-		       Segment                *segment)
+remove_invalid (GtkSourceContextEngine *ce,
+		Segment                *segment)
 {
-	Context *ctx;
-	SubPattern *sp;
-
-	g_assert (!SEGMENT_IS_INVALID (segment));
+	GSList *hint = ce->priv->invalid_hint;
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
+	g_assert (g_slist_find (ce->priv->invalid, segment) != NULL);
 
-	while (sp != NULL)
+	if (hint != NULL && hint->next != NULL && hint->next->data == segment)
 	{
-		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
-		sp = next;
+		hint->next = g_slist_delete_link (hint->next, hint->next);
+		return;
 	}
 
-	ctx = segment->context;
-	segment->context = NULL;
-	segment->is_start = FALSE;
-	segment->start_len = 0;
-	segment->end_len = 0;
-	add_invalid (ce, segment);
-	context_unref (ctx);
+	if (hint != NULL && hint->data == segment)
+		ce->priv->invalid_hint = NULL;
+
+	ce->priv->invalid = g_slist_remove (ce->priv->invalid, segment);
 }
 
 /**
- * simple_segment_split_:
+ * checkpoint_lookup:
  *
  * @ce: the engine.
- * @segment: segment to split.
- * @offset: offset at which text insertion occurred.
+ * @offset: the offset.
  *
- * Creates a new invalid segment and inserts it in the middle
- * of the given one. Called from insert_range() to mark inserted
- * text.
+ * Finds the last checkpoint at or before @offset. Only the checkpoints
+ * the binary search looks at are synced.
  *
- * Returns: new invalid segment.
+ * Returns: index of the checkpoint, or -1.
  */
-static Segment *
-simple_segment_split_ (GtkSourceContextEngine *ce,
-		       Segment                *segment,
-		       gint                    offset)
+static gint
+checkpoint_lookup (GtkSourceContextEngine *ce,
+		   gint                    offset)
 {
-	SubPattern *sp;
-	Segment *new_segment, *invalid;
-	gint end_at = segment->end_at;
-
-	g_assert (SEGMENT_IS_SIMPLE (segment));
-	g_assert (segment->start_at < offset && offset < segment->end_at);
+	GArray *checkpoints = ce->priv->checkpoints;
+	gint lo = 0, hi;
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
-	segment->end_at = offset;
+	if (checkpoints == NULL)
+		return -1;
 
-	invalid = create_segment (ce, segment->parent, NULL, offset, offset, FALSE, segment);
-	new_segment = create_segment (ce, segment->parent, segment->context, offset, end_at, FALSE, invalid);
+	hi = checkpoints->len;
 
-	while (sp != NULL)
+	while (lo < hi)
 	{
-		Segment *append_to = NULL;
-		SubPattern *next = sp->next;
+		gint mid = (lo + hi) / 2;
 
-		if (sp->end_at <= offset)
-		{
-			append_to = segment;
-		}
-		else if (sp->start_at >= offset)
-		{
-			append_to = new_segment;
-		}
+		if (checkpoint_sync_ (ce, &g_array_index (checkpoints, Checkpoint, mid))->offset <= offset)
+			lo = mid + 1;
 		else
-		{
-			sub_pattern_new (new_segment,
-					 offset,
-					 sp->end_at,
-					 sp->definition);
-			sp->end_at = offset;
-			append_to = segment;
-		}
-
-		segment_add_subpattern (append_to, sp);
-
-		sp = next;
+			hi = mid;
 	}
 
-	return invalid;
+	return lo - 1;
 }
 
 /**
- * invalidate_region:
+ * checkpoint_add:
  *
- * @ce: a #GtkSourceContextEngine.
- * @offset: the start of invalidated area.
- * @length: the length of the area.
+ * @ce: the engine.
+ * @offset: start of a line following an analyzed line.
+ * @state: the state at @offset.
  *
- * Adds the area to the invalid region and queues highlighting.
- * @length may be negative which means deletion; positive
- * means insertion; 0 means "something happened here", it's
- * treated as zero-length insertion.
+ * Remembers @state so that analysis can resume at @offset, see
+ * checkpoint_get_state(). The root segment is where analysis starts
+ * anyway, so it's not remembered.
  */
 static void
-invalidate_region (GtkSourceContextEngine *ce,
-		   gint                    offset,
-		   gint                    length)
+checkpoint_add (GtkSourceContextEngine *ce,
+		gint                    offset,
+		Segment                *state)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
-	GtkTextBuffer *buffer = ce->priv->buffer;
-	GtkTextIter iter;
-	gint end_offset;
+	GArray *checkpoints = ce->priv->checkpoints;
+	Checkpoint cp;
+	gint i;
 
-	end_offset = length >= 0 ? offset + length : offset;
+	if (checkpoints == NULL || state == ce->priv->root_segment)
+		return;
 
-	if (region->empty)
-	{
-		region->empty = FALSE;
-		region->delta = length;
+	state->checkpoint = TRUE;
+	cp.offset = offset;
+	cp.stamp = ce->priv->stamp;
+	cp.state = state;
 
-		gtk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
-		gtk_text_buffer_move_mark (buffer, region->start, &iter);
+	i = checkpoint_lookup (ce, offset);
 
-		gtk_text_iter_set_offset (&iter, end_offset);
-		gtk_text_buffer_move_mark (buffer, region->end, &iter);
-	}
+	if (i >= 0 && g_array_index (checkpoints, Checkpoint, i).offset == offset)
+		g_array_index (checkpoints, Checkpoint, i) = cp;
 	else
-	{
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
-
-		if (gtk_text_iter_get_offset (&iter) > offset)
-		{
-			gtk_text_iter_set_offset (&iter, offset);
-			gtk_text_buffer_move_mark (buffer, region->start, &iter);
-		}
-
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+		g_array_insert_val (checkpoints, i + 1, cp);
+}
 
-		if (gtk_text_iter_get_offset (&iter) < end_offset)
-		{
-			gtk_text_iter_set_offset (&iter, end_offset);
-			gtk_text_buffer_move_mark (buffer, region->end, &iter);
-		}
+/**
+ * checkpoint_get_state:
+ *
+ * @ce: the engine.
+ * @offset: a line start.
+ *
+ * Finds the state remembered at @offset in O(log n). Text before
+ * @offset may have changed since, so the result is only a hint for
+ * get_segment_at_offset(): when nothing before @offset changed, it's
+ * the segment the search returns right away.
+ *
+ * Returns: the state at @offset, or %NULL.
+ */
+static Segment *
+checkpoint_get_state (GtkSourceContextEngine *ce,
+		      gint                    offset)
+{
+	gint i = checkpoint_lookup (ce, offset);
 
-		region->delta += length;
-	}
+	if (i < 0 || g_array_index (ce->priv->checkpoints, Checkpoint, i).offset != offset)
+		return NULL;
 
-	DEBUG (({
-		gint start, end;
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
-		start = gtk_text_iter_get_offset (&iter);
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
-		end = gtk_text_iter_get_offset (&iter);
-		g_assert (start <= end - region->delta);
-	}));
+	return g_array_index (ce->priv->checkpoints, Checkpoint, i).state;
+}
 
-	CHECK_TREE (ce);
+/**
+ * checkpoints_remove_segment:
+ *
+ * @ce: the engine.
+ * @segment: segment being destroyed.
+ *
+ * Marks checkpoints pointing to @segment dead. They are removed by
+ * checkpoints_remove_dead() when the outermost segment_destroy()
+ * returns, in one pass for the whole subtree. No segments are
+ * allocated meanwhile, so the address of @segment can't be reused.
+ */
+static void
+checkpoints_remove_segment (GtkSourceContextEngine *ce,
+			    Segment                *segment)
+{
+	if (ce->priv->checkpoints == NULL)
+		return;
 
-	install_first_update (ce);
+	g_hash_table_insert (ce->priv->dead_checkpoints, segment, segment);
 }
 
 /**
- * insert_range:
+ * checkpoints_remove_dead:
  *
- * @ce: a #GtkSourceContextEngine.
- * @offset: the start of new segment.
- * @length: the length of the segment.
+ * @ce: the engine.
  *
- * Updates segment tree after insertion: it updates tree
- * offsets as appropriate, and inserts a new invalid segment
- * or extends existing invalid segment as @offset, so
- * after the call segment [@offset, @offset + @length) is marked
- * invalid in the tree.
- * It may be safely called with length == 0 at any moment
- * to invalidate some offset (and it's used here and there).
+ * Removes checkpoints marked by checkpoints_remove_segment().
  */
 static void
-insert_range (GtkSourceContextEngine *ce,
-	      gint                    offset,
-	      gint                    length)
+checkpoints_remove_dead (GtkSourceContextEngine *ce)
 {
-	Segment *parent, *prev = NULL, *next = NULL, *new_segment;
-	Segment *segment;
+	GArray *checkpoints = ce->priv->checkpoints;
+	guint i, n;
 
-	/* If there is an invalid segment adjacent to offset, use it.
-	 * Otherwise, find the deepest segment to split and insert
-	 * dummy segment in there. */
+	if (g_hash_table_size (ce->priv->dead_checkpoints) == 0)
+		return;
 
-	parent = get_invalid_at (ce, offset);
+	if (checkpoints != NULL)
+	{
+		for (i = 0, n = 0; i < checkpoints->len; ++i)
+		{
+			Checkpoint *cp = &g_array_index (checkpoints, Checkpoint, i);
 
-	if (parent == NULL)
-		find_insertion_place (ce->priv->root_segment, offset,
-				      &parent, &prev, &next,
-				      ce->priv->hint);
+			if (g_hash_table_lookup (ce->priv->dead_checkpoints, cp->state) == NULL)
+				g_array_index (checkpoints, Checkpoint, n++) = *cp;
+		}
 
-	g_assert (parent->start_at <= offset);
-	g_assert (parent->end_at >= offset);
-	g_assert (!prev || prev->parent == parent);
-	g_assert (!next || next->parent == parent);
-	g_assert (!prev || prev->next == next);
-	g_assert (!next || next->prev == prev);
-
-	if (SEGMENT_IS_INVALID (parent))
-	{
-		/* If length is zero, and we already have an invalid segment there,
-		 * do nothing. */
-		if (length == 0)
-			return;
-
-		segment = parent;
-	}
-	else if (SEGMENT_IS_SIMPLE (parent))
-	{
-		/* If it's a simple context, then:
-		 * if one of its ends is offset, then we just invalidate it;
-		 * otherwise, we split it into two, and insert zero-lentgh
-		 * invalid segment in the middle. */
-		if (parent->start_at < offset && parent->end_at > offset)
-		{
-			segment = simple_segment_split_ (ce, parent, offset);
-		}
-		else
-		{
-			segment_make_invalid_ (ce, parent);
-			segment = parent;
-		}
+		g_array_set_size (checkpoints, n);
 	}
-	else
-	{
-		/* Just insert new zero-length invalid segment. */
-
-		new_segment = segment_new (ce, parent, NULL, offset, offset, FALSE);
-
-		new_segment->next = next;
-		new_segment->prev = prev;
-
-		if (next != NULL)
-			next->prev = new_segment;
-		else
-			parent->last_child = new_segment;
 
-		if (prev != NULL)
-			prev->next = new_segment;
-		else
-			parent->children = new_segment;
+	g_hash_table_remove_all (ce->priv->dead_checkpoints);
+}
 
-		segment = new_segment;
-	}
+/**
+ * get_hint:
+ *
+ * @ce: the engine.
+ * @offset: the offset.
+ *
+ * Returns: a segment to start searching for @offset from: either
+ * ce->priv->hint or the closest checkpoint, whichever is nearer,
+ * or %NULL.
+ */
+static Segment *
+get_hint (GtkSourceContextEngine *ce,
+	  gint                    offset)
+{
+	Segment *hint = ce->priv->hint;
+	gint i;
 
-	g_assert (!segment->children);
+	i = checkpoint_lookup (ce, offset);
 
-	if (length != 0)
+	if (i >= 0)
 	{
-		/* now fix offsets in all the segments "to the right"
-		 * of segment. */
-		while (segment != NULL)
-		{
-			Segment *tmp;
-			SubPattern *sp;
-
-			for (tmp = segment->next; tmp != NULL; tmp = tmp->next)
-				fix_offsets_insert_ (tmp, offset, length);
-
-			segment->end_at += length;
-
-			for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
-			{
-				if (sp->start_at > offset)
-					sp->start_at += length;
-				if (sp->end_at > offset)
-					sp->end_at += length;
-			}
+		Checkpoint *cp = &g_array_index (ce->priv->checkpoints, Checkpoint, i);
 
-			segment = segment->parent;
-		}
+		if (hint == NULL ||
+		    ABS (segment_sync (ce, hint)->start_at - offset) > offset - cp->offset)
+			hint = cp->state;
 	}
 
-	CHECK_TREE (ce);
+	return hint;
 }
 
 /**
- * gtk_source_context_engine_text_inserted:
+ * fix_offsets_insert_:
  *
- * @ce: a #GtkSourceContextEngine.
- * @start_offset: the start of inserted text.
- * @end_offset: the end of inserted text.
+ * @ce: the engine.
+ * @segment: segment which starts right at inserted text.
+ * @offset: start of inserted text.
+ * @delta: length of inserted text.
  *
- * Called from GtkTextBuffer::insert_text.
+ * Moves @segment and its descendants which start at @offset after
+ * inserted text. Other segments are moved lazily, but these can't
+ * be told from those which end at @offset, see edit_fix_offset_().
+ * To be called only from insert_range(), after the edit is added
+ * to pending edits.
  */
 static void
-gtk_source_context_engine_text_inserted (GtkSourceEngine *engine,
-					 gint             start_offset,
-					 gint             end_offset)
+fix_offsets_insert_ (GtkSourceContextEngine *ce,
+		     Segment                *segment,
+		     gint                    offset,
+		     gint                    delta)
 {
-	GtkTextIter iter;
-	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	Segment *child;
+	SubPattern *sp;
 
-	/* Happens when highlighting is disabled */
-	if (ce->priv->buffer == NULL)
-	{
-		return;
-	}
+	g_assert (segment->start_at == offset);
 
-	g_return_if_fail (start_offset < end_offset);
+	for (child = segment->children; child != NULL; child = child->next)
+	{
+		segment_apply_edits_ (ce, child, ce->priv->stamp - 1);
 
-	invalidate_region (ce, start_offset, end_offset - start_offset);
+		if (child->start_at != offset)
+			break;
 
-	/* If end_offset is at the start of a line (enter key pressed) then
-	 * we need to invalidate the whole new line, otherwise it may not be
-	 * highlighted because the engine analyzes the previous line, end
-	 * context there is none, start context at this line is none too,
-	 * and the engine stops. */
-	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, end_offset);
-	if (gtk_text_iter_starts_line (&iter) && !gtk_text_iter_ends_line (&iter))
-	{
-		gtk_text_iter_forward_to_line_end (&iter);
-		invalidate_region (ce, gtk_text_iter_get_offset (&iter), 0);
+		fix_offsets_insert_ (ce, child, offset, delta);
 	}
-}
 
-/**
- * fix_offset_delete_one_:
- *
- * @offset: segment.
- * @start: start of deleted text.
- * @length: length of deleted text.
- *
- * Returns: new offset depending on location of @offset
- * relative to deleted text.
- * Called only from fix_offsets_delete_().
- */
-static inline gint
-fix_offset_delete_one_ (gint offset,
-		        gint start,
-		        gint length)
-{
-	if (offset > start)
+	segment->start_at += delta;
+	segment->end_at += delta;
+
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		if (offset >= start + length)
-			offset -= length;
-		else
-			offset = start;
+		sp->start_at += delta;
+		sp->end_at += delta;
 	}
 
-	return offset;
+	segment->stamp = ce->priv->stamp;
 }
 
 /**
- * fix_offsets_delete_:
+ * find_insertion_place_forward_:
  *
- * @segment: segment.
- * @start: start offset.
- * @length: length of deleted text.
- * @hint: some segment somewhere near deleted text to optimize search.
+ * @ce: the engine.
+ * @segment: (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @next: initialized with the next sibling of new segment.
  *
- * Recursively updates offsets after deleting text. To be called
- * only from delete_range_().
+ * Auxiliary function used in find_insertion_place().
  */
 static void
-fix_offsets_delete_ (Segment *segment,
-		     gint     offset,
-		     gint     length,
-		     Segment *hint)
+find_insertion_place_forward_ (GtkSourceContextEngine *ce,
+			       Segment                *segment,
+			       gint                    offset,
+			       Segment                *start,
+			       Segment               **parent,
+			       Segment               **prev,
+			       Segment               **next)
 {
 	Segment *child;
-	SubPattern *sp;
 
-	g_return_if_fail (segment->end_at > offset);
+	g_assert (start->end_at < offset);
 
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != segment)
-			hint = hint->parent;
+	for (child = start; child != NULL; child = child->next)
+	{
+		segment_sync (ce, child);
 
-	if (hint == NULL)
-		hint = segment->children;
+		if (child->start_at <= offset && child->end_at >= offset)
+		{
+			find_insertion_place (ce, child, offset, parent, prev, next, NULL);
+			return;
+		}
 
-	for (child = hint; child != NULL; child = child->next)
-	{
-		if (child->end_at <= offset)
+		if (child->end_at == offset)
+		{
+			if (SEGMENT_IS_INVALID (child))
+			{
+				*parent = child;
+				*prev = NULL;
+				*next = NULL;
+			}
+			else
+			{
+				*prev = child;
+				*next = child->next;
+				*parent = segment;
+			}
+
+			return;
+		}
+
+		if (child->end_at < offset)
+		{
+			*prev = child;
 			continue;
-		fix_offsets_delete_ (child, offset, length, NULL);
-	}
+		}
 
-	for (child = hint ? hint->prev : NULL; child != NULL; child = child->prev)
-	{
-		if (child->end_at <= offset)
+		if (child->start_at > offset)
+		{
+			*next = child;
 			break;
-		fix_offsets_delete_ (child, offset, length, NULL);
-	}
+		}
 
-	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
-	{
-		sp->start_at = fix_offset_delete_one_ (sp->start_at, offset, length);
-		sp->end_at = fix_offset_delete_one_ (sp->end_at, offset, length);
+		g_assert_not_reached ();
 	}
 
-	segment->start_at = fix_offset_delete_one_ (segment->start_at, offset, length);
-	segment->end_at = fix_offset_delete_one_ (segment->end_at, offset, length);
+	*parent = segment;
 }
 
 /**
- * delete_range_:
+ * find_insertion_place_backward_:
  *
- * @ce: a #GtkSourceContextEngine.
- * @start: the start of deleted area.
- * @end: the end of deleted area.
+ * @ce: the engine.
+ * @segment: (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @next: initialized with the next sibling of new segment.
  *
- * Updates segment tree after deletion: removes segments at deleted
- * interval, updates tree offsets, etc.
- * It's called only from update_tree().
+ * Auxiliary function used in find_insertion_place().
  */
 static void
-delete_range_ (GtkSourceContextEngine *ce,
-	       gint                    start,
-	       gint                    end)
+find_insertion_place_backward_ (GtkSourceContextEngine *ce,
+				Segment                *segment,
+				gint                    offset,
+				Segment                *start,
+				Segment               **parent,
+				Segment               **prev,
+				Segment               **next)
 {
-	g_return_if_fail (start < end);
+	Segment *child;
 
-	/* FIXME adjacent invalid segments? */
-	erase_segments (ce, start, end, NULL);
-	fix_offsets_delete_ (ce->priv->root_segment, start, end - start, ce->priv->hint);
+	g_assert (start->end_at >= offset);
 
-	/* no need to invalidate at start, update_tree will do it */
+	for (child = start; child != NULL; child = child->prev)
+	{
+		segment_sync (ce, child);
 
-	CHECK_TREE (ce);
-}
+		if (child->start_at <= offset && child->end_at >= offset)
+		{
+			find_insertion_place (ce, child, offset, parent, prev, next, NULL);
+			return;
+		}
 
-/**
- * gtk_source_context_engine_text_deleted:
- *
- * @ce: a #GtkSourceContextEngine.
- * @offset: the start of deleted text.
- * @length: the length (in characters) of deleted text.
- *
- * Called from GtkTextBuffer::delete_range.
- */
-static void
-gtk_source_context_engine_text_deleted (GtkSourceEngine *engine,
-					gint             offset,
-					gint             length)
-{
-	g_return_if_fail (length > 0);
-	invalidate_region (GTK_SOURCE_CONTEXT_ENGINE (engine),
-			   offset,
-			   - length);
-}
+		if (child->end_at == offset)
+		{
+			if (SEGMENT_IS_INVALID (child))
+			{
+				*parent = child;
+				*prev = NULL;
+				*next = NULL;
+			}
+			else
+			{
+				*prev = child;
+				*next = child->next;
+				*parent = segment;
+			}
 
-/**
- * get_invalid_segment:
- *
- * @ce: a #GtkSourceContextEngine.
- *
- * Returns: first invalid segment, or %NULL.
- */
-static Segment *
-get_invalid_segment (GtkSourceContextEngine *ce)
-{
-	g_return_val_if_fail (ce->priv->invalid_region.empty, NULL);
-	return ce->priv->invalid ? ce->priv->invalid->data : NULL;
-}
+			return;
+		}
 
-/**
- * get_invalid_line:
- *
- * @ce: a #GtkSourceContextEngine.
- *
- * Returns: first invalid line, or -1.
- */
-static gint
-get_invalid_line (GtkSourceContextEngine *ce)
-{
-	GtkTextIter iter;
-	gint offset = G_MAXINT;
+		if (child->end_at < offset)
+		{
+			*prev = child;
+			*next = child->next;
+			break;
+		}
 
-	if (!ce->priv->invalid_region.empty)
-	{
-		gint tmp;
-		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer,
-						  &iter,
-						  ce->priv->invalid_region.start);
-		tmp = gtk_text_iter_get_offset (&iter);
-		offset = MIN (offset, tmp);
-	}
+		if (child->start_at > offset)
+		{
+			*next = child;
+			continue;
+		}
 
-	if (ce->priv->invalid)
-	{
-		Segment *segment = ce->priv->invalid->data;
-		offset = MIN (offset, segment->start_at);
+		g_assert_not_reached ();
 	}
 
-	if (offset == G_MAXINT)
-		return -1;
-
-	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, offset);
-	return gtk_text_iter_get_line (&iter);
+	*parent = segment;
 }
 
 /**
- * update_tree:
+ * find_insertion_place:
  *
- * @ce: a #GtkSourceContextEngine.
+ * @ce: the engine.
+ * @segment: (grand)parent segment the new one should be inserted into.
+ * @offset: offset at which text is inserted.
+ * @start: segment from which to start search (to avoid
+ * walking whole tree).
+ * @parent: initialized with the parent of new segment.
+ * @prev: initialized with the previous sibling of new segment.
+ * @hint: a segment somewhere near insertion place to optimize search.
  *
- * Modifies syntax tree according to data in invalid_region.
+ * After text is inserted, a new invalid segment is created and inserted
+ * into the tree. This function finds an appropriate position for the new
+ * segment. To make it faster, it uses hint and calls
+ * find_insertion_place_forward_ or find_insertion_place_backward_ depending
+ * on position of offset relative to hint.
+ * There is no return value, it always succeeds (or crashes).
  */
 static void
-update_tree (GtkSourceContextEngine *ce)
+find_insertion_place (GtkSourceContextEngine *ce,
+		      Segment                *segment,
+		      gint                    offset,
+		      Segment               **parent,
+		      Segment               **prev,
+		      Segment               **next,
+		      Segment                *hint)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
-	gint start, end, delta;
-	gint erase_start, erase_end;
-	GtkTextIter iter;
-
-	if (region->empty)
-		return;
-
-	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
-	start = gtk_text_iter_get_offset (&iter);
-	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
-	end = gtk_text_iter_get_offset (&iter);
-
-	delta = region->delta;
-
-	g_assert (start <= MIN (end, end - delta));
+	segment_sync (ce, segment);
 
-	/* Here start and end are actual offsets in the buffer (they do not match offsets
-	 * in the tree if delta is not zero); delta is how much was inserted/removed.
-	 * First, we insert/delete range from the tree, to make offsets in tree
-	 * match offsets in the buffer. Then, create an invalid segment for the rest
-	 * of the area if needed. */
+	g_assert (segment->start_at <= offset && segment->end_at >= offset);
 
-	if (delta > 0)
-		insert_range (ce, start, delta);
-	else if (delta < 0)
-		delete_range_ (ce, end, end - delta);
+	*prev = NULL;
+	*next = NULL;
 
-	if (delta <= 0)
-	{
-		erase_start = start;
-		erase_end = end;
-	}
-	else
+	if (SEGMENT_IS_INVALID (segment) || segment->children == NULL)
 	{
-		erase_start = start + delta;
-		erase_end = end;
+		*parent = segment;
+		return;
 	}
 
-	if (erase_start < erase_end)
-	{
-		erase_segments (ce, erase_start, erase_end, NULL);
-		create_segment (ce, ce->priv->root_segment, NULL, erase_start, erase_end, FALSE, NULL);
-	}
-	else if (get_invalid_at (ce, start) == NULL)
+	if (segment->start_at == offset)
 	{
-		insert_range (ce, start, 0);
-	}
-
-	region->empty = TRUE;
-
 #ifdef ENABLE_CHECK_TREE
-	g_assert (get_invalid_at (ce, start) != NULL);
-	CHECK_TREE (ce);
+		g_assert (!segment->children ||
+			  !SEGMENT_IS_INVALID (segment->children) ||
+			  segment_sync (ce, segment->children)->start_at > offset);
 #endif
-}
 
-/**
- * gtk_source_context_engine_update_highlight:
- *
- * @ce: a #GtkSourceContextEngine.
- * @start: start of area to update.
- * @end: start of area to update.
- * @synchronous: whether it should block until everything
- * is analyzed/highlighted.
- *
- * GtkSourceEngine::update_highlight method.
- *
- * Makes sure the area is analyzed and highlighted. If @synchronous
- * is %FALSE, then it queues idle worker.
- */
-static void
-gtk_source_context_engine_update_highlight (GtkSourceEngine   *engine,
-					    const GtkTextIter *start,
-					    const GtkTextIter *end,
-					    gboolean           synchronous)
-{
-	gint invalid_line;
-	gint end_line;
-	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+		*parent = segment;
+		*next = segment->children;
 
-	if (!ce->priv->highlight || ce->priv->disabled)
 		return;
+	}
 
-	invalid_line = get_invalid_line (ce);
-	end_line = gtk_text_iter_get_line (end);
+	if (hint != NULL)
+		while (hint != NULL && hint->parent != segment)
+			hint = hint->parent;
 
-	if (gtk_text_iter_starts_line (end) && end_line > 0)
-		end_line -= 1;
+	if (hint == NULL)
+		hint = segment->children;
 
-	if (invalid_line < 0 || invalid_line > end_line)
-	{
-		ensure_highlighted (ce, start, end);
-	}
-	else if (synchronous)
-	{
-		/* analyze whole region */
-		update_syntax (ce, end, 0);
-		ensure_highlighted (ce, start, end);
-	}
+	if (segment_sync (ce, hint)->end_at < offset)
+		find_insertion_place_forward_ (ce, segment, offset, hint, parent, prev, next);
 	else
-	{
-		if (gtk_text_iter_get_line (start) < invalid_line)
-		{
-			GtkTextIter valid_end = *start;
-			gtk_text_iter_set_line (&valid_end, invalid_line);
-			ensure_highlighted (ce, start, &valid_end);
-		}
-
-		install_first_update (ce);
-	}
+		find_insertion_place_backward_ (ce, segment, offset, hint, parent, prev, next);
 }
 
 /**
- * enable_highlight:
+ * get_invalid_at:
  *
- * @ce: a #GtkSourceContextEngine.
- * @enable: whether to enable highlighting.
+ * @ce: the engine.
+ * @offset: the offset.
  *
- * Whether to highlight (i.e. apply tags) analyzed area.
- * Note that this does not turn on/off the analyzis stuff,
- * it affects only text tags.
+ * Finds invalid segment adjacent to offset (i.e. such that start <= offset <= end),
+ * if any.
+ *
+ * Returns: invalid segment or %NULL.
  */
-static void
-enable_highlight (GtkSourceContextEngine *ce,
-		  gboolean                enable)
+static Segment *
+get_invalid_at (GtkSourceContextEngine *ce,
+		gint                    offset)
 {
-	GtkTextIter start, end;
-
-	if (!enable == !ce->priv->highlight)
-		return;
+	GSList *link = ce->priv->invalid;
 
-	ce->priv->highlight = enable != 0;
-	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (ce->priv->buffer),
-				    &start, &end);
+	/* Segments before the hint end before it starts. */
+	if (ce->priv->invalid_hint != NULL &&
+	    segment_sync (ce, ce->priv->invalid_hint->data)->start_at < offset)
+		link = ce->priv->invalid_hint;
 
-	if (enable)
+	while (link != NULL)
 	{
-		gtk_text_region_add (ce->priv->refresh_region, &start, &end);
+		Segment *segment = segment_sync (ce, link->data);
 
-		refresh_range (ce, &start, &end);
-	}
-	else
-	{
-		unhighlight_region (ce, &start, &end);
-	}
-}
+		link = link->next;
 
-static void
-buffer_notify_highlight_syntax_cb (GtkSourceContextEngine *ce)
-{
-	gboolean highlight;
-	g_object_get (ce->priv->buffer, "highlight-syntax", &highlight, NULL);
-	enable_highlight (ce, highlight);
-}
+		if (segment->start_at > offset)
+			break;
+
+		if (segment->end_at < offset)
+			continue;
 
+		return segment;
+	}
 
-/* IDLE WORKER CODE ------------------------------------------------------- */
+	return NULL;
+}
 
 /**
- * all_analyzed:
+ * segment_add_subpattern:
  *
- * @ce: a #GtkSourceContextEngine.
+ * @state: the segment.
+ * @sp: subpattern.
  *
- * Returns: whether everything is analyzed (but it doesn't care about the tags).
+ * Prepends subpattern to subpatterns list in the segment.
  */
-static gboolean
-all_analyzed (GtkSourceContextEngine *ce)
+static void
+segment_add_subpattern (Segment    *state,
+			SubPattern *sp)
 {
-	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty;
+	sp->next = state->sub_patterns;
+	state->sub_patterns = sp;
 }
 
 /**
- * idle_worker:
+ * sub_pattern_new:
  *
- * @ce: #GtkSourceContextEngine.
+ * @ce: the engine.
+ * @segment: the segment.
+ * @start_at: start offset of the subpattern.
+ * @end_at: end offset of the subpattern.
+ * @sp_def: the subppatern definition.
  *
- * Analyzes a batch in idle. Stops when
- * whole buffer is analyzed.
+ * Creates new subpattern and adds it to the segment's
+ * subpatterns list.
+ *
+ * Returns: new subpattern.
  */
-static gboolean
-idle_worker (GtkSourceContextEngine *ce)
+static SubPattern *
+sub_pattern_new (GtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    start_at,
+		 gint                    end_at,
+		 SubPatternDefinition   *sp_def)
 {
-	gboolean retval = TRUE;
-
-	g_return_val_if_fail (ce->priv->buffer != NULL, FALSE);
-
-	gdk_threads_enter ();
-
-	/* analyze batch of text */
-	update_syntax (ce, NULL, INCREMENTAL_UPDATE_TIME_SLICE);
-	CHECK_TREE (ce);
+	SubPattern *sp;
 
-	if (all_analyzed (ce))
-	{
-		ce->priv->incremental_update = 0;
-		retval = FALSE;
-	}
+	sp = node_pool_alloc (&ce->priv->sub_pattern_pool);
+	sp->start_at = start_at;
+	sp->end_at = end_at;
+	sp->definition = sp_def;
 
-	gdk_threads_leave ();
+	segment_add_subpattern (segment, sp);
 
-	return retval;
+	return sp;
 }
 
 /**
- * first_update_callback:
+ * sub_pattern_free:
  *
- * @ce: a #GtkSourceContextEngine.
+ * @ce: the engine.
+ * @sp: subppatern.
  *
- * Same as idle_worker, except: it runs once, and install idle_worker
- * if not everything was analyzed at once.
+ * Returns subpattern memory to the engine.
  */
-static gboolean
-first_update_callback (GtkSourceContextEngine *ce)
+static inline void
+sub_pattern_free (GtkSourceContextEngine *ce,
+		  SubPattern             *sp)
 {
-	g_return_val_if_fail (ce->priv->buffer != NULL, FALSE);
-
-	gdk_threads_enter ();
-
-	/* analyze batch of text */
-	update_syntax (ce, NULL, FIRST_UPDATE_TIME_SLICE);
-	CHECK_TREE (ce);
-
-	ce->priv->first_update = 0;
-
-	if (!all_analyzed (ce))
-		install_idle_worker (ce);
-
-	gdk_threads_leave ();
-
-	return FALSE;
+	node_pool_free (&ce->priv->sub_pattern_pool, sp);
 }
 
 /**
- * install_idle_worker:
+ * segment_make_invalid_:
  *
- * @ce: #GtkSourceContextEngine.
+ * @ce: the engine.
+ * @segment: segment to invalidate.
  *
- * Schedules reanalyzing buffer in idle.
- * Always safe to call.
+ * Invalidates segment. Called only from insert_range().
  */
 static void
-install_idle_worker (GtkSourceContextEngine *ce)
+segment_make_invalid_ (GtkSourceContextEngine *ce,
+		       Segment                *segment)
 {
-	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0)
-		ce->priv->incremental_update =
-			g_idle_add_full (INCREMENTAL_UPDATE_PRIORITY,
-					 (GSourceFunc) idle_worker, ce, NULL);
+	Context *ctx;
+	SubPattern *sp;
+
+	g_assert (!SEGMENT_IS_INVALID (segment));
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		sub_pattern_free (ce, sp);
+		sp = next;
+	}
+
+	ctx = segment->context;
+	segment->context = NULL;
+	segment->is_start = FALSE;
+	segment->start_len = 0;
+	segment->end_len = 0;
+	add_invalid (ce, segment);
+	context_unref (ctx);
 }
 
 /**
- * install_first_update:
+ * simple_segment_split_:
  *
- * @ce: #GtkSourceContextEngine.
+ * @ce: the engine.
+ * @segment: segment to split.
+ * @offset: offset at which text insertion occurred.
  *
- * Schedules first_update_callback call.
- * Always safe to call.
+ * Creates a new invalid segment and inserts it in the middle
+ * of the given one. Called from insert_range() to mark inserted
+ * text.
+ *
+ * Returns: new invalid segment.
  */
-static void
-install_first_update (GtkSourceContextEngine *ce)
+static Segment *
+simple_segment_split_ (GtkSourceContextEngine *ce,
+		       Segment                *segment,
+		       gint                    offset)
 {
-	if (ce->priv->first_update == 0)
+	SubPattern *sp;
+	Segment *new_segment, *invalid;
+	gint end_at = segment->end_at;
+
+	g_assert (SEGMENT_IS_SIMPLE (segment));
+	g_assert (segment->start_at < offset && offset < segment->end_at);
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+	segment->end_at = offset;
+
+	invalid = create_segment (ce, segment->parent, NULL, offset, offset, FALSE, segment);
+	new_segment = create_segment (ce, segment->parent, segment->context, offset, end_at, FALSE, invalid);
+
+	while (sp != NULL)
 	{
-		if (ce->priv->incremental_update != 0)
+		Segment *append_to = NULL;
+		SubPattern *next = sp->next;
+
+		if (sp->end_at <= offset)
 		{
-			g_source_remove (ce->priv->incremental_update);
-			ce->priv->incremental_update = 0;
+			append_to = segment;
+		}
+		else if (sp->start_at >= offset)
+		{
+			append_to = new_segment;
+		}
+		else
+		{
+			sub_pattern_new (ce, new_segment,
+					 offset,
+					 sp->end_at,
+					 sp->definition);
+			sp->end_at = offset;
+			append_to = segment;
 		}
 
-		ce->priv->first_update =
-			g_idle_add_full (FIRST_UPDATE_PRIORITY,
-					 (GSourceFunc) first_update_callback,
-					 ce, NULL);
-	}
-}
-
-/* GtkSourceContextEngine class ------------------------------------------- */
+		segment_add_subpattern (append_to, sp);
 
-G_DEFINE_TYPE (GtkSourceContextEngine, _gtk_source_context_engine, GTK_TYPE_SOURCE_ENGINE)
+		sp = next;
+	}
 
-static GQuark
-gtk_source_context_engine_error_quark (void)
-{
-	static GQuark err_q = 0;
-	if (err_q == 0)
-		err_q = g_quark_from_static_string ("gtk-source-context-engine-error-quark");
-	return err_q;
+	return invalid;
 }
 
+/**
+ * invalid_region_add_span:
+ *
+ * @buffer: the buffer.
+ * @region: an #InvalidRegion.
+ * @start_offset: the start of changed text.
+ * @end_offset: the end of changed text.
+ * @delta: how much text was inserted or removed there.
+ *
+ * Extends @region to cover [@start_offset, @end_offset) and adds
+ * @delta to its delta.
+ */
 static void
-remove_tags_hash_cb (G_GNUC_UNUSED gpointer style,
-		     GSList          *tags,
-		     GtkTextTagTable *table)
+invalid_region_add_span (GtkTextBuffer *buffer,
+			 InvalidRegion *region,
+			 gint           start_offset,
+			 gint           end_offset,
+			 gint           delta)
 {
-	GSList *l = tags;
+	GtkTextIter iter;
 
-	while (l != NULL)
+	if (region->empty)
 	{
-		gtk_text_tag_table_remove (table, l->data);
-		g_object_unref (l->data);
-		l = l->next;
+		region->empty = FALSE;
+		region->delta = delta;
+
+		gtk_text_buffer_get_iter_at_offset (buffer, &iter, start_offset);
+		gtk_text_buffer_move_mark (buffer, region->start, &iter);
+
+		gtk_text_iter_set_offset (&iter, end_offset);
+		gtk_text_buffer_move_mark (buffer, region->end, &iter);
 	}
+	else
+	{
+		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
 
-	g_slist_free (tags);
-}
+		if (gtk_text_iter_get_offset (&iter) > start_offset)
+		{
+			gtk_text_iter_set_offset (&iter, start_offset);
+			gtk_text_buffer_move_mark (buffer, region->start, &iter);
+		}
 
-static void
-remove_context_classes_hash_cb (G_GNUC_UNUSED gpointer class,
-                                GtkTextTag             *tag,
-                                GtkTextTagTable        *table)
-{
-	gtk_text_tag_table_remove (table, tag);
+		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+
+		if (gtk_text_iter_get_offset (&iter) < end_offset)
+		{
+			gtk_text_iter_set_offset (&iter, end_offset);
+			gtk_text_buffer_move_mark (buffer, region->end, &iter);
+		}
+
+		region->delta += delta;
+	}
+
+	DEBUG (({
+		gint start, end;
+		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
+		start = gtk_text_iter_get_offset (&iter);
+		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+		end = gtk_text_iter_get_offset (&iter);
+		g_assert (start <= end - region->delta);
+	}));
 }
 
 /**
- * destroy_tags_hash:
+ * invalid_region_add:
  *
- * @ce: #GtkSourceContextEngine.
+ * @buffer: the buffer.
+ * @region: an #InvalidRegion.
+ * @offset: the start of invalidated area.
+ * @length: the length of the area.
  *
- * Destroys syntax tags cache.
+ * Extends @region to cover the area, see invalidate_region().
  */
 static void
-destroy_tags_hash (GtkSourceContextEngine *ce)
-{
-	g_hash_table_foreach (ce->priv->tags, (GHFunc) remove_tags_hash_cb,
-                              gtk_text_buffer_get_tag_table (ce->priv->buffer));
-	g_hash_table_destroy (ce->priv->tags);
-	ce->priv->tags = NULL;
-}
-
-static void
-destroy_context_classes_hash (GtkSourceContextEngine *ce)
+invalid_region_add (GtkTextBuffer *buffer,
+		    InvalidRegion *region,
+		    gint           offset,
+		    gint           length)
 {
-	g_hash_table_foreach (ce->priv->context_classes, (GHFunc) remove_context_classes_hash_cb,
-	                      gtk_text_buffer_get_tag_table (ce->priv->buffer));
-	g_hash_table_destroy (ce->priv->context_classes);
-	ce->priv->context_classes = NULL;
+	invalid_region_add_span (buffer, region, offset,
+				 length >= 0 ? offset + length : offset,
+				 length);
 }
 
 /**
- * gtk_source_context_engine_attach_buffer:
+ * batch_add_edit_:
  *
- * @ce: #GtkSourceContextEngine.
- * @buffer: buffer.
+ * @ce: a #GtkSourceContextEngine.
+ * @offset: the start of invalidated area.
+ * @length: the length of the area, as in invalidate_region().
  *
- * Detaches engine from previous buffer, and attaches to @buffer if
- * it's not %NULL.
+ * Records an edit made between begin_batch() and end_batch().
+ * Ranges the edit touches are merged with it into one, ranges
+ * after it are moved; the tree is left alone until batch_flush_().
  */
 static void
-gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
-					 GtkTextBuffer   *buffer)
+batch_add_edit_ (GtkSourceContextEngine *ce,
+		 gint                    offset,
+		 gint                    length)
 {
-	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	GArray *ranges = ce->priv->batch_ranges;
+	BatchRange merged;
+	guint first, last, i;
+	gint old_end;
 
-	g_return_if_fail (!buffer || GTK_IS_TEXT_BUFFER (buffer));
+	/* [offset, old_end) is the text which was there before the edit. */
+	old_end = length < 0 ? offset - length : offset;
 
-	if (ce->priv->buffer == buffer)
-		return;
+	/* Find the first range which ends at or after offset. Replacing
+	 * text from the top of the buffer down, the edit always goes
+	 * after the last range, so check that first. */
+	first = ranges->len;
 
-	/* Detach previous buffer if there is one. */
-	if (ce->priv->buffer != NULL)
+	if (first != 0 && g_array_index (ranges, BatchRange, first - 1).end >= offset)
 	{
-		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
-						      (gpointer) buffer_notify_highlight_syntax_cb,
-						      ce);
-
-		if (ce->priv->first_update != 0)
-			g_source_remove (ce->priv->first_update);
-		if (ce->priv->incremental_update != 0)
-			g_source_remove (ce->priv->incremental_update);
-		ce->priv->first_update = 0;
-		ce->priv->incremental_update = 0;
-
-		if (ce->priv->root_segment != NULL)
-			segment_destroy (ce, ce->priv->root_segment);
-		if (ce->priv->root_context != NULL)
-			context_unref (ce->priv->root_context);
-		g_assert (!ce->priv->invalid);
-		g_slist_free (ce->priv->invalid);
-		ce->priv->root_segment = NULL;
-		ce->priv->root_context = NULL;
-		ce->priv->invalid = NULL;
-
-		if (ce->priv->invalid_region.start != NULL)
-			gtk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.start);
-		if (ce->priv->invalid_region.end != NULL)
-			gtk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.end);
-		ce->priv->invalid_region.start = NULL;
-		ce->priv->invalid_region.end = NULL;
+		guint lo = 0, hi = first;
 
-		/* this deletes tags from the tag table, therefore there is no need
-		 * in removing tags from the text (it may be very slow).
-		 * FIXME: don't we want to just destroy and forget everything when
-		 * the buffer is destroyed? Removing tags is still slower than doing
-		 * nothing. Caveat: if tag table is shared with other buffer, we do
-		 * need to remove tags. */
-		destroy_tags_hash (ce);
-		ce->priv->n_tags = 0;
+		while (lo < hi)
+		{
+			guint mid = (lo + hi) / 2;
 
-		destroy_context_classes_hash (ce);
+			if (g_array_index (ranges, BatchRange, mid).end < offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
 
-		if (ce->priv->refresh_region != NULL)
-			gtk_text_region_destroy (ce->priv->refresh_region, FALSE);
-		ce->priv->refresh_region = NULL;
+		first = lo;
 	}
 
-	ce->priv->buffer = buffer;
+	merged.start = offset;
+	merged.delta = length;
 
-	if (buffer != NULL)
+	for (last = first; last < ranges->len; ++last)
 	{
-		gchar *root_id;
-		ContextDefinition *main_definition;
-		GtkTextIter start, end;
-
-		/* Create the root context. */
-		root_id = g_strdup_printf ("%s:%s", ENGINE_ID (ce), ENGINE_ID (ce));
-		main_definition = LOOKUP_DEFINITION (ce->priv->ctx_data, root_id);
-		g_free (root_id);
-
-		/* If we don't abort here, we will crash later (#485661). But it should
-		 * never happen, _gtk_source_context_data_finish_parse checks main context. */
-		g_assert (main_definition != NULL);
-
-		ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, FALSE);
-		ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
+		BatchRange *range = &g_array_index (ranges, BatchRange, last);
 
-		ce->priv->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-		ce->priv->context_classes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		if (range->start > old_end)
+			break;
 
-		gtk_text_buffer_get_bounds (buffer, &start, &end);
-		ce->priv->invalid_region.start = gtk_text_buffer_create_mark (buffer, NULL,
-									      &start, TRUE);
-		ce->priv->invalid_region.end = gtk_text_buffer_create_mark (buffer, NULL,
-									    &end, FALSE);
+		merged.start = MIN (merged.start, range->start);
+		merged.delta += range->delta;
+		old_end = MAX (old_end, range->end);
+	}
 
-		if (gtk_text_buffer_get_char_count (buffer) != 0)
-		{
-			ce->priv->invalid_region.empty = FALSE;
-			ce->priv->invalid_region.delta = gtk_text_buffer_get_char_count (buffer);
-		}
-		else
-		{
-			ce->priv->invalid_region.empty = TRUE;
-			ce->priv->invalid_region.delta = 0;
-		}
+	merged.end = old_end + length;
 
-		g_object_get (ce->priv->buffer, "highlight-syntax", &ce->priv->highlight, NULL);
-		ce->priv->refresh_region = gtk_text_region_new (buffer);
+	for (i = last; i < ranges->len; ++i)
+	{
+		g_array_index (ranges, BatchRange, i).start += length;
+		g_array_index (ranges, BatchRange, i).end += length;
+	}
 
-		g_signal_connect_swapped (buffer,
-					  "notify::highlight-syntax",
-					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
-					  ce);
+	if (first == last)
+	{
+		g_array_insert_val (ranges, first, merged);
+	}
+	else
+	{
+		g_array_index (ranges, BatchRange, first) = merged;
 
-		install_first_update (ce);
+		if (last - first > 1)
+			g_array_remove_range (ranges, first + 1, last - first - 1);
 	}
 }
 
 /**
- * disable_highlighting:
+ * slow_line_lookup_:
  *
- * @ce: #GtkSourceContextEngine.
+ * @lines: array of #SlowLine.
+ * @offset: the offset.
  *
- * Dsiables highlighting in case of errors (currently if highlighting
- * a single line took too long, so that highlighting doesn't freeze
- * text editor).
+ * Returns: index of the first line starting at or after @offset.
  */
-static void
-disable_highlighting (GtkSourceContextEngine *ce)
+static guint
+slow_line_lookup_ (GArray *lines,
+		   gint    offset)
 {
-	if (!ce->priv->disabled)
-	{
-		ce->priv->disabled = TRUE;
-		gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), NULL);
-		/* FIXME maybe emit some signal here? */
-	}
-}
+	guint lo = 0, hi = lines->len;
 
-static void
-set_tag_style_hash_cb (const char             *style,
-		       GSList                 *tags,
-		       GtkSourceContextEngine *ce)
-{
-	while (tags != NULL)
+	while (lo < hi)
 	{
-		set_tag_style (ce, tags->data, style);
-		tags = tags->next;
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index (lines, SlowLine, mid).start_at < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	return lo;
 }
 
 /**
- * gtk_source_context_engine_set_style_scheme:
+ * slow_lines_edit_:
  *
- * @engine: #GtkSourceContextEngine.
- * @scheme: #GtkSourceStyleScheme to set.
+ * @lines: array of #SlowLine.
+ * @start: the start of changed text.
+ * @old_end: the end of changed text before the change.
+ * @delta: how much was inserted or removed there.
  *
- * GtkSourceEngine::set_style_scheme method.
- * Sets current style scheme, updates tag styles and everything.
+ * Forgets the lines the change touches, they are analyzed normally
+ * again, and moves the lines after it.
  */
 static void
-gtk_source_context_engine_set_style_scheme (GtkSourceEngine      *engine,
-					    GtkSourceStyleScheme *scheme)
+slow_lines_edit_ (GArray *lines,
+		  gint    start,
+		  gint    old_end,
+		  gint    delta)
 {
-	GtkSourceContextEngine *ce;
-
-	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (engine));
-	g_return_if_fail (GTK_IS_SOURCE_STYLE_SCHEME (scheme) || scheme == NULL);
+	guint first, last, i;
 
-	ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
-
-	if (scheme == ce->priv->style_scheme)
+	if (lines->len == 0)
 		return;
 
-	if (ce->priv->style_scheme != NULL)
-		g_object_unref (ce->priv->style_scheme);
-
-	ce->priv->style_scheme = scheme ? g_object_ref (scheme) : NULL;
-	g_hash_table_foreach (ce->priv->tags, (GHFunc) set_tag_style_hash_cb, ce);
-}
-
-static void
-gtk_source_context_engine_finalize (GObject *object)
-{
-	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (object);
+	first = slow_line_lookup_ (lines, start);
 
-	if (ce->priv->buffer != NULL)
+	/* Lines don't overlap, so only the previous one may contain
+	 * start. Text at its end includes its line terminator. */
+	if (first > 0)
 	{
-		g_critical ("finalizing engine with attached buffer");
-		/* Disconnect the buffer (if there is one), which destroys almost
-		 * everything. */
-		gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), NULL);
-	}
+		SlowLine *prev = &g_array_index (lines, SlowLine, first - 1);
 
-#ifdef ENABLE_MEMORY_DEBUG
-	if (ce->priv->mem_usage_timeout)
-		g_source_remove (ce->priv->mem_usage_timeout);
-#endif
-
-	g_assert (!ce->priv->tags);
-	g_assert (!ce->priv->root_context);
-	g_assert (!ce->priv->root_segment);
-	g_assert (!ce->priv->first_update);
-	g_assert (!ce->priv->incremental_update);
-
-	_gtk_source_context_data_unref (ce->priv->ctx_data);
-
-	if (ce->priv->style_scheme != NULL)
-		g_object_unref (ce->priv->style_scheme);
-
-	G_OBJECT_CLASS (_gtk_source_context_engine_parent_class)->finalize (object);
-}
+		if (prev->start_at + prev->char_length >= start)
+			first--;
+	}
 
-static GtkTextTag *
-gtk_source_context_engine_get_context_class_tag (GtkSourceEngine *engine,
-						 const gchar     *context_class)
-{
-	GHashTable *hash_table = GTK_SOURCE_CONTEXT_ENGINE (engine)->priv->context_classes;
+	for (last = first; last < lines->len; ++last)
+		if (g_array_index (lines, SlowLine, last).start_at > old_end)
+			break;
 
-	if (hash_table == NULL)
-	{
-		/* This happens when highlighting is disabled */
-		return NULL;
-	}
+	for (i = last; i < lines->len; ++i)
+		g_array_index (lines, SlowLine, i).start_at += delta;
 
-	return g_hash_table_lookup (hash_table,
-				    context_class);
+	g_array_remove_range (lines, first, last - first);
 }
 
+/**
+ * slow_lines_take_:
+ *
+ * @dest: array of #SlowLine.
+ * @src: array of #SlowLine.
+ * @start: the start of a range.
+ * @end: the end of the range.
+ *
+ * Replaces lines of @dest in [@start, @end) with those of @src.
+ */
 static void
-_gtk_source_context_engine_class_init (GtkSourceContextEngineClass *klass)
+slow_lines_take_ (GArray *dest,
+		  GArray *src,
+		  gint    start,
+		  gint    end)
 {
-	GObjectClass *object_class = G_OBJECT_CLASS (klass);
-	GtkSourceEngineClass *engine_class = GTK_SOURCE_ENGINE_CLASS (klass);
+	guint first, src_first;
 
-	object_class->finalize = gtk_source_context_engine_finalize;
+	first = slow_line_lookup_ (dest, start);
+	g_array_remove_range (dest, first, slow_line_lookup_ (dest, end) - first);
 
-	engine_class->attach_buffer = gtk_source_context_engine_attach_buffer;
-	engine_class->text_inserted = gtk_source_context_engine_text_inserted;
-	engine_class->text_deleted = gtk_source_context_engine_text_deleted;
-	engine_class->update_highlight = gtk_source_context_engine_update_highlight;
-	engine_class->set_style_scheme = gtk_source_context_engine_set_style_scheme;
-	engine_class->get_context_class_tag = gtk_source_context_engine_get_context_class_tag;
+	src_first = slow_line_lookup_ (src, start);
 
-	g_type_class_add_private (object_class, sizeof (GtkSourceContextEnginePrivate));
+	if (src_first < src->len)
+		g_array_insert_vals (dest, first,
+				     &g_array_index (src, SlowLine, src_first),
+				     slow_line_lookup_ (src, end) - src_first);
 }
 
+/**
+ * degraded_lines_add_:
+ *
+ * @lines: array of offsets of degraded lines.
+ * @offset: offset of the line.
+ *
+ * Adds the line unless it is already there, so that it's reported
+ * once however many times it's analyzed before emit_degraded_lines().
+ */
 static void
-_gtk_source_context_engine_init (GtkSourceContextEngine *ce)
-{
-	ce->priv = G_TYPE_INSTANCE_GET_PRIVATE (ce, GTK_TYPE_SOURCE_CONTEXT_ENGINE,
-						GtkSourceContextEnginePrivate);
-}
-
-GtkSourceContextEngine *
-_gtk_source_context_engine_new (GtkSourceContextData *ctx_data)
+degraded_lines_add_ (GArray *lines,
+		     gint    offset)
 {
-	GtkSourceContextEngine *ce;
-
-	g_return_val_if_fail (ctx_data != NULL, NULL);
-	g_return_val_if_fail (ctx_data->lang != NULL, NULL);
-
-	ce = g_object_new (GTK_TYPE_SOURCE_CONTEXT_ENGINE, NULL);
-	ce->priv->ctx_data = _gtk_source_context_data_ref (ctx_data);
+	guint i;
 
-#ifdef ENABLE_MEMORY_DEBUG
-	ce->priv->mem_usage_timeout =
-		g_timeout_add (5000, (GSourceFunc) mem_usage_timeout, ce);
-#endif
+	for (i = 0; i < lines->len; ++i)
+		if (g_array_index (lines, gint, i) == offset)
+			return;
 
-	return ce;
+	g_array_append_val (lines, offset);
 }
 
 /**
- * _gtk_source_context_data_new:
+ * degraded_lines_take_:
  *
- * @lang: #GtkSourceLanguage.
+ * @dest: array of offsets of degraded lines.
+ * @src: array of offsets of degraded lines.
  *
- * Creates new context definition set. It does not set lang->priv->ctx_data,
- * that's lang business.
+ * Moves lines of @src to @dest.
  */
-GtkSourceContextData *
-_gtk_source_context_data_new (GtkSourceLanguage *lang)
+static void
+degraded_lines_take_ (GArray *dest,
+		      GArray *src)
 {
-	GtkSourceContextData *ctx_data;
+	guint i;
 
-	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE (lang), NULL);
-
-	ctx_data = g_slice_new0 (GtkSourceContextData);
-	ctx_data->ref_count = 1;
-	ctx_data->lang = lang;
-	ctx_data->definitions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-						       (GDestroyNotify) context_definition_unref);
-
-	return ctx_data;
-}
+	for (i = 0; i < src->len; ++i)
+		degraded_lines_add_ (dest, g_array_index (src, gint, i));
 
-GtkSourceContextData *
-_gtk_source_context_data_ref (GtkSourceContextData *ctx_data)
-{
-	g_return_val_if_fail (ctx_data != NULL, NULL);
-	ctx_data->ref_count++;
-	return ctx_data;
+	g_array_set_size (src, 0);
 }
 
 /**
- * _gtk_source_context_data_unref:
+ * invalidate_region:
  *
- * @ctx_data: #GtkSourceContextData.
+ * @ce: a #GtkSourceContextEngine.
+ * @offset: the start of invalidated area.
+ * @length: the length of the area.
  *
- * Decreases reference count in ctx_data. When reference count
- * drops to zero, ctx_data is freed, and ctx_data->lang->priv->ctx_data
- * is unset.
+ * Adds the area to the invalid region and queues highlighting.
+ * Edits made during a batch, or while edits of a finished batch
+ * are waiting for update_tree(), are only recorded.
+ * @length may be negative which means deletion; positive
+ * means insertion; 0 means "something happened here", it's
+ * treated as zero-length insertion.
  */
-void
-_gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
+static void
+invalidate_region (GtkSourceContextEngine *ce,
+		   gint                    offset,
+		   gint                    length)
 {
-	g_return_if_fail (ctx_data != NULL);
+	partial_line_drop (ce, TRUE);
+
+	slow_lines_edit_ (ce->priv->slow_lines, offset,
+			  length < 0 ? offset - length : offset, length);
 
-	if (--ctx_data->ref_count == 0)
+	if (ce->priv->batch_depth > 0)
 	{
-		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
-		    ctx_data->lang->priv->ctx_data == ctx_data)
-			ctx_data->lang->priv->ctx_data = NULL;
-		g_hash_table_destroy (ctx_data->definitions);
-		g_slice_free (GtkSourceContextData, ctx_data);
+		batch_add_edit_ (ce, offset, length);
+		return;
 	}
-}
 
-/* REGEX HANDLING --------------------------------------------------------- */
+	/* Ranges of the batch are relative to the tree, keep them so. */
+	if (ce->priv->batch_ranges->len != 0)
+	{
+		batch_add_edit_ (ce, offset, length);
+		install_first_update (ce);
+		return;
+	}
 
-static Regex *
-regex_ref (Regex *regex)
-{
-	if (regex != NULL)
-		regex->ref_count++;
-	return regex;
+	invalid_region_add (ce->priv->buffer, &ce->priv->invalid_region,
+			    offset, length);
+
+	/* The tree built by the background thread must be told too. */
+	if (ce->priv->background_job != NULL)
+		invalid_region_add (ce->priv->buffer, &ce->priv->background_job->edits,
+				    offset, length);
+
+	CHECK_TREE (ce);
+
+	install_first_update (ce);
 }
 
+/**
+ * insert_range:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @offset: the start of new segment.
+ * @length: the length of the segment.
+ *
+ * Updates segment tree after insertion: it updates tree
+ * offsets as appropriate, and inserts a new invalid segment
+ * or extends existing invalid segment as @offset, so
+ * after the call segment [@offset, @offset + @length) is marked
+ * invalid in the tree.
+ * It may be safely called with length == 0 at any moment
+ * to invalidate some offset (and it's used here and there).
+ */
 static void
-regex_unref (Regex *regex)
+insert_range (GtkSourceContextEngine *ce,
+	      gint                    offset,
+	      gint                    length)
 {
-	if (regex != NULL && --regex->ref_count == 0)
+	Segment *parent, *prev = NULL, *next = NULL, *new_segment;
+	Segment *segment;
+
+	/* If there is an invalid segment adjacent to offset, use it.
+	 * Otherwise, find the deepest segment to split and insert
+	 * dummy segment in there. */
+
+	parent = get_invalid_at (ce, offset);
+
+	if (parent == NULL)
+		find_insertion_place (ce, ce->priv->root_segment, offset,
+				      &parent, &prev, &next,
+				      get_hint (ce, offset));
+
+	g_assert (parent->start_at <= offset);
+	g_assert (parent->end_at >= offset);
+	g_assert (!prev || prev->parent == parent);
+	g_assert (!next || next->parent == parent);
+	g_assert (!prev || prev->next == next);
+	g_assert (!next || next->prev == prev);
+
+	if (SEGMENT_IS_INVALID (parent))
 	{
-		if (regex->resolved)
+		/* If length is zero, and we already have an invalid segment there,
+		 * do nothing. */
+		if (length == 0)
+			return;
+
+		segment = parent;
+	}
+	else if (SEGMENT_IS_SIMPLE (parent))
+	{
+		/* If it's a simple context, then:
+		 * if one of its ends is offset, then we just invalidate it;
+		 * otherwise, we split it into two, and insert zero-lentgh
+		 * invalid segment in the middle. */
+		if (parent->start_at < offset && parent->end_at > offset)
 		{
-			g_regex_unref (regex->u.regex.regex);
-			if (regex->u.regex.match)
-				g_match_info_free (regex->u.regex.match);
+			segment = simple_segment_split_ (ce, parent, offset);
 		}
 		else
-			g_free (regex->u.info.pattern);
-		g_slice_free (Regex, regex);
+		{
+			segment_make_invalid_ (ce, parent);
+			segment = parent;
+		}
 	}
-}
+	else
+	{
+		/* Just insert new zero-length invalid segment. */
 
-/**
- * find_single_byte_escape:
- *
- * @string: the pattern.
- *
- * Checks whether pattern contains \C escape sequence,
- * which means "single byte" in pcre and naturally leads
- * to crash if used for highlighting.
- */
-static gboolean
-find_single_byte_escape (const gchar *string)
-{
-	const char *p = string;
+		new_segment = segment_new (ce, parent, NULL, offset, offset, FALSE);
 
-	while ((p = strstr (p, "\\C")))
-	{
-		const char *slash;
-		gboolean found;
+		new_segment->next = next;
+		new_segment->prev = prev;
 
-		if (p == string)
-			return TRUE;
+		if (next != NULL)
+			next->prev = new_segment;
+		else
+			parent->last_child = new_segment;
 
-		found = TRUE;
-		slash = p - 1;
+		if (prev != NULL)
+			prev->next = new_segment;
+		else
+			parent->children = new_segment;
 
-		while (slash >= string && *slash == '\\')
+		segment = new_segment;
+	}
+
+	g_assert (!segment->children);
+
+	if (length != 0)
+	{
+		pending_edits_add (ce, offset, length);
+
+		/* Now fix offsets in segment and its ancestors, and in the
+		 * segments "to the right" of them which start at offset.
+		 * The rest is moved lazily. */
+		while (segment != NULL)
 		{
-			found = !found;
-			slash--;
-		}
+			Segment *tmp;
+			SubPattern *sp;
 
-		if (found)
-			return TRUE;
+			for (tmp = segment->next; tmp != NULL; tmp = tmp->next)
+			{
+				segment_apply_edits_ (ce, tmp, ce->priv->stamp - 1);
 
-		p += 2;
+				if (tmp->start_at != offset)
+					break;
+
+				fix_offsets_insert_ (ce, tmp, offset, length);
+			}
+
+			segment_apply_edits_ (ce, segment, ce->priv->stamp - 1);
+			segment->end_at += length;
+
+			for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+			{
+				if (sp->start_at > offset)
+					sp->start_at += length;
+				if (sp->end_at > offset)
+					sp->end_at += length;
+			}
+
+			segment->stamp = ce->priv->stamp;
+			segment = segment->parent;
+		}
 	}
 
-	return FALSE;
+	CHECK_TREE (ce);
 }
 
 /**
- * regex_new:
- *
- * @pattern: the regular expression.
- * @flags: compile options for @pattern.
- * @error: location to store the error occuring, or %NULL to ignore errors.
+ * gtk_source_context_engine_text_inserted:
  *
- * Creates a new regex.
+ * @ce: a #GtkSourceContextEngine.
+ * @start_offset: the start of inserted text.
+ * @end_offset: the end of inserted text.
  *
- * Returns: a newly-allocated #Regex.
+ * Called from GtkTextBuffer::insert_text.
  */
-static Regex *
-regex_new (const gchar           *pattern,
-	   GRegexCompileFlags     flags,
-	   GError               **error)
+static void
+gtk_source_context_engine_text_inserted (GtkSourceEngine *engine,
+					 gint             start_offset,
+					 gint             end_offset)
 {
-	Regex *regex;
-	static GRegex *start_ref_re = NULL;
-
-	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+	GtkTextIter iter;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	if (find_single_byte_escape (pattern))
+	/* Happens when highlighting is disabled */
+	if (ce->priv->buffer == NULL)
 	{
-		g_set_error (error, GTK_SOURCE_CONTEXT_ENGINE_ERROR,
-			     GTK_SOURCE_CONTEXT_ENGINE_ERROR_INVALID_REGEX,
-			     "%s", _("using \\C is not supported in language definitions"));
-		return NULL;
+		return;
 	}
 
-	regex = g_slice_new0 (Regex);
-	regex->ref_count = 1;
+	g_return_if_fail (start_offset < end_offset);
 
-	if (start_ref_re == NULL)
-		start_ref_re = g_regex_new (START_REF_REGEX,
-					    /* http://bugzilla.gnome.org/show_bug.cgi?id=455640
-					     * we don't care about line ends anyway */
-					    G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF,
-					    0,
-					    NULL);
+	invalidate_region (ce, start_offset, end_offset - start_offset);
 
-	if (g_regex_match (start_ref_re, pattern, 0, NULL))
-	{
-		regex->resolved = FALSE;
-		regex->u.info.pattern = g_strdup (pattern);
-		regex->u.info.flags = flags;
-	}
-	else
+	/* If end_offset is at the start of a line (enter key pressed) then
+	 * we need to invalidate the whole new line, otherwise it may not be
+	 * highlighted because the engine analyzes the previous line, end
+	 * context there is none, start context at this line is none too,
+	 * and the engine stops. */
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, end_offset);
+	if (gtk_text_iter_starts_line (&iter) && !gtk_text_iter_ends_line (&iter))
 	{
-		regex->resolved = TRUE;
-		regex->u.regex.regex = g_regex_new (pattern,
-						    flags | G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF, 0,
-						    error);
-
-		if (regex->u.regex.regex == NULL)
-		{
-			g_slice_free (Regex, regex);
-			regex = NULL;
-		}
+		gtk_text_iter_forward_to_line_end (&iter);
+		invalidate_region (ce, gtk_text_iter_get_offset (&iter), 0);
 	}
-
-	return regex;
 }
 
 /**
- * sub_pattern_to_int:
+ * delete_range_:
  *
- * @name: the string from lang file.
+ * @ce: a #GtkSourceContextEngine.
+ * @start: the start of deleted area.
+ * @end: the end of deleted area.
  *
- * Tries to convert @name to a number and assumes
- * it's a name if that fails. Used for references in
- * subpattern contexts (e.g. \%{1@start} or \%{blah@start}).
+ * Updates segment tree after deletion: removes segments at deleted
+ * interval, updates tree offsets, etc.
+ * It's called only from update_tree().
  */
-static gint
-sub_pattern_to_int (const gchar *name)
+static void
+delete_range_ (GtkSourceContextEngine *ce,
+	       gint                    start,
+	       gint                    end)
 {
-	guint64 number;
-	gchar *end_name;
-
-	if (*name == 0)
-		return -1;
+	g_return_if_fail (start < end);
 
-	errno = 0;
-	number = g_ascii_strtoull (name, &end_name, 10);
+	/* FIXME adjacent invalid segments? */
+	erase_segments (ce, start, end, NULL);
+	pending_edits_add (ce, start, start - end);
 
-	if (errno !=0 || number > G_MAXINT || *end_name != 0)
-		return -1;
+	/* no need to invalidate at start, update_tree will do it */
 
-	return number;
+	CHECK_TREE (ce);
 }
 
-struct RegexResolveData {
-	Regex       *start_regex;
-	const gchar *matched_text;
-};
-
-static gboolean
-replace_start_regex (const GMatchInfo *match_info,
-		     GString          *expanded_regex,
-		     gpointer          user_data)
-{
-	gchar *num_string, *subst, *subst_escaped, *escapes;
-	gint num;
-	struct RegexResolveData *data = user_data;
-
-	escapes = g_match_info_fetch (match_info, 1);
-	num_string = g_match_info_fetch (match_info, 2);
-	num = sub_pattern_to_int (num_string);
-
-	if (num < 0)
-		subst = g_match_info_fetch_named (data->start_regex->u.regex.match,
-						  num_string);
-	else
-		subst = g_match_info_fetch (data->start_regex->u.regex.match,
-					    num);
-
-	if (subst != NULL)
-	{
-		subst_escaped = g_regex_escape_string (subst, -1);
-	}
-	else
-	{
-		g_warning ("Invalid group: %s", num_string);
-		subst_escaped = g_strdup ("");
-	}
-
-	g_string_append (expanded_regex, escapes);
-	g_string_append (expanded_regex, subst_escaped);
-
-	g_free (escapes);
-	g_free (num_string);
-	g_free (subst);
-	g_free (subst_escaped);
-
-	return FALSE;
+/**
+ * gtk_source_context_engine_text_deleted:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @offset: the start of deleted text.
+ * @length: the length (in characters) of deleted text.
+ *
+ * Called from GtkTextBuffer::delete_range.
+ */
+static void
+gtk_source_context_engine_text_deleted (GtkSourceEngine *engine,
+					gint             offset,
+					gint             length)
+{
+	g_return_if_fail (length > 0);
+	invalidate_region (GTK_SOURCE_CONTEXT_ENGINE (engine),
+			   offset,
+			   - length);
 }
 
 /**
- * regex_resolve:
+ * get_invalid_segment:
  *
- * @regex: a #Regex.
- * @start_regex: a #Regex.
- * @matched_text: the text matched against @start_regex.
+ * @ce: a #GtkSourceContextEngine.
  *
- * If the regular expression does not contain references to the start
- * regular expression, the functions increases the reference count
- * of @regex and returns it.
+ * Returns: first invalid segment, or %NULL.
+ */
+static Segment *
+get_invalid_segment (GtkSourceContextEngine *ce)
+{
+	g_return_val_if_fail (ce->priv->invalid_region.empty, NULL);
+	return ce->priv->invalid ? segment_sync (ce, ce->priv->invalid->data) : NULL;
+}
+
+/**
+ * get_invalid_line:
  *
- * If the regular expression contains references to the start regular
- * expression in the form "\%{start_sub_pattern@start}", it replaces
- * them (they are extracted from @start_regex and @matched_text) and
- * returns the new regular expression.
+ * @ce: a #GtkSourceContextEngine.
  *
- * Returns: a #Regex.
+ * Returns: first invalid line, or -1.
  */
-static Regex *
-regex_resolve (Regex       *regex,
-	       Regex       *start_regex,
-	       const gchar *matched_text)
+static gint
+get_invalid_line (GtkSourceContextEngine *ce)
 {
-	GRegex *start_ref;
-	gchar *expanded_regex;
-	Regex *new_regex;
-	struct RegexResolveData data;
-
-	if (regex == NULL || regex->resolved)
-		return regex_ref (regex);
-
-	start_ref = g_regex_new (START_REF_REGEX, G_REGEX_NEWLINE_LF, 0, NULL);
-	data.start_regex = start_regex;
-	data.matched_text = matched_text;
-	expanded_regex = g_regex_replace_eval (start_ref,
-					       regex->u.info.pattern,
-					       -1, 0, 0,
-					       replace_start_regex,
-					       &data, NULL);
-	new_regex = regex_new (expanded_regex, regex->u.info.flags, NULL);
+	GtkTextIter iter;
+	gint offset = G_MAXINT;
 
-	if (new_regex == NULL || !new_regex->resolved)
+	if (!ce->priv->invalid_region.empty)
 	{
-		regex_unref (new_regex);
-		g_warning ("Regular expression %s cannot be expanded.",
-			   regex->u.info.pattern);
-		/* Returns a regex that nevers matches. */
-		new_regex = regex_new ("$never-match^", 0, NULL);
+		gint tmp;
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer,
+						  &iter,
+						  ce->priv->invalid_region.start);
+		tmp = gtk_text_iter_get_offset (&iter);
+		offset = MIN (offset, tmp);
 	}
 
-	g_free (expanded_regex);
-	g_regex_unref (start_ref);
-	return new_regex;
-}
-
-static gboolean
-regex_match (Regex       *regex,
-	     const gchar *line,
-	     gint         byte_length,
-	     gint         byte_pos)
-{
-	gboolean result;
-
-	g_assert (regex->resolved);
+	if (ce->priv->batch_ranges->len != 0)
+		offset = MIN (offset, g_array_index (ce->priv->batch_ranges,
+						     BatchRange, 0).start);
 
-	if (regex->u.regex.match)
+	if (ce->priv->invalid)
 	{
-		g_match_info_free (regex->u.regex.match);
-		regex->u.regex.match = NULL;
+		Segment *segment = segment_sync (ce, ce->priv->invalid->data);
+		offset = MIN (offset, segment->start_at);
 	}
 
-	result = g_regex_match_full (regex->u.regex.regex, line,
-				     byte_length, byte_pos,
-				     0, &regex->u.regex.match,
-				     NULL);
+	if (ce->priv->partial_line != NULL)
+		offset = MIN (offset, ce->priv->partial_line->line.start_at);
 
-	return result;
-}
+	if (offset == G_MAXINT)
+		return -1;
 
-static gchar *
-regex_fetch (Regex       *regex,
-	     gint         num)
-{
-	g_assert (regex->resolved);
-	return g_match_info_fetch (regex->u.regex.match, num);
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, offset);
+	return gtk_text_iter_get_line (&iter);
 }
 
+/**
+ * repair_range_:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @start: the start of changed text.
+ * @end: the end of changed text.
+ * @delta: how much was inserted or removed there.
+ *
+ * Modifies syntax tree after text in [@start, @end - @delta) in
+ * the tree was replaced with [@start, @end) in the buffer. Tree
+ * offsets before @start must match the buffer.
+ */
 static void
-regex_fetch_pos (Regex       *regex,
-		 const gchar *text,
-		 gint         num,
-		 gint        *start_pos, /* character offsets */
-		 gint        *end_pos)   /* character offsets */
+repair_range_ (GtkSourceContextEngine *ce,
+	       gint                    start,
+	       gint                    end,
+	       gint                    delta)
 {
-	gint byte_start_pos, byte_end_pos;
+	gint erase_start, erase_end;
 
-	g_assert (regex->resolved);
+	g_assert (start <= MIN (end, end - delta));
+
+	/* Here start and end are actual offsets in the buffer (they do not match offsets
+	 * in the tree if delta is not zero); delta is how much was inserted/removed.
+	 * First, we insert/delete range from the tree, to make offsets in tree
+	 * match offsets in the buffer. Then, create an invalid segment for the rest
+	 * of the area if needed. */
+
+	if (delta > 0)
+		insert_range (ce, start, delta);
+	else if (delta < 0)
+		delete_range_ (ce, end, end - delta);
 
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &byte_start_pos, &byte_end_pos))
+	if (delta <= 0)
 	{
-		if (start_pos != NULL)
-			*start_pos = -1;
-		if (end_pos != NULL)
-			*end_pos = -1;
+		erase_start = start;
+		erase_end = end;
 	}
 	else
 	{
-		if (start_pos != NULL)
-			*start_pos = g_utf8_pointer_to_offset (text, text + byte_start_pos);
-		if (end_pos != NULL)
-			*end_pos = g_utf8_pointer_to_offset (text, text + byte_end_pos);
+		erase_start = start + delta;
+		erase_end = end;
 	}
-}
-
-static void
-regex_fetch_pos_bytes (Regex *regex,
-		       gint   num,
-		       gint  *start_pos_p, /* byte offsets */
-		       gint  *end_pos_p)   /* byte offsets */
-{
-	gint start_pos;
-	gint end_pos;
-
-	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &start_pos, &end_pos))
+	if (erase_start < erase_end)
 	{
-		start_pos = -1;
-		end_pos = -1;
+		erase_segments (ce, erase_start, erase_end, NULL);
+		create_segment (ce, ce->priv->root_segment, NULL, erase_start, erase_end, FALSE, NULL);
+	}
+	else if (get_invalid_at (ce, start) == NULL)
+	{
+		insert_range (ce, start, 0);
 	}
 
-	if (start_pos_p != NULL)
-		*start_pos_p = start_pos;
-	if (end_pos_p != NULL)
-		*end_pos_p = end_pos;
+#ifdef ENABLE_CHECK_TREE
+	g_assert (get_invalid_at (ce, start) != NULL);
+#endif
 }
 
+/**
+ * batch_flush_:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ *
+ * Applies edits recorded by batch_add_edit_() to the tree.
+ */
 static void
-regex_fetch_named_pos (Regex       *regex,
-		       const gchar *text,
-		       const gchar *name,
-		       gint        *start_pos, /* character offsets */
-		       gint        *end_pos)   /* character offsets */
+batch_flush_ (GtkSourceContextEngine *ce)
 {
-	gint byte_start_pos, byte_end_pos;
+	GArray *ranges = ce->priv->batch_ranges;
+	guint i;
 
-	g_assert (regex->resolved);
+	if (ranges->len == 0)
+		return;
 
-	if (!g_match_info_fetch_named_pos (regex->u.regex.match, name, &byte_start_pos, &byte_end_pos))
+	g_assert (ce->priv->invalid_region.empty);
+
+	if (ce->priv->background_job != NULL)
 	{
-		if (start_pos != NULL)
-			*start_pos = -1;
-		if (end_pos != NULL)
-			*end_pos = -1;
+		gint delta = 0;
+
+		for (i = 0; i < ranges->len; ++i)
+			delta += g_array_index (ranges, BatchRange, i).delta;
+
+		invalid_region_add_span (ce->priv->buffer,
+					 &ce->priv->background_job->edits,
+					 g_array_index (ranges, BatchRange, 0).start,
+					 g_array_index (ranges, BatchRange, ranges->len - 1).end,
+					 delta);
 	}
-	else
+
+	/* Once the ranges before it are applied, the tree matches the
+	 * buffer up to the start of the next range. */
+	for (i = 0; i < ranges->len; ++i)
 	{
-		if (start_pos != NULL)
-			*start_pos = g_utf8_pointer_to_offset (text, text + byte_start_pos);
-		if (end_pos != NULL)
-			*end_pos = g_utf8_pointer_to_offset (text, text + byte_end_pos);
+		BatchRange *range = &g_array_index (ranges, BatchRange, i);
+		repair_range_ (ce, range->start, range->end, range->delta);
 	}
-}
 
-static const gchar *
-regex_get_pattern (Regex *regex)
-{
-	g_return_val_if_fail (regex && regex->resolved, "");
-	return g_regex_get_pattern (regex->u.regex.regex);
-}
+	g_array_set_size (ranges, 0);
 
-/* SYNTAX TREE ------------------------------------------------------------ */
+	CHECK_TREE (ce);
+}
 
 /**
- * apply_sub_patterns:
+ * update_tree:
  *
- * @contextstate: a #Context.
- * @line_starts_at: beginning offset of the line.
- * @line: the line to analyze.
- * @line_pos: the position inside @line.
- * @line_length: the length of @line.
- * @regex: regex that matched.
- * @where: kind of sub patterns to apply.
+ * @ce: a #GtkSourceContextEngine.
  *
- * Applies sub patterns of kind @where to the matched text.
+ * Modifies syntax tree according to data in invalid_region
+ * and edits made during a batch.
  */
 static void
-apply_sub_patterns (Segment         *state,
-		    LineInfo        *line,
-		    Regex           *regex,
-		    SubPatternWhere  where)
+update_tree (GtkSourceContextEngine *ce)
 {
-	GSList *sub_pattern_list = state->context->definition->sub_patterns;
+	InvalidRegion *region = &ce->priv->invalid_region;
+	gint start, end;
+	GtkTextIter iter;
 
-	if (SEGMENT_IS_CONTAINER (state))
-	{
-		gint start_pos;
-		gint end_pos;
+	batch_flush_ (ce);
 
-		regex_fetch_pos (regex, line->text, 0, &start_pos, &end_pos);
+	if (region->empty)
+		return;
 
-		if (where == SUB_PATTERN_WHERE_START)
-		{
-			if (line->start_at + start_pos != state->start_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos > state->end_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else
-				state->start_len = line->start_at + end_pos - state->start_at;
-		}
-		else
-		{
-			if (line->start_at + start_pos < state->start_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos != state->end_at)
-				g_critical ("%s: oops", G_STRLOC);
-			else
-				state->end_len = state->end_at - line->start_at - start_pos;
-		}
-	}
-
-	while (sub_pattern_list != NULL)
-	{
-		SubPatternDefinition *sp_def = sub_pattern_list->data;
-
-		if (sp_def->where == where)
-		{
-			gint start_pos;
-			gint end_pos;
+	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
+	start = gtk_text_iter_get_offset (&iter);
+	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
+	end = gtk_text_iter_get_offset (&iter);
 
-			if (sp_def->is_named)
-				regex_fetch_named_pos (regex,
-						       line->text,
-						       sp_def->u.name,
-						       &start_pos,
-						       &end_pos);
-			else
-				regex_fetch_pos (regex,
-						 line->text,
-						 sp_def->u.num,
-						 &start_pos,
-						 &end_pos);
+	repair_range_ (ce, start, end, region->delta);
 
-			if (start_pos >= 0 && start_pos != end_pos)
-			{
-				sub_pattern_new (state,
-						 line->start_at + start_pos,
-						 line->start_at + end_pos,
-						 sp_def);
-			}
-		}
+	region->empty = TRUE;
 
-		sub_pattern_list = sub_pattern_list->next;
-	}
+	CHECK_TREE (ce);
 }
 
 /**
- * can_apply_match:
+ * gtk_source_context_engine_begin_batch:
  *
- * @state: the current state of the parser.
- * @line: the line to analyze.
- * @match_start: start position of match, bytes.
- * @match_end: where to put end of match, bytes.
- * @where: kind of sub patterns to apply.
+ * @engine: a #GtkSourceContextEngine.
  *
- * See apply_match(), this function is a helper function
- * called from where, it doesn't modify syntax tree.
+ * GtkSourceEngine::begin_batch method.
  *
- * Returns: %TRUE if the match can be applied.
+ * Edits made until the matching end_batch() are only recorded
+ * and merged, so that a lot of small changes all over the buffer
+ * cost one pass over the tree.
  */
-static gboolean
-can_apply_match (Context  *state,
-		 LineInfo *line,
-		 gint      match_start,
-		 gint     *match_end,
-		 Regex    *regex)
+static void
+gtk_source_context_engine_begin_batch (GtkSourceEngine *engine)
 {
-	gint end_match_pos;
-	gboolean ancestor_ends;
-	gint pos;
-
-	ancestor_ends = FALSE;
-	/* end_match_pos is the position of the end of the matched regex. */
-	regex_fetch_pos_bytes (regex, 0, NULL, &end_match_pos);
-
-	g_assert (end_match_pos <= line->byte_length);
-
-	/* Verify if an ancestor ends in the matched text. */
-	if (ANCESTOR_CAN_END_CONTEXT (state) &&
-	    /* there is no middle of zero-length match */
-	    match_start < end_match_pos)
-	{
-		pos = match_start + 1;
-
-		while (pos < end_match_pos)
-		{
-			if (ancestor_context_ends_here (state, line, pos))
-			{
-				ancestor_ends = TRUE;
-				break;
-			}
-
-			pos = g_utf8_next_char (line->text + pos) - line->text;
-		}
-	}
-	else
-	{
-		pos = end_match_pos;
-	}
-
-	if (ancestor_ends)
-	{
-		/* An ancestor ends in the middle of the match, we verify
-		 * if the regex matches against the available string before
-		 * the end of the ancestor.
-		 * For instance in C a net-address context matches even if
-		 * it contains the end of a multi-line comment. */
-		if (!regex_match (regex, line->text, pos, match_start))
-		{
-			/* This match is not valid, so we can try to match
-			 * the next definition, so the position should not
-			 * change. */
-			return FALSE;
-		}
-	}
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	*match_end = pos;
-	return TRUE;
-}
+	if (ce->priv->buffer == NULL)
+		return;
 
-static gint
-line_pos_to_offset (LineInfo *line,
-		    gint      pos)
-{
-	if (line->char_length != line->byte_length)
-		pos = g_utf8_pointer_to_offset (line->text, line->text + pos);
-	return line->start_at + pos;
+	/* Ranges are relative to the tree, so an invalid region must
+	 * be applied before the batch starts. Ranges left by a previous
+	 * batch are fine, they're merged with the new ones. */
+	if (ce->priv->batch_depth++ == 0 && !ce->priv->invalid_region.empty)
+		update_tree (ce);
 }
 
 /**
- * apply_match:
- *
- * @state: the current state of the parser.
- * @line: the line to analyze.
- * @line_pos: position in the line, bytes.
- * @regex: regex that matched.
- * @where: kind of sub patterns to apply.
+ * gtk_source_context_engine_end_batch:
  *
- * Moves @line_pos after the matched text. @line_pos is not
- * updated and the function returns %FALSE if the match cannot be
- * applied because an ancestor ends in the middle of the matched
- * text.
+ * @engine: a #GtkSourceContextEngine.
  *
- * If the match can be applied the function applies the appropriate
- * sub patterns.
+ * GtkSourceEngine::end_batch method.
  *
- * Returns: %TRUE if the match can be applied.
+ * Queues highlighting of text changed during the batch. The
+ * tree is repaired by update_tree(), in idle like after any
+ * other edit.
  */
-static gboolean
-apply_match (Segment         *state,
-	     LineInfo        *line,
-	     gint            *line_pos,
-	     Regex           *regex,
-	     SubPatternWhere  where)
+static void
+gtk_source_context_engine_end_batch (GtkSourceEngine *engine)
 {
-	gint match_end;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	if (!can_apply_match (state->context, line, *line_pos, &match_end, regex))
-		return FALSE;
+	/* The engine may have been attached in the middle of a batch. */
+	if (ce->priv->buffer == NULL || ce->priv->batch_depth == 0)
+		return;
 
-	segment_extend (state, line_pos_to_offset (line, match_end));
-	apply_sub_patterns (state, line, regex, where);
-	*line_pos = match_end;
+	if (--ce->priv->batch_depth > 0 || ce->priv->batch_ranges->len == 0)
+		return;
 
-	return TRUE;
+	install_first_update (ce);
 }
 
 /**
- * create_reg_all:
- *
- * @context: context.
- * @definition: context definition.
+ * gtk_source_context_engine_update_highlight:
  *
- * Creates regular expression for all possible transitions: it
- * combines terminating regex, terminating regexes of parent
- * contexts if those can terminate this one, and start regexes
- * of child contexts.
+ * @ce: a #GtkSourceContextEngine.
+ * @start: start of area to update.
+ * @end: start of area to update.
+ * @synchronous: whether it should block until everything
+ * is analyzed/highlighted.
  *
- * It takes as an argument actual context or a context definition. In
- * case when context end depends on start (\%{foo@start} references),
- * it must use the context, definition is not enough. If there are no
- * those references, then the reg_all is created right in the definition
- * when no contexts exist yet. This is why this function has its funny
- * arguments.
+ * GtkSourceEngine::update_highlight method.
  *
- * Returns: resulting regex or %NULL when pcre failed to compile the regex.
+ * Makes sure the area is analyzed and highlighted. If @synchronous
+ * is %FALSE, then it queues idle worker.
  */
-static Regex *
-create_reg_all (Context           *context,
-		ContextDefinition *definition)
+static void
+gtk_source_context_engine_update_highlight (GtkSourceEngine   *engine,
+					    const GtkTextIter *start,
+					    const GtkTextIter *end,
+					    gboolean           synchronous)
 {
-	DefinitionsIter iter;
-	DefinitionChild *child_def;
-	GString *all;
-	Regex *regex;
-	GError *error = NULL;
+	gint invalid_line;
+	gint end_line;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	g_return_val_if_fail ((context == NULL && definition != NULL) ||
-			      (context != NULL && definition == NULL), NULL);
+	if (!ce->priv->highlight)
+		return;
 
-	if (definition == NULL)
-		definition = context->definition;
+	evict_tags (ce, start, end);
 
-	all = g_string_new ("(");
+	if (ce->priv->background_job != NULL)
+		background_job_window (ce, start);
 
-	/* Closing regex. */
-	if (definition->type == CONTEXT_TYPE_CONTAINER &&
-	    definition->u.start_end.end != NULL)
-	{
-		Regex *end;
+	invalid_line = get_invalid_line (ce);
+	end_line = gtk_text_iter_get_line (end);
 
-		if (definition->u.start_end.end->resolved)
-		{
-			end = definition->u.start_end.end;
-		}
-		else
+	if (gtk_text_iter_starts_line (end) && end_line > 0)
+		end_line -= 1;
+
+	if (invalid_line < 0 || invalid_line > end_line)
+	{
+		ensure_highlighted (ce, start, end);
+	}
+	else if (synchronous)
+	{
+		/* analyze whole region */
+		update_syntax (ce, end, 0);
+		ensure_highlighted (ce, start, end);
+	}
+	else
+	{
+		if (gtk_text_iter_get_line (start) < invalid_line)
 		{
-			g_return_val_if_fail (context && context->end, NULL);
-			end = context->end;
+			GtkTextIter valid_end = *start;
+			gtk_text_iter_set_line (&valid_end, invalid_line);
+			ensure_highlighted (ce, start, &valid_end);
 		}
 
-		g_string_append (all, regex_get_pattern (end));
-		g_string_append (all, "|");
+		request_viewport (ce, end);
 	}
+}
 
-	/* Ancestors. */
-	if (context != NULL)
-	{
-		Context *tmp = context;
+/**
+ * enable_highlight:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @enable: whether to enable highlighting.
+ *
+ * Whether to highlight (i.e. apply tags) analyzed area.
+ * Note that this does not turn on/off the analyzis stuff,
+ * it affects only text tags.
+ */
+static void
+enable_highlight (GtkSourceContextEngine *ce,
+		  gboolean                enable)
+{
+	GtkTextIter start, end;
 
-		while (ANCESTOR_CAN_END_CONTEXT (tmp))
-		{
-			if (!CONTEXT_EXTENDS_PARENT (tmp))
-			{
-				gboolean append = TRUE;
+	if (!enable == !ce->priv->highlight)
+		return;
 
-				/* Code as it is seems to be right, and seems working right.
-				 * Remove FIXME's below if everything is fine. */
+	ce->priv->highlight = enable != 0;
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (ce->priv->buffer),
+				    &start, &end);
 
-				if (tmp->parent->end != NULL)
-					g_string_append (all, regex_get_pattern (tmp->parent->end));
-				/* FIXME ?
-				 * The old code insisted on having tmp->parent->end != NULL here,
-				 * though e.g. in case line-comment -> email-address it's not the case.
-				 * Apparently using $ fixes the problem. */
-				else if (CONTEXT_END_AT_LINE_END (tmp->parent))
-					g_string_append (all, "$");
-				/* FIXME it's not clear whether it can happen, maybe we need assert here
-				 * or parser need to check it */
-				else
-				{
-					/* g_critical ("%s: oops", G_STRLOC); */
-					append = FALSE;
-				}
-
-				if (append)
-					g_string_append (all, "|");
-			}
+	if (enable)
+	{
+		gtk_text_region_add (ce->priv->refresh_region, &start, &end);
 
-			tmp = tmp->parent;
-		}
+		refresh_range (ce, &start, &end);
 	}
-
-	/* Children. */
-	definition_iter_init (&iter, definition);
-	while ((child_def = definition_iter_next (&iter)) != NULL)
+	else
 	{
-		Regex *child_regex = NULL;
-
-		g_return_val_if_fail (child_def->resolved, NULL);
+		unhighlight_region (ce, &start, &end);
+		gtk_text_region_subtract (ce->priv->tagged_region, &start, &end);
+	}
+}
 
-		switch (child_def->u.definition->type)
-		{
-			case CONTEXT_TYPE_CONTAINER:
-				child_regex = child_def->u.definition->u.start_end.start;
-				break;
-			case CONTEXT_TYPE_SIMPLE:
-				child_regex = child_def->u.definition->u.match;
-				break;
-			default:
-				g_return_val_if_reached (NULL);
-		}
+static void
+buffer_notify_highlight_syntax_cb (GtkSourceContextEngine *ce)
+{
+	gboolean highlight;
+	g_object_get (ce->priv->buffer, "highlight-syntax", &highlight, NULL);
+	enable_highlight (ce, highlight);
+}
 
-		if (child_regex != NULL)
-		{
-			g_string_append (all, regex_get_pattern (child_regex));
-			g_string_append (all, "|");
-		}
-	}
-	definition_iter_destroy (&iter);
+static void
+buffer_notify_large_file_tier_cb (GtkSourceContextEngine *ce)
+{
+	GtkSourceLargeFileTier tier;
+	GtkSourceLargeFileTier changed;
+	GtkTextIter start, end;
 
-	if (all->len > 1)
-		g_string_truncate (all, all->len - 1);
-	g_string_append (all, ")");
+	g_object_get (ce->priv->buffer, "large-file-tier", &tier, NULL);
+	changed = tier ^ ce->priv->large_file_tier;
+	ce->priv->large_file_tier = tier;
 
-	regex = regex_new (all->str, 0, &error);
+	/* Tags outside of the view go away in the next evict_tags(), and
+	 * get applied again by ensure_highlighted() when needed, so only
+	 * context classes need to be handled here. */
+	if (!(changed & GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES))
+		return;
 
-	if (regex == NULL)
-	{
-		/* regex_new could fail, for instance if there are different
-		 * named sub-patterns with the same name or if resulting regex is
-		 * too long. In this case fixing lang file helps (e.g. renaming
-		 * subpatterns, making huge keywords use bigger prefixes, etc.) */
-		g_warning (_("Cannot create a regex for all the transitions, "
-			     "the syntax highlighting process will be slower "
-			     "than usual.\nThe error was: %s"), error->message);
-		g_error_free (error);
-	}
+	gtk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
 
-	g_string_free (all, TRUE);
-	return regex;
+	if (tier & GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES)
+		remove_region_context_classes (ce, &start, &end);
+	else
+		refresh_context_classes (ce, &start, &end);
 }
 
-static Context *
-context_ref (Context *context)
+
+/* IDLE WORKER CODE ------------------------------------------------------- */
+
+/**
+ * all_analyzed:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ *
+ * Returns: whether everything is analyzed (but it doesn't care about the tags).
+ */
+static gboolean
+all_analyzed (GtkSourceContextEngine *ce)
 {
-	if (context != NULL)
-		context->ref_count++;
-	return context;
+	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty &&
+	       ce->priv->batch_ranges->len == 0 &&
+	       ce->priv->partial_line == NULL;
 }
 
-/* does not copy style */
-static Context *
-context_new (Context           *parent,
-	     ContextDefinition *definition,
-	     const gchar       *line_text,
-	     const gchar       *style,
-	     gboolean           ignore_children_style)
+/**
+ * idle_worker:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Analyzes a batch in idle. Stops when
+ * whole buffer is analyzed.
+ */
+static gboolean
+idle_worker (GtkSourceContextEngine *ce)
 {
-	Context *context;
+	gboolean retval = TRUE;
+	gboolean viewport_pending;
+	gint64 profile_start = 0;
 
-	context = g_slice_new0 (Context);
-	context->ref_count = 1;
-	context->definition = definition;
-	context->parent = parent;
+	g_return_val_if_fail (ce->priv->buffer != NULL, FALSE);
 
-	context->style = style;
-	context->ignore_children_style = ignore_children_style;
+	gdk_threads_enter ();
 
-	if (parent != NULL && parent->ignore_children_style)
-	{
-		context->ignore_children_style = TRUE;
-		context->style = NULL;
-	}
+	if (ce->priv->profile)
+		profile_start = profile_time_ ();
 
-	if (!parent || (parent->all_ancestors_extend && CONTEXT_EXTENDS_PARENT (parent)))
+	viewport_pending = ce->priv->viewport_pending;
+
+	/* analyze batch of text */
+	if (viewport_pending)
 	{
-		context->all_ancestors_extend = TRUE;
+		GtkTextIter end;
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &end,
+						  ce->priv->viewport_end);
+		update_syntax (ce, &end, INCREMENTAL_UPDATE_TIME_SLICE);
 	}
-
-	if (line_text &&
-	    definition->type == CONTEXT_TYPE_CONTAINER &&
-	    definition->u.start_end.end)
+	else
 	{
-		context->end = regex_resolve (definition->u.start_end.end,
-					      definition->u.start_end.start,
-					      line_text);
+		update_syntax (ce, NULL, INCREMENTAL_UPDATE_TIME_SLICE);
 	}
+	CHECK_TREE (ce);
 
-	/* Create reg_all. If it is possibile we share the same reg_all
-	 * for more contexts storing it in the definition. */
-	if (ANCESTOR_CAN_END_CONTEXT (context) ||
-	    (definition->type == CONTEXT_TYPE_CONTAINER &&
-	     definition->u.start_end.end != NULL &&
-	     !definition->u.start_end.end->resolved))
+	/* Signal handlers run by update_syntax() may have detached
+	 * the engine from the buffer. */
+	if (ce->priv->buffer == NULL)
 	{
-		context->reg_all = create_reg_all (context, NULL);
+		retval = FALSE;
 	}
-	else
+	else if (all_analyzed (ce))
 	{
-		if (!definition->reg_all)
-			definition->reg_all = create_reg_all (NULL, definition);
-		context->reg_all = regex_ref (definition->reg_all);
+		viewport_check (ce);
+		ce->priv->incremental_update = 0;
+		retval = FALSE;
 	}
-
-#ifdef ENABLE_DEBUG
+	else if (viewport_pending && viewport_check (ce))
 	{
-		GString *str = g_string_new (definition->id);
-		Context *tmp = context->parent;
-		while (tmp != NULL)
-		{
-			g_string_prepend (str, "/");
-			g_string_prepend (str, tmp->definition->id);
-			tmp = tmp->parent;
-		}
-		g_print ("created context %s: %s\n", definition->id, str->str);
-		g_string_free (str, TRUE);
+		/* The rest of the buffer may be analyzed slowly. */
+		ce->priv->incremental_update = 0;
+		install_idle_worker (ce);
+		retval = FALSE;
 	}
-#endif
 
-	return context;
-}
+	if (ce->priv->profile)
+		profile_add_slice_ (ce, profile_start);
 
-static void
-context_unref_hash_cb (G_GNUC_UNUSED gpointer text,
-		       Context *context)
-{
-	context->parent = NULL;
-	context_unref (context);
+	gdk_threads_leave ();
+
+	return retval;
 }
 
+/**
+ * first_update_callback:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ *
+ * Same as idle_worker, except: it runs once, and install idle_worker
+ * if not everything was analyzed at once. While the background
+ * thread runs, only leaves the text the view is waiting for to
+ * idle_worker(), the rest is analyzed by the thread.
+ */
 static gboolean
-remove_context_cb (G_GNUC_UNUSED gpointer text,
-		   Context *context,
-		   Context *target)
+first_update_callback (GtkSourceContextEngine *ce)
 {
-	return context == target;
-}
+	gint64 profile_start = 0;
 
-static void
-context_remove_child (Context *parent,
-		      Context *context)
-{
-	ContextPtr *ptr, *prev = NULL;
-	gboolean delete = TRUE;
+	g_return_val_if_fail (ce->priv->buffer != NULL, FALSE);
 
-	g_assert (context->parent == parent);
+	gdk_threads_enter ();
 
-	for (ptr = parent->children; ptr; ptr = ptr->next)
+	if (ce->priv->background_job != NULL)
 	{
-		if (ptr->definition == context->definition)
-			break;
-		prev = ptr;
+		ce->priv->first_update = 0;
+		install_idle_worker (ce);
+		gdk_threads_leave ();
+		return FALSE;
 	}
 
-	g_assert (ptr != NULL);
+	if (ce->priv->profile)
+		profile_start = profile_time_ ();
 
-	if (!ptr->fixed)
+	/* analyze batch of text */
+	update_syntax (ce, NULL, FIRST_UPDATE_TIME_SLICE);
+	CHECK_TREE (ce);
+
+	ce->priv->first_update = 0;
+
+	if (ce->priv->buffer != NULL)
 	{
-		g_hash_table_foreach_remove (ptr->u.hash,
-					     (GHRFunc) remove_context_cb,
-					     context);
+		viewport_check (ce);
 
-		if (g_hash_table_size (ptr->u.hash) != 0)
-			delete = FALSE;
+		if (!all_analyzed (ce))
+			install_idle_worker (ce);
 	}
 
-	if (delete)
-	{
-		if (prev != NULL)
-			prev->next = ptr->next;
-		else
-			parent->children = ptr->next;
+	if (ce->priv->profile)
+		profile_add_slice_ (ce, profile_start);
 
-		if (!ptr->fixed)
-			g_hash_table_destroy (ptr->u.hash);
+	gdk_threads_leave ();
 
-#ifdef ENABLE_DEBUG
-		memset (ptr, 1, sizeof (ContextPtr));
-#else
-		g_slice_free (ContextPtr, ptr);
-#endif
-	}
+	return FALSE;
 }
 
 /**
- * context_unref:
+ * install_idle_worker:
  *
- * @context: the context.
+ * @ce: #GtkSourceContextEngine.
  *
- * Decreases reference count and removes @context
- * from the tree when it drops to zero.
+ * Schedules reanalyzing buffer in idle.
+ * Always safe to call.
  */
 static void
-context_unref (Context *context)
+install_idle_worker (GtkSourceContextEngine *ce)
 {
-	ContextPtr *children;
-	gint i;
-
-	if (context == NULL || --context->ref_count != 0)
+	/* The tree built by the background thread will replace
+	 * whatever idle_worker() could do meanwhile, only the text
+	 * the view is waiting for is analyzed. */
+	if (ce->priv->background_job != NULL && !ce->priv->viewport_pending)
 		return;
 
-	DEBUG (g_print ("destroying context %s\n", context->definition->id));
-
-	children = context->children;
-	context->children = NULL;
+	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0 &&
+	    (ce->priv->background_job != NULL || !background_analysis_start (ce)))
+		ce->priv->incremental_update =
+			g_idle_add_full (ce->priv->viewport_pending ?
+						VIEWPORT_UPDATE_PRIORITY :
+						INCREMENTAL_UPDATE_PRIORITY,
+					 (GSourceFunc) idle_worker, ce, NULL);
+}
 
-	while (children != NULL)
+/**
+ * install_first_update:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Schedules first_update_callback call.
+ * Always safe to call.
+ */
+static void
+install_first_update (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->first_update == 0)
 	{
-		ContextPtr *ptr = children;
-
-		children = children->next;
-
-		if (ptr->fixed)
-		{
-			ptr->u.context->parent = NULL;
-			context_unref (ptr->u.context);
-		}
-		else
+		if (ce->priv->incremental_update != 0)
 		{
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) context_unref_hash_cb,
-					      NULL);
-			g_hash_table_destroy (ptr->u.hash);
+			g_source_remove (ce->priv->incremental_update);
+			ce->priv->incremental_update = 0;
 		}
 
-#ifdef ENABLE_DEBUG
-		memset (ptr, 1, sizeof (ContextPtr));
-#else
-		g_slice_free (ContextPtr, ptr);
-#endif
+		ce->priv->first_update =
+			g_idle_add_full (FIRST_UPDATE_PRIORITY,
+					 (GSourceFunc) first_update_callback,
+					 ce, NULL);
 	}
+}
 
-	if (context->parent != NULL)
-		context_remove_child (context->parent, context);
+/**
+ * viewport_check:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Checks whether the region requested by request_viewport() is
+ * analyzed now, and if it is, records how long it took. Analysis goes
+ * from the first invalid line on, so that is the time it took to catch
+ * up with the end of the region, not to analyze the region alone.
+ *
+ * Returns: %TRUE if a pending request was satisfied by this call.
+ */
+static gboolean
+viewport_check (GtkSourceContextEngine *ce)
+{
+	GtkTextIter end;
+	gint invalid_line;
+	gint end_line;
 
-	regex_unref (context->end);
-	regex_unref (context->reg_all);
+	if (!ce->priv->viewport_pending)
+		return FALSE;
 
-	if (context->subpattern_context_classes != NULL)
+	invalid_line = get_invalid_line (ce);
+
+	if (invalid_line >= 0)
 	{
-		for (i = 0; i < context->definition->n_sub_patterns; ++i)
-		{
-			g_slist_foreach (context->subpattern_context_classes[i], 
-			                 (GFunc)context_class_tag_free,
-			                 NULL);
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &end,
+						  ce->priv->viewport_end);
+		end_line = gtk_text_iter_get_line (&end);
 
-			g_slist_free (context->subpattern_context_classes[i]);
-		}
-	}
+		if (gtk_text_iter_starts_line (&end) && end_line > 0)
+			end_line -= 1;
 
-	g_slist_foreach (context->context_classes, (GFunc)context_class_tag_free, NULL);
-	g_slist_free (context->context_classes);
+		if (invalid_line <= end_line)
+			return FALSE;
+	}
 
-	g_free (context->subpattern_context_classes);
-	g_free (context->subpattern_tags);
+	ce->priv->viewport_pending = FALSE;
+	ce->priv->viewport_catch_up_time =
+		g_timer_elapsed (ce->priv->viewport_timer, NULL) * 1000;
 
-	g_slice_free (Context, context);
-}
+	g_object_notify (G_OBJECT (ce), "viewport-catch-up-time");
 
-static void
-context_freeze_hash_cb (G_GNUC_UNUSED gpointer text,
-		        Context *context)
-{
-	context_freeze (context);
+	return TRUE;
 }
 
 /**
- * context_freeze:
+ * request_viewport:
  *
- * @context: the context.
- *
- * Recursively increments reference count in context and its children,
- * and marks them, so context_thaw is able to correctly decrement
- * reference count.
- * This function is for update_syntax: we want to preserve existing
- * contexts when possible, and update_syntax erases contexts from
- * reanalyzed lines; so to avoid destructing and recreating contexts
- * every time, we need to increment reference count on existing contexts,
- * and decrement it when we are done with analysis, so no more needed
- * contexts go away. Keeping a list of referenced contexts is painful
- * or slow, so we just reference all contexts present at the moment.
+ * @ce: #GtkSourceContextEngine.
+ * @end: end of the region the view wants to display.
  *
- * Note this is not reentrant, context_freeze()/context_thaw() pair is called
- * only from update_syntax().
+ * Makes idle worker analyze text up to @end before the rest of
+ * the buffer, and with higher priority. Text before @end needs
+ * to be analyzed anyway to know the contexts at @end.
  */
 static void
-context_freeze (Context *ctx)
+request_viewport (GtkSourceContextEngine *ce,
+		  const GtkTextIter      *end)
 {
-	ContextPtr *ptr;
+	if (ce->priv->viewport_end == NULL)
+		ce->priv->viewport_end =
+			gtk_text_buffer_create_mark (ce->priv->buffer, NULL,
+						     end, FALSE);
+	else
+		gtk_text_buffer_move_mark (ce->priv->buffer,
+					   ce->priv->viewport_end,
+					   end);
 
-	g_assert (!ctx->frozen);
-	ctx->frozen = TRUE;
-	context_ref (ctx);
+	if (!ce->priv->viewport_pending)
+	{
+		ce->priv->viewport_pending = TRUE;
+		g_timer_start (ce->priv->viewport_timer);
+	}
 
-	for (ptr = ctx->children; ptr != NULL; ptr = ptr->next)
+	/* This also reinstalls idle worker with the right priority. */
+	install_first_update (ce);
+}
+
+/* GtkSourceContextEngine class ------------------------------------------- */
+
+enum {
+	PROP_0,
+	PROP_VIEWPORT_CATCH_UP_TIME,
+	PROP_PROFILE
+};
+
+G_DEFINE_TYPE (GtkSourceContextEngine, _gtk_source_context_engine, GTK_TYPE_SOURCE_ENGINE)
+
+static GQuark
+gtk_source_context_engine_error_quark (void)
+{
+	static GQuark err_q = 0;
+	if (err_q == 0)
+		err_q = g_quark_from_static_string ("gtk-source-context-engine-error-quark");
+	return err_q;
+}
+
+static void
+remove_tags_hash_cb (G_GNUC_UNUSED gpointer style,
+		     GSList          *tags,
+		     GtkTextTagTable *table)
+{
+	GSList *l = tags;
+
+	while (l != NULL)
 	{
-		if (ptr->fixed)
-		{
-			context_freeze (ptr->u.context);
-		}
-		else
-		{
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) context_freeze_hash_cb,
-					      NULL);
-		}
+		gtk_text_tag_table_remove (table, l->data);
+		g_object_unref (l->data);
+		l = l->next;
 	}
+
+	g_slist_free (tags);
 }
 
 static void
-get_child_contexts_hash_cb (G_GNUC_UNUSED gpointer text,
-			    Context *context,
-			    GSList **list)
+remove_context_classes_hash_cb (G_GNUC_UNUSED gpointer class,
+                                GtkTextTag             *tag,
+                                GtkTextTagTable        *table)
 {
-	*list = g_slist_prepend (*list, context);
+	gtk_text_tag_table_remove (table, tag);
 }
 
 /**
- * context_thaw:
+ * destroy_tags_hash:
  *
- * @context: the context.
+ * @ce: #GtkSourceContextEngine.
  *
- * Recursively decrements reference count in context and its children,
- * if it was incremented by context_freeze().
+ * Destroys syntax tags cache.
  */
 static void
-context_thaw (Context *ctx)
+destroy_tags_hash (GtkSourceContextEngine *ce)
 {
-	ContextPtr *ptr;
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) remove_tags_hash_cb,
+                              gtk_text_buffer_get_tag_table (ce->priv->buffer));
+	g_hash_table_destroy (ce->priv->tags);
+	ce->priv->tags = NULL;
+}
 
-	if (!ctx->frozen)
-		return;
+static void
+destroy_context_classes_hash (GtkSourceContextEngine *ce)
+{
+	g_hash_table_foreach (ce->priv->context_classes, (GHFunc) remove_context_classes_hash_cb,
+	                      gtk_text_buffer_get_tag_table (ce->priv->buffer));
+	g_hash_table_destroy (ce->priv->context_classes);
+	ce->priv->context_classes = NULL;
+}
 
-	for (ptr = ctx->children; ptr != NULL; )
-	{
-		ContextPtr *next = ptr->next;
+/**
+ * create_root:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Creates the root context and the root segment, which
+ * initially has zero length.
+ */
+static void
+create_root (GtkSourceContextEngine *ce)
+{
+	gchar *root_id;
+	ContextDefinition *main_definition;
 
-		if (ptr->fixed)
-		{
-			context_thaw (ptr->u.context);
-		}
-		else
-		{
-			GSList *children = NULL;
-			g_hash_table_foreach (ptr->u.hash,
-					      (GHFunc) get_child_contexts_hash_cb,
-					      &children);
-			g_slist_foreach (children, (GFunc) context_thaw, NULL);
-			g_slist_free (children);
-		}
+	root_id = g_strdup_printf ("%s:%s", ENGINE_ID (ce), ENGINE_ID (ce));
+	main_definition = LOOKUP_DEFINITION (ce->priv->ctx_data, root_id);
+	g_free (root_id);
 
-		ptr = next;
-	}
+	/* If we don't abort here, we will crash later (#485661). But it should
+	 * never happen, _gtk_source_context_data_finish_parse checks main context. */
+	g_assert (main_definition != NULL);
 
-	ctx->frozen = FALSE;
-	context_unref (ctx);
+	ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, FALSE);
+
+	ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
 }
 
-static Context *
-create_child_context (Context           *parent,
-		      DefinitionChild   *child_def,
-		      const gchar       *line_text)
+/**
+ * set_profile:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @profile: whether to collect statistics.
+ *
+ * Sets GtkSourceContextEngine:profile.
+ */
+static void
+set_profile (GtkSourceContextEngine *ce,
+	     gboolean                profile)
 {
-	Context *context;
-	ContextPtr *ptr;
-	gchar *match = NULL;
-	ContextDefinition *definition = child_def->u.definition;
-
-	g_return_val_if_fail (parent != NULL, NULL);
-
-	for (ptr = parent->children;
-	     ptr != NULL && ptr->definition != definition;
-	     ptr = ptr->next) ;
+	profile = profile != FALSE;
 
-	if (ptr == NULL)
-	{
-		ptr = g_slice_new0 (ContextPtr);
-		ptr->next = parent->children;
-		parent->children = ptr;
-		ptr->definition = definition;
+	if (ce->priv->profile == profile)
+		return;
 
-		if (definition->type != CONTEXT_TYPE_CONTAINER ||
-		    !definition->u.start_end.end ||
-		    definition->u.start_end.end->resolved)
-		{
-			ptr->fixed = TRUE;
-		}
+	ce->priv->profile = profile;
 
-		if (!ptr->fixed)
-			ptr->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-	}
+	g_object_notify (G_OBJECT (ce), "profile");
+}
 
-	if (ptr->fixed)
-	{
-		context = ptr->u.context;
-	}
-	else
-	{
-		match = regex_fetch (definition->u.start_end.start, 0);
-		g_return_val_if_fail (match != NULL, NULL);
-		context = g_hash_table_lookup (ptr->u.hash, match);
-	}
+/**
+ * gtk_source_context_engine_attach_buffer:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @buffer: buffer.
+ *
+ * Detaches engine from previous buffer, and attaches to @buffer if
+ * it's not %NULL.
+ */
+static void
+gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
+					 GtkTextBuffer   *buffer)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	if (context != NULL)
+	g_return_if_fail (!buffer || GTK_IS_TEXT_BUFFER (buffer));
+
+	if (ce->priv->buffer == buffer)
+		return;
+
+	/* Detach previous buffer if there is one. */
+	if (ce->priv->buffer != NULL)
 	{
-		g_free (match);
-		return context_ref (context);
-	}
+		if (ce->priv->profile && g_getenv ("GTKSOURCEVIEW_PROFILE") != NULL)
+			_gtk_source_context_engine_print_stats (ce);
 
-	context = context_new (parent,
-			       definition,
-			       line_text,
-			       child_def->override_style ? child_def->style :
-					child_def->u.definition->default_style,
-			       child_def->override_style ? child_def->override_style_deep : FALSE);
-	g_return_val_if_fail (context != NULL, NULL);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_highlight_syntax_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_large_file_tier_cb,
+						      ce);
 
-	if (ptr->fixed)
-		ptr->u.context = context;
-	else
-		g_hash_table_insert (ptr->u.hash, match, context);
+		if (ce->priv->first_update != 0)
+			g_source_remove (ce->priv->first_update);
+		if (ce->priv->incremental_update != 0)
+			g_source_remove (ce->priv->incremental_update);
+		ce->priv->first_update = 0;
+		ce->priv->incremental_update = 0;
 
-	return context;
-}
+		if (ce->priv->background_job != NULL)
+			background_analysis_cancel (ce);
 
-/**
- * segment_new:
- *
- * @ce: the engine.
- * @parent: parent segment (%NULL for the root segment).
- * @context: context for this segment (%NULL for invalid segments).
- * @start_at: start offset in the buffer, characters.
- * @end_at: end offset in the buffer, characters.
- * @is_start: is_start flag.
- *
- * Creates a new segment structure. It doesn't take care about
- * parent or siblings, create_segment() is the function to
- * create new segments in the tree.
- *
- * Returns: newly created segment.
- */
-static Segment *
-segment_new (GtkSourceContextEngine *ce,
-	     Segment                *parent,
-	     Context                *context,
-	     gint                    start_at,
-	     gint                    end_at,
-	     gboolean                is_start)
-{
-	Segment *segment;
+		/* Checkpoints go away with the tree anyway. */
+		g_array_free (ce->priv->checkpoints, TRUE);
+		ce->priv->checkpoints = NULL;
 
-#ifdef ENABLE_CHECK_TREE
-	g_assert (!is_start || context != NULL);
-#endif
+		partial_line_drop (ce, FALSE);
 
-	segment = g_slice_new0 (Segment);
-	segment->parent = parent;
-	segment->context = context_ref (context);
-	segment->start_at = start_at;
-	segment->end_at = end_at;
-	segment->is_start = is_start;
+		if (ce->priv->root_segment != NULL)
+			segment_destroy (ce, ce->priv->root_segment);
+		if (ce->priv->root_context != NULL)
+			context_unref (ce->priv->root_context);
+		g_assert (!ce->priv->invalid);
+		g_slist_free (ce->priv->invalid);
+		ce->priv->root_segment = NULL;
+		ce->priv->root_context = NULL;
+		ce->priv->invalid = NULL;
+		ce->priv->invalid_hint = NULL;
+		g_array_set_size (ce->priv->pending_edits, 0);
+		g_array_set_size (ce->priv->batch_ranges, 0);
+		g_array_set_size (ce->priv->degraded_lines, 0);
+		g_array_set_size (ce->priv->slow_lines, 0);
+		ce->priv->batch_depth = 0;
+
+		/* The tree is gone, release its memory at once (e.g. when
+		 * the buffer changes language). */
+		node_pool_clear (&ce->priv->segment_pool);
+		node_pool_clear (&ce->priv->sub_pattern_pool);
 
-	if (context == NULL)
-		add_invalid (ce, segment);
+		if (ce->priv->invalid_region.start != NULL)
+			gtk_text_buffer_delete_mark (ce->priv->buffer,
+						     ce->priv->invalid_region.start);
+		if (ce->priv->invalid_region.end != NULL)
+			gtk_text_buffer_delete_mark (ce->priv->buffer,
+						     ce->priv->invalid_region.end);
+		ce->priv->invalid_region.start = NULL;
+		ce->priv->invalid_region.end = NULL;
 
-	return segment;
-}
+		if (ce->priv->viewport_end != NULL)
+			gtk_text_buffer_delete_mark (ce->priv->buffer,
+						     ce->priv->viewport_end);
+		ce->priv->viewport_end = NULL;
+		ce->priv->viewport_pending = FALSE;
 
-static void
-find_segment_position_forward_ (Segment  *segment,
-				gint      start_at,
-				gint      end_at,
-				Segment **prev,
-				Segment **next)
-{
-	g_assert (segment->start_at <= start_at);
+		/* this deletes tags from the tag table, therefore there is no need
+		 * in removing tags from the text (it may be very slow).
+		 * FIXME: don't we want to just destroy and forget everything when
+		 * the buffer is destroyed? Removing tags is still slower than doing
+		 * nothing. Caveat: if tag table is shared with other buffer, we do
+		 * need to remove tags. */
+		destroy_tags_hash (ce);
+		ce->priv->n_tags = 0;
 
-	while (segment != NULL)
+		destroy_context_classes_hash (ce);
+
+		if (ce->priv->refresh_region != NULL)
+			gtk_text_region_destroy (ce->priv->refresh_region, FALSE);
+		ce->priv->refresh_region = NULL;
+		if (ce->priv->tagged_region != NULL)
+			gtk_text_region_destroy (ce->priv->tagged_region, FALSE);
+		ce->priv->tagged_region = NULL;
+	}
+
+	ce->priv->buffer = buffer;
+
+	if (buffer != NULL)
 	{
-		if (segment->end_at == start_at)
-		{
-			while (segment->next != NULL && segment->next->start_at == start_at)
-				segment = segment->next;
+		GtkTextIter start, end;
 
-			*prev = segment;
-			*next = segment->next;
+		create_root (ce);
 
-			break;
-		}
+		ce->priv->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		ce->priv->context_classes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		ce->priv->checkpoints = g_array_new (FALSE, FALSE, sizeof (Checkpoint));
 
-		if (segment->start_at == end_at)
+		gtk_text_buffer_get_bounds (buffer, &start, &end);
+		ce->priv->invalid_region.start = gtk_text_buffer_create_mark (buffer, NULL,
+									      &start, TRUE);
+		ce->priv->invalid_region.end = gtk_text_buffer_create_mark (buffer, NULL,
+									    &end, FALSE);
+
+		if (gtk_text_buffer_get_char_count (buffer) != 0)
 		{
-			*next = segment;
-			*prev = segment->prev;
-			break;
+			ce->priv->invalid_region.empty = FALSE;
+			ce->priv->invalid_region.delta = gtk_text_buffer_get_char_count (buffer);
 		}
-
-		if (segment->start_at > end_at)
+		else
 		{
-			*next = segment;
-			break;
+			ce->priv->invalid_region.empty = TRUE;
+			ce->priv->invalid_region.delta = 0;
 		}
 
-		if (segment->end_at < start_at)
-			*prev = segment;
+		if (g_getenv ("GTKSOURCEVIEW_PROFILE") != NULL)
+			set_profile (ce, TRUE);
 
-		segment = segment->next;
+		g_object_get (ce->priv->buffer,
+			      "highlight-syntax", &ce->priv->highlight,
+			      "large-file-tier", &ce->priv->large_file_tier,
+			      NULL);
+		ce->priv->refresh_region = gtk_text_region_new (buffer);
+		ce->priv->tagged_region = gtk_text_region_new (buffer);
+
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-syntax",
+					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
+					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::large-file-tier",
+					  G_CALLBACK (buffer_notify_large_file_tier_cb),
+					  ce);
+
+		install_first_update (ce);
 	}
 }
 
 static void
-find_segment_position_backward_ (Segment  *segment,
-				 gint      start_at,
-				 gint      end_at,
-				 Segment **prev,
-				 Segment **next)
+set_tag_style_hash_cb (const char             *style,
+		       GSList                 *tags,
+		       GtkSourceContextEngine *ce)
 {
-	g_assert (start_at < segment->end_at);
-
-	while (segment != NULL)
+	while (tags != NULL)
 	{
-		if (segment->end_at <= start_at)
-		{
-			*prev = segment;
-			break;
-		}
-
-		g_assert (segment->start_at >= end_at);
-
-		*next = segment;
-		segment = segment->prev;
+		set_tag_style (ce, tags->data, style);
+		tags = tags->next;
 	}
 }
 
 /**
- * find_segment_position:
+ * gtk_source_context_engine_set_style_scheme:
  *
- * @parent: parent segment (not %NULL).
- * @hint: segment somewhere near new segment position.
- * @start_at: start offset.
- * @end_at: end offset.
- * @prev: location to return previous sibling.
- * @next: location to return next sibling.
+ * @engine: #GtkSourceContextEngine.
+ * @scheme: #GtkSourceStyleScheme to set.
  *
- * Finds siblings of a new segment to be created at interval
- * (start_at, end_at). It uses hint to avoid walking whole
- * parent->children list.
+ * GtkSourceEngine::set_style_scheme method.
+ * Sets current style scheme, updates tag styles and everything.
  */
 static void
-find_segment_position (Segment  *parent,
-		       Segment  *hint,
-		       gint      start_at,
-		       gint      end_at,
-		       Segment **prev,
-		       Segment **next)
+gtk_source_context_engine_set_style_scheme (GtkSourceEngine      *engine,
+					    GtkSourceStyleScheme *scheme)
 {
-	Segment *tmp;
+	GtkSourceContextEngine *ce;
 
-	g_assert (parent->start_at <= start_at && end_at <= parent->end_at);
-	g_assert (!hint || hint->parent == parent);
+	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (engine));
+	g_return_if_fail (GTK_IS_SOURCE_STYLE_SCHEME (scheme) || scheme == NULL);
 
-	*prev = *next = NULL;
+	ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
-	if (parent->children == NULL)
+	if (scheme == ce->priv->style_scheme)
 		return;
 
-	if (parent->children->next == NULL)
-	{
-		tmp = parent->children;
+	if (ce->priv->style_scheme != NULL)
+		g_object_unref (ce->priv->style_scheme);
 
-		if (start_at >= tmp->end_at)
-			*prev = tmp;
-		else
-			*next = tmp;
+	ce->priv->style_scheme = scheme ? g_object_ref (scheme) : NULL;
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) set_tag_style_hash_cb, ce);
+}
 
-		return;
+static void
+gtk_source_context_engine_finalize (GObject *object)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (object);
+
+	if (ce->priv->buffer != NULL)
+	{
+		g_critical ("finalizing engine with attached buffer");
+		/* Disconnect the buffer (if there is one), which destroys almost
+		 * everything. */
+		gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), NULL);
 	}
 
-	if (hint == NULL)
-		hint = parent->children;
+#ifdef ENABLE_MEMORY_DEBUG
+	if (ce->priv->mem_usage_timeout)
+		g_source_remove (ce->priv->mem_usage_timeout);
+#endif
 
-	if (hint->end_at <= start_at)
-		find_segment_position_forward_ (hint, start_at, end_at, prev, next);
-	else
-		find_segment_position_backward_ (hint, start_at, end_at, prev, next);
-}
+	g_assert (!ce->priv->tags);
+	g_assert (!ce->priv->root_context);
+	g_assert (!ce->priv->root_segment);
+	g_assert (!ce->priv->first_update);
+	g_assert (!ce->priv->incremental_update);
 
-/**
- * create_segment:
- *
- * @ce: the engine.
- * @parent: parent segment (%NULL for the root segment).
- * @context: context for this segment (%NULL for invalid segments).
- * @start_at: start offset, characters.
- * @end_at: end offset, characters.
- * @is_start: is_start flag.
- * @hint: a segment somewhere near new one, to omtimize search.
- *
- * Creates a new segment and inserts it into the tree.
- *
- * Returns: newly created segment.
- */
-static Segment *
-create_segment (GtkSourceContextEngine *ce,
-		Segment                *parent,
-		Context                *context,
-		gint                    start_at,
-		gint                    end_at,
-		gboolean                is_start,
-		Segment                *hint)
-{
-	Segment *segment;
-
-	g_assert (!parent || (parent->start_at <= start_at && end_at <= parent->end_at));
-
-	segment = segment_new (ce, parent, context, start_at, end_at, is_start);
-
-	if (parent != NULL)
-	{
-		Segment *prev, *next;
-
-		if (hint == NULL)
-		{
-			hint = ce->priv->hint;
-			while (hint != NULL && hint->parent != parent)
-				hint = hint->parent;
-		}
-
-		find_segment_position (parent, hint,
-				       start_at, end_at,
-				       &prev, &next);
+	_gtk_source_context_data_unref (ce->priv->ctx_data);
 
-		g_assert ((!parent->children && !prev && !next) ||
-			  (parent->children && (prev || next)));
-		g_assert (!prev || prev->next == next);
-		g_assert (!next || next->prev == prev);
+	if (ce->priv->style_scheme != NULL)
+		g_object_unref (ce->priv->style_scheme);
 
-		segment->next = next;
-		segment->prev = prev;
+	g_timer_destroy (ce->priv->viewport_timer);
+	g_array_free (ce->priv->pending_edits, TRUE);
+	g_array_free (ce->priv->batch_ranges, TRUE);
+	g_array_free (ce->priv->degraded_lines, TRUE);
+	g_array_free (ce->priv->slow_lines, TRUE);
+	g_hash_table_destroy (ce->priv->dead_checkpoints);
+	g_hash_table_destroy (ce->priv->definition_stats);
+	node_pool_clear (&ce->priv->segment_pool);
+	node_pool_clear (&ce->priv->sub_pattern_pool);
 
-		if (next != NULL)
-			next->prev = segment;
-		else
-			parent->last_child = segment;
+	G_OBJECT_CLASS (_gtk_source_context_engine_parent_class)->finalize (object);
+}
 
-		if (prev != NULL)
-			prev->next = segment;
-		else
-			parent->children = segment;
+static GtkTextTag *
+gtk_source_context_engine_get_context_class_tag (GtkSourceEngine *engine,
+						 const gchar     *context_class)
+{
+	GHashTable *hash_table = GTK_SOURCE_CONTEXT_ENGINE (engine)->priv->context_classes;
 
-		CHECK_SEGMENT_LIST (parent);
-		CHECK_TREE (ce);
+	if (hash_table == NULL)
+	{
+		/* This happens when highlighting is disabled */
+		return NULL;
 	}
 
-	return segment;
+	return g_hash_table_lookup (hash_table,
+				    context_class);
 }
 
-/**
- * segment_extend:
- *
- * @state: the semgent.
- * @end_at: new end offset, characters.
- *
- * Updates end offset in the segment and its ancestors.
- */
 static void
-segment_extend (Segment *state,
-		gint     end_at)
+gtk_source_context_engine_set_property (GObject      *object,
+					guint         prop_id,
+					const GValue *value,
+					GParamSpec   *pspec)
 {
-	while (state != NULL && state->end_at < end_at)
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (object);
+
+	switch (prop_id)
 	{
-		state->end_at = end_at;
-		state = state->parent;
+		case PROP_PROFILE:
+			set_profile (ce, g_value_get_boolean (value));
+			break;
+
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
 	}
-	CHECK_SEGMENT_LIST (state->parent);
 }
 
 static void
-segment_destroy_children (GtkSourceContextEngine *ce,
-			  Segment                *segment)
+gtk_source_context_engine_get_property (GObject    *object,
+					guint       prop_id,
+					GValue     *value,
+					GParamSpec *pspec)
 {
-	Segment *child;
-	SubPattern *sp;
-
-	g_return_if_fail (segment != NULL);
-
-	child = segment->children;
-	segment->children = NULL;
-	segment->last_child = NULL;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (object);
 
-	while (child != NULL)
+	switch (prop_id)
 	{
-		Segment *next = child->next;
-		segment_destroy (ce, child);
-		child = next;
-	}
+		case PROP_VIEWPORT_CATCH_UP_TIME:
+			g_value_set_double (value, ce->priv->viewport_catch_up_time);
+			break;
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
+		case PROP_PROFILE:
+			g_value_set_boolean (value, ce->priv->profile);
+			break;
 
-	while (sp != NULL)
-	{
-		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
-		sp = next;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
 	}
 }
 
-/**
- * segment_destroy:
- *
- * @ce: the engine.
- * @context: the segment to destroy.
- *
- * Recursively frees given segment. It removes the segment
- * from ce structure, but it doesn't update parent and
- * siblings. segment_remove() is the function that takes
- * care of everything.
- */
 static void
-segment_destroy (GtkSourceContextEngine *ce,
-		 Segment                *segment)
+_gtk_source_context_engine_class_init (GtkSourceContextEngineClass *klass)
 {
-	g_return_if_fail (segment != NULL);
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	GtkSourceEngineClass *engine_class = GTK_SOURCE_ENGINE_CLASS (klass);
 
-	segment_destroy_children (ce, segment);
+	object_class->finalize = gtk_source_context_engine_finalize;
+	object_class->get_property = gtk_source_context_engine_get_property;
+	object_class->set_property = gtk_source_context_engine_set_property;
 
-	/* segment neighbours and parent may be invalid here,
-	 * so we only can unset the hint */
-	if (ce->priv->hint == segment)
-		ce->priv->hint = NULL;
-        if (ce->priv->hint2 == segment)
-                ce->priv->hint2 = NULL;
+	engine_class->attach_buffer = gtk_source_context_engine_attach_buffer;
+	engine_class->text_inserted = gtk_source_context_engine_text_inserted;
+	engine_class->text_deleted = gtk_source_context_engine_text_deleted;
+	engine_class->begin_batch = gtk_source_context_engine_begin_batch;
+	engine_class->end_batch = gtk_source_context_engine_end_batch;
+	engine_class->update_highlight = gtk_source_context_engine_update_highlight;
+	engine_class->set_style_scheme = gtk_source_context_engine_set_style_scheme;
+	engine_class->get_context_class_tag = gtk_source_context_engine_get_context_class_tag;
 
-	if (SEGMENT_IS_INVALID (segment))
-		remove_invalid (ce, segment);
+	/* Time in milliseconds between the moment the view asked to highlight
+	 * a region which was not analyzed yet and the moment analysis got past
+	 * its end. Invalid text before the region is analyzed first, so with
+	 * a lot of it this is much more than the time to analyze the region. */
+	g_object_class_install_property (object_class,
+					 PROP_VIEWPORT_CATCH_UP_TIME,
+					 g_param_spec_double ("viewport-catch-up-time",
+							      "Viewport catch-up time",
+							      "Time it took analysis to get past "
+							      "the end of the requested region",
+							      0, G_MAXDOUBLE, 0,
+							      G_PARAM_READABLE));
+
+	/* Whether to collect statistics, see _gtk_source_context_engine_get_stats().
+	 * It's set for all engines if GTKSOURCEVIEW_PROFILE is in the environment,
+	 * and then they print the statistics when detached from the buffer. */
+	g_object_class_install_property (object_class,
+					 PROP_PROFILE,
+					 g_param_spec_boolean ("profile",
+							       "Profile",
+							       "Whether to collect statistics",
+							       FALSE,
+							       G_PARAM_READWRITE));
 
-	context_unref (segment->context);
+	g_type_class_add_private (object_class, sizeof (GtkSourceContextEnginePrivate));
+}
 
-#ifdef ENABLE_DEBUG
-	g_assert (!g_slist_find (ce->priv->invalid, segment));
-	memset (segment, 1, sizeof (Segment));
-#else
-	g_slice_free (Segment, segment);
-#endif
+static void
+_gtk_source_context_engine_init (GtkSourceContextEngine *ce)
+{
+	ce->priv = G_TYPE_INSTANCE_GET_PRIVATE (ce, GTK_TYPE_SOURCE_CONTEXT_ENGINE,
+						GtkSourceContextEnginePrivate);
+	ce->priv->viewport_timer = g_timer_new ();
+	ce->priv->pending_edits = g_array_new (FALSE, FALSE, sizeof (PendingEdit));
+	ce->priv->batch_ranges = g_array_new (FALSE, FALSE, sizeof (BatchRange));
+	ce->priv->degraded_lines = g_array_new (FALSE, FALSE, sizeof (gint));
+	ce->priv->slow_lines = g_array_new (FALSE, FALSE, sizeof (SlowLine));
+	ce->priv->dead_checkpoints = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ce->priv->definition_stats = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							    NULL, g_free);
+	node_pool_init (&ce->priv->segment_pool, sizeof (Segment));
+	node_pool_init (&ce->priv->sub_pattern_pool, sizeof (SubPattern));
 }
 
-/**
- * container_context_starts_here:
- *
- * See child_starts_here().
- */
-static gboolean
-container_context_starts_here (GtkSourceContextEngine  *ce,
-			       Segment                 *state,
-			       DefinitionChild         *child_def,
-			       LineInfo                *line,
-			       gint                    *line_pos, /* bytes */
-			       Segment                **new_state)
+GtkSourceContextEngine *
+_gtk_source_context_engine_new (GtkSourceContextData *ctx_data)
 {
-	Context *new_context;
-	Segment *new_segment;
-	gint match_end;
-	ContextDefinition *definition = child_def->u.definition;
+	GtkSourceContextEngine *ce;
 
-	g_assert (*line_pos <= line->byte_length);
+	g_return_val_if_fail (ctx_data != NULL, NULL);
+	g_return_val_if_fail (ctx_data->lang != NULL, NULL);
 
-	/* We can have a container context definition (i.e. the main
-	 * language definition) without start_end.start. */
-	if (definition->u.start_end.start == NULL)
-		return FALSE;
+	ce = g_object_new (GTK_TYPE_SOURCE_CONTEXT_ENGINE, NULL);
+	ce->priv->ctx_data = _gtk_source_context_data_ref (ctx_data);
 
-	if (!regex_match (definition->u.start_end.start,
-			  line->text, line->byte_length, *line_pos))
-	{
-		return FALSE;
-	}
+#ifdef ENABLE_MEMORY_DEBUG
+	ce->priv->mem_usage_timeout =
+		g_timeout_add (5000, (GSourceFunc) mem_usage_timeout, ce);
+#endif
 
-	new_context = create_child_context (state->context, child_def, line->text);
-	g_return_val_if_fail (new_context != NULL, FALSE);
+	return ce;
+}
 
-	if (!can_apply_match (new_context, line, *line_pos, &match_end,
-			      definition->u.start_end.start))
-	{
-		context_unref (new_context);
-		return FALSE;
-	}
+static void count_contexts (Context *context, guint *counts);
 
-	g_assert (match_end <= line->byte_length);
+static void
+count_contexts_hash_cb (G_GNUC_UNUSED gpointer text,
+			Context *context,
+			guint   *counts)
+{
+	count_contexts (context, counts);
+}
 
-        segment_extend (state, line_pos_to_offset (line, match_end));
-        new_segment = create_segment (ce, state, new_context,
-				      line_pos_to_offset (line, *line_pos),
-				      line_pos_to_offset (line, match_end),
-				      TRUE,
-				      ce->priv->hint2);
+/* counts[0] is the number of contexts, counts[1] the number of idle ones. */
+static void
+count_contexts (Context *context,
+		guint   *counts)
+{
+	ContextPtr *ptr;
 
-	/* This new context could end at the same position (i.e. have zero length),
-	 * and then we get an infinite loop. We can't possibly know about it at this point
-	 * (since we need to know that the context indeed *ends* here, and that's
-	 * discovered only later) so we look at the previous sibling: if it's the same,
-	 * and has zero length then we remove the segment. We do it this way instead of
-	 * checking before creating the segment because it's more convenient. */
-	if (*line_pos == match_end &&
-	    new_segment->prev != NULL &&
-	    new_segment->prev->context == new_segment->context &&
-	    new_segment->prev->start_at == new_segment->prev->end_at &&
-	    new_segment->prev->start_at == line_pos_to_offset (line, *line_pos))
+	counts[0]++;
+
+	if (context->idle)
+		counts[1]++;
+
+	for (ptr = context->children; ptr != NULL; ptr = ptr->next)
 	{
-		segment_remove (ce, new_segment);
-		return FALSE;
+		if (ptr->fixed)
+			count_contexts (ptr->u.context, counts);
+		else
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) count_contexts_hash_cb,
+					      counts);
 	}
-
-	apply_sub_patterns (new_segment, line,
-			    definition->u.start_end.start,
-			    SUB_PATTERN_WHERE_START);
-	*line_pos = match_end;
-	*new_state = new_segment;
-	ce->priv->hint2 = NULL;
-	context_unref (new_context);
-	return TRUE;
 }
 
 /**
- * simple_context_starts_here:
+ * _gtk_source_context_engine_get_context_cache_stats:
  *
- * See child_starts_here().
+ * @ce: #GtkSourceContextEngine.
+ * @n_contexts: (out): return location for the number of contexts
+ * in the tree of @ce, or %NULL.
+ * @n_idle: (out): return location for the number of them kept only
+ * for reuse, or %NULL.
+ * @n_reused: (out): return location for the number of idle contexts
+ * reused, or %NULL.
+ * @n_evicted: (out): return location for the number of idle contexts
+ * destroyed to make room for others, or %NULL.
+ *
+ * Gets statistics of the contexts created for matched text, see
+ * context_release(). @n_reused and @n_evicted are summed over
+ * all engines sharing the definitions of @ce.
  */
-static gboolean
-simple_context_starts_here (GtkSourceContextEngine *ce,
-			    Segment                *state,
-			    DefinitionChild        *child_def,
-			    LineInfo               *line,
-			    gint                   *line_pos, /* bytes */
-			    Segment               **new_state)
-{
-	gint match_end;
-	Context *new_context;
-	ContextDefinition *definition = child_def->u.definition;
-
-	g_return_val_if_fail (definition->u.match != NULL, FALSE);
+void
+_gtk_source_context_engine_get_context_cache_stats (GtkSourceContextEngine *ce,
+						    guint                  *n_contexts,
+						    guint                  *n_idle,
+						    guint                  *n_reused,
+						    guint                  *n_evicted)
+{
+	GHashTable *seen;
+	GHashTableIter iter;
+	ContextDefinition *definition;
+	guint counts[2] = {0, 0};
+	guint reused = 0;
+	guint evicted = 0;
 
-	g_assert (*line_pos <= line->byte_length);
+	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (ce));
 
-	if (!regex_match (definition->u.match, line->text, line->byte_length, *line_pos))
-		return FALSE;
+	if (ce->priv->root_context != NULL)
+		count_contexts (ce->priv->root_context, counts);
 
-	new_context = create_child_context (state->context, child_def, line->text);
-	g_return_val_if_fail (new_context != NULL, FALSE);
+	/* The same definition may be stored under several ids. */
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-	if (!can_apply_match (new_context, line, *line_pos, &match_end, definition->u.match))
+	g_hash_table_iter_init (&iter, ce->priv->ctx_data->definitions);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &definition))
 	{
-		context_unref (new_context);
-		return FALSE;
-	}
+		if (g_hash_table_lookup (seen, definition) != NULL)
+			continue;
 
-	/* If length of the match is zero, then we get zero-length segment and return to
-	 * the same state, so it's an infinite loop. But, if this child ends parent, we
-	 * do want to terminate parent. Still, if match is at the beginning of the parent
-	 * then we get an infinite loop again, so we check that (NOTE it really should destroy
-	 * parent context then, but then we again can get parent context be recreated here and
-	 * so on). */
-	if (*line_pos == match_end &&
-	    (!CONTEXT_ENDS_PARENT (new_context) ||
-		line_pos_to_offset (line, *line_pos) == state->start_at))
-	{
-		context_unref (new_context);
-		return FALSE;
+		g_hash_table_insert (seen, definition, definition);
+		reused += g_atomic_int_get (&definition->context_cache_reused);
+		evicted += g_atomic_int_get (&definition->context_cache_evicted);
 	}
 
-	g_assert (match_end <= line->byte_length);
-	segment_extend (state, line_pos_to_offset (line, match_end));
+	g_hash_table_destroy (seen);
 
-	if (*line_pos != match_end)
-	{
-		/* Normal non-zero-length match, create a child segment */
-		Segment *new_segment;
-		new_segment = create_segment (ce, state, new_context,
-					      line_pos_to_offset (line, *line_pos),
-					      line_pos_to_offset (line, match_end),
-					      TRUE,
-					      ce->priv->hint2);
-		apply_sub_patterns (new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
-		ce->priv->hint2 = new_segment;
-	}
+	if (n_contexts != NULL)
+		*n_contexts = counts[0];
+	if (n_idle != NULL)
+		*n_idle = counts[1];
+	if (n_reused != NULL)
+		*n_reused = reused;
+	if (n_evicted != NULL)
+		*n_evicted = evicted;
+}
 
-	/* Terminate parent if needed */
-	if (CONTEXT_ENDS_PARENT (new_context))
-	{
-		do
-		{
-			ce->priv->hint2 = state;
-			state = state->parent;
-		}
-		while (SEGMENT_ENDS_PARENT (state));
-	}
+static gsize get_context_memory_ (Context *context);
 
-	*line_pos = match_end;
-	*new_state = state;
-	context_unref (new_context);
-	return TRUE;
+static gsize
+get_context_ptr_memory_ (ContextPtr *ptr)
+{
+	GHashTableIter iter;
+	const gchar *text;
+	Context *context;
+	gsize mem = sizeof (ContextPtr);
+
+	if (ptr->fixed)
+		return mem + get_context_memory_ (ptr->u.context);
+
+	/* Roughly a hash table node per context. */
+	g_hash_table_iter_init (&iter, ptr->u.hash);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &text, (gpointer *) &context))
+		mem += 3 * sizeof (gpointer) + strlen (text) + 1 +
+		       get_context_memory_ (context);
+
+	if (ptr->idle != NULL)
+		mem += sizeof (GQueue) + ptr->idle->length * sizeof (GList);
+
+	return mem;
+}
+
+static gsize
+get_context_memory_ (Context *context)
+{
+	ContextPtr *ptr;
+	gsize mem = sizeof (Context);
+	guint n_sub_patterns = context->definition->n_sub_patterns;
+
+	if (context->subpattern_tags != NULL)
+		mem += n_sub_patterns * sizeof (GtkTextTag *);
+	if (context->subpattern_context_classes != NULL)
+		mem += n_sub_patterns * sizeof (GSList *);
+	mem += g_slist_length (context->context_classes) * sizeof (GSList);
+
+	for (ptr = context->children; ptr != NULL; ptr = ptr->next)
+		mem += get_context_ptr_memory_ (ptr);
+
+	return mem;
+}
+
+static gsize
+get_node_pool_memory_ (NodePool *pool)
+{
+	return g_slist_length (pool->blocks) * pool->node_size * NODE_POOL_BLOCK_NODES;
 }
 
 /**
- * child_starts_here:
- *
- * @ce: the engine.
- * @state: current state.
- * @child_def: the child.
- * @line: line to analyze.
- * @line_pos: the position inside @line, bytes.
- * @new_state: where to store the new state.
+ * _gtk_source_context_engine_get_stats:
  *
- * Verifies if a context of the type in @curr_definition starts at
- * @line_pos in @line. If the contexts start here @new_state and
- * @line_pos are updated.
+ * @ce: #GtkSourceContextEngine.
+ * @stats: (out): return location for the statistics.
  *
- * Returns: %TRUE if the context starts here.
+ * Gets the counters collected while GtkSourceContextEngine:profile
+ * was set, and the memory used by the tree and contexts of @ce now.
  */
-static gboolean
-child_starts_here (GtkSourceContextEngine *ce,
-		   Segment                *state,
-		   DefinitionChild        *child_def,
-		   LineInfo               *line,
-		   gint                   *line_pos,
-		   Segment               **new_state)
+void
+_gtk_source_context_engine_get_stats (GtkSourceContextEngine      *ce,
+				      GtkSourceContextEngineStats *stats)
 {
-	g_return_val_if_fail (child_def->resolved, FALSE);
+	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (ce));
+	g_return_if_fail (stats != NULL);
 
-	switch (child_def->u.definition->type)
-	{
-		case CONTEXT_TYPE_SIMPLE:
-			return simple_context_starts_here (ce,
-							   state,
-							   child_def,
-							   line,
-							   line_pos,
-							   new_state);
-		case CONTEXT_TYPE_CONTAINER:
-			return container_context_starts_here (ce,
-							      state,
-							      child_def,
-							      line,
-							      line_pos,
-							      new_state);
-		default:
-			g_return_val_if_reached (FALSE);
-	}
+	*stats = ce->priv->stats;
+
+	stats->tree_memory = get_node_pool_memory_ (&ce->priv->segment_pool) +
+			     get_node_pool_memory_ (&ce->priv->sub_pattern_pool) +
+			     ce->priv->pending_edits->len * sizeof (PendingEdit);
+
+	if (ce->priv->checkpoints != NULL)
+		stats->tree_memory += ce->priv->checkpoints->len * sizeof (Checkpoint);
+
+	stats->context_memory = ce->priv->root_context != NULL ?
+		get_context_memory_ (ce->priv->root_context) : 0;
 }
 
 /**
- * segment_ends_here:
+ * _gtk_source_context_engine_reset_stats:
  *
- * @state: the segment.
- * @line: analyzed line.
- * @pos: the position inside @line, bytes.
+ * @ce: #GtkSourceContextEngine.
  *
- * Checks whether given segment ends at pos. Unlike
- * child_starts_here() it doesn't modify tree, it merely
- * calls regex_match() for the end regex.
+ * Zeroes the counters of @ce, including those of definitions.
  */
-static gboolean
-segment_ends_here (Segment  *state,
-		   LineInfo *line,
-		   gint      pos)
+void
+_gtk_source_context_engine_reset_stats (GtkSourceContextEngine *ce)
 {
-	g_assert (SEGMENT_IS_CONTAINER (state));
+	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (ce));
 
-	return state->context->definition->u.start_end.end &&
-		regex_match (state->context->end,
-			     line->text,
-			     line->byte_length,
-			     pos);
+	memset (&ce->priv->stats, 0, sizeof (GtkSourceContextEngineStats));
+	g_hash_table_remove_all (ce->priv->definition_stats);
 }
 
 /**
- * ancestor_context_ends_here:
- *
- * @state: current context.
- * @line: the line to analyze.
- * @line_pos: the position inside @line, bytes.
- *
- * Verifies if some ancestor context ends at the current position.
- * This function only checks conetxts and does not modify the tree,
- * it's used by ancestor_ends_here().
+ * _gtk_source_context_engine_get_definition_stats:
  *
- * Returns: the ancestor context that terminates here or %NULL.
+ * @ce: #GtkSourceContextEngine.
+ * @id: id of a context definition.
+ * @matches: (out): return location for the number of matches tried
+ * with regexes of the definition, or %NULL.
+ * @time: (out): return location for the time they took in seconds,
+ * or %NULL.
+ *
+ * Gets the regex statistics of the definition collected while @ce
+ * was profiling, including the analysis done for it in background
+ * threads. The regex combining all children of a container is
+ * accounted to the container.
+ *
+ * Returns: %FALSE if there is no definition with @id.
  */
-static Context *
-ancestor_context_ends_here (Context                *state,
-			    LineInfo               *line,
-			    gint                    line_pos)
+gboolean
+_gtk_source_context_engine_get_definition_stats (GtkSourceContextEngine *ce,
+						 const gchar            *id,
+						 guint64                *matches,
+						 gdouble                *time)
 {
-	Context *current_context;
-	GSList *current_context_list;
-	GSList *check_ancestors;
-	Context *terminating_context;
+	ContextDefinition *definition;
+	DefinitionStats *def_stats;
 
-	/* A context can be terminated by the parent if extend_parent is
-	 * FALSE, so we need to verify the end of all the parents of
-	 * not-extending contexts. The list is ordered by ascending
-	 * depth. */
-	check_ancestors = NULL;
-	current_context = state;
-	while (ANCESTOR_CAN_END_CONTEXT (current_context))
-	{
-		if (!CONTEXT_EXTENDS_PARENT (current_context))
-			check_ancestors = g_slist_prepend (check_ancestors,
-							   current_context->parent);
-		current_context = current_context->parent;
-	}
+	g_return_val_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (ce), FALSE);
+	g_return_val_if_fail (id != NULL, FALSE);
 
-	/* The first context that ends here terminates its descendants. */
-	terminating_context = NULL;
-	current_context_list = check_ancestors;
-	while (current_context_list != NULL)
-	{
-		current_context = current_context_list->data;
+	definition = g_hash_table_lookup (ce->priv->ctx_data->definitions, id);
 
-		if (current_context->end &&
-		    current_context->end->u.regex.regex &&
-		    regex_match (current_context->end,
-				 line->text,
-				 line->byte_length,
-				 line_pos))
-		{
-			terminating_context = current_context;
-			break;
-		}
+	if (definition == NULL)
+		return FALSE;
 
-		current_context_list = current_context_list->next;
-	}
-	g_slist_free (check_ancestors);
+	def_stats = g_hash_table_lookup (ce->priv->definition_stats, definition);
 
-	return terminating_context;
+	if (matches != NULL)
+		*matches = def_stats != NULL ? def_stats->matches : 0;
+	if (time != NULL)
+		*time = def_stats != NULL ? def_stats->usec / (gdouble) G_USEC_PER_SEC : 0.;
+
+	return TRUE;
+}
+
+static gint
+compare_definition_time_ (const DefinitionStats *a,
+			  const DefinitionStats *b)
+{
+	return a->usec < b->usec ? 1 : (a->usec > b->usec ? -1 : 0);
 }
 
 /**
- * ancestor_ends_here:
- *
- * @state: current state.
- * @line: the line to analyze.
- * @line_pos: the position inside @line, bytes.
- * @new_state: where to store the new state.
+ * _gtk_source_context_engine_print_stats:
  *
- * Verifies if some ancestor context ends at given position. If
- * state changed and @new_state is not %NULL, then the new state is stored
- * in @new_state, and descendants of @new_state are closed, so the
- * terminating segment becomes current state.
+ * @ce: #GtkSourceContextEngine.
  *
- * Returns: %TRUE if an ancestor ends at the given position.
+ * Prints the statistics of @ce, and definitions sorted by the
+ * time their regexes took, slowest first.
  */
-static gboolean
-ancestor_ends_here (Segment                *state,
-		    LineInfo               *line,
-		    gint                    line_pos,
-		    Segment               **new_state)
+void
+_gtk_source_context_engine_print_stats (GtkSourceContextEngine *ce)
 {
-	Context *terminating_context;
+	GtkSourceContextEngineStats stats;
+	GHashTableIter iter;
+	DefinitionStats *def_stats;
+	GArray *definitions;
+	guint i;
 
-	terminating_context = ancestor_context_ends_here (state->context, line, line_pos);
+	g_return_if_fail (GTK_IS_SOURCE_CONTEXT_ENGINE (ce));
 
-	if (new_state != NULL && terminating_context != NULL)
-	{
-		/* We have found a context that ends here, so we close
-		 * all the descendants. terminating_segment will be
-		 * closed by next next_segment() call from analyze_line. */
-		Segment *current_segment = state;
+	_gtk_source_context_engine_get_stats (ce, &stats);
 
-		while (current_segment->context != terminating_context)
-			current_segment = current_segment->parent;
+	g_print ("%s: analyzed %u lines in %.3f s (%.0f lines/s)\n",
+		 gtk_source_language_get_id (ce->priv->ctx_data->lang),
+		 stats.lines_analyzed, stats.analysis_time,
+		 stats.analysis_time > 0 ? stats.lines_analyzed / stats.analysis_time : 0.);
+	g_print ("  %u idle slices in %.3f s, applying tags took %.3f s\n",
+		 stats.idle_slices, stats.idle_time, stats.tags_time);
+	g_print ("  tree: %" G_GSIZE_FORMAT " bytes, contexts: %" G_GSIZE_FORMAT " bytes\n",
+		 stats.tree_memory, stats.context_memory);
 
-		*new_state = current_segment;
-		g_assert (*new_state != NULL);
+	definitions = g_array_new (FALSE, FALSE, sizeof (DefinitionStats));
+
+	g_hash_table_iter_init (&iter, ce->priv->definition_stats);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &def_stats))
+		g_array_append_val (definitions, *def_stats);
+
+	g_array_sort (definitions, (GCompareFunc) compare_definition_time_);
+
+	g_print ("  definitions:\n");
+
+	for (i = 0; i < definitions->len; ++i)
+	{
+		def_stats = &g_array_index (definitions, DefinitionStats, i);
+
+		g_print ("  %-40s %10" G_GUINT64_FORMAT " matches %10.3f ms\n",
+			 def_stats->id,
+			 def_stats->matches,
+			 def_stats->usec / 1000.);
 	}
 
-	return terminating_context != NULL;
+	g_array_free (definitions, TRUE);
 }
 
 /**
- * next_segment:
- *
- * @ce: #GtkSourceContextEngine.
- * @state: current state.
- * @line: analyzed line.
- * @line_pos: position inside @line, bytes.
- * @new_state: where to store the new state.
- * @hint: child of @state used to optimize tree operations.
+ * _gtk_source_context_data_new:
  *
- * Verifies if a context starts or ends in @line at @line_pos of after it.
- * If the contexts starts or ends here @new_state and @line_pos are updated.
+ * @lang: #GtkSourceLanguage.
  *
- * Returns: %FALSE is there are no more contexts in @line.
+ * Creates new context definition set. It does not set lang->priv->ctx_data,
+ * that's lang business.
  */
-static gboolean
-next_segment (GtkSourceContextEngine  *ce,
-	      Segment                 *state,
-	      LineInfo                *line,
-	      gint                    *line_pos,
-	      Segment                **new_state)
+GtkSourceContextData *
+_gtk_source_context_data_new (GtkSourceLanguage *lang)
 {
-	gint pos = *line_pos;
+	GtkSourceContextData *ctx_data;
 
-	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
-	g_assert (pos <= line->byte_length);
+	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE (lang), NULL);
 
-	while (pos <= line->byte_length)
+	ctx_data = g_slice_new0 (GtkSourceContextData);
+	ctx_data->ref_count = 1;
+	ctx_data->lang = lang;
+	ctx_data->definitions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						       (GDestroyNotify) context_definition_unref);
+
+	return ctx_data;
+}
+
+GtkSourceContextData *
+_gtk_source_context_data_ref (GtkSourceContextData *ctx_data)
+{
+	g_return_val_if_fail (ctx_data != NULL, NULL);
+	g_atomic_int_inc (&ctx_data->ref_count);
+	return ctx_data;
+}
+
+/**
+ * _gtk_source_context_data_unref:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ *
+ * Decreases reference count in ctx_data. When reference count
+ * drops to zero, ctx_data is freed, and ctx_data->lang->priv->ctx_data
+ * is unset.
+ */
+void
+_gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
+{
+	gboolean destroy = FALSE;
+
+	g_return_if_fail (ctx_data != NULL);
+
+	/* The language must not hand out the data while it's destroyed. */
+	G_LOCK (context_data);
+
+	if (g_atomic_int_dec_and_test (&ctx_data->ref_count))
 	{
-		DefinitionsIter def_iter;
-		gboolean context_end_found;
-		DefinitionChild *child_def;
+		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
+		    ctx_data->lang->priv->ctx_data == ctx_data)
+			ctx_data->lang->priv->ctx_data = NULL;
+		destroy = TRUE;
+	}
 
-		if (state->context->reg_all)
-		{
-			if (!regex_match (state->context->reg_all,
-					  line->text,
-					  line->byte_length,
-					  pos))
-			{
-				return FALSE;
-			}
+	G_UNLOCK (context_data);
 
-			regex_fetch_pos_bytes (state->context->reg_all,
-					       0, &pos, NULL);
-		}
+	if (destroy)
+	{
+		g_hash_table_destroy (ctx_data->definitions);
+		g_slice_free (GtkSourceContextData, ctx_data);
+	}
+}
 
-		/* Does an ancestor end here? */
-		if (ANCESTOR_CAN_END_CONTEXT (state->context) &&
-		    ancestor_ends_here (state, line, pos, new_state))
-		{
-			g_assert (pos <= line->byte_length);
-			segment_extend (state, line_pos_to_offset (line, pos));
-			*line_pos = pos;
-			return TRUE;
-		}
+/**
+ * _gtk_source_context_data_get_end_cache_stats:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ * @hits: (out): return location for the number of end regexes
+ * found in the cache, or %NULL.
+ * @misses: (out): return location for the number of end regexes
+ * which had to be compiled, or %NULL.
+ *
+ * Gets statistics of the caches of end regexes referring to the
+ * start regex, summed over all definitions in @ctx_data.
+ */
+void
+_gtk_source_context_data_get_end_cache_stats (GtkSourceContextData *ctx_data,
+					      guint                *hits,
+					      guint                *misses)
+{
+	GHashTable *seen;
+	GHashTableIter iter;
+	ContextDefinition *definition;
+	guint n_hits = 0;
+	guint n_misses = 0;
 
-		/* Does the current context end here? */
-		context_end_found = segment_ends_here (state, line, pos);
+	g_return_if_fail (ctx_data != NULL);
 
-		/* Iter over the definitions we can find in the current
-		 * context. */
-		definition_iter_init (&def_iter, state->context->definition);
-		while ((child_def = definition_iter_next (&def_iter)) != NULL)
-		{
-			gboolean try_this = TRUE;
+	/* The same definition may be stored under several ids. */
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-			g_return_val_if_fail (child_def->resolved, FALSE);
+	G_LOCK (definition_end_cache);
 
-			/* If the child definition does not extend the parent
-			 * and the current context could end here we do not
-			 * need to examine this child. */
-			if (!HAS_OPTION (child_def->u.definition, EXTEND_PARENT) && context_end_found)
-				try_this = FALSE;
+	g_hash_table_iter_init (&iter, ctx_data->definitions);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &definition))
+	{
+		if (g_hash_table_lookup (seen, definition) != NULL)
+			continue;
 
-			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) && line->start_at != 0)
-				try_this = FALSE;
+		g_hash_table_insert (seen, definition, definition);
+		n_hits += definition->end_cache_hits;
+		n_misses += definition->end_cache_misses;
+	}
 
-			if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
-			{
-				Segment *prev;
+	G_UNLOCK (definition_end_cache);
 
-				for (prev = state->children; prev != NULL; prev = prev->next)
-				{
-					if (prev->context != NULL &&
-					    prev->context->definition == child_def->u.definition)
-					{
-						try_this = FALSE;
-						break;
-					}
-				}
-			}
+	g_hash_table_destroy (seen);
 
-			if (try_this)
-			{
-				/* Does this child definition start a new
-				 * context at the current position? */
-				if (child_starts_here (ce, state, child_def,
-						       line, &pos, new_state))
-				{
-					g_assert (pos <= line->byte_length);
-					*line_pos = pos;
-					definition_iter_destroy (&def_iter);
-					return TRUE;
-				}
-			}
+	if (hits != NULL)
+		*hits = n_hits;
+	if (misses != NULL)
+		*misses = n_misses;
+}
 
-			/* This child does not start here, so we analyze
-			 * another definition. */
-		}
-		definition_iter_destroy (&def_iter);
+/* REGEX HANDLING --------------------------------------------------------- */
 
-		if (context_end_found)
+static Regex *
+regex_ref (Regex *regex)
+{
+	if (regex != NULL)
+		g_atomic_int_inc (&regex->ref_count);
+	return regex;
+}
+
+static void
+regex_unref (Regex *regex)
+{
+	if (regex != NULL && g_atomic_int_dec_and_test (&regex->ref_count))
+	{
+		if (regex->resolved)
 		{
-			/* We have found that the current context could end
-			 * here and that it cannot be extended by a child.
-			 * Still, it may happen that parent context ends in
-			 * the middle of the end regex match, apply_match()
-			 * checks this. */
-			if (apply_match (state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
-			{
-				g_assert (pos <= line->byte_length);
+			GHashTable *matches = g_static_private_get (&thread_matches);
 
-				while (SEGMENT_ENDS_PARENT (state))
-					state = state->parent;
+			if (matches != NULL)
+				g_hash_table_remove (matches, regex);
 
-				*new_state = state->parent;
-				ce->priv->hint2 = state;
-				*line_pos = pos;
-				return TRUE;
-			}
+			g_regex_unref (regex->u.regex.regex);
+			if (regex->u.regex.match)
+				g_match_info_free (regex->u.regex.match);
+			if (regex->u.regex.prefilter)
+				g_slice_free (RegexPrefilter, regex->u.regex.prefilter);
 		}
+		else
+			g_free (regex->u.info.pattern);
+		g_slice_free (Regex, regex);
+	}
+}
 
-		/* Nothing new at this position, go to next char. */
-		pos = g_utf8_next_char (line->text + pos) - line->text;
+/**
+ * find_single_byte_escape:
+ *
+ * @string: the pattern.
+ *
+ * Checks whether pattern contains \C escape sequence,
+ * which means "single byte" in pcre and naturally leads
+ * to crash if used for highlighting.
+ */
+static gboolean
+find_single_byte_escape (const gchar *string)
+{
+	const char *p = string;
+
+	while ((p = strstr (p, "\\C")))
+	{
+		const char *slash;
+		gboolean found;
+
+		if (p == string)
+			return TRUE;
+
+		found = TRUE;
+		slash = p - 1;
+
+		while (slash >= string && *slash == '\\')
+		{
+			found = !found;
+			slash--;
+		}
+
+		if (found)
+			return TRUE;
+
+		p += 2;
 	}
 
 	return FALSE;
 }
 
 /**
- * check_line_end:
- *
- * @state: current state.
- * @hint: child of @state used in analyze_line() and next_segment().
- *
- * Closes the contexts that cannot contain end of lines if needed.
- * Updates hint if new state is different from @state.
+ * get_start_ref_regex:
  *
- * Returns: the new state.
+ * Returns: the regex matching "\%{...@start}", compiled once.
  */
-static Segment *
-check_line_end (GtkSourceContextEngine *ce,
-                Segment                *state)
+static GRegex *
+get_start_ref_regex (void)
 {
-	Segment *current_segment;
-	Segment *terminating_segment;
+	static volatile gsize start_ref_re = 0;
 
-	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	if (g_once_init_enter (&start_ref_re))
+	{
+		GRegex *re;
 
-	/* A context can be terminated by the parent if extend_parent is
-	 * FALSE, so we need to verify the end of all the parents of
-	 * not-extending contexts. */
-	terminating_segment = NULL;
-	current_segment = state;
+		re = g_regex_new (START_REF_REGEX,
+				  /* http://bugzilla.gnome.org/show_bug.cgi?id=455640
+				   * we don't care about line ends anyway */
+				  G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF,
+				  0,
+				  NULL);
 
-	while (current_segment != NULL)
-	{
-		if (SEGMENT_END_AT_LINE_END (current_segment))
-			terminating_segment = current_segment;
-		else if (!ANCESTOR_CAN_END_CONTEXT(current_segment->context))
-			break;
-		current_segment = current_segment->parent;
+		g_once_init_leave (&start_ref_re, (gsize) re);
 	}
 
-	if (terminating_segment != NULL)
+	return (GRegex *) start_ref_re;
+}
+
+/**
+ * regex_new:
+ *
+ * @pattern: the regular expression.
+ * @flags: compile options for @pattern.
+ * @error: location to store the error occuring, or %NULL to ignore errors.
+ *
+ * Creates a new regex.
+ *
+ * Returns: a newly-allocated #Regex.
+ */
+static Regex *
+regex_new (const gchar           *pattern,
+	   GRegexCompileFlags     flags,
+	   GError               **error)
+{
+	Regex *regex;
+
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	if (find_single_byte_escape (pattern))
+	{
+		g_set_error (error, GTK_SOURCE_CONTEXT_ENGINE_ERROR,
+			     GTK_SOURCE_CONTEXT_ENGINE_ERROR_INVALID_REGEX,
+			     "%s", _("using \\C is not supported in language definitions"));
+		return NULL;
+	}
+
+	regex = g_slice_new0 (Regex);
+	regex->ref_count = 1;
+
+	if (g_regex_match (get_start_ref_regex (), pattern, 0, NULL))
+	{
+		regex->resolved = FALSE;
+		regex->u.info.pattern = g_strdup (pattern);
+		regex->u.info.flags = flags;
+	}
+	else
+	{
+		regex->resolved = TRUE;
+		regex->u.regex.regex = g_regex_new (pattern,
+						    flags | G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF, 0,
+						    error);
+
+		if (regex->u.regex.regex == NULL)
+		{
+			g_slice_free (Regex, regex);
+			regex = NULL;
+		}
+	}
+
+	return regex;
+}
+
+/**
+ * sub_pattern_to_int:
+ *
+ * @name: the string from lang file.
+ *
+ * Tries to convert @name to a number and assumes
+ * it's a name if that fails. Used for references in
+ * subpattern contexts (e.g. \%{1@start} or \%{blah@start}).
+ */
+static gint
+sub_pattern_to_int (const gchar *name)
+{
+	guint64 number;
+	gchar *end_name;
+
+	if (*name == 0)
+		return -1;
+
+	errno = 0;
+	number = g_ascii_strtoull (name, &end_name, 10);
+
+	if (errno !=0 || number > G_MAXINT || *end_name != 0)
+		return -1;
+
+	return number;
+}
+
+struct RegexResolveData {
+	Regex       *start_regex;
+	const gchar *matched_text;
+};
+
+static gboolean
+replace_start_regex (const GMatchInfo *match_info,
+		     GString          *expanded_regex,
+		     gpointer          user_data)
+{
+	gchar *num_string, *subst, *subst_escaped, *escapes;
+	gint num;
+	struct RegexResolveData *data = user_data;
+
+	escapes = g_match_info_fetch (match_info, 1);
+	num_string = g_match_info_fetch (match_info, 2);
+	num = sub_pattern_to_int (num_string);
+
+	if (num < 0)
+		subst = g_match_info_fetch_named (*regex_match_info (data->start_regex),
+						  num_string);
+	else
+		subst = g_match_info_fetch (*regex_match_info (data->start_regex),
+					    num);
+
+	if (subst != NULL)
+	{
+		subst_escaped = g_regex_escape_string (subst, -1);
+	}
+	else
+	{
+		g_warning ("Invalid group: %s", num_string);
+		subst_escaped = g_strdup ("");
+	}
+
+	g_string_append (expanded_regex, escapes);
+	g_string_append (expanded_regex, subst_escaped);
+
+	g_free (escapes);
+	g_free (num_string);
+	g_free (subst);
+	g_free (subst_escaped);
+
+	return FALSE;
+}
+
+/**
+ * regex_resolve:
+ *
+ * @definition: a container #ContextDefinition.
+ * @matched_text: the text matched against the start regex of @definition.
+ *
+ * If the end regular expression of @definition does not contain
+ * references to the start regular expression, the functions increases
+ * its reference count and returns it.
+ *
+ * If the regular expression contains references to the start regular
+ * expression in the form "\%{start_sub_pattern@start}", it replaces
+ * them (they are extracted from the start regex and @matched_text) and
+ * returns the new regular expression. The same references are often
+ * found many times in a file (think of heredocs or xml tags), so the
+ * compiled regexes are cached in @definition.
+ *
+ * Returns: a #Regex.
+ */
+static Regex *
+regex_resolve (ContextDefinition *definition,
+	       const gchar       *matched_text)
+{
+	Regex *regex = definition->u.start_end.end;
+	gchar *expanded_regex;
+	Regex *new_regex;
+	struct RegexResolveData data;
+
+	if (regex == NULL || regex->resolved)
+		return regex_ref (regex);
+
+	data.start_regex = definition->u.start_end.start;
+	data.matched_text = matched_text;
+	expanded_regex = g_regex_replace_eval (get_start_ref_regex (),
+					       regex->u.info.pattern,
+					       -1, 0, 0,
+					       replace_start_regex,
+					       &data, NULL);
+
+	G_LOCK (definition_end_cache);
+
+	if (definition->end_cache == NULL)
+		definition->end_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+							       (GDestroyNotify) regex_unref);
+
+	new_regex = regex_ref (g_hash_table_lookup (definition->end_cache,
+						    expanded_regex));
+
+	if (new_regex != NULL)
+		definition->end_cache_hits++;
+	else
+		definition->end_cache_misses++;
+
+	G_UNLOCK (definition_end_cache);
+
+	if (new_regex != NULL)
+	{
+		g_free (expanded_regex);
+		return new_regex;
+	}
+
+	new_regex = regex_new (expanded_regex, regex->u.info.flags, NULL);
+
+	if (new_regex == NULL || !new_regex->resolved)
+	{
+		regex_unref (new_regex);
+		g_warning ("Regular expression %s cannot be expanded.",
+			   regex->u.info.pattern);
+		/* Returns a regex that nevers matches. */
+		new_regex = regex_new ("$never-match^", 0, NULL);
+	}
+
+	G_LOCK (definition_end_cache);
+
+	if (g_hash_table_size (definition->end_cache) < END_CACHE_MAX_SIZE)
+		g_hash_table_insert (definition->end_cache,
+				     expanded_regex,
+				     regex_ref (new_regex));
+	else
+		g_free (expanded_regex);
+
+	G_UNLOCK (definition_end_cache);
+
+	return new_regex;
+}
+
+static void
+match_info_slot_free (GMatchInfo **match)
+{
+	if (*match != NULL)
+		g_match_info_free (*match);
+	g_slice_free (GMatchInfo *, match);
+}
+
+/**
+ * thread_matches_init:
+ *
+ * Must be called by threads other than the main one before they
+ * analyze text, see regex_match_info().
+ */
+static void
+thread_matches_init (void)
+{
+	GHashTable *matches;
+
+	matches = g_hash_table_new_full (NULL, NULL, NULL,
+					 (GDestroyNotify) match_info_slot_free);
+	g_static_private_set (&thread_matches, matches, NULL);
+}
+
+/**
+ * thread_matches_free:
+ *
+ * Frees match data stored by the calling thread.
+ */
+static void
+thread_matches_free (void)
+{
+	g_hash_table_destroy (g_static_private_get (&thread_matches));
+	g_static_private_set (&thread_matches, NULL, NULL);
+}
+
+/**
+ * regex_match_info:
+ *
+ * @regex: a resolved #Regex.
+ *
+ * Regexes from definitions are used by all engines with the same
+ * language, so while the main thread keeps the result of the last
+ * regex_match() in the regex itself, other threads keep it in a
+ * table private to the thread.
+ *
+ * Returns: location of the match data of @regex for the calling thread.
+ */
+static GMatchInfo **
+regex_match_info (Regex *regex)
+{
+	GHashTable *matches;
+	GMatchInfo **match;
+
+	matches = g_static_private_get (&thread_matches);
+
+	if (matches == NULL)
+		return &regex->u.regex.match;
+
+	match = g_hash_table_lookup (matches, regex);
+
+	if (match == NULL)
+	{
+		match = g_slice_new0 (GMatchInfo *);
+		g_hash_table_insert (matches, regex, match);
+	}
+
+	return match;
+}
+
+/**
+ * definition_stats_add_:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @definition: a #ContextDefinition.
+ * @matches: number of matches.
+ * @usec: the time they took in microseconds.
+ *
+ * Accounts the matches to @definition in @ce.
+ */
+static void
+definition_stats_add_ (GtkSourceContextEngine *ce,
+		       ContextDefinition      *definition,
+		       guint64                 matches,
+		       gint64                  usec)
+{
+	DefinitionStats *def_stats;
+
+	def_stats = g_hash_table_lookup (ce->priv->definition_stats, definition);
+
+	if (def_stats == NULL)
+	{
+		def_stats = g_new0 (DefinitionStats, 1);
+		def_stats->id = definition->id;
+		g_hash_table_insert (ce->priv->definition_stats, definition, def_stats);
+	}
+
+	def_stats->matches += matches;
+	def_stats->usec += usec;
+}
+
+/**
+ * definition_stats_take_:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @shadow: an engine which analyzed text for @ce.
+ *
+ * Adds the regex counters of @shadow to those of @ce, and zeroes
+ * them in @shadow.
+ */
+static void
+definition_stats_take_ (GtkSourceContextEngine *ce,
+			GtkSourceContextEngine *shadow)
+{
+	GHashTableIter iter;
+	ContextDefinition *definition;
+	DefinitionStats *def_stats;
+
+	g_hash_table_iter_init (&iter, shadow->priv->definition_stats);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &definition, (gpointer *) &def_stats))
+		definition_stats_add_ (ce, definition, def_stats->matches, def_stats->usec);
+
+	g_hash_table_remove_all (shadow->priv->definition_stats);
+}
+
+/**
+ * regex_match:
+ *
+ * @ce: the #GtkSourceContextEngine matching.
+ * @regex: a resolved #Regex.
+ * @definition: the #ContextDefinition @regex belongs to.
+ * @line: the text to match.
+ * @byte_length: length of @line in bytes.
+ * @byte_pos: where to start matching.
+ *
+ * Matches @regex against @line, the result may be retrieved with
+ * regex_fetch() and friends. While @ce is profiling, the match is
+ * accounted to @definition. Each engine is used by one thread at a
+ * time, so this takes no lock.
+ *
+ * Returns: whether @regex matched.
+ */
+static gboolean
+regex_match (GtkSourceContextEngine *ce,
+	     Regex                  *regex,
+	     ContextDefinition      *definition,
+	     const gchar            *line,
+	     gint                    byte_length,
+	     gint                    byte_pos)
+{
+	GMatchInfo **match;
+	gboolean result;
+	gint64 start = 0;
+
+	g_assert (regex->resolved);
+
+	if (ce->priv->profile)
+		start = profile_time_ ();
+
+	match = regex_match_info (regex);
+
+	if (*match)
+	{
+		g_match_info_free (*match);
+		*match = NULL;
+	}
+
+	result = g_regex_match_full (regex->u.regex.regex, line,
+				     byte_length, byte_pos,
+				     0, match,
+				     NULL);
+
+	if (ce->priv->profile)
+		definition_stats_add_ (ce, definition, 1, profile_time_ () - start);
+
+	return result;
+}
+
+static gchar *
+regex_fetch (Regex       *regex,
+	     gint         num)
+{
+	g_assert (regex->resolved);
+	return g_match_info_fetch (*regex_match_info (regex), num);
+}
+
+static void
+regex_fetch_pos (Regex       *regex,
+		 const gchar *text,
+		 gint         num,
+		 gint        *start_pos, /* character offsets */
+		 gint        *end_pos)   /* character offsets */
+{
+	gint byte_start_pos, byte_end_pos;
+
+	g_assert (regex->resolved);
+
+	if (!g_match_info_fetch_pos (*regex_match_info (regex), num, &byte_start_pos, &byte_end_pos))
+	{
+		if (start_pos != NULL)
+			*start_pos = -1;
+		if (end_pos != NULL)
+			*end_pos = -1;
+	}
+	else
+	{
+		if (start_pos != NULL)
+			*start_pos = g_utf8_pointer_to_offset (text, text + byte_start_pos);
+		if (end_pos != NULL)
+			*end_pos = g_utf8_pointer_to_offset (text, text + byte_end_pos);
+	}
+}
+
+static void
+regex_fetch_pos_bytes (Regex *regex,
+		       gint   num,
+		       gint  *start_pos_p, /* byte offsets */
+		       gint  *end_pos_p)   /* byte offsets */
+{
+	gint start_pos;
+	gint end_pos;
+
+	g_assert (regex->resolved);
+
+	if (!g_match_info_fetch_pos (*regex_match_info (regex), num, &start_pos, &end_pos))
+	{
+		start_pos = -1;
+		end_pos = -1;
+	}
+
+	if (start_pos_p != NULL)
+		*start_pos_p = start_pos;
+	if (end_pos_p != NULL)
+		*end_pos_p = end_pos;
+}
+
+static void
+regex_fetch_named_pos (Regex       *regex,
+		       const gchar *text,
+		       const gchar *name,
+		       gint        *start_pos, /* character offsets */
+		       gint        *end_pos)   /* character offsets */
+{
+	gint byte_start_pos, byte_end_pos;
+
+	g_assert (regex->resolved);
+
+	if (!g_match_info_fetch_named_pos (*regex_match_info (regex), name, &byte_start_pos, &byte_end_pos))
+	{
+		if (start_pos != NULL)
+			*start_pos = -1;
+		if (end_pos != NULL)
+			*end_pos = -1;
+	}
+	else
+	{
+		if (start_pos != NULL)
+			*start_pos = g_utf8_pointer_to_offset (text, text + byte_start_pos);
+		if (end_pos != NULL)
+			*end_pos = g_utf8_pointer_to_offset (text, text + byte_end_pos);
+	}
+}
+
+static const gchar *
+regex_get_pattern (Regex *regex)
+{
+	g_return_val_if_fail (regex && regex->resolved, "");
+	return g_regex_get_pattern (regex->u.regex.regex);
+}
+
+/* REGEX PREFILTER -------------------------------------------------------- */
+
+/* reg_all is matched at every position where something may start in
+ * a line, and most of the time nothing starts before the end of the line.
+ * To avoid calling pcre when it can't match, regex_prefilter_new() finds
+ * the set of bytes a match may start with by looking at the pattern, and
+ * regex_prefilter_skip() looks for these bytes in the line. The pattern
+ * parser only knows what is used in language definitions and is very
+ * conservative: as soon as it sees something it does not understand, or
+ * the regex may match the empty string, there is no prefilter. */
+
+typedef enum {
+	NULLABLE_NO,
+	/* Matches the empty string only at the end of the text, like "$". */
+	NULLABLE_AT_END,
+	NULLABLE_YES
+} Nullable;
+
+typedef struct {
+	const gchar	*p;
+	gboolean	 caseless;
+	gboolean	 extended;
+	gboolean	 failed;
+} PrefilterParser;
+
+#define BYTES_ADD(set,c) ((set)[(guchar) (c) >> 3] |= 1 << ((guchar) (c) & 7))
+#define BYTES_HAS(set,c) (((set)[(guchar) (c) >> 3] & (1 << ((guchar) (c) & 7))) != 0)
+
+static Nullable	prefilter_alternation	(PrefilterParser	*pp,
+					 guint8			*set);
+
+static void
+bytes_add_range (guint8 *set,
+		 guint   from,
+		 guint   to)
+{
+	guint c;
+
+	/* All we know about non-ascii characters is their first byte,
+	 * so any non-ascii character in a range means all of them. */
+	if (to > 0x7f)
+	{
+		from = MIN (from, 0x80);
+		to = 0xff;
+	}
+
+	for (c = from; c <= to; c++)
+		BYTES_ADD (set, c);
+}
+
+static void
+bytes_add_char (guint8   *set,
+		gunichar  c,
+		gboolean  caseless)
+{
+	if (c > 0x7f)
+	{
+		bytes_add_range (set, 0x80, 0xff);
+
+		if (caseless && c == 0x212a)
+		{
+			BYTES_ADD (set, 'k');
+			BYTES_ADD (set, 'K');
+		}
+		else if (caseless && c == 0x017f)
+		{
+			BYTES_ADD (set, 's');
+			BYTES_ADD (set, 'S');
+		}
+	}
+	else
+	{
+		BYTES_ADD (set, c);
+
+		if (caseless && g_ascii_isalpha (c))
+		{
+			BYTES_ADD (set, g_ascii_tolower (c));
+			BYTES_ADD (set, g_ascii_toupper (c));
+
+			/* U+212A KELVIN SIGN and U+017F LATIN SMALL LETTER LONG S */
+			if (g_ascii_tolower (c) == 'k')
+				BYTES_ADD (set, 0xe2);
+			if (g_ascii_tolower (c) == 's')
+				BYTES_ADD (set, 0xc5);
+		}
+	}
+}
+
+static Nullable
+nullable_seq (Nullable a,
+	      Nullable b)
+{
+	if (a == NULLABLE_NO || b == NULLABLE_NO)
+		return NULLABLE_NO;
+	if (a == NULLABLE_AT_END || b == NULLABLE_AT_END)
+		return NULLABLE_AT_END;
+	return NULLABLE_YES;
+}
+
+static Nullable
+nullable_alt (Nullable a,
+	      Nullable b)
+{
+	return MAX (a, b);
+}
+
+static void
+prefilter_skip_space (PrefilterParser *pp)
+{
+	if (!pp->extended)
+		return;
+
+	while (TRUE)
+	{
+		if (g_ascii_isspace (*pp->p))
+		{
+			pp->p++;
+		}
+		else if (*pp->p == '#')
+		{
+			while (*pp->p != 0 && *pp->p != '\n')
+				pp->p++;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * prefilter_escape_class:
+ *
+ * @c: character following a backslash.
+ * @set: where to add bytes.
+ *
+ * Returns: whether @c is one of the character type escapes.
+ */
+static gboolean
+prefilter_escape_class (gchar   c,
+			guint8 *set)
+{
+	switch (c)
+	{
+		case 'd':
+			bytes_add_range (set, '0', '9');
+			break;
+		case 'w':
+			bytes_add_range (set, 'a', 'z');
+			bytes_add_range (set, 'A', 'Z');
+			bytes_add_range (set, '0', '9');
+			BYTES_ADD (set, '_');
+			break;
+		case 's':
+			bytes_add_range (set, '\t', '\r');
+			BYTES_ADD (set, ' ');
+			break;
+		case 'D':
+		case 'W':
+		case 'S':
+		case 'h':
+		case 'H':
+		case 'v':
+		case 'V':
+		case 'R':
+		case 'N':
+		case 'X':
+			bytes_add_range (set, 0, 0xff);
+			return TRUE;
+		default:
+			return FALSE;
+	}
+
+	/* Be safe with unicode properties. */
+	bytes_add_range (set, 0x80, 0xff);
+	return TRUE;
+}
+
+/**
+ * prefilter_escape_char:
+ *
+ * @pp: #PrefilterParser pointing after a backslash.
+ * @c: where to store the character.
+ *
+ * Parses escapes which stand for a single character.
+ *
+ * Returns: whether it was such an escape.
+ */
+static gboolean
+prefilter_escape_char (PrefilterParser *pp,
+		       gunichar        *c)
+{
+	gchar e = *pp->p;
+
+	switch (e)
+	{
+		case 'n': *c = '\n'; break;
+		case 't': *c = '\t'; break;
+		case 'r': *c = '\r'; break;
+		case 'f': *c = '\f'; break;
+		case 'e': *c = 0x1b; break;
+		case 'a': *c = 0x07; break;
+		case 'x':
+			*c = 0;
+			pp->p++;
+
+			if (*pp->p == '{')
+			{
+				pp->p++;
+				while (g_ascii_isxdigit (*pp->p))
+					*c = *c * 16 + g_ascii_xdigit_value (*pp->p++);
+				if (*pp->p != '}')
+					return FALSE;
+			}
+			else
+			{
+				gint i;
+
+				for (i = 0; i < 2 && g_ascii_isxdigit (*pp->p); i++)
+					*c = *c * 16 + g_ascii_xdigit_value (*pp->p++);
+				return TRUE;
+			}
+			break;
+		default:
+			/* Escaped punctuation. */
+			if (e == 0 || g_ascii_isalnum (e) || (guchar) e > 0x7f)
+				return FALSE;
+			*c = e;
+			break;
+	}
+
+	pp->p++;
+	return TRUE;
+}
+
+static Nullable
+prefilter_escape (PrefilterParser *pp,
+		  guint8          *set)
+{
+	gunichar c;
+
+	/* skip the backslash */
+	pp->p++;
+
+	if (prefilter_escape_class (*pp->p, set))
+	{
+		pp->p++;
+		return NULLABLE_NO;
+	}
+
+	switch (*pp->p)
+	{
+		case 'b':
+		case 'B':
+		case 'A':
+		case 'E':
+			pp->p++;
+			return NULLABLE_YES;
+
+		case 'G':
+			/* Matches where the search starts, so skipping
+			 * anything changes what it matches. */
+			pp->failed = TRUE;
+			return NULLABLE_YES;
+
+		case 'z':
+		case 'Z':
+			pp->p++;
+			BYTES_ADD (set, '\n');
+			BYTES_ADD (set, '\r');
+			return NULLABLE_AT_END;
+
+		case 'Q':
+			pp->p++;
+
+			if (g_str_has_prefix (pp->p, "\\E"))
+			{
+				pp->p += 2;
+				return NULLABLE_YES;
+			}
+
+			bytes_add_char (set, g_utf8_get_char (pp->p), pp->caseless);
+			pp->p = strstr (pp->p, "\\E");
+
+			if (pp->p == NULL)
+				pp->p = "";
+			else
+				pp->p += 2;
+
+			return NULLABLE_NO;
+	}
+
+	if (!prefilter_escape_char (pp, &c))
+	{
+		pp->failed = TRUE;
+		return NULLABLE_YES;
+	}
+
+	bytes_add_char (set, c, pp->caseless);
+	return NULLABLE_NO;
+}
+
+static void
+prefilter_posix_class (const gchar *name,
+		       gsize        len,
+		       guint8      *set)
+{
+	static const struct {
+		const gchar *name;
+		guint16 type;
+	} classes[] = {
+		{"alpha", G_ASCII_ALPHA},
+		{"digit", G_ASCII_DIGIT},
+		{"alnum", G_ASCII_ALNUM},
+		{"space", G_ASCII_SPACE},
+		{"upper", G_ASCII_UPPER},
+		{"lower", G_ASCII_LOWER},
+		{"xdigit", G_ASCII_XDIGIT},
+		{"punct", G_ASCII_PUNCT}
+	};
+	guint i, c;
+
+	for (i = 0; i < G_N_ELEMENTS (classes); i++)
+	{
+		if (strlen (classes[i].name) == len &&
+		    strncmp (classes[i].name, name, len) == 0)
+		{
+			for (c = 0; c < 0x80; c++)
+				if (g_ascii_table[c] & classes[i].type)
+					BYTES_ADD (set, c);
+
+			bytes_add_range (set, 0x80, 0xff);
+			return;
+		}
+	}
+
+	bytes_add_range (set, 0, 0xff);
+}
+
+/**
+ * prefilter_class_char:
+ *
+ * Parses a character inside a character class, or adds
+ * a whole character type to @set.
+ *
+ * Returns: %FALSE if it was a character type.
+ */
+static gboolean
+prefilter_class_char (PrefilterParser *pp,
+		      guint8          *set,
+		      gunichar        *c)
+{
+	if (*pp->p == '\\')
+	{
+		pp->p++;
+
+		if (prefilter_escape_class (*pp->p, set))
+		{
+			pp->p++;
+			return FALSE;
+		}
+
+		if (*pp->p == 'b')
+		{
+			pp->p++;
+			*c = '\b';
+			return TRUE;
+		}
+
+		if (!prefilter_escape_char (pp, c))
+			pp->failed = TRUE;
+
+		return TRUE;
+	}
+
+	if (g_str_has_prefix (pp->p, "[:"))
+	{
+		const gchar *end = pp->p + 2;
+
+		/* Like pcre, only take "[:name:]" for a posix class,
+		 * otherwise '[' is an ordinary character. */
+		if (*end == '^')
+			end++;
+		while (g_ascii_isalpha (*end))
+			end++;
+
+		if (end[0] == ':' && end[1] == ']')
+		{
+			if (pp->p[2] == '^')
+				bytes_add_range (set, 0, 0xff);
+			else
+				prefilter_posix_class (pp->p + 2, end - pp->p - 2, set);
+
+			pp->p = end + 2;
+			return FALSE;
+		}
+	}
+
+	*c = g_utf8_get_char (pp->p);
+	pp->p = g_utf8_next_char (pp->p);
+	return TRUE;
+}
+
+static Nullable
+prefilter_class (PrefilterParser *pp,
+		 guint8          *set)
+{
+	guint8 class[32] = {0};
+	gboolean negated = FALSE;
+	gboolean first = TRUE;
+	guint i;
+
+	/* skip '[' */
+	pp->p++;
+
+	if (*pp->p == '^')
+	{
+		negated = TRUE;
+		pp->p++;
+	}
+
+	while (!pp->failed)
+	{
+		gunichar from, to;
+
+		if (*pp->p == 0)
+		{
+			pp->failed = TRUE;
+			break;
+		}
+
+		if (*pp->p == ']' && !first)
+		{
+			pp->p++;
+			break;
+		}
+
+		first = FALSE;
+
+		if (!prefilter_class_char (pp, class, &from))
+			continue;
+
+		if (pp->p[0] == '-' && pp->p[1] != ']' && pp->p[1] != 0)
+		{
+			pp->p++;
+
+			if (prefilter_class_char (pp, class, &to))
+			{
+				bytes_add_range (class, MIN (from, to), MAX (from, to));
+				continue;
+			}
+
+			BYTES_ADD (class, '-');
+		}
+
+		bytes_add_char (class, from, FALSE);
+	}
+
+	/* Non-ascii characters in a caseless class may be the kelvin
+	 * sign or the long s, which match 'k' and 's'. */
+	if (pp->caseless && BYTES_HAS (class, 0x80))
+	{
+		BYTES_ADD (class, 'k');
+		BYTES_ADD (class, 's');
+	}
+
+	for (i = 0; i < 0x80; i++)
+	{
+		gboolean in_class = BYTES_HAS (class, i);
+
+		if (pp->caseless && g_ascii_isalpha (i))
+			in_class = in_class ||
+				   BYTES_HAS (class, g_ascii_tolower (i)) ||
+				   BYTES_HAS (class, g_ascii_toupper (i));
+
+		if (in_class != negated)
+			bytes_add_char (set, i, pp->caseless);
+	}
+
+	/* A negated class matches most non-ascii characters. */
+	if (negated || BYTES_HAS (class, 0x80))
+		bytes_add_range (set, 0x80, 0xff);
+
+	return NULLABLE_NO;
+}
+
+/**
+ * prefilter_options:
+ *
+ * Parses "(?i-x)" or "(?i-x:" options, @pp points after "(?".
+ *
+ * Returns: %TRUE if the options apply to a group.
+ */
+static gboolean
+prefilter_options (PrefilterParser *pp)
+{
+	gboolean on = TRUE;
+
+	while (TRUE)
+	{
+		switch (*pp->p++)
+		{
+			case '-':
+				on = FALSE;
+				break;
+			case 'i':
+				pp->caseless = on;
+				break;
+			case 'x':
+				pp->extended = on;
+				break;
+			case 's':
+			case 'm':
+			case 'J':
+			case 'U':
+			case 'X':
+				break;
+			case ')':
+				return FALSE;
+			case ':':
+				return TRUE;
+			default:
+				pp->failed = TRUE;
+				return FALSE;
+		}
+	}
+}
+
+static Nullable
+prefilter_group (PrefilterParser *pp,
+		 guint8          *set)
+{
+	gboolean caseless = pp->caseless;
+	gboolean extended = pp->extended;
+	gboolean zero_width = FALSE;
+	gboolean named = FALSE;
+	guint8 dummy[32];
+	Nullable nullable;
+
+	/* skip '(' */
+	pp->p++;
+
+	if (*pp->p == '?')
+	{
+		const gchar *end = NULL;
+
+		pp->p++;
+
+		switch (*pp->p)
+		{
+			case ':':
+			case '>':
+			case '|':
+				pp->p++;
+				break;
+
+			case '=':
+			case '!':
+				pp->p++;
+				zero_width = TRUE;
+				break;
+
+			case '<':
+				if (pp->p[1] == '=' || pp->p[1] == '!')
+				{
+					pp->p += 2;
+					zero_width = TRUE;
+				}
+				else
+				{
+					end = strchr (pp->p, '>');
+					named = TRUE;
+				}
+				break;
+
+			case 'P':
+				if (pp->p[1] == '<')
+					end = strchr (pp->p, '>');
+				else
+					pp->failed = TRUE;
+				named = TRUE;
+				break;
+
+			case '\'':
+				end = strchr (pp->p + 1, '\'');
+				named = TRUE;
+				break;
+
+			case '#':
+				end = strchr (pp->p, ')');
+				if (end == NULL)
+					pp->failed = TRUE;
+				else
+					pp->p = end + 1;
+				return NULLABLE_YES;
+
+			default:
+				/* Options set in the middle of a group apply
+				 * till the end of the group. */
+				if (!prefilter_options (pp))
+					return NULLABLE_YES;
+				break;
+		}
+
+		if (named && end == NULL)
+			pp->failed = TRUE;
+		else if (named)
+			pp->p = end + 1;
+
+		if (pp->failed)
+			return NULLABLE_YES;
+	}
+	else if (*pp->p == '*')
+	{
+		pp->failed = TRUE;
+		return NULLABLE_YES;
+	}
+
+	if (zero_width)
+	{
+		memset (dummy, 0, sizeof (dummy));
+		prefilter_alternation (pp, dummy);
+		nullable = NULLABLE_YES;
+	}
+	else
+	{
+		nullable = prefilter_alternation (pp, set);
+	}
+
+	if (*pp->p != ')')
+		pp->failed = TRUE;
+	else
+		pp->p++;
+
+	pp->caseless = caseless;
+	pp->extended = extended;
+
+	return nullable;
+}
+
+static Nullable
+prefilter_atom (PrefilterParser *pp,
+		guint8          *set)
+{
+	switch (*pp->p)
+	{
+		case '(':
+			return prefilter_group (pp, set);
+
+		case '[':
+			return prefilter_class (pp, set);
+
+		case '\\':
+			return prefilter_escape (pp, set);
+
+		case '.':
+			pp->p++;
+			bytes_add_range (set, 0, 0xff);
+			return NULLABLE_NO;
+
+		case '^':
+			pp->p++;
+			return NULLABLE_YES;
+
+		case '$':
+			pp->p++;
+			BYTES_ADD (set, '\n');
+			BYTES_ADD (set, '\r');
+			return NULLABLE_AT_END;
+
+		case '*':
+		case '+':
+		case '?':
+			pp->failed = TRUE;
+			return NULLABLE_YES;
+
+		default:
+			bytes_add_char (set, g_utf8_get_char (pp->p), pp->caseless);
+			pp->p = g_utf8_next_char (pp->p);
+			return NULLABLE_NO;
+	}
+}
+
+static Nullable
+prefilter_quantifier (PrefilterParser *pp,
+		      Nullable         nullable)
+{
+	prefilter_skip_space (pp);
+
+	switch (*pp->p)
+	{
+		case '?':
+		case '*':
+			pp->p++;
+			nullable = NULLABLE_YES;
+			break;
+
+		case '+':
+			pp->p++;
+			break;
+
+		case '{':
+		{
+			const gchar *p = pp->p + 1;
+			gboolean zero = *p == '0';
+
+			if (!g_ascii_isdigit (*p))
+				return nullable;
+
+			while (g_ascii_isdigit (*p))
+				p++;
+			if (*p == ',')
+				p++;
+			while (g_ascii_isdigit (*p))
+				p++;
+
+			/* Otherwise it's a literal '{'. */
+			if (*p != '}')
+				return nullable;
+
+			pp->p = p + 1;
+
+			if (zero)
+				nullable = NULLABLE_YES;
+			break;
+		}
+
+		default:
+			return nullable;
+	}
+
+	/* lazy or possessive quantifier */
+	if (*pp->p == '?' || *pp->p == '+')
+		pp->p++;
+
+	return nullable;
+}
+
+static Nullable
+prefilter_sequence (PrefilterParser *pp,
+		    guint8          *set)
+{
+	Nullable nullable = NULLABLE_YES;
+
+	while (!pp->failed)
+	{
+		guint8 item[32] = {0};
+		Nullable item_nullable;
+		guint i;
+
+		prefilter_skip_space (pp);
+
+		if (*pp->p == 0 || *pp->p == '|' || *pp->p == ')')
+			break;
+
+		item_nullable = prefilter_atom (pp, item);
+		item_nullable = prefilter_quantifier (pp, item_nullable);
+
+		if (nullable != NULLABLE_NO)
+			for (i = 0; i < sizeof (item); i++)
+				set[i] |= item[i];
+
+		nullable = nullable_seq (nullable, item_nullable);
+	}
+
+	return nullable;
+}
+
+static Nullable
+prefilter_alternation (PrefilterParser *pp,
+		       guint8          *set)
+{
+	Nullable nullable = prefilter_sequence (pp, set);
+
+	while (!pp->failed && *pp->p == '|')
+	{
+		pp->p++;
+		nullable = nullable_alt (nullable, prefilter_sequence (pp, set));
+	}
+
+	return nullable;
+}
+
+/**
+ * regex_prefilter_new:
+ *
+ * @pattern: a pattern without any flags set.
+ *
+ * Returns: a new #RegexPrefilter for @pattern, or %NULL if
+ * @pattern is too complex or may match the empty string.
+ */
+static RegexPrefilter *
+regex_prefilter_new (const gchar *pattern)
+{
+	PrefilterParser pp = {pattern, FALSE, FALSE, FALSE};
+	RegexPrefilter *prefilter;
+	guint8 set[32] = {0};
+	Nullable nullable;
+	gint n_bytes = 0;
+	guint i;
+
+	nullable = prefilter_alternation (&pp, set);
+
+	if (pp.failed || *pp.p != 0 || nullable == NULLABLE_YES)
+		return NULL;
+
+	prefilter = g_slice_new0 (RegexPrefilter);
+	memcpy (prefilter->bytes, set, sizeof (set));
+	prefilter->at_end = nullable == NULLABLE_AT_END;
+	prefilter->single_byte = -1;
+
+	for (i = 0; i < 0x100; i++)
+	{
+		if (BYTES_HAS (set, i))
+		{
+			prefilter->single_byte = i;
+			n_bytes++;
+		}
+	}
+
+	if (n_bytes == 0x100)
+	{
+		g_slice_free (RegexPrefilter, prefilter);
+		return NULL;
+	}
+
+	if (n_bytes != 1)
+		prefilter->single_byte = -1;
+
+	return prefilter;
+}
+
+/**
+ * regex_prefilter_skip:
+ *
+ * @regex: a #Regex.
+ * @text: the line.
+ * @byte_length: length of @text.
+ * @byte_pos: (inout): where to start looking for a match.
+ *
+ * Moves @byte_pos to the first position at which @regex may match.
+ *
+ * Returns: %FALSE if @regex can't match at or after @byte_pos.
+ */
+static gboolean
+regex_prefilter_skip (Regex       *regex,
+		      const gchar *text,
+		      gint         byte_length,
+		      gint        *byte_pos)
+{
+	RegexPrefilter *prefilter = regex->u.regex.prefilter;
+	const guchar *p, *end;
+
+	if (prefilter == NULL)
+		return TRUE;
+
+	p = (const guchar *) text + *byte_pos;
+	end = (const guchar *) text + byte_length;
+
+	if (prefilter->single_byte >= 0)
+	{
+		p = memchr (p, prefilter->single_byte, end - p);
+
+		if (p == NULL)
+			p = end;
+	}
+	else
+	{
+		while (p < end && !BYTES_HAS (prefilter->bytes, *p))
+			p++;
+	}
+
+	if (p == end && !prefilter->at_end)
+		return FALSE;
+
+	*byte_pos = (const gchar *) p - text;
+	return TRUE;
+}
+
+/* SYNTAX TREE ------------------------------------------------------------ */
+
+/**
+ * apply_sub_patterns:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @contextstate: a #Context.
+ * @line_starts_at: beginning offset of the line.
+ * @line: the line to analyze.
+ * @line_pos: the position inside @line.
+ * @line_length: the length of @line.
+ * @regex: regex that matched.
+ * @where: kind of sub patterns to apply.
+ *
+ * Applies sub patterns of kind @where to the matched text.
+ */
+static void
+apply_sub_patterns (GtkSourceContextEngine *ce,
+		    Segment                *state,
+		    LineInfo               *line,
+		    Regex                  *regex,
+		    SubPatternWhere         where)
+{
+	GSList *sub_pattern_list = state->context->definition->sub_patterns;
+
+	if (SEGMENT_IS_CONTAINER (state))
+	{
+		gint start_pos;
+		gint end_pos;
+
+		regex_fetch_pos (regex, line->text, 0, &start_pos, &end_pos);
+
+		if (where == SUB_PATTERN_WHERE_START)
+		{
+			if (line->start_at + start_pos != state->start_at)
+				g_critical ("%s: oops", G_STRLOC);
+			else if (line->start_at + end_pos > state->end_at)
+				g_critical ("%s: oops", G_STRLOC);
+			else
+				state->start_len = line->start_at + end_pos - state->start_at;
+		}
+		else
+		{
+			if (line->start_at + start_pos < state->start_at)
+				g_critical ("%s: oops", G_STRLOC);
+			else if (line->start_at + end_pos != state->end_at)
+				g_critical ("%s: oops", G_STRLOC);
+			else
+				state->end_len = state->end_at - line->start_at - start_pos;
+		}
+	}
+
+	while (sub_pattern_list != NULL)
+	{
+		SubPatternDefinition *sp_def = sub_pattern_list->data;
+
+		if (sp_def->where == where)
+		{
+			gint start_pos;
+			gint end_pos;
+
+			if (sp_def->is_named)
+				regex_fetch_named_pos (regex,
+						       line->text,
+						       sp_def->u.name,
+						       &start_pos,
+						       &end_pos);
+			else
+				regex_fetch_pos (regex,
+						 line->text,
+						 sp_def->u.num,
+						 &start_pos,
+						 &end_pos);
+
+			if (start_pos >= 0 && start_pos != end_pos)
+			{
+				sub_pattern_new (ce, state,
+						 line->start_at + start_pos,
+						 line->start_at + end_pos,
+						 sp_def);
+			}
+		}
+
+		sub_pattern_list = sub_pattern_list->next;
+	}
+}
+
+/**
+ * can_apply_match:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: the current state of the parser.
+ * @line: the line to analyze.
+ * @match_start: start position of match, bytes.
+ * @match_end: where to put end of match, bytes.
+ * @where: kind of sub patterns to apply.
+ *
+ * See apply_match(), this function is a helper function
+ * called from where, it doesn't modify syntax tree.
+ *
+ * Returns: %TRUE if the match can be applied.
+ */
+static gboolean
+can_apply_match (GtkSourceContextEngine *ce,
+		 Context                *state,
+		 LineInfo               *line,
+		 gint                    match_start,
+		 gint                   *match_end,
+		 Regex                  *regex)
+{
+	gint end_match_pos;
+	gboolean ancestor_ends;
+	gint pos;
+
+	ancestor_ends = FALSE;
+	/* end_match_pos is the position of the end of the matched regex. */
+	regex_fetch_pos_bytes (regex, 0, NULL, &end_match_pos);
+
+	g_assert (end_match_pos <= line->byte_length);
+
+	/* Verify if an ancestor ends in the matched text. */
+	if (ANCESTOR_CAN_END_CONTEXT (state) &&
+	    /* there is no middle of zero-length match */
+	    match_start < end_match_pos)
+	{
+		pos = match_start + 1;
+
+		while (pos < end_match_pos)
+		{
+			if (ancestor_context_ends_here (ce, state, line, pos))
+			{
+				ancestor_ends = TRUE;
+				break;
+			}
+
+			pos = g_utf8_next_char (line->text + pos) - line->text;
+		}
+	}
+	else
+	{
+		pos = end_match_pos;
+	}
+
+	if (ancestor_ends)
+	{
+		/* An ancestor ends in the middle of the match, we verify
+		 * if the regex matches against the available string before
+		 * the end of the ancestor.
+		 * For instance in C a net-address context matches even if
+		 * it contains the end of a multi-line comment. */
+		if (!regex_match (ce, regex, state->definition, line->text, pos, match_start))
+		{
+			/* This match is not valid, so we can try to match
+			 * the next definition, so the position should not
+			 * change. */
+			return FALSE;
+		}
+	}
+
+	*match_end = pos;
+	return TRUE;
+}
+
+static gint
+line_pos_to_offset (LineInfo *line,
+		    gint      pos)
+{
+	if (line->char_length != line->byte_length)
+		pos = g_utf8_pointer_to_offset (line->text, line->text + pos);
+	return line->start_at + pos;
+}
+
+/**
+ * apply_match:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: the current state of the parser.
+ * @line: the line to analyze.
+ * @line_pos: position in the line, bytes.
+ * @regex: regex that matched.
+ * @where: kind of sub patterns to apply.
+ *
+ * Moves @line_pos after the matched text. @line_pos is not
+ * updated and the function returns %FALSE if the match cannot be
+ * applied because an ancestor ends in the middle of the matched
+ * text.
+ *
+ * If the match can be applied the function applies the appropriate
+ * sub patterns.
+ *
+ * Returns: %TRUE if the match can be applied.
+ */
+static gboolean
+apply_match (GtkSourceContextEngine *ce,
+	     Segment                *state,
+	     LineInfo               *line,
+	     gint                   *line_pos,
+	     Regex                  *regex,
+	     SubPatternWhere         where)
+{
+	gint match_end;
+
+	if (!can_apply_match (ce, state->context, line, *line_pos, &match_end, regex))
+		return FALSE;
+
+	segment_extend (state, line_pos_to_offset (line, match_end));
+	apply_sub_patterns (ce, state, line, regex, where);
+	*line_pos = match_end;
+
+	return TRUE;
+}
+
+/**
+ * create_reg_all:
+ *
+ * @context: context.
+ * @definition: context definition.
+ *
+ * Creates regular expression for all possible transitions: it
+ * combines terminating regex, terminating regexes of parent
+ * contexts if those can terminate this one, and start regexes
+ * of child contexts.
+ *
+ * It takes as an argument actual context or a context definition. In
+ * case when context end depends on start (\%{foo@start} references),
+ * it must use the context, definition is not enough. If there are no
+ * those references, then the reg_all is created right in the definition
+ * when no contexts exist yet. This is why this function has its funny
+ * arguments.
+ *
+ * Returns: resulting regex or %NULL when pcre failed to compile the regex.
+ */
+static Regex *
+create_reg_all (Context           *context,
+		ContextDefinition *definition)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+	GString *all;
+	Regex *regex;
+	GError *error = NULL;
+
+	g_return_val_if_fail ((context == NULL && definition != NULL) ||
+			      (context != NULL && definition == NULL), NULL);
+
+	if (definition == NULL)
+		definition = context->definition;
+
+	all = g_string_new ("(");
+
+	/* Closing regex. */
+	if (definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->u.start_end.end != NULL)
+	{
+		Regex *end;
+
+		if (definition->u.start_end.end->resolved)
+		{
+			end = definition->u.start_end.end;
+		}
+		else
+		{
+			g_return_val_if_fail (context && context->end, NULL);
+			end = context->end;
+		}
+
+		g_string_append (all, regex_get_pattern (end));
+		g_string_append (all, "|");
+	}
+
+	/* Ancestors. */
+	if (context != NULL)
+	{
+		Context *tmp = context;
+
+		while (ANCESTOR_CAN_END_CONTEXT (tmp))
+		{
+			if (!CONTEXT_EXTENDS_PARENT (tmp))
+			{
+				gboolean append = TRUE;
+
+				/* Code as it is seems to be right, and seems working right.
+				 * Remove FIXME's below if everything is fine. */
+
+				if (tmp->parent->end != NULL)
+					g_string_append (all, regex_get_pattern (tmp->parent->end));
+				/* FIXME ?
+				 * The old code insisted on having tmp->parent->end != NULL here,
+				 * though e.g. in case line-comment -> email-address it's not the case.
+				 * Apparently using $ fixes the problem. */
+				else if (CONTEXT_END_AT_LINE_END (tmp->parent))
+					g_string_append (all, "$");
+				/* FIXME it's not clear whether it can happen, maybe we need assert here
+				 * or parser need to check it */
+				else
+				{
+					/* g_critical ("%s: oops", G_STRLOC); */
+					append = FALSE;
+				}
+
+				if (append)
+					g_string_append (all, "|");
+			}
+
+			tmp = tmp->parent;
+		}
+	}
+
+	/* Children. */
+	definition_iter_init (&iter, definition);
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+	{
+		Regex *child_regex = NULL;
+
+		g_return_val_if_fail (child_def->resolved, NULL);
+
+		switch (child_def->u.definition->type)
+		{
+			case CONTEXT_TYPE_CONTAINER:
+				child_regex = child_def->u.definition->u.start_end.start;
+				break;
+			case CONTEXT_TYPE_SIMPLE:
+				child_regex = child_def->u.definition->u.match;
+				break;
+			default:
+				g_return_val_if_reached (NULL);
+		}
+
+		if (child_regex != NULL)
+		{
+			g_string_append (all, regex_get_pattern (child_regex));
+			g_string_append (all, "|");
+		}
+	}
+	definition_iter_destroy (&iter);
+
+	if (all->len > 1)
+		g_string_truncate (all, all->len - 1);
+	g_string_append (all, ")");
+
+	regex = regex_new (all->str, 0, &error);
+
+	if (regex == NULL)
+	{
+		/* regex_new could fail, for instance if there are different
+		 * named sub-patterns with the same name or if resulting regex is
+		 * too long. In this case fixing lang file helps (e.g. renaming
+		 * subpatterns, making huge keywords use bigger prefixes, etc.) */
+		g_warning (_("Cannot create a regex for all the transitions, "
+			     "the syntax highlighting process will be slower "
+			     "than usual.\nThe error was: %s"), error->message);
+		g_error_free (error);
+	}
+	else
+	{
+		regex->u.regex.prefilter = regex_prefilter_new (all->str);
+	}
+
+	g_string_free (all, TRUE);
+	return regex;
+}
+
+static Context *
+context_ref (Context *context)
+{
+	if (context != NULL)
+		context->ref_count++;
+	return context;
+}
+
+/* does not copy style */
+static Context *
+context_new (Context           *parent,
+	     ContextDefinition *definition,
+	     const gchar       *line_text,
+	     const gchar       *style,
+	     gboolean           ignore_children_style)
+{
+	Context *context;
+
+	context = g_slice_new0 (Context);
+	context->ref_count = 1;
+	context->definition = definition;
+	context->parent = parent;
+
+	context->style = style;
+	context->ignore_children_style = ignore_children_style;
+
+	if (parent != NULL && parent->ignore_children_style)
+	{
+		context->ignore_children_style = TRUE;
+		context->style = NULL;
+	}
+
+	if (!parent || (parent->all_ancestors_extend && CONTEXT_EXTENDS_PARENT (parent)))
+	{
+		context->all_ancestors_extend = TRUE;
+	}
+
+	if (line_text &&
+	    definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->u.start_end.end)
+	{
+		context->end = regex_resolve (definition, line_text);
+	}
+
+	/* Create reg_all. If it is possibile we share the same reg_all
+	 * for more contexts storing it in the definition. */
+	if (ANCESTOR_CAN_END_CONTEXT (context) ||
+	    (definition->type == CONTEXT_TYPE_CONTAINER &&
+	     definition->u.start_end.end != NULL &&
+	     !definition->u.start_end.end->resolved))
+	{
+		context->reg_all = create_reg_all (context, NULL);
+	}
+	else
+	{
+		G_LOCK (definition_reg_all);
+		if (!definition->reg_all)
+			definition->reg_all = create_reg_all (NULL, definition);
+		context->reg_all = regex_ref (definition->reg_all);
+		G_UNLOCK (definition_reg_all);
+	}
+
+#ifdef ENABLE_DEBUG
+	{
+		GString *str = g_string_new (definition->id);
+		Context *tmp = context->parent;
+		while (tmp != NULL)
+		{
+			g_string_prepend (str, "/");
+			g_string_prepend (str, tmp->definition->id);
+			tmp = tmp->parent;
+		}
+		g_print ("created context %s: %s\n", definition->id, str->str);
+		g_string_free (str, TRUE);
+	}
+#endif
+
+	return context;
+}
+
+static void
+context_unref_hash_cb (G_GNUC_UNUSED gpointer text,
+		       Context *context)
+{
+	context->parent = NULL;
+
+	if (context->idle)
+	{
+		context->idle = FALSE;
+		context_destroy (context);
+	}
+	else
+	{
+		context_unref (context);
+	}
+}
+
+static gboolean
+remove_context_cb (G_GNUC_UNUSED gpointer text,
+		   Context *context,
+		   Context *target)
+{
+	return context == target;
+}
+
+static void
+context_remove_child (Context *parent,
+		      Context *context)
+{
+	ContextPtr *ptr, *prev = NULL;
+	gboolean delete = TRUE;
+
+	g_assert (context->parent == parent);
+
+	for (ptr = parent->children; ptr; ptr = ptr->next)
+	{
+		if (ptr->definition == context->definition)
+			break;
+		prev = ptr;
+	}
+
+	g_assert (ptr != NULL);
+
+	if (!ptr->fixed)
+	{
+		g_hash_table_foreach_remove (ptr->u.hash,
+					     (GHRFunc) remove_context_cb,
+					     context);
+
+		if (g_hash_table_size (ptr->u.hash) != 0)
+			delete = FALSE;
+	}
+
+	if (delete)
+	{
+		if (prev != NULL)
+			prev->next = ptr->next;
+		else
+			parent->children = ptr->next;
+
+		if (!ptr->fixed)
+		{
+			g_hash_table_destroy (ptr->u.hash);
+			g_queue_free (ptr->idle);
+		}
+
+#ifdef ENABLE_DEBUG
+		memset (ptr, 1, sizeof (ContextPtr));
+#else
+		g_slice_free (ContextPtr, ptr);
+#endif
+	}
+}
+
+/**
+ * context_release:
+ *
+ * @context: the context which is not referenced anymore.
+ *
+ * Contexts with end regexes referring to the start regex are
+ * created for every distinct matched text, and each of them compiles
+ * its own reg_all. Text which goes in and out of such a context
+ * while it's edited would create them again and again, so the last
+ * CONTEXT_CACHE_MAX_IDLE of them are kept in their parent and
+ * create_child_context() reuses them. The least recently released
+ * one is destroyed when there are more.
+ *
+ * Returns: whether @context was kept.
+ */
+static gboolean
+context_release (Context *context)
+{
+	ContextPtr *ptr;
+	Context *victim;
+
+	if (context->parent == NULL)
+		return FALSE;
+
+	for (ptr = context->parent->children;
+	     ptr->definition != context->definition;
+	     ptr = ptr->next) ;
+
+	if (ptr->fixed)
+		return FALSE;
+
+	context->idle = TRUE;
+	g_queue_push_head (ptr->idle, context);
+
+	if (g_queue_get_length (ptr->idle) <= CONTEXT_CACHE_MAX_IDLE)
+		return TRUE;
+
+	victim = g_queue_pop_tail (ptr->idle);
+	victim->idle = FALSE;
+	g_atomic_int_inc (&victim->definition->context_cache_evicted);
+	context_destroy (victim);
+
+	return TRUE;
+}
+
+/**
+ * context_reuse:
+ *
+ * @ptr: the #ContextPtr holding @context.
+ * @context: a context in the hash of @ptr.
+ *
+ * Takes @context out of the idle contexts if it was released,
+ * the caller is supposed to reference it.
+ */
+static void
+context_reuse (ContextPtr *ptr,
+	       Context    *context)
+{
+	if (context->idle)
+	{
+		g_queue_remove (ptr->idle, context);
+		context->idle = FALSE;
+		g_atomic_int_inc (&context->definition->context_cache_reused);
+	}
+}
+
+/**
+ * context_unref:
+ *
+ * @context: the context.
+ *
+ * Decreases reference count and removes @context
+ * from the tree when it drops to zero, unless
+ * context_release() keeps it.
+ */
+static void
+context_unref (Context *context)
+{
+	if (context == NULL || --context->ref_count != 0)
+		return;
+
+	if (!context_release (context))
+		context_destroy (context);
+}
+
+static void
+context_destroy (Context *context)
+{
+	ContextPtr *children;
+	gint i;
+
+	g_assert (context->ref_count == 0 && !context->idle);
+
+	DEBUG (g_print ("destroying context %s\n", context->definition->id));
+
+	children = context->children;
+	context->children = NULL;
+
+	while (children != NULL)
+	{
+		ContextPtr *ptr = children;
+
+		children = children->next;
+
+		if (ptr->fixed)
+		{
+			ptr->u.context->parent = NULL;
+			context_unref (ptr->u.context);
+		}
+		else
+		{
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_unref_hash_cb,
+					      NULL);
+			g_hash_table_destroy (ptr->u.hash);
+			g_queue_free (ptr->idle);
+		}
+
+#ifdef ENABLE_DEBUG
+		memset (ptr, 1, sizeof (ContextPtr));
+#else
+		g_slice_free (ContextPtr, ptr);
+#endif
+	}
+
+	if (context->parent != NULL)
+		context_remove_child (context->parent, context);
+
+	regex_unref (context->end);
+	regex_unref (context->reg_all);
+
+	if (context->subpattern_context_classes != NULL)
+	{
+		for (i = 0; i < context->definition->n_sub_patterns; ++i)
+		{
+			g_slist_foreach (context->subpattern_context_classes[i], 
+			                 (GFunc)context_class_tag_free,
+			                 NULL);
+
+			g_slist_free (context->subpattern_context_classes[i]);
+		}
+	}
+
+	g_slist_foreach (context->context_classes, (GFunc)context_class_tag_free, NULL);
+	g_slist_free (context->context_classes);
+
+	g_free (context->subpattern_context_classes);
+	g_free (context->subpattern_tags);
+
+	g_slice_free (Context, context);
+}
+
+static void
+context_freeze_hash_cb (G_GNUC_UNUSED gpointer text,
+		        Context *context)
+{
+	/* Nothing refers to idle contexts, nothing to preserve. */
+	if (!context->idle)
+		context_freeze (context);
+}
+
+/**
+ * context_freeze:
+ *
+ * @context: the context.
+ *
+ * Recursively increments reference count in context and its children,
+ * and marks them, so context_thaw is able to correctly decrement
+ * reference count.
+ * This function is for update_syntax: we want to preserve existing
+ * contexts when possible, and update_syntax erases contexts from
+ * reanalyzed lines; so to avoid destructing and recreating contexts
+ * every time, we need to increment reference count on existing contexts,
+ * and decrement it when we are done with analysis, so no more needed
+ * contexts go away. Keeping a list of referenced contexts is painful
+ * or slow, so we just reference all contexts present at the moment.
+ *
+ * Note this is not reentrant, context_freeze()/context_thaw() pair is called
+ * only from update_syntax().
+ */
+static void
+context_freeze (Context *ctx)
+{
+	ContextPtr *ptr;
+
+	g_assert (!ctx->frozen);
+	ctx->frozen = TRUE;
+	context_ref (ctx);
+
+	for (ptr = ctx->children; ptr != NULL; ptr = ptr->next)
+	{
+		if (ptr->fixed)
+		{
+			context_freeze (ptr->u.context);
+		}
+		else
+		{
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_freeze_hash_cb,
+					      NULL);
+		}
+	}
+}
+
+static void
+get_child_contexts_hash_cb (G_GNUC_UNUSED gpointer text,
+			    Context *context,
+			    GSList **list)
+{
+	/* Idle contexts are not frozen, and may be destroyed
+	 * while their siblings are thawed. */
+	if (!context->idle)
+		*list = g_slist_prepend (*list, context);
+}
+
+/**
+ * context_thaw:
+ *
+ * @context: the context.
+ *
+ * Recursively decrements reference count in context and its children,
+ * if it was incremented by context_freeze().
+ */
+static void
+context_thaw (Context *ctx)
+{
+	ContextPtr *ptr;
+
+	if (!ctx->frozen)
+		return;
+
+	for (ptr = ctx->children; ptr != NULL; )
+	{
+		ContextPtr *next = ptr->next;
+
+		if (ptr->fixed)
+		{
+			context_thaw (ptr->u.context);
+		}
+		else
+		{
+			GSList *children = NULL;
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) get_child_contexts_hash_cb,
+					      &children);
+			g_slist_foreach (children, (GFunc) context_thaw, NULL);
+			g_slist_free (children);
+		}
+
+		ptr = next;
+	}
+
+	ctx->frozen = FALSE;
+	context_unref (ctx);
+}
+
+/**
+ * context_get_child_ptr:
+ *
+ * @parent: the context.
+ * @definition: definition of a child context.
+ *
+ * Returns: the #ContextPtr holding children of @parent with given
+ * @definition, created if needed.
+ */
+static ContextPtr *
+context_get_child_ptr (Context           *parent,
+		       ContextDefinition *definition)
+{
+	ContextPtr *ptr;
+
+	for (ptr = parent->children;
+	     ptr != NULL && ptr->definition != definition;
+	     ptr = ptr->next) ;
+
+	if (ptr == NULL)
+	{
+		ptr = g_slice_new0 (ContextPtr);
+		ptr->next = parent->children;
+		parent->children = ptr;
+		ptr->definition = definition;
+
+		if (definition->type != CONTEXT_TYPE_CONTAINER ||
+		    !definition->u.start_end.end ||
+		    definition->u.start_end.end->resolved)
+		{
+			ptr->fixed = TRUE;
+		}
+
+		if (!ptr->fixed)
+		{
+			ptr->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+			ptr->idle = g_queue_new ();
+		}
+	}
+
+	return ptr;
+}
+
+static Context *
+create_child_context (Context           *parent,
+		      DefinitionChild   *child_def,
+		      const gchar       *line_text)
+{
+	Context *context;
+	ContextPtr *ptr;
+	gchar *match = NULL;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_return_val_if_fail (parent != NULL, NULL);
+
+	ptr = context_get_child_ptr (parent, definition);
+
+	if (ptr->fixed)
+	{
+		context = ptr->u.context;
+	}
+	else
+	{
+		match = regex_fetch (definition->u.start_end.start, 0);
+		g_return_val_if_fail (match != NULL, NULL);
+		context = g_hash_table_lookup (ptr->u.hash, match);
+
+		if (context != NULL)
+			context_reuse (ptr, context);
+	}
+
+	if (context != NULL)
+	{
+		g_free (match);
+		return context_ref (context);
+	}
+
+	context = context_new (parent,
+			       definition,
+			       line_text,
+			       child_def->override_style ? child_def->style :
+					child_def->u.definition->default_style,
+			       child_def->override_style ? child_def->override_style_deep : FALSE);
+	g_return_val_if_fail (context != NULL, NULL);
+
+	if (ptr->fixed)
+		ptr->u.context = context;
+	else
+		g_hash_table_insert (ptr->u.hash, match, context);
+
+	return context;
+}
+
+/**
+ * segment_new:
+ *
+ * @ce: the engine.
+ * @parent: parent segment (%NULL for the root segment).
+ * @context: context for this segment (%NULL for invalid segments).
+ * @start_at: start offset in the buffer, characters.
+ * @end_at: end offset in the buffer, characters.
+ * @is_start: is_start flag.
+ *
+ * Creates a new segment structure. It doesn't take care about
+ * parent or siblings, create_segment() is the function to
+ * create new segments in the tree.
+ *
+ * Returns: newly created segment.
+ */
+static Segment *
+segment_new (GtkSourceContextEngine *ce,
+	     Segment                *parent,
+	     Context                *context,
+	     gint                    start_at,
+	     gint                    end_at,
+	     gboolean                is_start)
+{
+	Segment *segment;
+
+#ifdef ENABLE_CHECK_TREE
+	g_assert (!is_start || context != NULL);
+#endif
+
+	segment = node_pool_alloc (&ce->priv->segment_pool);
+	segment->parent = parent;
+	segment->context = context_ref (context);
+	segment->start_at = start_at;
+	segment->end_at = end_at;
+	segment->is_start = is_start;
+	segment->stamp = ce->priv->stamp;
+
+	if (context == NULL)
+		add_invalid (ce, segment);
+
+	return segment;
+}
+
+static void
+find_segment_position_forward_ (GtkSourceContextEngine *ce,
+				Segment                *segment,
+				gint                    start_at,
+				gint                    end_at,
+				Segment               **prev,
+				Segment               **next)
+{
+	g_assert (segment->start_at <= start_at);
+
+	while (segment != NULL)
+	{
+		segment_sync (ce, segment);
+
+		if (segment->end_at == start_at)
+		{
+			while (segment->next != NULL &&
+			       segment_sync (ce, segment->next)->start_at == start_at)
+				segment = segment->next;
+
+			*prev = segment;
+			*next = segment->next;
+
+			break;
+		}
+
+		if (segment->start_at == end_at)
+		{
+			*next = segment;
+			*prev = segment->prev;
+			break;
+		}
+
+		if (segment->start_at > end_at)
+		{
+			*next = segment;
+			break;
+		}
+
+		if (segment->end_at < start_at)
+			*prev = segment;
+
+		segment = segment->next;
+	}
+}
+
+static void
+find_segment_position_backward_ (GtkSourceContextEngine *ce,
+				 Segment                *segment,
+				 gint                    start_at,
+				 gint                    end_at,
+				 Segment               **prev,
+				 Segment               **next)
+{
+	g_assert (start_at < segment->end_at);
+
+	while (segment != NULL)
+	{
+		segment_sync (ce, segment);
+
+		if (segment->end_at <= start_at)
+		{
+			*prev = segment;
+			break;
+		}
+
+		g_assert (segment->start_at >= end_at);
+
+		*next = segment;
+		segment = segment->prev;
+	}
+}
+
+/**
+ * find_segment_position:
+ *
+ * @ce: the engine.
+ * @parent: parent segment (not %NULL).
+ * @hint: segment somewhere near new segment position.
+ * @start_at: start offset.
+ * @end_at: end offset.
+ * @prev: location to return previous sibling.
+ * @next: location to return next sibling.
+ *
+ * Finds siblings of a new segment to be created at interval
+ * (start_at, end_at). It uses hint to avoid walking whole
+ * parent->children list.
+ */
+static void
+find_segment_position (GtkSourceContextEngine *ce,
+		       Segment                *parent,
+		       Segment                *hint,
+		       gint                    start_at,
+		       gint                    end_at,
+		       Segment               **prev,
+		       Segment               **next)
+{
+	Segment *tmp;
+
+	g_assert (parent->start_at <= start_at && end_at <= parent->end_at);
+	g_assert (!hint || hint->parent == parent);
+
+	*prev = *next = NULL;
+
+	if (parent->children == NULL)
+		return;
+
+	if (parent->children->next == NULL)
+	{
+		tmp = segment_sync (ce, parent->children);
+
+		if (start_at >= tmp->end_at)
+			*prev = tmp;
+		else
+			*next = tmp;
+
+		return;
+	}
+
+	if (hint == NULL)
+		hint = parent->children;
+
+	if (segment_sync (ce, hint)->end_at <= start_at)
+		find_segment_position_forward_ (ce, hint, start_at, end_at, prev, next);
+	else
+		find_segment_position_backward_ (ce, hint, start_at, end_at, prev, next);
+}
+
+/**
+ * create_segment:
+ *
+ * @ce: the engine.
+ * @parent: parent segment (%NULL for the root segment).
+ * @context: context for this segment (%NULL for invalid segments).
+ * @start_at: start offset, characters.
+ * @end_at: end offset, characters.
+ * @is_start: is_start flag.
+ * @hint: a segment somewhere near new one, to omtimize search.
+ *
+ * Creates a new segment and inserts it into the tree.
+ *
+ * Returns: newly created segment.
+ */
+static Segment *
+create_segment (GtkSourceContextEngine *ce,
+		Segment                *parent,
+		Context                *context,
+		gint                    start_at,
+		gint                    end_at,
+		gboolean                is_start,
+		Segment                *hint)
+{
+	Segment *segment;
+
+	if (parent != NULL)
+		segment_sync (ce, parent);
+
+	g_assert (!parent || (parent->start_at <= start_at && end_at <= parent->end_at));
+
+	segment = segment_new (ce, parent, context, start_at, end_at, is_start);
+
+	if (parent != NULL)
+	{
+		Segment *prev, *next;
+
+		if (hint == NULL)
+		{
+			hint = ce->priv->hint;
+			while (hint != NULL && hint->parent != parent)
+				hint = hint->parent;
+		}
+
+		find_segment_position (ce, parent, hint,
+				       start_at, end_at,
+				       &prev, &next);
+
+		g_assert ((!parent->children && !prev && !next) ||
+			  (parent->children && (prev || next)));
+		g_assert (!prev || prev->next == next);
+		g_assert (!next || next->prev == prev);
+
+		segment->next = next;
+		segment->prev = prev;
+
+		if (next != NULL)
+			next->prev = segment;
+		else
+			parent->last_child = segment;
+
+		if (prev != NULL)
+			prev->next = segment;
+		else
+			parent->children = segment;
+
+		CHECK_SEGMENT_LIST (parent);
+		CHECK_TREE (ce);
+	}
+
+	return segment;
+}
+
+/**
+ * segment_extend:
+ *
+ * @state: the semgent.
+ * @end_at: new end offset, characters.
+ *
+ * Updates end offset in the segment and its ancestors.
+ */
+static void
+segment_extend (Segment *state,
+		gint     end_at)
+{
+	while (state != NULL && state->end_at < end_at)
+	{
+		state->end_at = end_at;
+		state = state->parent;
+	}
+	CHECK_SEGMENT_LIST (state->parent);
+}
+
+static void
+segment_destroy_children (GtkSourceContextEngine *ce,
+			  Segment                *segment)
+{
+	Segment *child;
+	SubPattern *sp;
+
+	g_return_if_fail (segment != NULL);
+
+	child = segment->children;
+	segment->children = NULL;
+	segment->last_child = NULL;
+
+	ce->priv->destroy_depth++;
+
+	while (child != NULL)
+	{
+		Segment *next = child->next;
+		segment_destroy (ce, child);
+		child = next;
+	}
+
+	if (--ce->priv->destroy_depth == 0)
+		checkpoints_remove_dead (ce);
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		sub_pattern_free (ce, sp);
+		sp = next;
+	}
+}
+
+/**
+ * segment_destroy:
+ *
+ * @ce: the engine.
+ * @context: the segment to destroy.
+ *
+ * Recursively frees given segment. It removes the segment
+ * from ce structure, but it doesn't update parent and
+ * siblings. segment_remove() is the function that takes
+ * care of everything.
+ */
+static void
+segment_destroy (GtkSourceContextEngine *ce,
+		 Segment                *segment)
+{
+	g_return_if_fail (segment != NULL);
+
+	ce->priv->destroy_depth++;
+
+	segment_destroy_children (ce, segment);
+
+	/* segment neighbours and parent may be invalid here,
+	 * so we only can unset the hint */
+	if (ce->priv->hint == segment)
+		ce->priv->hint = NULL;
+        if (ce->priv->hint2 == segment)
+                ce->priv->hint2 = NULL;
+
+	if (SEGMENT_IS_INVALID (segment))
+		remove_invalid (ce, segment);
+
+	if (segment->checkpoint)
+		checkpoints_remove_segment (ce, segment);
+
+	context_unref (segment->context);
+
+#ifdef ENABLE_DEBUG
+	g_assert (!g_slist_find (ce->priv->invalid, segment));
+#endif
+
+	node_pool_free (&ce->priv->segment_pool, segment);
+
+	if (--ce->priv->destroy_depth == 0)
+		checkpoints_remove_dead (ce);
+}
+
+/**
+ * container_context_starts_here:
+ *
+ * See child_starts_here().
+ */
+static gboolean
+container_context_starts_here (GtkSourceContextEngine  *ce,
+			       Segment                 *state,
+			       DefinitionChild         *child_def,
+			       LineInfo                *line,
+			       gint                    *line_pos, /* bytes */
+			       Segment                **new_state)
+{
+	Context *new_context;
+	Segment *new_segment;
+	gint match_end;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_assert (*line_pos <= line->byte_length);
+
+	/* We can have a container context definition (i.e. the main
+	 * language definition) without start_end.start. */
+	if (definition->u.start_end.start == NULL)
+		return FALSE;
+
+	if (!regex_match (ce, definition->u.start_end.start, definition,
+			  line->text, line->byte_length, *line_pos))
+	{
+		return FALSE;
+	}
+
+	new_context = create_child_context (state->context, child_def, line->text);
+	g_return_val_if_fail (new_context != NULL, FALSE);
+
+	if (!can_apply_match (ce, new_context, line, *line_pos, &match_end,
+			      definition->u.start_end.start))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	g_assert (match_end <= line->byte_length);
+
+        segment_extend (state, line_pos_to_offset (line, match_end));
+        new_segment = create_segment (ce, state, new_context,
+				      line_pos_to_offset (line, *line_pos),
+				      line_pos_to_offset (line, match_end),
+				      TRUE,
+				      ce->priv->hint2);
+
+	/* This new context could end at the same position (i.e. have zero length),
+	 * and then we get an infinite loop. We can't possibly know about it at this point
+	 * (since we need to know that the context indeed *ends* here, and that's
+	 * discovered only later) so we look at the previous sibling: if it's the same,
+	 * and has zero length then we remove the segment. We do it this way instead of
+	 * checking before creating the segment because it's more convenient. */
+	if (*line_pos == match_end &&
+	    new_segment->prev != NULL &&
+	    new_segment->prev->context == new_segment->context &&
+	    segment_sync (ce, new_segment->prev)->start_at == new_segment->prev->end_at &&
+	    new_segment->prev->start_at == line_pos_to_offset (line, *line_pos))
+	{
+		segment_remove (ce, new_segment);
+		return FALSE;
+	}
+
+	apply_sub_patterns (ce, new_segment, line,
+			    definition->u.start_end.start,
+			    SUB_PATTERN_WHERE_START);
+	*line_pos = match_end;
+	*new_state = new_segment;
+	ce->priv->hint2 = NULL;
+	context_unref (new_context);
+	return TRUE;
+}
+
+/**
+ * simple_context_starts_here:
+ *
+ * See child_starts_here().
+ */
+static gboolean
+simple_context_starts_here (GtkSourceContextEngine *ce,
+			    Segment                *state,
+			    DefinitionChild        *child_def,
+			    LineInfo               *line,
+			    gint                   *line_pos, /* bytes */
+			    Segment               **new_state)
+{
+	gint match_end;
+	Context *new_context;
+	ContextDefinition *definition = child_def->u.definition;
+
+	g_return_val_if_fail (definition->u.match != NULL, FALSE);
+
+	g_assert (*line_pos <= line->byte_length);
+
+	if (!regex_match (ce, definition->u.match, definition,
+			  line->text, line->byte_length, *line_pos))
+		return FALSE;
+
+	new_context = create_child_context (state->context, child_def, line->text);
+	g_return_val_if_fail (new_context != NULL, FALSE);
+
+	if (!can_apply_match (ce, new_context, line, *line_pos, &match_end, definition->u.match))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	/* If length of the match is zero, then we get zero-length segment and return to
+	 * the same state, so it's an infinite loop. But, if this child ends parent, we
+	 * do want to terminate parent. Still, if match is at the beginning of the parent
+	 * then we get an infinite loop again, so we check that (NOTE it really should destroy
+	 * parent context then, but then we again can get parent context be recreated here and
+	 * so on). */
+	if (*line_pos == match_end &&
+	    (!CONTEXT_ENDS_PARENT (new_context) ||
+		line_pos_to_offset (line, *line_pos) == state->start_at))
+	{
+		context_unref (new_context);
+		return FALSE;
+	}
+
+	g_assert (match_end <= line->byte_length);
+	segment_extend (state, line_pos_to_offset (line, match_end));
+
+	if (*line_pos != match_end)
+	{
+		/* Normal non-zero-length match, create a child segment */
+		Segment *new_segment;
+		new_segment = create_segment (ce, state, new_context,
+					      line_pos_to_offset (line, *line_pos),
+					      line_pos_to_offset (line, match_end),
+					      TRUE,
+					      ce->priv->hint2);
+		apply_sub_patterns (ce, new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
+		ce->priv->hint2 = new_segment;
+	}
+
+	/* Terminate parent if needed */
+	if (CONTEXT_ENDS_PARENT (new_context))
+	{
+		do
+		{
+			ce->priv->hint2 = state;
+			state = state->parent;
+		}
+		while (SEGMENT_ENDS_PARENT (state));
+	}
+
+	*line_pos = match_end;
+	*new_state = state;
+	context_unref (new_context);
+	return TRUE;
+}
+
+/**
+ * child_starts_here:
+ *
+ * @ce: the engine.
+ * @state: current state.
+ * @child_def: the child.
+ * @line: line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ * @new_state: where to store the new state.
+ *
+ * Verifies if a context of the type in @curr_definition starts at
+ * @line_pos in @line. If the contexts start here @new_state and
+ * @line_pos are updated.
+ *
+ * Returns: %TRUE if the context starts here.
+ */
+static gboolean
+child_starts_here (GtkSourceContextEngine *ce,
+		   Segment                *state,
+		   DefinitionChild        *child_def,
+		   LineInfo               *line,
+		   gint                   *line_pos,
+		   Segment               **new_state)
+{
+	g_return_val_if_fail (child_def->resolved, FALSE);
+
+	switch (child_def->u.definition->type)
+	{
+		case CONTEXT_TYPE_SIMPLE:
+			return simple_context_starts_here (ce,
+							   state,
+							   child_def,
+							   line,
+							   line_pos,
+							   new_state);
+		case CONTEXT_TYPE_CONTAINER:
+			return container_context_starts_here (ce,
+							      state,
+							      child_def,
+							      line,
+							      line_pos,
+							      new_state);
+		default:
+			g_return_val_if_reached (FALSE);
+	}
+}
+
+/**
+ * segment_ends_here:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: the segment.
+ * @line: analyzed line.
+ * @pos: the position inside @line, bytes.
+ *
+ * Checks whether given segment ends at pos. Unlike
+ * child_starts_here() it doesn't modify tree, it merely
+ * calls regex_match() for the end regex.
+ */
+static gboolean
+segment_ends_here (GtkSourceContextEngine *ce,
+		   Segment                *state,
+		   LineInfo               *line,
+		   gint                    pos)
+{
+	g_assert (SEGMENT_IS_CONTAINER (state));
+
+	return state->context->definition->u.start_end.end &&
+		regex_match (ce,
+			     state->context->end,
+			     state->context->definition,
+			     line->text,
+			     line->byte_length,
+			     pos);
+}
+
+/**
+ * ancestor_context_ends_here:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: current context.
+ * @line: the line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ *
+ * Verifies if some ancestor context ends at the current position.
+ * This function only checks conetxts and does not modify the tree,
+ * it's used by ancestor_ends_here().
+ *
+ * Returns: the ancestor context that terminates here or %NULL.
+ */
+static Context *
+ancestor_context_ends_here (GtkSourceContextEngine *ce,
+			    Context                *state,
+			    LineInfo               *line,
+			    gint                    line_pos)
+{
+	Context *current_context;
+	GSList *current_context_list;
+	GSList *check_ancestors;
+	Context *terminating_context;
+
+	/* A context can be terminated by the parent if extend_parent is
+	 * FALSE, so we need to verify the end of all the parents of
+	 * not-extending contexts. The list is ordered by ascending
+	 * depth. */
+	check_ancestors = NULL;
+	current_context = state;
+	while (ANCESTOR_CAN_END_CONTEXT (current_context))
+	{
+		if (!CONTEXT_EXTENDS_PARENT (current_context))
+			check_ancestors = g_slist_prepend (check_ancestors,
+							   current_context->parent);
+		current_context = current_context->parent;
+	}
+
+	/* The first context that ends here terminates its descendants. */
+	terminating_context = NULL;
+	current_context_list = check_ancestors;
+	while (current_context_list != NULL)
+	{
+		current_context = current_context_list->data;
+
+		if (current_context->end &&
+		    current_context->end->u.regex.regex &&
+		    regex_match (ce,
+				 current_context->end,
+				 current_context->definition,
+				 line->text,
+				 line->byte_length,
+				 line_pos))
+		{
+			terminating_context = current_context;
+			break;
+		}
+
+		current_context_list = current_context_list->next;
+	}
+	g_slist_free (check_ancestors);
+
+	return terminating_context;
+}
+
+/**
+ * ancestor_ends_here:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: current state.
+ * @line: the line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ * @new_state: where to store the new state.
+ *
+ * Verifies if some ancestor context ends at given position. If
+ * state changed and @new_state is not %NULL, then the new state is stored
+ * in @new_state, and descendants of @new_state are closed, so the
+ * terminating segment becomes current state.
+ *
+ * Returns: %TRUE if an ancestor ends at the given position.
+ */
+static gboolean
+ancestor_ends_here (GtkSourceContextEngine *ce,
+		    Segment                *state,
+		    LineInfo               *line,
+		    gint                    line_pos,
+		    Segment               **new_state)
+{
+	Context *terminating_context;
+
+	terminating_context = ancestor_context_ends_here (ce, state->context, line, line_pos);
+
+	if (new_state != NULL && terminating_context != NULL)
+	{
+		/* We have found a context that ends here, so we close
+		 * all the descendants. terminating_segment will be
+		 * closed by next next_segment() call from analyze_line. */
+		Segment *current_segment = state;
+
+		while (current_segment->context != terminating_context)
+			current_segment = current_segment->parent;
+
+		*new_state = current_segment;
+		g_assert (*new_state != NULL);
+	}
+
+	return terminating_context != NULL;
+}
+
+/**
+ * next_segment:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: current state.
+ * @line: analyzed line.
+ * @line_pos: position inside @line, bytes.
+ * @new_state: where to store the new state.
+ * @hint: child of @state used to optimize tree operations.
+ *
+ * Verifies if a context starts or ends in @line at @line_pos of after it.
+ * If the contexts starts or ends here @new_state and @line_pos are updated.
+ *
+ * Returns: %FALSE is there are no more contexts in @line.
+ */
+static gboolean
+next_segment (GtkSourceContextEngine  *ce,
+	      Segment                 *state,
+	      LineInfo                *line,
+	      gint                    *line_pos,
+	      Segment                **new_state)
+{
+	gint pos = *line_pos;
+
+	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	g_assert (pos <= line->byte_length);
+
+	while (pos <= line->byte_length)
+	{
+		DefinitionsIter def_iter;
+		gboolean context_end_found;
+		DefinitionChild *child_def;
+
+		if (state->context->reg_all)
+		{
+			if (!regex_prefilter_skip (state->context->reg_all,
+						   line->text,
+						   line->byte_length,
+						   &pos) ||
+			    !regex_match (ce, state->context->reg_all,
+					  state->context->definition,
+					  line->text,
+					  line->byte_length,
+					  pos))
+			{
+				return FALSE;
+			}
+
+			regex_fetch_pos_bytes (state->context->reg_all,
+					       0, &pos, NULL);
+		}
+
+		/* Does an ancestor end here? */
+		if (ANCESTOR_CAN_END_CONTEXT (state->context) &&
+		    ancestor_ends_here (ce, state, line, pos, new_state))
+		{
+			g_assert (pos <= line->byte_length);
+			segment_extend (state, line_pos_to_offset (line, pos));
+			*line_pos = pos;
+			return TRUE;
+		}
+
+		/* Does the current context end here? */
+		context_end_found = segment_ends_here (ce, state, line, pos);
+
+		/* Iter over the definitions we can find in the current
+		 * context. */
+		definition_iter_init (&def_iter, state->context->definition);
+		while ((child_def = definition_iter_next (&def_iter)) != NULL)
+		{
+			gboolean try_this = TRUE;
+
+			g_return_val_if_fail (child_def->resolved, FALSE);
+
+			/* If the child definition does not extend the parent
+			 * and the current context could end here we do not
+			 * need to examine this child. */
+			if (!HAS_OPTION (child_def->u.definition, EXTEND_PARENT) && context_end_found)
+				try_this = FALSE;
+
+			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) && line->start_at != 0)
+				try_this = FALSE;
+
+			if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
+			{
+				Segment *prev;
+
+				for (prev = state->children; prev != NULL; prev = prev->next)
+				{
+					if (prev->context != NULL &&
+					    prev->context->definition == child_def->u.definition)
+					{
+						try_this = FALSE;
+						break;
+					}
+				}
+			}
+
+			if (try_this)
+			{
+				/* Does this child definition start a new
+				 * context at the current position? */
+				if (child_starts_here (ce, state, child_def,
+						       line, &pos, new_state))
+				{
+					g_assert (pos <= line->byte_length);
+					*line_pos = pos;
+					definition_iter_destroy (&def_iter);
+					return TRUE;
+				}
+			}
+
+			/* This child does not start here, so we analyze
+			 * another definition. */
+		}
+		definition_iter_destroy (&def_iter);
+
+		if (context_end_found)
+		{
+			/* We have found that the current context could end
+			 * here and that it cannot be extended by a child.
+			 * Still, it may happen that parent context ends in
+			 * the middle of the end regex match, apply_match()
+			 * checks this. */
+			if (apply_match (ce, state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
+			{
+				g_assert (pos <= line->byte_length);
+
+				while (SEGMENT_ENDS_PARENT (state))
+					state = state->parent;
+
+				*new_state = state->parent;
+				ce->priv->hint2 = state;
+				*line_pos = pos;
+				return TRUE;
+			}
+		}
+
+		/* Nothing new at this position, go to next char. */
+		pos = g_utf8_next_char (line->text + pos) - line->text;
+	}
+
+	return FALSE;
+}
+
+/**
+ * check_line_end:
+ *
+ * @state: current state.
+ * @hint: child of @state used in analyze_line() and next_segment().
+ *
+ * Closes the contexts that cannot contain end of lines if needed.
+ * Updates hint if new state is different from @state.
+ *
+ * Returns: the new state.
+ */
+static Segment *
+check_line_end (GtkSourceContextEngine *ce,
+                Segment                *state)
+{
+	Segment *current_segment;
+	Segment *terminating_segment;
+
+	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+	/* A context can be terminated by the parent if extend_parent is
+	 * FALSE, so we need to verify the end of all the parents of
+	 * not-extending contexts. */
+	terminating_segment = NULL;
+	current_segment = state;
+
+	while (current_segment != NULL)
+	{
+		if (SEGMENT_END_AT_LINE_END (current_segment))
+			terminating_segment = current_segment;
+		else if (!ANCESTOR_CAN_END_CONTEXT(current_segment->context))
+			break;
+		current_segment = current_segment->parent;
+	}
+
+	if (terminating_segment != NULL)
 	{
 		ce->priv->hint2 = terminating_segment;
 		return terminating_segment->parent;
 	}
 	else
 	{
-		return state;
+		return state;
+	}
+}
+
+static void
+delete_zero_length_segments (GtkSourceContextEngine *ce,
+			     GList                  *list)
+{
+	while (list != NULL)
+	{
+		Segment *s = segment_sync (ce, list->data);
+
+		if (s->start_at == s->end_at)
+		{
+			GList *l;
+
+			for (l = list->next; l != NULL; )
+			{
+				GList *next = l->next;
+				Segment *s2 = l->data;
+				gboolean child = FALSE;
+
+				while (s2 != NULL)
+				{
+					if (s2 == s)
+					{
+						child = TRUE;
+						break;
+					}
+
+					s2 = s2->parent;
+				}
+
+				if (child)
+					list = g_list_delete_link (list, l);
+
+				l = next;
+			}
+
+			if (ce->priv->hint2 != NULL)
+			{
+				Segment *s2 = ce->priv->hint2;
+				gboolean child = FALSE;
+
+				while (s2 != NULL)
+				{
+					if (s2 == s)
+					{
+						child = TRUE;
+						break;
+					}
+
+					s2 = s2->parent;
+				}
+
+				if (child)
+					ce->priv->hint2 = s->parent;
+			}
+
+			segment_remove (ce, s);
+		}
+
+		list = g_list_delete_link (list, list);
+	}
+}
+
+/**
+ * analyze_line_from_:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @partial: the line, and the state and position to start at.
+ * @timer: timer of the time slice, or %NULL.
+ * @time: maximal duration of the time slice in milliseconds, or 0.
+ *
+ * Finds contexts at the line starting from @partial->line_pos and
+ * updates the syntax tree on it. If the time slice is over before the
+ * end of line, stops and saves in @partial where to go on from.
+ *
+ * Returns: %TRUE if the line is done, then @partial->state is the
+ * starting state at the next line; %FALSE if the analysis stopped in
+ * the middle of the line.
+ */
+static gboolean
+analyze_line_from_ (GtkSourceContextEngine *ce,
+		    PartialLine            *partial,
+		    GTimer                 *slice_timer,
+		    gint                    time)
+{
+	LineInfo *line = &partial->line;
+	Segment *state = partial->state;
+	gint line_pos = partial->line_pos;
+	GList *end_segments = partial->end_segments;
+	GTimer *timer;
+	GArray *slow_lines = ce->priv->slow_lines;
+	guint slow_index;
+	gboolean slow;
+
+	g_assert (SEGMENT_IS_CONTAINER (state));
+
+	slow_index = slow_line_lookup_ (slow_lines, line->start_at);
+	slow = slow_index < slow_lines->len &&
+	       g_array_index (slow_lines, SlowLine, slow_index).start_at == line->start_at &&
+	       g_array_index (slow_lines, SlowLine, slow_index).char_length == line->char_length;
+
+        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
+                ce->priv->hint2 = state->last_child;
+        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+	timer = g_timer_new ();
+
+	/* Find the contexts in the line, unless it's known to take
+	 * too long. */
+	while (!slow && line_pos <= line->byte_length)
+	{
+		Segment *new_state = NULL;
+
+		if (!next_segment (ce, state, line, &line_pos, &new_state))
+			break;
+
+		g_assert (new_state != NULL);
+		g_assert (SEGMENT_IS_CONTAINER (new_state));
+
+		state = new_state;
+
+                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
+                        ce->priv->hint2 = state->last_child;
+                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+
+		/* XXX this a temporary workaround for zero-length segments in the end
+		 * of line. there are no zero-length segments in the middle because it goes
+		 * into infinite loop in that case. */
+		/* state may be extended later, so not all elements of new_segments
+		 * really have zero length */
+		if (state->start_at == line->char_length)
+			end_segments = g_list_prepend (end_segments, state);
+
+		/* Don't let one line freeze the editor, give up on the rest
+		 * of it and go on with the next one. */
+		if ((partial->elapsed + g_timer_elapsed (timer, NULL)) * 1000 > MAX_TIME_FOR_ONE_LINE)
+		{
+			SlowLine slow_line;
+
+			slow_line.start_at = line->start_at;
+			slow_line.char_length = line->char_length;
+
+			/* A line known to be slow with another length is
+			 * the same line, it only changed. */
+			if (slow_index < slow_lines->len &&
+			    g_array_index (slow_lines, SlowLine, slow_index).start_at == line->start_at)
+				g_array_index (slow_lines, SlowLine, slow_index) = slow_line;
+			else
+				g_array_insert_val (slow_lines, slow_index, slow_line);
+
+			degraded_lines_add_ (ce->priv->degraded_lines, line->start_at);
+			break;
+		}
+
+		if (time != 0 && line_pos < line->byte_length &&
+		    g_timer_elapsed (slice_timer, NULL) * 1000 > time)
+		{
+			partial->elapsed += g_timer_elapsed (timer, NULL);
+			g_timer_destroy (timer);
+			partial->line_pos = line_pos;
+			partial->state = state;
+			partial->end_segments = end_segments;
+			return FALSE;
+		}
+	}
+
+	g_timer_destroy (timer);
+
+	/* Extend current state to the end of line. */
+	segment_extend (state, line->start_at + line->char_length);
+	g_assert (line_pos <= line->byte_length);
+
+	/* Verify if we need to close the context because we are at
+	 * the end of the line. */
+	if (ANCESTOR_CAN_END_CONTEXT (state->context) ||
+	    SEGMENT_END_AT_LINE_END (state))
+	{
+		state = check_line_end (ce, state);
+	}
+
+	/* Extend the segment to the beginning of next line. */
+	g_assert (SEGMENT_IS_CONTAINER (state));
+	segment_extend (state, NEXT_LINE_OFFSET (line));
+
+	/* if it's the last line, don't bother with zero length segments */
+	if (!line->eol_length)
+		g_list_free (end_segments);
+	else
+		delete_zero_length_segments (ce, end_segments);
+
+	CHECK_TREE (ce);
+
+	partial->line_pos = line_pos;
+	partial->state = state;
+	partial->end_segments = NULL;
+	return TRUE;
+}
+
+/**
+ * analyze_line:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @state: the state at the beginning of line.
+ * @line: the line.
+ *
+ * Finds contexts at the line and updates the syntax tree on it.
+ *
+ * Returns: starting state at the next line.
+ */
+static Segment *
+analyze_line (GtkSourceContextEngine *ce,
+	      Segment                *state,
+	      LineInfo               *line)
+{
+	PartialLine partial;
+
+	partial.line = *line;
+	partial.line_pos = 0;
+	partial.state = state;
+	partial.end_segments = NULL;
+	partial.elapsed = 0;
+
+	analyze_line_from_ (ce, &partial, NULL, 0);
+
+	return partial.state;
+}
+
+static void
+partial_line_free_ (PartialLine *partial)
+{
+	g_list_free (partial->end_segments);
+	g_free (partial->line.text);
+	g_slice_free (PartialLine, partial);
+}
+
+/**
+ * partial_line_drop:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @invalidate: whether the line must be analyzed again.
+ *
+ * Forgets about the partially analyzed line, if any. If @invalidate
+ * is %TRUE, the line is marked invalid; this must be done before the
+ * tree is modified, while the tree still matches the buffer.
+ */
+static void
+partial_line_drop (GtkSourceContextEngine *ce,
+		   gboolean                invalidate)
+{
+	PartialLine *partial = ce->priv->partial_line;
+
+	if (partial == NULL)
+		return;
+
+	ce->priv->partial_line = NULL;
+
+	if (invalidate)
+	{
+		g_assert (ce->priv->invalid_region.empty);
+		insert_range (ce, partial->line.start_at, 0);
+	}
+
+	partial_line_free_ (partial);
+}
+
+/**
+ * get_line_info_from_text:
+ *
+ * @text: text starting at the beginning of a line.
+ * @length: length of @text in bytes.
+ * @start_at: character offset of @text in the buffer.
+ * @line: #LineInfo structure to be filled.
+ *
+ * Finds line terminator in @text and fills @line structure.
+ * @line->text points inside @text.
+ *
+ * Returns: byte index of the next line in @text.
+ */
+static gint
+get_line_info_from_text (const gchar *text,
+			 gint         length,
+			 gint         start_at,
+			 LineInfo    *line)
+{
+	gint eol_index, next_line_index;
+
+	pango_find_paragraph_boundary (text, length,
+				       &eol_index,
+				       &next_line_index);
+
+	line->text = (gchar *) text;
+	line->start_at = start_at;
+	line->char_length = g_utf8_strlen (text, eol_index);
+	line->eol_length = g_utf8_strlen (text + eol_index, next_line_index - eol_index);
+	line->byte_length = eol_index;
+
+	return next_line_index;
+}
+
+/**
+ * line_chunk_init:
+ *
+ * @chunk: #LineChunk.
+ *
+ * Initializes empty @chunk.
+ */
+static void
+line_chunk_init (LineChunk *chunk)
+{
+	chunk->text = NULL;
+	chunk->byte_length = 0;
+	chunk->start_at = chunk->end_at = 0;
+	chunk->pos = chunk->pos_offset = 0;
+}
+
+/**
+ * line_chunk_destroy:
+ *
+ * @chunk: #LineChunk.
+ *
+ * Frees text held by @chunk. Lines taken out of it become invalid.
+ */
+static void
+line_chunk_destroy (LineChunk *chunk)
+{
+	g_free (chunk->text);
+	line_chunk_init (chunk);
+}
+
+/**
+ * line_chunk_fill:
+ *
+ * @chunk: #LineChunk.
+ * @buffer: #GtkTextBuffer.
+ * @line_start: iterator pointing to the beginning of line.
+ * @line_end: iterator pointing to the beginning of next line or to the end
+ * of this line if it's the last line in @buffer.
+ * @limit: offset after which text is not going to be needed.
+ *
+ * Fetches text of LINE_CHUNK_LINES lines starting at @line_start, but at
+ * least up to @line_end and at most up to @limit if it's further.
+ */
+static void
+line_chunk_fill (LineChunk         *chunk,
+		 GtkTextBuffer     *buffer,
+		 const GtkTextIter *line_start,
+		 const GtkTextIter *line_end,
+		 gint               limit)
+{
+	GtkTextIter chunk_end;
+
+	line_chunk_destroy (chunk);
+
+	chunk_end = *line_start;
+	gtk_text_iter_forward_lines (&chunk_end, LINE_CHUNK_LINES);
+
+	if (gtk_text_iter_get_offset (&chunk_end) > limit)
+		gtk_text_iter_set_offset (&chunk_end, limit);
+	if (gtk_text_iter_compare (&chunk_end, line_end) < 0)
+		chunk_end = *line_end;
+
+	chunk->text = gtk_text_buffer_get_slice (buffer, line_start, &chunk_end, TRUE);
+	chunk->byte_length = strlen (chunk->text);
+	chunk->start_at = gtk_text_iter_get_offset (line_start);
+	chunk->end_at = gtk_text_iter_get_offset (&chunk_end);
+	chunk->pos = 0;
+	chunk->pos_offset = chunk->start_at;
+}
+
+/**
+ * line_chunk_get_line:
+ *
+ * @chunk: #LineChunk.
+ * @buffer: #GtkTextBuffer.
+ * @line_start: iterator pointing to the beginning of line.
+ * @line_end: iterator pointing to the beginning of next line or to the end
+ * of this line if it's the last line in @buffer.
+ * @limit: offset after which text is not going to be needed.
+ * @line: #LineInfo structure to be filled.
+ *
+ * Fills @line structure with the line text taken from @chunk, and
+ * refills @chunk only when the line is not there. Lines are usually
+ * taken one after another, so the buffer is read once per
+ * LINE_CHUNK_LINES lines. @line->text points inside @chunk and is
+ * valid until @chunk is refilled or destroyed. The buffer must not change while @chunk is in use.
+ */
+static void
+line_chunk_get_line (LineChunk         *chunk,
+		     GtkTextBuffer     *buffer,
+		     const GtkTextIter *line_start,
+		     const GtkTextIter *line_end,
+		     gint               limit,
+		     LineInfo          *line)
+{
+	gint start_offset = gtk_text_iter_get_offset (line_start);
+	gint end_offset = gtk_text_iter_get_offset (line_end);
+
+	g_assert (start_offset < end_offset);
+
+	if (chunk->text == NULL ||
+	    start_offset < chunk->pos_offset ||
+	    end_offset > chunk->end_at)
+	{
+		line_chunk_fill (chunk, buffer, line_start, line_end, limit);
+	}
+	else if (start_offset > chunk->pos_offset)
+	{
+		/* Skipped some lines, e.g. the rest of a region which
+		 * did not need to be analyzed again. */
+		const gchar *p = chunk->text + chunk->pos;
+		p = g_utf8_offset_to_pointer (p, start_offset - chunk->pos_offset);
+		chunk->pos = p - chunk->text;
+		chunk->pos_offset = start_offset;
+	}
+
+	chunk->pos += get_line_info_from_text (chunk->text + chunk->pos,
+					       chunk->byte_length - chunk->pos,
+					       start_offset,
+					       line);
+	chunk->pos_offset = NEXT_LINE_OFFSET (line);
+
+	g_assert (chunk->pos_offset == end_offset);
+}
+
+/**
+ * segment_tree_zero_len:
+ *
+ * @ce: #GtkSoucreContextEngine.
+ *
+ * Erases syntax tree and sets root segment length to zero.
+ * It's a shortcut for case when all the text is deleted from
+ * the buffer.
+ */
+static void
+segment_tree_zero_len (GtkSourceContextEngine *ce)
+{
+	Segment *root = segment_sync (ce, ce->priv->root_segment);
+	segment_destroy_children (ce, root);
+	root->start_at = root->end_at = 0;
+	CHECK_TREE (ce);
+}
+
+#ifdef ENABLE_CHECK_TREE
+static Segment *
+get_segment_at_offset_slow_ (GtkSourceContextEngine *ce,
+			     Segment                *segment,
+			     gint                    offset)
+{
+	Segment *child;
+
+start:
+	segment_sync (ce, segment);
+
+	if (segment->parent == NULL && offset == segment->end_at)
+		return segment;
+
+	if (segment->start_at > offset)
+	{
+		g_assert (segment->parent != NULL);
+		segment = segment->parent;
+		goto start;
+	}
+
+	if (segment->start_at == offset)
+	{
+		if (segment->children != NULL && segment_sync (ce, segment->children)->start_at == offset)
+		{
+			segment = segment->children;
+			goto start;
+		}
+
+		return segment;
+	}
+
+        if (segment->end_at <= offset && segment->parent != NULL)
+	{
+		if (segment->next != NULL)
+		{
+			if (segment_sync (ce, segment->next)->start_at > offset)
+				return segment->parent;
+
+			segment = segment->next;
+		}
+		else
+		{
+			segment = segment->parent;
+		}
+
+		goto start;
+	}
+
+	for (child = segment->children; child != NULL; child = child->next)
+	{
+		if (segment_sync (ce, child)->start_at == offset)
+		{
+			segment = child;
+			goto start;
+		}
+
+		if (child->end_at <= offset)
+			continue;
+
+		if (child->start_at > offset)
+			break;
+
+		segment = child;
+		goto start;
+	}
+
+	return segment;
+}
+#endif /* ENABLE_CHECK_TREE */
+
+/* These sync the segment, so they can be used on any segment. */
+#define SEGMENT_IS_ZERO_LEN_AT(s,o) (segment_sync (ce, s)->start_at == (o) && (s)->end_at == (o))
+#define SEGMENT_CONTAINS(s,o) (segment_sync (ce, s)->start_at <= (o) && (s)->end_at > (o))
+#define SEGMENT_DISTANCE(s,o) (MIN (ABS (segment_sync (ce, s)->start_at - (o)), ABS ((s)->end_at - (o))))
+static Segment *
+get_segment_in_ (GtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    offset)
+{
+	Segment *child;
+
+	g_assert (segment->start_at <= offset && segment->end_at > offset);
+
+	if (segment->children == NULL)
+		return segment;
+
+	if (segment->children == segment->last_child)
+	{
+		if (SEGMENT_IS_ZERO_LEN_AT (segment->children, offset))
+			return segment->children;
+
+		if (SEGMENT_CONTAINS (segment->children, offset))
+			return get_segment_in_ (ce, segment->children, offset);
+
+		return segment;
+	}
+
+	if (segment_sync (ce, segment->children)->start_at > offset ||
+	    segment_sync (ce, segment->last_child)->end_at < offset)
+		return segment;
+
+	if (SEGMENT_DISTANCE (segment->children, offset) >= SEGMENT_DISTANCE (segment->last_child, offset))
+	{
+		for (child = segment->children; child; child = child->next)
+		{
+			if (segment_sync (ce, child)->start_at > offset)
+				return segment;
+
+			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
+				return child;
+
+			if (SEGMENT_CONTAINS (child, offset))
+				return get_segment_in_ (ce, child, offset);
+		}
+	}
+	else
+	{
+		for (child = segment->last_child; child; child = child->prev)
+		{
+			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
+			{
+				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (child->prev, offset))
+					child = child->prev;
+				return child;
+			}
+
+			if (child->end_at <= offset)
+				return segment;
+
+			if (SEGMENT_CONTAINS (child, offset))
+				return get_segment_in_ (ce, child, offset);
+		}
+	}
+
+	return segment;
+}
+
+/* assumes zero-length segments can't have children */
+static Segment *
+get_segment_ (GtkSourceContextEngine *ce,
+	      Segment                *segment,
+	      gint                    offset)
+{
+	segment_sync (ce, segment);
+
+	if (segment->parent != NULL)
+	{
+		if (!SEGMENT_CONTAINS (segment->parent, offset))
+			return get_segment_ (ce, segment->parent, offset);
+	}
+	else
+	{
+		g_assert (offset >= segment->start_at);
+		g_assert (offset <= segment->end_at);
+	}
+
+	if (SEGMENT_CONTAINS (segment, offset))
+		return get_segment_in_ (ce, segment, offset);
+
+	if (SEGMENT_IS_ZERO_LEN_AT (segment, offset))
+	{
+		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+			segment = segment->prev;
+		return segment;
+	}
+
+	if (offset < segment->start_at)
+	{
+		while (segment->prev != NULL && segment_sync (ce, segment->prev)->start_at > offset)
+			segment = segment->prev;
+
+		g_assert (!segment->prev || segment->prev->start_at <= offset);
+
+		if (segment->prev == NULL)
+			return segment->parent;
+
+		if (segment_sync (ce, segment->prev)->end_at > offset)
+			return get_segment_in_ (ce, segment->prev, offset);
+
+		if (segment->prev->end_at == offset)
+		{
+			if (SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+			{
+				segment = segment->prev;
+				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+					segment = segment->prev;
+				return segment;
+			}
+
+			return segment->parent;
+		}
+
+		/* segment->prev->end_at < offset */
+		return segment->parent;
+	}
+
+	/* offset >= segment->end_at, not zero-length */
+
+	while (segment->next != NULL)
+	{
+		if (SEGMENT_IS_ZERO_LEN_AT (segment->next, offset))
+			return segment->next;
+
+		if (segment->next->end_at > offset)
+		{
+			if (segment->next->start_at <= offset)
+				return get_segment_in_ (ce, segment->next, offset);
+			else
+				return segment->parent;
+		}
+
+		segment = segment->next;
+	}
+
+	return segment->parent;
+}
+#undef SEGMENT_IS_ZERO_LEN_AT
+#undef SEGMENT_CONTAINS
+#undef SEGMENT_DISTANCE
+
+/**
+ * get_segment_at_offset:
+ *
+ * @ce: #GtkSoucreContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: the offset, characters.
+ *
+ * Finds the deepest segment "at @offset".
+ * More precisely, it returns toplevel segment if
+ * @offset is equal to length of buffer; or non-zero-length
+ * segment which contains character at @offset; or zero-length
+ * segment at @offset. In case when there are several zero-length
+ * segments, it returns the first one.
+ */
+static Segment *
+get_segment_at_offset (GtkSourceContextEngine *ce,
+		       Segment                *hint,
+		       gint                    offset)
+{
+	Segment *result;
+
+	if (offset == segment_sync (ce, ce->priv->root_segment)->end_at)
+		return ce->priv->root_segment;
+
+#ifdef ENABLE_DEBUG
+	/* if you see this message (often), then something is
+	 * wrong with the hints business, i.e. optimizations
+	 * do not work quite like they should */
+	if (hint == NULL || hint == ce->priv->root_segment)
+	{
+		static int c;
+		g_print ("searching from root %d\n", ++c);
+	}
+#endif
+
+	result = get_segment_ (ce, hint ? hint : ce->priv->root_segment, offset);
+
+#ifdef ENABLE_CHECK_TREE
+	g_assert (result == get_segment_at_offset_slow_ (ce, hint, offset));
+#endif
+
+	return result;
+}
+
+/**
+ * segment_remove:
+ *
+ * @ce: #GtkSoucreContextEngine.
+ * @segment: segment to remove.
+ *
+ * Removes the segment from syntax tree and frees it.
+ * It correctly updates parent's children list, not
+ * like segment_destroy() where caller has to take care
+ * of tree integrity.
+ */
+static void
+segment_remove (GtkSourceContextEngine *ce,
+		Segment                *segment)
+{
+	if (segment->next != NULL)
+		segment->next->prev = segment->prev;
+	else
+		segment->parent->last_child = segment->prev;
+
+	if (segment->prev != NULL)
+		segment->prev->next = segment->next;
+	else
+		segment->parent->children = segment->next;
+
+	/* if ce->priv->hint is being deleted, set it to some
+	 * neighbour segment */
+	if (ce->priv->hint == segment)
+	{
+		if (segment->next != NULL)
+			ce->priv->hint = segment->next;
+		else if (segment->prev != NULL)
+			ce->priv->hint = segment->prev;
+		else
+			ce->priv->hint = segment->parent;
+	}
+
+        /* if ce->priv->hint2 is being deleted, set it to some
+         * neighbour segment */
+        if (ce->priv->hint2 == segment)
+        {
+                if (segment->next != NULL)
+                        ce->priv->hint2 = segment->next;
+                else if (segment->prev != NULL)
+                        ce->priv->hint2 = segment->prev;
+                else
+                        ce->priv->hint2 = segment->parent;
+        }
+
+	segment_destroy (ce, segment);
+}
+
+static void
+segment_erase_middle_ (GtkSourceContextEngine *ce,
+		       Segment                *segment,
+		       gint                    start,
+		       gint                    end)
+{
+	Segment *new_segment, *child;
+	SubPattern *sp;
+
+	new_segment = segment_new (ce,
+				   segment->parent,
+				   segment->context,
+				   end,
+				   segment->end_at,
+				   FALSE);
+	segment->end_at = start;
+
+	new_segment->next = segment->next;
+	segment->next = new_segment;
+	new_segment->prev = segment;
+
+	if (new_segment->next != NULL)
+		new_segment->next->prev = new_segment;
+	else
+		new_segment->parent->last_child = new_segment;
+
+	child = segment->children;
+	segment->children = NULL;
+	segment->last_child = NULL;
+
+	while (child != NULL)
+	{
+		Segment *append_to;
+		Segment *next = child->next;
+
+		segment_sync (ce, child);
+
+		if (child->start_at < start)
+		{
+			g_assert (child->end_at <= start);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (child->start_at >= end);
+			append_to = new_segment;
+		}
+
+		child->parent = append_to;
+
+		if (append_to->last_child != NULL)
+		{
+			append_to->last_child->next = child;
+			child->prev = append_to->last_child;
+			child->next = NULL;
+			append_to->last_child = child;
+		}
+		else
+		{
+			child->next = child->prev = NULL;
+			append_to->last_child = child;
+			append_to->children = child;
+		}
+
+		child = next;
+	}
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		Segment *append_to;
+
+		if (sp->start_at < start)
+		{
+			sp->end_at = MIN (sp->end_at, start);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (sp->end_at > end);
+			sp->start_at = MAX (sp->start_at, end);
+			append_to = new_segment;
+		}
+
+		sp->next = append_to->sub_patterns;
+		append_to->sub_patterns = sp;
+
+		sp = next;
+	}
+
+	CHECK_SEGMENT_CHILDREN (segment);
+	CHECK_SEGMENT_CHILDREN (new_segment);
+}
+
+/**
+ * segment_erase_range_:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @segment: the segment.
+ * @start: start offset of range to erase, characters.
+ * @end: end offset of range to erase, characters.
+ *
+ * Recurisvely removes segments from [@start, @end] interval
+ * starting from @segment. If @segment belongs to the range,
+ * or it's a zero-length segment at @end offset, and it's not
+ * the toplevel segment, then it's removed from the tree.
+ * If @segment intersects with the range (unless it's the toplevel
+ * segment), then its ends are adjusted appropriately, and it's
+ * split into two if it completely contains the range.
+ */
+static void
+segment_erase_range_ (GtkSourceContextEngine *ce,
+		      Segment                *segment,
+		      gint                    start,
+		      gint                    end)
+{
+	g_assert (start < end);
+
+	segment_sync (ce, segment);
+
+	if (segment->start_at == segment->end_at)
+	{
+		if (segment->start_at >= start && segment->start_at <= end)
+			segment_remove (ce, segment);
+		return;
+	}
+
+	if (segment->start_at > end || segment->end_at < start)
+		return;
+
+	if (segment->start_at >= start && segment->end_at <= end && segment->parent)
+	{
+		segment_remove (ce, segment);
+		return;
+	}
+
+	if (segment->start_at == end)
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL && segment_sync (ce, child)->start_at == end)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+	else if (segment->end_at == start)
+	{
+		Segment *child = segment->last_child;
+
+		while (child != NULL && segment_sync (ce, child)->end_at == start)
+		{
+			Segment *prev = child->prev;
+			segment_erase_range_ (ce, child, start, end);
+			child = prev;
+		}
+	}
+	else
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+
+	if (segment->sub_patterns != NULL)
+	{
+		SubPattern *sp;
+
+		sp = segment->sub_patterns;
+		segment->sub_patterns = NULL;
+
+		while (sp != NULL)
+		{
+			SubPattern *next = sp->next;
+
+			if (sp->start_at >= start && sp->end_at <= end)
+				sub_pattern_free (ce, sp);
+			else
+				segment_add_subpattern (segment, sp);
+
+			sp = next;
+		}
+	}
+
+	if (segment->parent != NULL)
+	{
+		/* Now all children and subpatterns are cleaned up,
+		 * so we only need to split segment properly if its middle
+		 * was erased. Otherwise, only ends need to be adjusted. */
+		if (segment->start_at < start && segment->end_at > end)
+		{
+			segment_erase_middle_ (ce, segment, start, end);
+		}
+		else
+		{
+			g_assert ((segment->start_at >= start && segment->end_at > end) ||
+				  (segment->start_at < start && segment->end_at <= end));
+
+			if (segment->end_at > end)
+			{
+				/* If we erase the beginning, we need to clear
+				 * is_start flag. */
+				segment->start_at = end;
+				segment->is_start = FALSE;
+			}
+			else
+			{
+				segment->end_at = start;
+			}
+		}
+	}
+}
+
+/**
+ * segment_merge:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @first: first segment.
+ * @second: second segment.
+ *
+ * Merges adjacent segments @first and @second given
+ * their contexts are equal.
+ */
+static void
+segment_merge (GtkSourceContextEngine *ce,
+	       Segment                *first,
+	       Segment                *second)
+{
+	Segment *parent;
+
+	if (first == second)
+		return;
+
+	segment_sync (ce, first);
+	segment_sync (ce, second);
+
+	g_assert (!SEGMENT_IS_INVALID (first));
+	g_assert (first->context == second->context);
+	g_assert (first->end_at == second->start_at);
+
+	if (first->parent != second->parent)
+		segment_merge (ce, first->parent, second->parent);
+
+	parent = first->parent;
+
+	g_assert (first->next == second);
+	g_assert (first->parent == second->parent);
+	g_assert (second != parent->children);
+
+	if (second == parent->last_child)
+		parent->last_child = first;
+	first->next = second->next;
+	if (second->next != NULL)
+		second->next->prev = first;
+
+	first->end_at = second->end_at;
+
+	if (second->children != NULL)
+	{
+		Segment *child;
+
+		for (child = second->children; child != NULL; child = child->next)
+			child->parent = first;
+
+		if (first->children == NULL)
+		{
+			g_assert (!first->last_child);
+			first->children = second->children;
+			first->last_child = second->last_child;
+		}
+		else
+		{
+			first->last_child->next = second->children;
+			second->children->prev = first->last_child;
+			first->last_child = second->last_child;
+		}
+	}
+
+	if (second->sub_patterns != NULL)
+	{
+		if (first->sub_patterns == NULL)
+		{
+			first->sub_patterns = second->sub_patterns;
+		}
+		else
+		{
+			while (second->sub_patterns != NULL)
+			{
+				SubPattern *sp = second->sub_patterns;
+				second->sub_patterns = sp->next;
+				sp->next = first->sub_patterns;
+				first->sub_patterns = sp;
+			}
+		}
+	}
+
+	second->children = NULL;
+	second->last_child = NULL;
+	second->sub_patterns = NULL;
+
+	segment_destroy (ce, second);
+}
+
+/**
+ * erase_segments:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @start: start offset of region to erase, characters.
+ * @end: end offset of region to erase, characters.
+ * @hint: segment around @start to make it faster.
+ *
+ * Erases all non-toplevel segments in the interval
+ * [@start, @end]. Its action on the tree is roughly
+ * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
+ * (but that does not accept toplevel segment).
+ */
+static void
+erase_segments (GtkSourceContextEngine *ce,
+		gint                    start,
+		gint                    end,
+		Segment                *hint)
+{
+	Segment *root = ce->priv->root_segment;
+	Segment *child, *hint_prev;
+
+	if (root->children == NULL)
+		return;
+
+	if (hint == NULL)
+		hint = get_hint (ce, start);
+
+	if (hint != NULL)
+		while (hint != NULL && hint->parent != ce->priv->root_segment)
+			hint = hint->parent;
+
+	if (hint == NULL)
+		hint = root->children;
+
+	hint_prev = hint->prev;
+
+	child = hint;
+	while (child != NULL)
+	{
+		Segment *next = child->next;
+
+		segment_sync (ce, child);
+
+		if (child->end_at < start)
+		{
+			child = next;
+
+			if (next != NULL)
+				ce->priv->hint = next;
+
+			continue;
+		}
+
+		if (child->start_at > end)
+		{
+			ce->priv->hint = child;
+			break;
+		}
+
+		segment_erase_range_ (ce, child, start, end);
+		child = next;
 	}
-}
 
-static void
-delete_zero_length_segments (GtkSourceContextEngine *ce,
-			     GList                  *list)
-{
-	while (list != NULL)
+	child = hint_prev;
+	while (child != NULL)
 	{
-		Segment *s = list->data;
+		Segment *prev = child->prev;
 
-		if (s->start_at == s->end_at)
-		{
-			GList *l;
+		if (ce->priv->hint == NULL)
+			ce->priv->hint = child;
 
-			for (l = list->next; l != NULL; )
-			{
-				GList *next = l->next;
-				Segment *s2 = l->data;
-				gboolean child = FALSE;
+		if (segment_sync (ce, child)->start_at > end)
+		{
+			child = prev;
+			continue;
+		}
 
-				while (s2 != NULL)
-				{
-					if (s2 == s)
-					{
-						child = TRUE;
-						break;
-					}
+		if (child->end_at < start)
+		{
+			break;
+		}
 
-					s2 = s2->parent;
-				}
+		segment_erase_range_ (ce, child, start, end);
+		child = prev;
+	}
 
-				if (child)
-					list = g_list_delete_link (list, l);
+	CHECK_TREE (ce);
+}
 
-				l = next;
-			}
+#define IS_BOM(c) (c == 0xFEFF)
 
-			if (ce->priv->hint2 != NULL)
-			{
-				Segment *s2 = ce->priv->hint2;
-				gboolean child = FALSE;
+/**
+ * emit_degraded_lines:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Emits GtkSourceBuffer::highlight-degraded for the lines
+ * analyze_line() gave up on since the last call.
+ */
+static void
+emit_degraded_lines (GtkSourceContextEngine *ce)
+{
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	GArray *lines;
+	guint i;
 
-				while (s2 != NULL)
-				{
-					if (s2 == s)
-					{
-						child = TRUE;
-						break;
-					}
+	if (ce->priv->degraded_lines->len == 0)
+		return;
 
-					s2 = s2->parent;
-				}
+	/* Signal handlers may modify the buffer. */
+	lines = ce->priv->degraded_lines;
+	ce->priv->degraded_lines = g_array_new (FALSE, FALSE, sizeof (gint));
 
-				if (child)
-					ce->priv->hint2 = s->parent;
-			}
+	for (i = 0; i < lines->len; ++i)
+	{
+		GtkTextIter start, end;
+		gint offset;
 
-			segment_remove (ce, s);
-		}
+		offset = MIN (g_array_index (lines, gint, i),
+			      gtk_text_buffer_get_char_count (buffer));
+		gtk_text_buffer_get_iter_at_offset (buffer, &start, offset);
+		gtk_text_iter_set_line_offset (&start, 0);
+		end = start;
+		if (!gtk_text_iter_ends_line (&end))
+			gtk_text_iter_forward_to_line_end (&end);
 
-		list = g_list_delete_link (list, list);
+		g_signal_emit_by_name (buffer, "highlight-degraded", &start, &end);
 	}
+
+	g_array_free (lines, TRUE);
 }
 
 /**
- * analyze_line:
+ * update_syntax:
  *
  * @ce: #GtkSourceContextEngine.
- * @state: the state at the beginning of line.
- * @line: the line.
- * @hint: a child of @state around start of line, to make it faster.
- *
- * Finds contexts at the line and updates the syntax tree on it.
+ * @end: desired end of region to analyze or %NULL.
+ * @time: maximal amount of time in milliseconds allowed to spend here
+ * or 0 for 'unlimited'.
  *
- * Returns: starting state at the next line.
+ * Updates syntax tree. If @end is not %NULL, then it analyzes
+ * (reanalyzes invalid areas in) region from start of buffer
+ * to @end. Otherwise, it analyzes batch of text starting at
+ * first invalid line.
+ * In order to avoid blocking ui it uses a timer and stops
+ * when time elapsed is greater than @time, so analyzed region is
+ * not necessarily what's requested (unless @time is 0). It may stop
+ * in the middle of a line, see PartialLine.
  */
-static Segment *
-analyze_line (GtkSourceContextEngine *ce,
-	      Segment                *state,
-	      LineInfo               *line)
+/* XXX it must be refactored. */
+static void
+update_syntax (GtkSourceContextEngine *ce,
+	       const GtkTextIter      *end,
+	       gint                    time)
 {
-	gint line_pos = 0;
-	GList *end_segments = NULL;
+	GtkTextBuffer *buffer;
+	GtkTextIter start_iter, end_iter;
+	GtkTextIter line_start, line_end;
+	Segment *state;
+	Segment *invalid;
+	gint invalid_start;
+	gint start_offset, end_offset;
+	gint line_start_offset, line_end_offset;
+	gint analyzed_end;
+	gboolean first_line = FALSE;
+	guint n_lines = 0;
 	GTimer *timer;
+	LineChunk chunk;
 
-	g_assert (SEGMENT_IS_CONTAINER (state));
+	buffer = ce->priv->buffer;
+	state = ce->priv->root_segment;
 
-        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                ce->priv->hint2 = state->last_child;
-        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	context_freeze (ce->priv->root_context);
+	update_tree (ce);
 
-	timer = g_timer_new ();
+	/* The buffer doesn't change until we are done, so the root
+	 * stays in sync, and so do segments synced below. */
+	segment_sync (ce, ce->priv->root_segment);
 
-	/* Find the contexts in the line. */
-	while (line_pos <= line->byte_length)
+	if (!gtk_text_buffer_get_char_count (buffer))
 	{
-		Segment *new_state = NULL;
+		segment_tree_zero_len (ce);
+		goto out;
+	}
 
-		if (!next_segment (ce, state, line, &line_pos, &new_state))
-			break;
+	invalid = get_invalid_segment (ce);
 
-		if (g_timer_elapsed (timer, NULL) * 1000 > MAX_TIME_FOR_ONE_LINE)
-		{
-			g_critical ("%s",
-			            _("Highlighting a single line took too much time, "
-				      "syntax highlighting will be disabled"));
-			disable_highlighting (ce);
-			break;
-		}
+	if (ce->priv->partial_line != NULL)
+		invalid_start = ce->priv->partial_line->line.start_at;
+	else if (invalid != NULL)
+		invalid_start = invalid->start_at;
+	else
+		goto out;
 
-		g_assert (new_state != NULL);
-		g_assert (SEGMENT_IS_CONTAINER (new_state));
+	if (end != NULL && invalid_start >= gtk_text_iter_get_offset (end))
+		goto out;
 
-		state = new_state;
+	if (end != NULL)
+	{
+		end_offset = gtk_text_iter_get_offset (end);
+		start_offset = MIN (end_offset, invalid_start);
+	}
+	else
+	{
+		start_offset = invalid_start;
+		end_offset = gtk_text_buffer_get_char_count (buffer);
+	}
 
-                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                        ce->priv->hint2 = state->last_child;
-                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+	gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
+	gtk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
 
-		/* XXX this a temporary workaround for zero-length segments in the end
-		 * of line. there are no zero-length segments in the middle because it goes
-		 * into infinite loop in that case. */
-		/* state may be extended later, so not all elements of new_segments
-		 * really have zero length */
-		if (state->start_at == line->char_length)
-			end_segments = g_list_prepend (end_segments, state);
+	if (!gtk_text_iter_starts_line (&start_iter))
+	{
+		gtk_text_iter_set_line_offset (&start_iter, 0);
+		start_offset = gtk_text_iter_get_offset (&start_iter);
 	}
 
-	g_timer_destroy (timer);
-	if (ce->priv->disabled)
-		return NULL;
+	if (!gtk_text_iter_starts_line (&end_iter))
+	{
+		gtk_text_iter_forward_line (&end_iter);
+		end_offset = gtk_text_iter_get_offset (&end_iter);
+	}
 
-	/* Extend current state to the end of line. */
-	segment_extend (state, line->start_at + line->char_length);
-	g_assert (line_pos <= line->byte_length);
+	if (0 == start_offset)
+	{
+		first_line = TRUE;
 
-	/* Verify if we need to close the context because we are at
-	 * the end of the line. */
-	if (ANCESTOR_CAN_END_CONTEXT (state->context) ||
-	    SEGMENT_END_AT_LINE_END (state))
+		/* If it is the first line and it starts with BOM, skip it
+		 * since regexes in lang files do not take it into account */
+		gunichar c = gtk_text_iter_get_char (&start_iter);
+		if (IS_BOM (c))
+		{
+			gtk_text_iter_forward_char (&start_iter);
+			start_offset = gtk_text_iter_get_offset (&start_iter);
+		}
+	}
+
+	/* This happens after deleting all text on last line. */
+	if (start_offset == end_offset)
 	{
-		state = check_line_end (ce, state);
+		g_assert (end_offset == gtk_text_buffer_get_char_count (buffer));
+		g_assert (g_slist_length (ce->priv->invalid) == 1);
+		segment_remove (ce, invalid);
+		CHECK_TREE (ce);
+		goto out;
 	}
 
-	/* Extend the segment to the beginning of next line. */
-	g_assert (SEGMENT_IS_CONTAINER (state));
-	segment_extend (state, NEXT_LINE_OFFSET (line));
 
-	/* if it's the last line, don't bother with zero length segments */
-	if (!line->eol_length)
-		g_list_free (end_segments);
-	else
-		delete_zero_length_segments (ce, end_segments);
+	/* Main loop */
 
-	CHECK_TREE (ce);
+	line_start = start_iter;
+	line_start_offset = start_offset;
+	line_end = line_start;
+	gtk_text_iter_forward_line (&line_end);
+	line_end_offset = gtk_text_iter_get_offset (&line_end);
+	analyzed_end = line_end_offset;
 
-	return state;
-}
+	line_chunk_init (&chunk);
+	timer = g_timer_new ();
 
-/**
- * get_line_info:
- *
- * @buffer: #GtkTextBuffer.
- * @line_start: iterator pointing to the beginning of line.
- * @line_end: iterator pointing to the beginning of next line or to the end
- * of this line if it's the last line in @buffer.
- * @line: #LineInfo structure to be filled.
- *
- * Retrieves line text from the buffer, finds line terminator and fills
- * @line structure.
- */
-static void
-get_line_info (GtkTextBuffer     *buffer,
-	       const GtkTextIter *line_start,
-	       const GtkTextIter *line_end,
-	       LineInfo          *line)
-{
-	g_assert (!gtk_text_iter_equal (line_start, line_end));
+	while (TRUE)
+	{
+		PartialLine line, *partial;
+		gboolean next_line_invalid = FALSE;
+		gboolean need_invalidate_next = FALSE;
+
+		/* Last buffer line. */
+		if (line_start_offset == line_end_offset)
+		{
+			g_assert (line_start_offset == gtk_text_buffer_get_char_count (buffer));
+			break;
+		}
+
+		if (ce->priv->partial_line != NULL)
+		{
+			/* Go on with the line analyzed in the previous slice. */
+			partial = ce->priv->partial_line;
+			ce->priv->partial_line = NULL;
+			g_assert (partial->line.start_at == line_start_offset);
+		}
+		else
+		{
+			/* Analyze the line */
+			erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
+			line_chunk_get_line (&chunk, buffer, &line_start, &line_end,
+					     end_offset, &line.line);
+
+#ifdef ENABLE_CHECK_TREE
+			{
+				Segment *inv = get_invalid_segment (ce);
+				g_assert (inv == NULL || inv->start_at >= line_end_offset);
+			}
+#endif
+
+			if (first_line)
+			{
+				state = ce->priv->root_segment;
+			}
+			else
+			{
+				Segment *hint = checkpoint_get_state (ce, line_start_offset);
+
+				if (hint == NULL)
+					hint = get_hint (ce, line_start_offset - 1);
 
-	line->text = gtk_text_buffer_get_slice (buffer, line_start, line_end, TRUE);
-	line->start_at = gtk_text_iter_get_offset (line_start);
+				state = get_segment_at_offset (ce,
+							       hint ? hint : state,
+							       line_start_offset - 1);
+			}
 
-	if (!gtk_text_iter_starts_line (line_end))
-	{
-		line->eol_length = 0;
-		line->char_length = g_utf8_strlen (line->text, -1);
-		line->byte_length = strlen (line->text);
-	}
-	else
-	{
-		gint eol_index, next_line_index;
+			g_assert (state->context != NULL);
 
-		pango_find_paragraph_boundary (line->text, -1,
-					       &eol_index,
-					       &next_line_index);
+			ce->priv->hint2 = ce->priv->hint;
 
-		g_assert (eol_index < next_line_index);
+			if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
+				ce->priv->hint2 = NULL;
 
-		line->char_length = g_utf8_strlen (line->text, eol_index);
-		line->eol_length = g_utf8_strlen (line->text + eol_index, -1);
-		line->byte_length = eol_index;
-	}
+			partial = &line;
+			partial->line_pos = 0;
+			partial->state = state;
+			partial->end_segments = NULL;
+			partial->elapsed = 0;
+		}
 
-	g_assert (gtk_text_iter_get_offset (line_end) ==
-			line->start_at + line->char_length + line->eol_length);
-}
+		if (!analyze_line_from_ (ce, partial, timer, time))
+		{
+			/* The time is over in the middle of a long line. The
+			 * text is kept, the chunk may be refilled before the
+			 * line is done. */
+			if (partial == &line)
+			{
+				partial = g_slice_dup (PartialLine, &line);
+				partial->line.text = g_strndup (line.line.text,
+								line.line.byte_length);
+			}
 
-/**
- * line_info_destroy:
- *
- * @line: #LineInfo.
- *
- * Destroys data allocated by get_line_info().
- */
-static void
-line_info_destroy (LineInfo *line)
-{
-	g_free (line->text);
-}
+			ce->priv->partial_line = partial;
+			analyzed_end = line_start_offset;
+			break;
+		}
 
-/**
- * segment_tree_zero_len:
- *
- * @ce: #GtkSoucreContextEngine.
- *
- * Erases syntax tree and sets root segment length to zero.
- * It's a shortcut for case when all the text is deleted from
- * the buffer.
- */
-static void
-segment_tree_zero_len (GtkSourceContextEngine *ce)
-{
-	Segment *root = ce->priv->root_segment;
-	segment_destroy_children (ce, root);
-	root->start_at = root->end_at = 0;
-	CHECK_TREE (ce);
-}
+		state = partial->state;
+		n_lines++;
+
+		if (partial != &line)
+			partial_line_free_ (partial);
 
 #ifdef ENABLE_CHECK_TREE
-static Segment *
-get_segment_at_offset_slow_ (Segment *segment,
-			     gint     offset)
-{
-	Segment *child;
+		{
+			Segment *inv = get_invalid_segment (ce);
+			g_assert (inv == NULL || inv->start_at >= line_end_offset);
+		}
+#endif
 
-start:
-	if (segment->parent == NULL && offset == segment->end_at)
-		return segment;
+		/* XXX this is wrong */
+		/* I don't know anymore why it's wrong, I guess it means
+		 * "may be inefficient" */
+		if (ce->priv->hint2 != NULL)
+			ce->priv->hint = ce->priv->hint2;
+		else
+			ce->priv->hint = state;
 
-	if (segment->start_at > offset)
-	{
-		g_assert (segment->parent != NULL);
-		segment = segment->parent;
-		goto start;
-	}
+		if (gtk_text_iter_get_line (&line_end) % CHECKPOINT_INTERVAL == 0)
+			checkpoint_add (ce, line_end_offset, state);
 
-	if (segment->start_at == offset)
-	{
-		if (segment->children != NULL && segment->children->start_at == offset)
+		gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
+		analyzed_end = line_end_offset;
+		invalid = get_invalid_segment (ce);
+
+		if (invalid != NULL)
 		{
-			segment = segment->children;
-			goto start;
+			GtkTextIter iter;
+
+			gtk_text_buffer_get_iter_at_offset (buffer, &iter, invalid->start_at);
+			gtk_text_iter_set_line_offset (&iter, 0);
+
+			if (gtk_text_iter_get_offset (&iter) == line_end_offset)
+				next_line_invalid = TRUE;
 		}
 
-		return segment;
-	}
+		if (!next_line_invalid)
+		{
+			Segment *old_state, *hint;
 
-        if (segment->end_at <= offset && segment->parent != NULL)
-	{
-		if (segment->next != NULL)
+			hint = ce->priv->hint ? ce->priv->hint : state;
+			old_state = get_segment_at_offset (ce, hint, line_end_offset);
+
+			/* We can merge old and new stuff if: contexts are the same,
+			 * and the segment on the next line is continuation of the
+			 * segment from previous line. */
+			if (old_state != state &&
+			    (old_state->context != state->context || state->is_start))
+			{
+				need_invalidate_next = TRUE;
+				next_line_invalid = TRUE;
+			}
+			else
+			{
+				segment_merge (ce, state, old_state);
+				CHECK_TREE (ce);
+			}
+		}
+
+		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
+		    line_end_offset >= end_offset ||
+		    (invalid == NULL && !next_line_invalid))
 		{
-			if (segment->next->start_at > offset)
-				return segment->parent;
+			if (need_invalidate_next)
+				insert_range (ce, line_end_offset, 0);
+			break;
+		}
 
-			segment = segment->next;
+		if (next_line_invalid)
+		{
+			line_start_offset = line_end_offset;
+			line_start = line_end;
+			gtk_text_iter_forward_line (&line_end);
+			line_end_offset = gtk_text_iter_get_offset (&line_end);
 		}
 		else
 		{
-			segment = segment->parent;
+			gtk_text_buffer_get_iter_at_offset (buffer, &line_start, invalid->start_at);
+			gtk_text_iter_set_line_offset (&line_start, 0);
+			line_start_offset = gtk_text_iter_get_offset (&line_start);
+			line_end = line_start;
+			gtk_text_iter_forward_line (&line_end);
+			line_end_offset = gtk_text_iter_get_offset (&line_end);
 		}
 
-		goto start;
+		first_line = (0 == line_start_offset);
 	}
 
-	for (child = segment->children; child != NULL; child = child->next)
+	line_chunk_destroy (&chunk);
+
+	if (ce->priv->profile)
+	{
+		ce->priv->stats.lines_analyzed += n_lines;
+		ce->priv->stats.analysis_time += g_timer_elapsed (timer, NULL);
+	}
+
+	if (analyzed_end == gtk_text_buffer_get_char_count (buffer))
 	{
-		if (child->start_at == offset)
+		g_assert (g_slist_length (ce->priv->invalid) <= 1);
+
+		if (ce->priv->invalid != NULL)
 		{
-			segment = child;
-			goto start;
+			invalid = get_invalid_segment (ce);
+			segment_remove (ce, invalid);
+			CHECK_TREE (ce);
 		}
+	}
 
-		if (child->end_at <= offset)
-			continue;
+	if (!all_analyzed (ce))
+		install_idle_worker (ce);
 
-		if (child->start_at > offset)
-			break;
+	gtk_text_iter_set_offset (&end_iter, analyzed_end);
 
-		segment = child;
-		goto start;
-	}
+	refresh_range (ce, &start_iter, &end_iter);
+	emit_degraded_lines (ce);
 
-	return segment;
-}
-#endif /* ENABLE_CHECK_TREE */
+	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
+			  analyzed_end - start_offset, start_offset, analyzed_end,
+			  g_timer_elapsed (timer, NULL) * 1000));
 
-#define SEGMENT_IS_ZERO_LEN_AT(s,o) ((s)->start_at == (o) && (s)->end_at == (o))
-#define SEGMENT_CONTAINS(s,o) ((s)->start_at <= (o) && (s)->end_at > (o))
-#define SEGMENT_DISTANCE(s,o) (MIN (ABS ((s)->start_at - (o)), ABS ((s)->end_at - (o))))
-static Segment *
-get_segment_in_ (Segment *segment,
-		 gint     offset)
-{
-	Segment *child;
+	g_timer_destroy (timer);
 
-	g_assert (segment->start_at <= offset && segment->end_at > offset);
+out:
+	/* must call context_thaw, so this is the only return point */
+	context_thaw (ce->priv->root_context);
+}
 
-	if (segment->children == NULL)
-		return segment;
 
-	if (segment->children == segment->last_child)
-	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->children, offset))
-			return segment->children;
+/* BACKGROUND ANALYSIS ---------------------------------------------------- */
+
+/* Analyzing a big file in idle takes a lot of slices, and each of them
+ * delays user input. So if there is a lot of text to analyze, we take
+ * a snapshot of the buffer and let another thread build a new tree
+ * from scratch in a separate engine which has no buffer. Only definitions
+ * are shared with the main thread, see regex_match_info(). Meanwhile the
+ * main thread only analyzes the text the view asks for, starting a bit
+ * before it in the root context rather than at the first invalid line,
+ * see background_job_window(), and the changes made to the buffer are
+ * collected in job->edits. When the thread is done, its tree replaces the tree of
+ * the engine and the edits are applied to it as usual by update_tree().
+ *
+ * On machines with several processors the snapshot is split into chunks
+ * at line boundaries, and every chunk but the first one is analyzed by
+ * its own thread as if it started in the root context. Once the job
+ * thread gets to the start of a chunk, it checks the guess: if it is
+ * in the root context indeed, the tree of the chunk is grafted into its
+ * own tree, otherwise the chunk is thrown away and analyzed again. Most
+ * languages get back to the root context after every top-level
+ * construct, so usually the guess is right.
+ */
 
-		if (SEGMENT_CONTAINS (segment->children, offset))
-			return get_segment_in_ (segment->children, offset);
+static gint
+get_n_processors (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	glong n = sysconf (_SC_NPROCESSORS_ONLN);
 
-		return segment;
-	}
+	if (n > 0)
+		return MIN (n, PARALLEL_ANALYSIS_MAX_CHUNKS);
+#endif
+	return 1;
+}
 
-	if (segment->children->start_at > offset || segment->last_child->end_at < offset)
-		return segment;
+/**
+ * shadow_destroy_tree:
+ *
+ * @shadow: engine without buffer.
+ *
+ * Frees the tree built in @shadow, if any.
+ */
+static void
+shadow_destroy_tree (GtkSourceContextEngine *shadow)
+{
+	if (shadow->priv->checkpoints != NULL)
+		g_array_free (shadow->priv->checkpoints, TRUE);
+	shadow->priv->checkpoints = NULL;
 
-	if (SEGMENT_DISTANCE (segment->children, offset) >= SEGMENT_DISTANCE (segment->last_child, offset))
-	{
-		for (child = segment->children; child; child = child->next)
-		{
-			if (child->start_at > offset)
-				return segment;
+	if (shadow->priv->root_segment != NULL)
+		segment_destroy (shadow, shadow->priv->root_segment);
+	if (shadow->priv->root_context != NULL)
+		context_unref (shadow->priv->root_context);
+	shadow->priv->root_segment = NULL;
+	shadow->priv->root_context = NULL;
 
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
-				return child;
+	g_array_set_size (shadow->priv->degraded_lines, 0);
+}
 
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
-		}
-	}
-	else
-	{
-		for (child = segment->last_child; child; child = child->prev)
-		{
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
-			{
-				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (child->prev, offset))
-					child = child->prev;
-				return child;
-			}
+static void
+background_job_free (BackgroundJob *job)
+{
+	gint i;
 
-			if (child->end_at <= offset)
-				return segment;
+	g_assert (job->ce == NULL);
 
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
-		}
+	for (i = 1; i < job->n_chunks; i++)
+	{
+		g_assert (job->chunks[i].thread == NULL);
+		shadow_destroy_tree (job->chunks[i].shadow);
+		g_object_unref (job->chunks[i].shadow);
 	}
 
-	return segment;
+	shadow_destroy_tree (job->shadow);
+	g_object_unref (job->shadow);
+
+	g_free (job->chunks);
+	g_free (job->text);
+	g_slice_free (BackgroundJob, job);
 }
 
-/* assumes zero-length segments can't have children */
-static Segment *
-get_segment_ (Segment *segment,
-	      gint     offset)
+/**
+ * background_job_detach:
+ *
+ * @job: #BackgroundJob.
+ *
+ * Disconnects @job from its engine and the buffer.
+ */
+static void
+background_job_detach (BackgroundJob *job)
 {
-	if (segment->parent != NULL)
-	{
-		if (!SEGMENT_CONTAINS (segment->parent, offset))
-			return get_segment_ (segment->parent, offset);
-	}
-	else
-	{
-		g_assert (offset >= segment->start_at);
-		g_assert (offset <= segment->end_at);
-	}
+	GtkTextBuffer *buffer = job->ce->priv->buffer;
 
-	if (SEGMENT_CONTAINS (segment, offset))
-		return get_segment_in_ (segment, offset);
+	gtk_text_buffer_delete_mark (buffer, job->edits.start);
+	gtk_text_buffer_delete_mark (buffer, job->edits.end);
+	job->edits.start = NULL;
+	job->edits.end = NULL;
 
-	if (SEGMENT_IS_ZERO_LEN_AT (segment, offset))
-	{
-		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			segment = segment->prev;
-		return segment;
-	}
+	if (job->window_start != NULL)
+		gtk_text_buffer_delete_mark (buffer, job->window_start);
+	job->window_start = NULL;
 
-	if (offset < segment->start_at)
-	{
-		while (segment->prev != NULL && segment->prev->start_at > offset)
-			segment = segment->prev;
+	job->ce->priv->background_job = NULL;
+	job->ce = NULL;
+}
 
-		g_assert (!segment->prev || segment->prev->start_at <= offset);
+/**
+ * background_job_window:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @start: start of the text the view wants to display.
+ *
+ * The tree of @ce is thrown away when the background job is done, so
+ * until then it only needs to cover the text the view shows. If that
+ * text is before the current window, or far after the first invalid
+ * line, the tree is emptied and everything from
+ * BACKGROUND_WINDOW_MARGIN_LINES lines before @start is invalidated.
+ * Text before that is taken for plain text in the root context, like
+ * at the start of a chunk, so analysis costs the window and not the
+ * text before it. Highlighting of the window may be wrong until the
+ * tree of the job replaces it.
+ */
+static void
+background_job_window (GtkSourceContextEngine *ce,
+		       const GtkTextIter      *start)
+{
+	BackgroundJob *job = ce->priv->background_job;
+	Segment *root;
+	GtkTextIter window_start;
+	gint start_line, window_line, invalid_line;
+	gboolean before_window = FALSE;
 
-		if (segment->prev == NULL)
-			return segment->parent;
+	/* Batch ranges must stay relative to the tree. */
+	if (ce->priv->batch_depth > 0)
+		return;
 
-		if (segment->prev->end_at > offset)
-			return get_segment_in_ (segment->prev, offset);
+	start_line = gtk_text_iter_get_line (start);
+	window_line = MAX (start_line - BACKGROUND_WINDOW_MARGIN_LINES, 0);
 
-		if (segment->prev->end_at == offset)
-		{
-			if (SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			{
-				segment = segment->prev;
-				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-					segment = segment->prev;
-				return segment;
-			}
+	if (job->window_start != NULL)
+	{
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &window_start,
+						  job->window_start);
+		before_window = gtk_text_iter_get_line (&window_start) > start_line;
+	}
 
-			return segment->parent;
-		}
+	if (!before_window)
+	{
+		invalid_line = get_invalid_line (ce);
 
-		/* segment->prev->end_at < offset */
-		return segment->parent;
+		if (invalid_line < 0 || invalid_line >= window_line)
+			return;
 	}
 
-	/* offset >= segment->end_at, not zero-length */
+	update_tree (ce);
+	partial_line_drop (ce, FALSE);
 
-	while (segment->next != NULL)
-	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->next, offset))
-			return segment->next;
+	gtk_text_buffer_get_iter_at_line (ce->priv->buffer, &window_start, window_line);
 
-		if (segment->next->end_at > offset)
-		{
-			if (segment->next->start_at <= offset)
-				return get_segment_in_ (segment->next, offset);
-			else
-				return segment->parent;
-		}
+	root = segment_sync (ce, ce->priv->root_segment);
+	segment_destroy_children (ce, root);
+	ce->priv->hint = NULL;
+	ce->priv->hint2 = NULL;
 
-		segment = segment->next;
-	}
+	if (gtk_text_iter_get_offset (&window_start) < root->end_at)
+		create_segment (ce, root, NULL,
+				gtk_text_iter_get_offset (&window_start),
+				root->end_at, FALSE, NULL);
 
-	return segment->parent;
+	if (job->window_start == NULL)
+		job->window_start = gtk_text_buffer_create_mark (ce->priv->buffer, NULL,
+								 &window_start, TRUE);
+	else
+		gtk_text_buffer_move_mark (ce->priv->buffer, job->window_start,
+					   &window_start);
+
+	CHECK_TREE (ce);
 }
-#undef SEGMENT_IS_ZERO_LEN_AT
-#undef SEGMENT_CONTAINS
-#undef SEGMENT_DISTANCE
 
 /**
- * get_segment_at_offset:
+ * background_analysis_adopt:
  *
- * @ce: #GtkSoucreContextEngine.
- * @hint: segment to start search from or %NULL.
- * @offset: the offset, characters.
+ * @ce: #GtkSourceContextEngine.
+ * @job: finished #BackgroundJob.
  *
- * Finds the deepest segment "at @offset".
- * More precisely, it returns toplevel segment if
- * @offset is equal to length of buffer; or non-zero-length
- * segment which contains character at @offset; or zero-length
- * segment at @offset. In case when there are several zero-length
- * segments, it returns the first one.
+ * Replaces the syntax tree of @ce with the one built by the
+ * thread, and invalidates text changed since the snapshot.
  */
-static Segment *
-get_segment_at_offset (GtkSourceContextEngine *ce,
-		       Segment                *hint,
-		       gint                    offset)
+static void
+background_analysis_adopt (GtkSourceContextEngine *ce,
+			   BackgroundJob          *job)
 {
-	Segment *result;
+	GtkSourceContextEngine *shadow = job->shadow;
+	InvalidRegion *region = &ce->priv->invalid_region;
+	GtkTextIter start, end;
 
-	if (offset == ce->priv->root_segment->end_at)
-		return ce->priv->root_segment;
+	/* Edits recorded in batch ranges go to job->edits. */
+	batch_flush_ (ce);
 
-#ifdef ENABLE_DEBUG
-	/* if you see this message (often), then something is
-	 * wrong with the hints business, i.e. optimizations
-	 * do not work quite like they should */
-	if (hint == NULL || hint == ce->priv->root_segment)
+	g_array_free (ce->priv->checkpoints, TRUE);
+	ce->priv->checkpoints = NULL;
+
+	partial_line_drop (ce, FALSE);
+	segment_destroy (ce, ce->priv->root_segment);
+	context_unref (ce->priv->root_context);
+	g_assert (ce->priv->invalid == NULL);
+
+	ce->priv->root_segment = shadow->priv->root_segment;
+	ce->priv->root_context = shadow->priv->root_context;
+	ce->priv->checkpoints = shadow->priv->checkpoints;
+	ce->priv->hint = NULL;
+	ce->priv->hint2 = NULL;
+
+	shadow->priv->root_segment = NULL;
+	shadow->priv->root_context = NULL;
+	shadow->priv->checkpoints = NULL;
+	shadow->priv->hint = NULL;
+	shadow->priv->hint2 = NULL;
+
+	/* The new tree knows nothing about edits made to the old one. */
+	g_array_set_size (ce->priv->pending_edits, 0);
+	ce->priv->stamp = shadow->priv->stamp;
+
+	/* Offsets of degraded lines are offsets in the snapshot too, but
+	 * they are only used to report the lines. */
+	degraded_lines_take_ (ce->priv->degraded_lines,
+			      shadow->priv->degraded_lines);
+	definition_stats_take_ (ce, shadow);
+
+	/* The new tree lives in memory of the shadow engine. */
+	node_pool_clear (&ce->priv->segment_pool);
+	node_pool_clear (&ce->priv->sub_pattern_pool);
+	ce->priv->segment_pool = shadow->priv->segment_pool;
+	ce->priv->sub_pattern_pool = shadow->priv->sub_pattern_pool;
+	node_pool_init (&shadow->priv->segment_pool, sizeof (Segment));
+	node_pool_init (&shadow->priv->sub_pattern_pool, sizeof (SubPattern));
+
+	g_assert (ce->priv->root_segment->end_at == job->char_count);
+
+	/* Offsets in the new tree are offsets in the snapshot, job->edits
+	 * tells how to get from them to the current buffer. */
+	region->empty = job->edits.empty;
+	region->delta = job->edits.delta;
+
+	if (!region->empty)
 	{
-		static int c;
-		g_print ("searching from root %d\n", ++c);
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &start, job->edits.start);
+		gtk_text_buffer_move_mark (ce->priv->buffer, region->start, &start);
+		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &end, job->edits.end);
+		gtk_text_buffer_move_mark (ce->priv->buffer, region->end, &end);
+
+		/* So are the offsets of slow lines. */
+		slow_lines_edit_ (shadow->priv->slow_lines,
+				  gtk_text_iter_get_offset (&start),
+				  gtk_text_iter_get_offset (&end) - region->delta,
+				  region->delta);
 	}
-#endif
 
-	result = get_segment_ (hint ? hint : ce->priv->root_segment, offset);
+	g_array_set_size (ce->priv->slow_lines, 0);
+	g_array_append_vals (ce->priv->slow_lines,
+			     shadow->priv->slow_lines->data,
+			     shadow->priv->slow_lines->len);
 
-#ifdef ENABLE_CHECK_TREE
-	g_assert (result == get_segment_at_offset_slow_ (hint, offset));
-#endif
+	if (!region->empty)
+		update_tree (ce);
 
-	return result;
+	CHECK_TREE (ce);
+
+	gtk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+	gtk_text_region_add (ce->priv->refresh_region, &start, &end);
+	refresh_range (ce, &start, &end);
+	emit_degraded_lines (ce);
+
+	viewport_check (ce);
 }
 
 /**
- * segment_remove:
+ * background_analysis_done:
  *
- * @ce: #GtkSoucreContextEngine.
- * @segment: segment to remove.
+ * @job: #BackgroundJob.
  *
- * Removes the segment from syntax tree and frees it.
- * It correctly updates parent's children list, not
- * like segment_destroy() where caller has to take care
- * of tree integrity.
+ * Called in the main thread when the analysis thread exits.
  */
-static void
-segment_remove (GtkSourceContextEngine *ce,
-		Segment                *segment)
+static gboolean
+background_analysis_done (BackgroundJob *job)
 {
-	if (segment->next != NULL)
-		segment->next->prev = segment->prev;
-	else
-		segment->parent->last_child = segment->prev;
+	GtkSourceContextEngine *ce = job->ce;
 
-	if (segment->prev != NULL)
-		segment->prev->next = segment->next;
-	else
-		segment->parent->children = segment->next;
+	gdk_threads_enter ();
 
-	/* if ce->priv->hint is being deleted, set it to some
-	 * neighbour segment */
-	if (ce->priv->hint == segment)
+	if (ce != NULL)
 	{
-		if (segment->next != NULL)
-			ce->priv->hint = segment->next;
-		else if (segment->prev != NULL)
-			ce->priv->hint = segment->prev;
-		else
-			ce->priv->hint = segment->parent;
+		background_analysis_adopt (ce, job);
+		background_job_detach (job);
+
+		/* Text edited meanwhile was left for now. */
+		if (!all_analyzed (ce))
+			install_first_update (ce);
 	}
 
-        /* if ce->priv->hint2 is being deleted, set it to some
-         * neighbour segment */
-        if (ce->priv->hint2 == segment)
-        {
-                if (segment->next != NULL)
-                        ce->priv->hint2 = segment->next;
-                else if (segment->prev != NULL)
-                        ce->priv->hint2 = segment->prev;
-                else
-                        ce->priv->hint2 = segment->parent;
-        }
+	background_job_free (job);
 
-	segment_destroy (ce, segment);
+	gdk_threads_leave ();
+
+	return FALSE;
 }
 
-static void
-segment_erase_middle_ (GtkSourceContextEngine *ce,
-		       Segment                *segment,
-		       gint                    start,
-		       gint                    end)
+/**
+ * context_graft:
+ *
+ * @root: root context of the tree to graft into.
+ * @context: context from the tree of a chunk.
+ * @map: contexts from the chunk mapped to contexts in the tree of @root.
+ * @clones: list of contexts created by this function.
+ *
+ * Finds the context equivalent to @context among descendants of @root,
+ * creating it if needed.
+ *
+ * Returns: the context, not referenced.
+ */
+static Context *
+context_graft (Context     *root,
+	       Context     *context,
+	       GHashTable  *map,
+	       GSList     **clones)
 {
-	Segment *new_segment, *child;
-	SubPattern *sp;
+	Context *parent;
+	Context *copy;
+	ContextPtr *ptr;
+	gchar *key = NULL;
 
-	new_segment = segment_new (ce,
-				   segment->parent,
-				   segment->context,
-				   end,
-				   segment->end_at,
-				   FALSE);
-	segment->end_at = start;
+	if (context->parent == NULL)
+		return root;
 
-	new_segment->next = segment->next;
-	segment->next = new_segment;
-	new_segment->prev = segment;
+	copy = g_hash_table_lookup (map, context);
 
-	if (new_segment->next != NULL)
-		new_segment->next->prev = new_segment;
-	else
-		new_segment->parent->last_child = new_segment;
+	if (copy != NULL)
+		return copy;
 
-	child = segment->children;
-	segment->children = NULL;
-	segment->last_child = NULL;
+	parent = context_graft (root, context->parent, map, clones);
+	ptr = context_get_child_ptr (parent, context->definition);
 
-	while (child != NULL)
+	if (ptr->fixed)
 	{
-		Segment *append_to;
-		Segment *next = child->next;
+		copy = ptr->u.context;
+	}
+	else
+	{
+		ContextPtr *orig_ptr;
+		GHashTableIter iter;
+		gpointer value;
 
-		if (child->start_at < start)
-		{
-			g_assert (child->end_at <= start);
-			append_to = segment;
-		}
-		else
-		{
-			g_assert (child->start_at >= end);
-			append_to = new_segment;
-		}
+		orig_ptr = context_get_child_ptr (context->parent, context->definition);
+		g_hash_table_iter_init (&iter, orig_ptr->u.hash);
 
-		child->parent = append_to;
+		while (g_hash_table_iter_next (&iter, (gpointer *) &key, &value))
+			if (value == context)
+				break;
 
-		if (append_to->last_child != NULL)
-		{
-			append_to->last_child->next = child;
-			child->prev = append_to->last_child;
-			child->next = NULL;
-			append_to->last_child = child;
-		}
-		else
+		g_assert (value == context);
+		copy = g_hash_table_lookup (ptr->u.hash, key);
+
+		/* Referenced like a new clone, so it goes back to
+		 * the idle ones if no segment needs it. */
+		if (copy != NULL && copy->idle)
 		{
-			child->next = child->prev = NULL;
-			append_to->last_child = child;
-			append_to->children = child;
+			context_reuse (ptr, copy);
+			context_ref (copy);
+			*clones = g_slist_prepend (*clones, copy);
 		}
-
-		child = next;
 	}
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
-
-	while (sp != NULL)
+	if (copy == NULL)
 	{
-		SubPattern *next = sp->next;
-		Segment *append_to;
+		/* Ancestors are equivalent, so regexes may be shared. */
+		copy = g_slice_new0 (Context);
+		copy->ref_count = 1;
+		copy->definition = context->definition;
+		copy->parent = parent;
+		copy->style = context->style;
+		copy->ignore_children_style = context->ignore_children_style;
+		copy->all_ancestors_extend = context->all_ancestors_extend;
+		copy->end = regex_ref (context->end);
+		copy->reg_all = regex_ref (context->reg_all);
 
-		if (sp->start_at < start)
-		{
-			sp->end_at = MIN (sp->end_at, start);
-			append_to = segment;
-		}
+		if (ptr->fixed)
+			ptr->u.context = copy;
 		else
-		{
-			g_assert (sp->end_at > end);
-			sp->start_at = MAX (sp->start_at, end);
-			append_to = new_segment;
-		}
-
-		sp->next = append_to->sub_patterns;
-		append_to->sub_patterns = sp;
+			g_hash_table_insert (ptr->u.hash, g_strdup (key), copy);
 
-		sp = next;
+		*clones = g_slist_prepend (*clones, copy);
 	}
 
-	CHECK_SEGMENT_CHILDREN (segment);
-	CHECK_SEGMENT_CHILDREN (new_segment);
+	g_hash_table_insert (map, context, copy);
+	return copy;
 }
 
-/**
- * segment_erase_range_:
- *
- * @ce: #GtkSourceContextEngine.
- * @segment: the segment.
- * @start: start offset of range to erase, characters.
- * @end: end offset of range to erase, characters.
- *
- * Recurisvely removes segments from [@start, @end] interval
- * starting from @segment. If @segment belongs to the range,
- * or it's a zero-length segment at @end offset, and it's not
- * the toplevel segment, then it's removed from the tree.
- * If @segment intersects with the range (unless it's the toplevel
- * segment), then its ends are adjusted appropriately, and it's
- * split into two if it completely contains the range.
- */
 static void
-segment_erase_range_ (GtkSourceContextEngine *ce,
-		      Segment                *segment,
-		      gint                    start,
-		      gint                    end)
+segment_graft (Context     *root,
+	       Segment     *segment,
+	       GHashTable  *map,
+	       GSList     **clones)
 {
-	g_assert (start < end);
+	Segment *child;
+	Context *context;
 
-	if (segment->start_at == segment->end_at)
-	{
-		if (segment->start_at >= start && segment->start_at <= end)
-			segment_remove (ce, segment);
-		return;
-	}
+	for (child = segment->children; child != NULL; child = child->next)
+		segment_graft (root, child, map, clones);
+
+	/* Same order as in segment_destroy(), contexts of children
+	 * go away before their parents. */
+	context = context_graft (root, segment->context, map, clones);
+	context_ref (context);
+	context_unref (segment->context);
+	segment->context = context;
+}
+
+/**
+ * background_chunk_graft:
+ *
+ * @ce: engine of the job thread.
+ * @chunk: analyzed #BackgroundChunk.
+ *
+ * Moves the tree built for @chunk into the tree of @ce, which is
+ * in the root context at the start of @chunk.
+ *
+ * Returns: state at the end of @chunk.
+ */
+static Segment *
+background_chunk_graft (GtkSourceContextEngine *ce,
+			BackgroundChunk        *chunk)
+{
+	GtkSourceContextEngine *shadow = chunk->shadow;
+	Segment *root = ce->priv->root_segment;
+	Segment *chunk_root = shadow->priv->root_segment;
+	Segment *state = chunk->state;
+	Segment *child;
+	GHashTable *map;
+	GSList *clones = NULL;
 
-	if (segment->start_at > end || segment->end_at < start)
-		return;
+	map = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-	if (segment->start_at >= start && segment->end_at <= end && segment->parent)
+	for (child = chunk_root->children; child != NULL; child = child->next)
 	{
-		segment_remove (ce, segment);
-		return;
+		segment_graft (ce->priv->root_context, child, map, &clones);
+		child->parent = root;
 	}
 
-	if (segment->start_at == end)
+	if (chunk_root->children != NULL)
 	{
-		Segment *child = segment->children;
+		chunk_root->children->prev = root->last_child;
 
-		while (child != NULL && child->start_at == end)
-		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
-		}
-	}
-	else if (segment->end_at == start)
-	{
-		Segment *child = segment->last_child;
+		if (root->last_child != NULL)
+			root->last_child->next = chunk_root->children;
+		else
+			root->children = chunk_root->children;
 
-		while (child != NULL && child->end_at == start)
-		{
-			Segment *prev = child->prev;
-			segment_erase_range_ (ce, child, start, end);
-			child = prev;
-		}
+		root->last_child = chunk_root->last_child;
+		chunk_root->children = NULL;
+		chunk_root->last_child = NULL;
 	}
-	else
-	{
-		Segment *child = segment->children;
 
-		while (child != NULL)
-		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
-		}
-	}
+	segment_extend (root, chunk->char_end);
 
-	if (segment->sub_patterns != NULL)
-	{
-		SubPattern *sp;
+	/* Segments keep their checkpoint flag, offsets are the same. */
+	g_array_append_vals (ce->priv->checkpoints,
+			     shadow->priv->checkpoints->data,
+			     shadow->priv->checkpoints->len);
+	g_array_set_size (shadow->priv->checkpoints, 0);
+	degraded_lines_take_ (ce->priv->degraded_lines,
+			      shadow->priv->degraded_lines);
+	definition_stats_take_ (ce, shadow);
+	slow_lines_take_ (ce->priv->slow_lines, shadow->priv->slow_lines,
+			  chunk->char_start, chunk->char_end);
 
-		sp = segment->sub_patterns;
-		segment->sub_patterns = NULL;
+	if (state == chunk_root)
+		state = root;
 
-		while (sp != NULL)
-		{
-			SubPattern *next = sp->next;
+	shadow_destroy_tree (shadow);
 
-			if (sp->start_at >= start && sp->end_at <= end)
-				sub_pattern_free (sp);
-			else
-				segment_add_subpattern (segment, sp);
+	/* Grafted segments still live in memory of the chunk engine. */
+	node_pool_merge (&ce->priv->segment_pool, &shadow->priv->segment_pool);
+	node_pool_merge (&ce->priv->sub_pattern_pool, &shadow->priv->sub_pattern_pool);
 
-			sp = next;
-		}
-	}
+	g_slist_foreach (clones, (GFunc) context_unref, NULL);
+	g_slist_free (clones);
+	g_hash_table_destroy (map);
 
-	if (segment->parent != NULL)
+	ce->priv->hint = state;
+	ce->priv->hint2 = NULL;
+
+	return state;
+}
+
+/**
+ * analyze_text:
+ *
+ * @ce: engine without buffer.
+ * @job: #BackgroundJob.
+ * @state: the state at @byte_offset.
+ * @byte_offset: where to start in job->text.
+ * @byte_end: where to stop, at a line boundary.
+ * @char_offset: character offset corresponding to @byte_offset.
+ * @line_no: line counter, used to place checkpoints.
+ *
+ * Analyzes part of job->text line by line, like update_syntax() does.
+ *
+ * Returns: the state at @byte_end, or %NULL if the job was cancelled.
+ */
+static Segment *
+analyze_text (GtkSourceContextEngine *ce,
+	      BackgroundJob          *job,
+	      Segment                *state,
+	      gint                    byte_offset,
+	      gint                    byte_end,
+	      gint                    char_offset,
+	      gint                   *line_no)
+{
+	while (byte_offset < byte_end)
 	{
-		/* Now all children and subpatterns are cleaned up,
-		 * so we only need to split segment properly if its middle
-		 * was erased. Otherwise, only ends need to be adjusted. */
-		if (segment->start_at < start && segment->end_at > end)
-		{
-			segment_erase_middle_ (ce, segment, start, end);
-		}
+		LineInfo line;
+
+		if (g_atomic_int_get (&job->cancelled))
+			return NULL;
+
+		byte_offset += get_line_info_from_text (job->text + byte_offset,
+							byte_end - byte_offset,
+							char_offset,
+							&line);
+
+		ce->priv->hint2 = ce->priv->hint;
+
+		if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
+			ce->priv->hint2 = NULL;
+
+		/* Whole lines: there is no main loop to give back to here,
+		 * and a cancelled job waits at most MAX_TIME_FOR_ONE_LINE. */
+		state = analyze_line (ce, state, &line);
+
+		if (ce->priv->hint2 != NULL)
+			ce->priv->hint = ce->priv->hint2;
 		else
-		{
-			g_assert ((segment->start_at >= start && segment->end_at > end) ||
-				  (segment->start_at < start && segment->end_at <= end));
+			ce->priv->hint = state;
 
-			if (segment->end_at > end)
-			{
-				/* If we erase the beginning, we need to clear
-				 * is_start flag. */
-				segment->start_at = end;
-				segment->is_start = FALSE;
-			}
-			else
-			{
-				segment->end_at = start;
-			}
-		}
+		if (++(*line_no) % CHECKPOINT_INTERVAL == 0)
+			checkpoint_add (ce, NEXT_LINE_OFFSET (&line), state);
+
+		char_offset = NEXT_LINE_OFFSET (&line);
 	}
+
+	return state;
 }
 
 /**
- * segment_merge:
+ * background_chunk_thread:
  *
- * @ce: #GtkSourceContextEngine.
- * @first: first segment.
- * @second: second segment.
+ * @chunk: #BackgroundChunk.
  *
- * Merges adjacent segments @first and @second given
- * their contexts are equal.
+ * Analyzes @chunk assuming it starts in the root context.
  */
-static void
-segment_merge (GtkSourceContextEngine *ce,
-	       Segment                *first,
-	       Segment                *second)
+static gpointer
+background_chunk_thread (BackgroundChunk *chunk)
 {
-	Segment *parent;
+	GtkSourceContextEngine *ce = chunk->shadow;
 
-	if (first == second)
-		return;
+	thread_matches_init ();
 
-	g_assert (!SEGMENT_IS_INVALID (first));
-	g_assert (first->context == second->context);
-	g_assert (first->end_at == second->start_at);
+	create_root (ce);
+	chunk->state = analyze_text (ce, chunk->job,
+				     ce->priv->root_segment,
+				     chunk->byte_start,
+				     chunk->byte_end,
+				     chunk->char_start,
+				     &chunk->n_lines);
 
-	if (first->parent != second->parent)
-		segment_merge (ce, first->parent, second->parent);
+	thread_matches_free ();
 
-	parent = first->parent;
+	return NULL;
+}
 
-	g_assert (first->next == second);
-	g_assert (first->parent == second->parent);
-	g_assert (second != parent->children);
+/**
+ * background_analysis_thread:
+ *
+ * @job: #BackgroundJob.
+ *
+ * Analyzes job->text like update_syntax() does when it starts at the
+ * beginning of an empty buffer, taking trees of chunks analyzed by other
+ * threads where possible.
+ */
+static gpointer
+background_analysis_thread (BackgroundJob *job)
+{
+	GtkSourceContextEngine *ce = job->shadow;
+	Segment *state;
+	gint line_no = 0;
+	gint i;
 
-	if (second == parent->last_child)
-		parent->last_child = first;
-	first->next = second->next;
-	if (second->next != NULL)
-		second->next->prev = first;
+	thread_matches_init ();
 
-	first->end_at = second->end_at;
+	create_root (ce);
+	state = ce->priv->root_segment;
 
-	if (second->children != NULL)
+	for (i = 0; i < job->n_chunks && state != NULL; i++)
 	{
-		Segment *child;
-
-		for (child = second->children; child != NULL; child = child->next)
-			child->parent = first;
+		BackgroundChunk *chunk = &job->chunks[i];
+		gint byte_offset = chunk->byte_start;
+		gint char_offset = chunk->char_start;
 
-		if (first->children == NULL)
+		/* Skip BOM, see update_syntax() */
+		if (i == 0 && g_str_has_prefix (job->text, "\xef\xbb\xbf"))
 		{
-			g_assert (!first->last_child);
-			first->children = second->children;
-			first->last_child = second->last_child;
+			byte_offset = 3;
+			char_offset = 1;
 		}
-		else
+
+		if (chunk->thread != NULL)
 		{
-			first->last_child->next = second->children;
-			second->children->prev = first->last_child;
-			first->last_child = second->last_child;
+			g_thread_join (chunk->thread);
+			chunk->thread = NULL;
+
+			if (chunk->state != NULL &&
+			    state == ce->priv->root_segment)
+			{
+				state = background_chunk_graft (ce, chunk);
+				line_no += chunk->n_lines;
+				continue;
+			}
+
+			shadow_destroy_tree (chunk->shadow);
 		}
+
+		state = analyze_text (ce, job, state,
+				      byte_offset, chunk->byte_end,
+				      char_offset, &line_no);
 	}
 
-	if (second->sub_patterns != NULL)
+	if (state == NULL)
 	{
-		if (first->sub_patterns == NULL)
+		/* Stop the chunk threads which are still running. */
+		g_atomic_int_set (&job->cancelled, TRUE);
+
+		for (i = 1; i < job->n_chunks; i++)
 		{
-			first->sub_patterns = second->sub_patterns;
+			if (job->chunks[i].thread != NULL)
+				g_thread_join (job->chunks[i].thread);
+			job->chunks[i].thread = NULL;
 		}
-		else
+	}
+	else
+	{
+		segment_extend (ce->priv->root_segment, job->char_count);
+	}
+
+	thread_matches_free ();
+
+	g_idle_add_full (FIRST_UPDATE_PRIORITY,
+			 (GSourceFunc) background_analysis_done,
+			 job, NULL);
+
+	return NULL;
+}
+
+/**
+ * background_job_split:
+ *
+ * @job: #BackgroundJob.
+ *
+ * Splits job->text into chunks at line boundaries, whichever line
+ * terminators the text uses.
+ */
+static void
+background_job_split (BackgroundJob *job)
+{
+	gint n_chunks;
+	gint byte_start = 0;
+	gint char_start = 0;
+	gint i;
+
+	n_chunks = MIN (get_n_processors (),
+			job->byte_length / PARALLEL_ANALYSIS_MIN_CHUNK);
+	n_chunks = MAX (n_chunks, 1);
+
+	job->chunks = g_new0 (BackgroundChunk, n_chunks);
+	job->n_chunks = 0;
+
+	for (i = 0; i < n_chunks && byte_start < job->byte_length; i++)
+	{
+		BackgroundChunk *chunk = &job->chunks[i];
+		gint byte_end = job->byte_length;
+
+		if (i < n_chunks - 1)
 		{
-			while (second->sub_patterns != NULL)
-			{
-				SubPattern *sp = second->sub_patterns;
-				second->sub_patterns = sp->next;
-				sp->next = first->sub_patterns;
-				first->sub_patterns = sp;
-			}
+			gint split = (gint64) job->byte_length * (i + 1) / n_chunks;
+			gint eol_index, next_line_index;
+
+			/* Same line terminators as get_line_info_from_text(). If
+			 * split is between \r and \n, the \n ends the line. */
+			split = MAX (split, byte_start);
+			pango_find_paragraph_boundary (job->text + split,
+						       job->byte_length - split,
+						       &eol_index,
+						       &next_line_index);
+
+			byte_end = split + next_line_index;
 		}
-	}
 
-	second->children = NULL;
-	second->last_child = NULL;
-	second->sub_patterns = NULL;
+		chunk->job = job;
+		chunk->byte_start = byte_start;
+		chunk->byte_end = byte_end;
+		chunk->char_start = char_start;
+		chunk->char_end = char_start +
+			g_utf8_strlen (job->text + byte_start, byte_end - byte_start);
 
-	segment_destroy (ce, second);
+		byte_start = chunk->byte_end;
+		char_start = chunk->char_end;
+		job->n_chunks++;
+	}
 }
 
 /**
- * erase_segments:
+ * background_analysis_start:
  *
  * @ce: #GtkSourceContextEngine.
- * @start: start offset of region to erase, characters.
- * @end: end offset of region to erase, characters.
- * @hint: segment around @start to make it faster.
  *
- * Erases all non-toplevel segments in the interval
- * [@start, @end]. Its action on the tree is roughly
- * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
- * (but that does not accept toplevel segment).
+ * Starts analyzing the buffer in a separate thread if there is
+ * enough to analyze to make it worth it.
+ *
+ * Returns: whether the thread was started.
  */
-static void
-erase_segments (GtkSourceContextEngine *ce,
-		gint                    start,
-		gint                    end,
-		Segment                *hint)
+static gboolean
+background_analysis_start (GtkSourceContextEngine *ce)
 {
-	Segment *root = ce->priv->root_segment;
-	Segment *child, *hint_prev;
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	BackgroundJob *job;
+	Segment *invalid;
+	GtkTextIter start, end;
+	GError *error = NULL;
+	gint char_count;
+	gint i;
 
-	if (root->children == NULL)
-		return;
+	g_return_val_if_fail (ce->priv->background_job == NULL, FALSE);
 
-	if (hint == NULL)
-		hint = ce->priv->hint;
+	if (!g_thread_supported ())
+		return FALSE;
 
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != ce->priv->root_segment)
-			hint = hint->parent;
+	char_count = gtk_text_buffer_get_char_count (buffer);
 
-	if (hint == NULL)
-		hint = root->children;
+	/* The thread starts from scratch, so it only pays off when
+	 * most of the text is still to be analyzed. */
+	invalid = ce->priv->invalid ? segment_sync (ce, ce->priv->invalid->data) : NULL;
 
-	hint_prev = hint->prev;
+	if (invalid == NULL ||
+	    char_count - invalid->start_at < BACKGROUND_ANALYSIS_MIN_CHARS)
+		return FALSE;
 
-	child = hint;
-	while (child != NULL)
-	{
-		Segment *next = child->next;
+	gtk_text_buffer_get_bounds (buffer, &start, &end);
 
-		if (child->end_at < start)
-		{
-			child = next;
+	job = g_slice_new0 (BackgroundJob);
+	job->ce = ce;
+	job->shadow = _gtk_source_context_engine_new (ce->priv->ctx_data);
+	job->shadow->priv->profile = ce->priv->profile;
+	job->shadow->priv->checkpoints = g_array_new (FALSE, FALSE, sizeof (Checkpoint));
+	g_array_append_vals (job->shadow->priv->slow_lines,
+			     ce->priv->slow_lines->data,
+			     ce->priv->slow_lines->len);
+	job->text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
+	job->byte_length = strlen (job->text);
+	job->char_count = char_count;
+	job->edits.empty = TRUE;
+	job->edits.start = gtk_text_buffer_create_mark (buffer, NULL, &start, TRUE);
+	job->edits.end = gtk_text_buffer_create_mark (buffer, NULL, &end, FALSE);
 
-			if (next != NULL)
-				ce->priv->hint = next;
+	ce->priv->background_job = job;
 
-			continue;
-		}
+	background_job_split (job);
 
-		if (child->start_at > end)
-		{
-			ce->priv->hint = child;
-			break;
-		}
+	/* If a chunk thread can't be created, the job thread
+	 * analyzes the chunk itself. */
+	for (i = 1; i < job->n_chunks; i++)
+	{
+		BackgroundChunk *chunk = &job->chunks[i];
 
-		segment_erase_range_ (ce, child, start, end);
-		child = next;
+		chunk->shadow = _gtk_source_context_engine_new (ce->priv->ctx_data);
+		chunk->shadow->priv->profile = ce->priv->profile;
+		chunk->shadow->priv->checkpoints = g_array_new (FALSE, FALSE, sizeof (Checkpoint));
+		g_array_append_vals (chunk->shadow->priv->slow_lines,
+				     ce->priv->slow_lines->data,
+				     ce->priv->slow_lines->len);
+		chunk->thread = g_thread_create ((GThreadFunc) background_chunk_thread,
+						 chunk, TRUE, NULL);
 	}
 
-	child = hint_prev;
-	while (child != NULL)
+	if (!g_thread_create ((GThreadFunc) background_analysis_thread,
+			      job, FALSE, &error))
 	{
-		Segment *prev = child->prev;
-
-		if (ce->priv->hint == NULL)
-			ce->priv->hint = child;
+		g_warning ("%s", error->message);
+		g_error_free (error);
 
-		if (child->start_at > end)
-		{
-			child = prev;
-			continue;
-		}
+		g_atomic_int_set (&job->cancelled, TRUE);
 
-		if (child->end_at < start)
+		for (i = 1; i < job->n_chunks; i++)
 		{
-			break;
+			if (job->chunks[i].thread != NULL)
+				g_thread_join (job->chunks[i].thread);
+			job->chunks[i].thread = NULL;
 		}
 
-		segment_erase_range_ (ce, child, start, end);
-		child = prev;
+		background_job_detach (job);
+		background_job_free (job);
+		return FALSE;
 	}
 
-	CHECK_TREE (ce);
+	return TRUE;
 }
 
-#define IS_BOM(c) (c == 0xFEFF)
-
 /**
- * update_syntax:
+ * background_analysis_cancel:
  *
  * @ce: #GtkSourceContextEngine.
- * @end: desired end of region to analyze or %NULL.
- * @time: maximal amount of time in milliseconds allowed to spend here
- * or 0 for 'unlimited'.
  *
- * Updates syntax tree. If @end is not %NULL, then it analyzes
- * (reanalyzes invalid areas in) region from start of buffer
- * to @end. Otherwise, it analyzes batch of text starting at
- * first invalid line.
- * In order to avoid blocking ui it uses a timer and stops
- * when time elapsed is greater than @time, so analyzed region is
- * not necessarily what's requested (unless @time is 0).
+ * Stops the analysis thread and forgets about it. The job
+ * is freed when the thread exits.
  */
-/* XXX it must be refactored. */
 static void
-update_syntax (GtkSourceContextEngine *ce,
-	       const GtkTextIter      *end,
-	       gint                    time)
+background_analysis_cancel (GtkSourceContextEngine *ce)
 {
-	GtkTextBuffer *buffer;
-	GtkTextIter start_iter, end_iter;
-	GtkTextIter line_start, line_end;
-	Segment *state;
-	Segment *invalid;
-	gint start_offset, end_offset;
-	gint line_start_offset, line_end_offset;
-	gint analyzed_end;
-	gboolean first_line = FALSE;
-	GTimer *timer;
+	BackgroundJob *job = ce->priv->background_job;
 
-	buffer = ce->priv->buffer;
-	state = ce->priv->root_segment;
+	g_return_if_fail (job != NULL);
 
-	context_freeze (ce->priv->root_context);
-	update_tree (ce);
+	g_atomic_int_set (&job->cancelled, TRUE);
+	background_job_detach (job);
+}
 
-	if (!gtk_text_buffer_get_char_count (buffer))
-	{
-		segment_tree_zero_len (ce);
-		goto out;
-	}
 
-	invalid = get_invalid_segment (ce);
+/* HEADLESS HIGHLIGHTING -------------------------------------------------- */
 
-	if (invalid == NULL)
-		goto out;
+/* Text without a buffer is analyzed the same way the background thread
+ * does it, and the styles are read from the tree instead of tags, see
+ * GtkSourceHighlighter. */
 
-	if (end != NULL && invalid->start_at >= gtk_text_iter_get_offset (end))
-		goto out;
+typedef struct _StyleSpan StyleSpan;
 
-	if (end != NULL)
-	{
-		end_offset = gtk_text_iter_get_offset (end);
-		start_offset = MIN (end_offset, invalid->start_at);
-	}
-	else
-	{
-		start_offset = invalid->start_at;
-		end_offset = gtk_text_buffer_get_char_count (buffer);
-	}
+struct _StyleSpan
+{
+	GtkSourceStyleSpan	 span;
+	/* Order in which spans were found, a span inside another one is
+	 * found later. */
+	guint			 seq;
+};
 
-	gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
-	gtk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
+static void
+style_span_add_ (GArray      *spans,
+		 gint         start,
+		 gint         end,
+		 const gchar *style)
+{
+	StyleSpan span;
 
-	if (!gtk_text_iter_starts_line (&start_iter))
-	{
-		gtk_text_iter_set_line_offset (&start_iter, 0);
-		start_offset = gtk_text_iter_get_offset (&start_iter);
-	}
+	span.span.offset = start;
+	span.span.length = end - start;
+	span.span.style_id = g_intern_string (style);
+	span.seq = spans->len;
 
-	if (!gtk_text_iter_starts_line (&end_iter))
-	{
-		gtk_text_iter_forward_line (&end_iter);
-		end_offset = gtk_text_iter_get_offset (&end_iter);
-	}
+	g_array_append_val (spans, span);
+}
 
-	if (0 == start_offset)
+/**
+ * get_style_spans_:
+ *
+ * @ce: engine without buffer.
+ * @segment: segment to look at.
+ * @spans: array of #StyleSpan.
+ *
+ * Appends to @spans the styles which @segment and its children
+ * put on text, same as get_tag_spans() does with tags.
+ */
+static void
+get_style_spans_ (GtkSourceContextEngine *ce,
+		  Segment                *segment,
+		  GArray                 *spans)
+{
+	SubPattern *sp;
+	Segment *child;
+
+	if (SEGMENT_IS_INVALID (segment))
+		return;
+
+	segment_sync (ce, segment);
+
+	if (segment->context->style != NULL)
 	{
-		first_line = TRUE;
+		gint start = segment->start_at;
+		gint end = segment->end_at;
 
-		/* If it is the first line and it starts with BOM, skip it
-		 * since regexes in lang files do not take it into account */
-		gunichar c = gtk_text_iter_get_char (&start_iter);
-		if (IS_BOM (c))
+		if (HAS_OPTION (segment->context->definition, STYLE_INSIDE))
 		{
-			gtk_text_iter_forward_char (&start_iter);
-			start_offset = gtk_text_iter_get_offset (&start_iter);
+			start += segment->start_len;
+			end -= segment->end_len;
 		}
+
+		if (start < end)
+			style_span_add_ (spans, start, end, segment->context->style);
 	}
 
-	/* This happens after deleting all text on last line. */
-	if (start_offset == end_offset)
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		g_assert (end_offset == gtk_text_buffer_get_char_count (buffer));
-		g_assert (g_slist_length (ce->priv->invalid) == 1);
-		segment_remove (ce, invalid);
-		CHECK_TREE (ce);
-		goto out;
+		if (sp->definition->style != NULL && sp->start_at < sp->end_at)
+			style_span_add_ (spans, sp->start_at, sp->end_at,
+					 sp->definition->style);
 	}
 
+	for (child = segment->children; child != NULL; child = child->next)
+		get_style_spans_ (ce, child, spans);
+}
 
-	/* Main loop */
+static gint
+style_span_cmp (const StyleSpan *span1,
+		const StyleSpan *span2)
+{
+	if (span1->span.offset != span2->span.offset)
+		return span1->span.offset < span2->span.offset ? -1 : 1;
+	if (span1->span.length != span2->span.length)
+		return span1->span.length > span2->span.length ? -1 : 1;
+	return span1->seq < span2->seq ? -1 : (span1->seq > span2->seq ? 1 : 0);
+}
 
-	line_start = start_iter;
-	line_start_offset = start_offset;
-	line_end = line_start;
-	gtk_text_iter_forward_line (&line_end);
-	line_end_offset = gtk_text_iter_get_offset (&line_end);
-	analyzed_end = line_end_offset;
+/**
+ * _gtk_source_context_data_highlight_text:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ * @text: UTF-8 text.
+ * @length: length of @text in bytes.
+ *
+ * Analyzes @text in an engine without buffer and collects the styles
+ * found. It may be called from any thread, several threads may use
+ * the same @ctx_data at once.
+ *
+ * Returns: array of #GtkSourceStyleSpan sorted by offset, a span
+ * nested in another one goes after it.
+ */
+GArray *
+_gtk_source_context_data_highlight_text (GtkSourceContextData *ctx_data,
+					 const gchar          *text,
+					 gint                  length)
+{
+	GtkSourceContextEngine *ce;
+	GArray *spans;
+	GArray *result;
+	Segment *state;
+	gboolean own_matches;
+	gint byte_offset = 0;
+	gint char_offset = 0;
+	guint i;
 
-	timer = g_timer_new ();
+	g_return_val_if_fail (ctx_data != NULL, NULL);
+	g_return_val_if_fail (text != NULL, NULL);
 
-	while (TRUE)
-	{
-		LineInfo line;
-		gboolean next_line_invalid = FALSE;
-		gboolean need_invalidate_next = FALSE;
+	/* Threads without their own match data share that of the
+	 * regexes, which engines of buffers with the same definitions
+	 * use in the main thread. Whichever thread this is, analyze
+	 * with match data of the thread, and free it afterwards unless
+	 * the thread had it before. */
+	own_matches = g_static_private_get (&thread_matches) == NULL;
 
-		/* Last buffer line. */
-		if (line_start_offset == line_end_offset)
-		{
-			g_assert (line_start_offset == gtk_text_buffer_get_char_count (buffer));
-			break;
-		}
+	if (own_matches)
+		thread_matches_init ();
 
-		/* Analyze the line */
-		erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
-		get_line_info (buffer, &line_start, &line_end, &line);
+	ce = _gtk_source_context_engine_new (ctx_data);
+	create_root (ce);
+	state = ce->priv->root_segment;
 
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
+	/* Skip BOM, see update_syntax() */
+	if (length >= 3 && strncmp (text, "\xef\xbb\xbf", 3) == 0)
+	{
+		byte_offset = 3;
+		char_offset = 1;
+	}
 
-		if (first_line)
-		{
-			state = ce->priv->root_segment;
-		}
-		else
-		{
-			state = get_segment_at_offset (ce,
-						       ce->priv->hint ? ce->priv->hint : state,
-						       line_start_offset - 1);
-		}
+	while (byte_offset < length)
+	{
+		LineInfo line;
 
-		g_assert (state->context != NULL);
+		byte_offset += get_line_info_from_text (text + byte_offset,
+							length - byte_offset,
+							char_offset,
+							&line);
 
 		ce->priv->hint2 = ce->priv->hint;
 
@@ -5920,122 +11051,34 @@ update_syntax (GtkSourceContextEngine *ce,
 
 		state = analyze_line (ce, state, &line);
 
-		/* At this point analyze_line() could have disabled highlighting */
-		if (ce->priv->disabled)
-			return;
-
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
-
-		/* XXX this is wrong */
-		/* I don't know anymore why it's wrong, I guess it means
-		 * "may be inefficient" */
 		if (ce->priv->hint2 != NULL)
 			ce->priv->hint = ce->priv->hint2;
 		else
 			ce->priv->hint = state;
 
-		line_info_destroy (&line);
-
-		gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
-		analyzed_end = line_end_offset;
-		invalid = get_invalid_segment (ce);
-
-		if (invalid != NULL)
-		{
-			GtkTextIter iter;
-
-			gtk_text_buffer_get_iter_at_offset (buffer, &iter, invalid->start_at);
-			gtk_text_iter_set_line_offset (&iter, 0);
-
-			if (gtk_text_iter_get_offset (&iter) == line_end_offset)
-				next_line_invalid = TRUE;
-		}
-
-		if (!next_line_invalid)
-		{
-			Segment *old_state, *hint;
-
-			hint = ce->priv->hint ? ce->priv->hint : state;
-			old_state = get_segment_at_offset (ce, hint, line_end_offset);
-
-			/* We can merge old and new stuff if: contexts are the same,
-			 * and the segment on the next line is continuation of the
-			 * segment from previous line. */
-			if (old_state != state &&
-			    (old_state->context != state->context || state->is_start))
-			{
-				need_invalidate_next = TRUE;
-				next_line_invalid = TRUE;
-			}
-			else
-			{
-				segment_merge (ce, state, old_state);
-				CHECK_TREE (ce);
-			}
-		}
-
-		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
-		    line_end_offset >= end_offset ||
-		    (invalid == NULL && !next_line_invalid))
-		{
-			if (need_invalidate_next)
-				insert_range (ce, line_end_offset, 0);
-			break;
-		}
-
-		if (next_line_invalid)
-		{
-			line_start_offset = line_end_offset;
-			line_start = line_end;
-			gtk_text_iter_forward_line (&line_end);
-			line_end_offset = gtk_text_iter_get_offset (&line_end);
-		}
-		else
-		{
-			gtk_text_buffer_get_iter_at_offset (buffer, &line_start, invalid->start_at);
-			gtk_text_iter_set_line_offset (&line_start, 0);
-			line_start_offset = gtk_text_iter_get_offset (&line_start);
-			line_end = line_start;
-			gtk_text_iter_forward_line (&line_end);
-			line_end_offset = gtk_text_iter_get_offset (&line_end);
-		}
-
-		first_line = (0 == line_start_offset);
+		char_offset = NEXT_LINE_OFFSET (&line);
 	}
 
-	if (analyzed_end == gtk_text_buffer_get_char_count (buffer))
-	{
-		g_assert (g_slist_length (ce->priv->invalid) <= 1);
+	segment_extend (ce->priv->root_segment, char_offset);
 
-		if (ce->priv->invalid != NULL)
-		{
-			invalid = get_invalid_segment (ce);
-			segment_remove (ce, invalid);
-			CHECK_TREE (ce);
-		}
-	}
+	spans = g_array_new (FALSE, FALSE, sizeof (StyleSpan));
+	get_style_spans_ (ce, ce->priv->root_segment, spans);
+	g_array_sort (spans, (GCompareFunc) style_span_cmp);
 
-	if (!all_analyzed (ce))
-		install_idle_worker (ce);
+	result = g_array_sized_new (FALSE, FALSE, sizeof (GtkSourceStyleSpan), spans->len);
 
-	gtk_text_iter_set_offset (&end_iter, analyzed_end);
+	for (i = 0; i < spans->len; ++i)
+		g_array_append_val (result, g_array_index (spans, StyleSpan, i).span);
 
-	refresh_range (ce, &start_iter, &end_iter);
+	g_array_free (spans, TRUE);
 
-	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
-			  analyzed_end - start_offset, start_offset, analyzed_end,
-			  g_timer_elapsed (timer, NULL) * 1000));
+	shadow_destroy_tree (ce);
+	g_object_unref (ce);
 
-	g_timer_destroy (timer);
+	if (own_matches)
+		thread_matches_free ();
 
-out:
-	/* must call context_thaw, so this is the only return point */
-	context_thaw (ce->priv->root_context);
+	return result;
 }
 
 
@@ -6252,6 +11295,9 @@ context_definition_unref (ContextDefinition *definition)
 	g_free (definition->default_style);
 	regex_unref (definition->reg_all);
 
+	if (definition->end_cache != NULL)
+		g_hash_table_destroy (definition->end_cache);
+
 	g_slist_foreach (definition->context_classes, (GFunc) gtk_source_context_class_free, NULL);
 	g_slist_free (definition->context_classes);
 
@@ -6682,6 +11728,85 @@ _gtk_source_context_replace_free (GtkSourceContextReplace *repl)
 	}
 }
 
+/**
+ * precompile_reg_all_:
+ *
+ * @definition: a #ContextDefinition.
+ * @depth: depth of the contexts of @definition, 0 for the root
+ * context, 2 for any context below the children of the root.
+ * @all_ancestors_extend: the all_ancestors_extend field those
+ * contexts would get.
+ * @visited: definitions already handled, mapped to a bitmask of the
+ * (@depth, @all_ancestors_extend) pairs they were reached with.
+ *
+ * Creates the reg_all shared by the contexts of @definition and of
+ * every definition it may contain, which context_new() would otherwise
+ * create when entering the first such context. Parsing may run in a
+ * worker thread, compiling there keeps the union regexes, the largest
+ * ones, off the thread doing the highlighting.
+ *
+ * Only the regexes context_new() will actually share are created: a
+ * context whose ancestors can end it gets its own reg_all, see
+ * ANCESTOR_CAN_END_CONTEXT(), and so does a context whose end regex
+ * refers to its start.
+ */
+static void
+precompile_reg_all_ (ContextDefinition *definition,
+		     gint               depth,
+		     gboolean           all_ancestors_extend,
+		     GHashTable        *visited)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+	gboolean extends_parent;
+	gboolean children_ancestors_extend;
+	guint state_bit;
+	guint states;
+
+	state_bit = 1 << (depth * 2 + (all_ancestors_extend ? 1 : 0));
+	states = GPOINTER_TO_UINT (g_hash_table_lookup (visited, definition));
+
+	if (states & state_bit)
+		return;
+
+	g_hash_table_insert (visited, definition, GUINT_TO_POINTER (states | state_bit));
+
+	extends_parent = depth < 2 || HAS_OPTION (definition, EXTEND_PARENT);
+
+	if (definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->reg_all == NULL &&
+	    (depth < 2 || (HAS_OPTION (definition, EXTEND_PARENT) && all_ancestors_extend)) &&
+	    (definition->u.start_end.end == NULL ||
+	     definition->u.start_end.end->resolved))
+	{
+		definition->reg_all = create_reg_all (NULL, definition);
+	}
+
+	/* Only containers have child contexts */
+	if (definition->type != CONTEXT_TYPE_CONTAINER)
+		return;
+
+	children_ancestors_extend = all_ancestors_extend && extends_parent;
+
+	definition_iter_init (&iter, definition);
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+		precompile_reg_all_ (child_def->u.definition,
+				     MIN (depth + 1, 2),
+				     children_ancestors_extend,
+				     visited);
+	definition_iter_destroy (&iter);
+}
+
+static void
+precompile_regexes (ContextDefinition *main_definition)
+{
+	GHashTable *visited;
+
+	visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+	precompile_reg_all_ (main_definition, 0, TRUE, visited);
+	g_hash_table_destroy (visited);
+}
+
 /**
  * _gtk_source_context_data_finish_parse:
  *
@@ -6752,6 +11877,8 @@ _gtk_source_context_data_finish_parse (GtkSourceContextData *ctx_data,
 		return FALSE;
 	}
 
+	precompile_regexes (main_definition);
+
 	return TRUE;
 }
 
@@ -6850,6 +11977,498 @@ out:
 }
 
 
+/* DEFINITIONS CACHE ------------------------------------------------------ */
+
+/* Definitions are saved after _gtk_source_context_data_finish_parse(),
+ * so that loading them skips parsing the lang files and resolving
+ * references, see gtksourcelanguage-cache.c. A definition is stored
+ * once however many ids map to it, and children refer to definitions
+ * by their index:
+ *
+ *   uint    number of definitions, and for each of them:
+ *     string  id
+ *     uint    type
+ *     uint    flags
+ *     string  default style
+ *     string  match, start and end regexes, expanded
+ *     classes
+ *     uint    number of sub patterns, and for each of them:
+ *       string  id, only with NEED_DEBUG_ID
+ *       string  style
+ *       uint    where
+ *       uint    is_named
+ *       string  name, or uint number
+ *       classes
+ *   for each definition:
+ *     uint    number of children, and for each of them:
+ *       uint    resolved
+ *       uint    index of the definition, or string id if not resolved
+ *       string  style
+ *       uint    CHILD_* bits
+ *   uint    number of ids, and for each of them:
+ *     string  id
+ *     uint    index of the definition
+ *
+ * Classes are the number of context classes followed by the name and
+ * the enabled flag of each of them.
+ */
+
+#define CHILD_IS_REF_ALL		(1 << 0)
+#define CHILD_OVERRIDE_STYLE		(1 << 1)
+#define CHILD_OVERRIDE_STYLE_DEEP	(1 << 2)
+
+typedef struct
+{
+	/* Maps definitions to their index plus one. */
+	GHashTable	*indices;
+	GPtrArray	*definitions;
+} SaveData;
+
+static void
+index_definition_ (G_GNUC_UNUSED const gchar *id,
+		   ContextDefinition *definition,
+		   SaveData          *data)
+{
+	if (g_hash_table_lookup (data->indices, definition) == NULL)
+	{
+		g_ptr_array_add (data->definitions, definition);
+		g_hash_table_insert (data->indices, definition,
+				     GUINT_TO_POINTER (data->definitions->len));
+	}
+}
+
+static guint
+definition_index_ (SaveData          *data,
+		   ContextDefinition *definition)
+{
+	return GPOINTER_TO_UINT (g_hash_table_lookup (data->indices, definition)) - 1;
+}
+
+static const gchar *
+regex_get_pattern_ (Regex *regex)
+{
+	if (regex == NULL)
+		return NULL;
+	else if (regex->resolved)
+		return g_regex_get_pattern (regex->u.regex.regex);
+	else
+		return regex->u.info.pattern;
+}
+
+static void
+write_context_classes_ (GString *out,
+			GSList  *context_classes)
+{
+	_gtk_source_cache_write_uint (out, g_slist_length (context_classes));
+
+	for ( ; context_classes != NULL; context_classes = context_classes->next)
+	{
+		GtkSourceContextClass *cclass = context_classes->data;
+
+		_gtk_source_cache_write_string (out, cclass->name);
+		_gtk_source_cache_write_uint (out, cclass->enabled);
+	}
+}
+
+static void
+write_definition_ (GString           *out,
+		   ContextDefinition *definition)
+{
+	GSList *l;
+
+	_gtk_source_cache_write_string (out, definition->id);
+	_gtk_source_cache_write_uint (out, definition->type);
+	_gtk_source_cache_write_uint (out, definition->flags);
+	_gtk_source_cache_write_string (out, definition->default_style);
+
+	if (definition->type == CONTEXT_TYPE_SIMPLE)
+	{
+		_gtk_source_cache_write_string (out, regex_get_pattern_ (definition->u.match));
+		_gtk_source_cache_write_string (out, NULL);
+		_gtk_source_cache_write_string (out, NULL);
+	}
+	else
+	{
+		_gtk_source_cache_write_string (out, NULL);
+		_gtk_source_cache_write_string (out, regex_get_pattern_ (definition->u.start_end.start));
+		_gtk_source_cache_write_string (out, regex_get_pattern_ (definition->u.start_end.end));
+	}
+
+	write_context_classes_ (out, definition->context_classes);
+
+	_gtk_source_cache_write_uint (out, g_slist_length (definition->sub_patterns));
+
+	for (l = definition->sub_patterns; l != NULL; l = l->next)
+	{
+		SubPatternDefinition *sp_def = l->data;
+
+#ifdef NEED_DEBUG_ID
+		_gtk_source_cache_write_string (out, sp_def->id);
+#else
+		_gtk_source_cache_write_string (out, NULL);
+#endif
+		_gtk_source_cache_write_string (out, sp_def->style);
+		_gtk_source_cache_write_uint (out, sp_def->where);
+		_gtk_source_cache_write_uint (out, sp_def->is_named);
+
+		if (sp_def->is_named)
+			_gtk_source_cache_write_string (out, sp_def->u.name);
+		else
+			_gtk_source_cache_write_uint (out, sp_def->u.num);
+
+		write_context_classes_ (out, sp_def->context_classes);
+	}
+}
+
+static void
+write_children_ (GString           *out,
+		 ContextDefinition *definition,
+		 SaveData          *data)
+{
+	GSList *l;
+
+	_gtk_source_cache_write_uint (out, g_slist_length (definition->children));
+
+	for (l = definition->children; l != NULL; l = l->next)
+	{
+		DefinitionChild *child = l->data;
+		guint bits = 0;
+
+		_gtk_source_cache_write_uint (out, child->resolved);
+
+		if (child->resolved)
+			_gtk_source_cache_write_uint (out, definition_index_ (data, child->u.definition));
+		else
+			_gtk_source_cache_write_string (out, child->u.id);
+
+		_gtk_source_cache_write_string (out, child->style);
+
+		if (child->is_ref_all)
+			bits |= CHILD_IS_REF_ALL;
+		if (child->override_style)
+			bits |= CHILD_OVERRIDE_STYLE;
+		if (child->override_style_deep)
+			bits |= CHILD_OVERRIDE_STYLE_DEEP;
+
+		_gtk_source_cache_write_uint (out, bits);
+	}
+}
+
+/**
+ * _gtk_source_context_data_save:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ * @out: string to append to.
+ *
+ * Appends the definitions of @ctx_data to @out, in a form read back
+ * by _gtk_source_context_data_load(). Must be called after
+ * _gtk_source_context_data_finish_parse().
+ */
+void
+_gtk_source_context_data_save (GtkSourceContextData *ctx_data,
+			       GString              *out)
+{
+	SaveData data;
+	GHashTableIter iter;
+	gpointer id, definition;
+	guint i;
+
+	g_return_if_fail (ctx_data != NULL);
+	g_return_if_fail (out != NULL);
+
+	data.indices = g_hash_table_new (g_direct_hash, g_direct_equal);
+	data.definitions = g_ptr_array_new ();
+
+	g_hash_table_foreach (ctx_data->definitions, (GHFunc) index_definition_, &data);
+
+	_gtk_source_cache_write_uint (out, data.definitions->len);
+
+	for (i = 0; i < data.definitions->len; ++i)
+		write_definition_ (out, g_ptr_array_index (data.definitions, i));
+
+	for (i = 0; i < data.definitions->len; ++i)
+		write_children_ (out, g_ptr_array_index (data.definitions, i), &data);
+
+	_gtk_source_cache_write_uint (out, g_hash_table_size (ctx_data->definitions));
+
+	g_hash_table_iter_init (&iter, ctx_data->definitions);
+
+	while (g_hash_table_iter_next (&iter, &id, &definition))
+	{
+		_gtk_source_cache_write_string (out, id);
+		_gtk_source_cache_write_uint (out, definition_index_ (&data, definition));
+	}
+
+	g_ptr_array_free (data.definitions, TRUE);
+	g_hash_table_destroy (data.indices);
+}
+
+static GSList *
+read_context_classes_ (GtkSourceCacheReader *reader)
+{
+	GSList *context_classes = NULL;
+	guint n_classes, i;
+
+	n_classes = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_classes && !reader->failed; ++i)
+	{
+		gchar *name;
+		gboolean enabled;
+
+		name = _gtk_source_cache_read_string (reader);
+		enabled = _gtk_source_cache_read_uint (reader) != 0;
+
+		if (name == NULL)
+			reader->failed = TRUE;
+		else
+			context_classes = g_slist_prepend (context_classes,
+							   gtk_source_context_class_new (name, enabled));
+
+		g_free (name);
+	}
+
+	return g_slist_reverse (context_classes);
+}
+
+static void
+free_context_classes_ (GSList *context_classes)
+{
+	g_slist_foreach (context_classes, (GFunc) gtk_source_context_class_free, NULL);
+	g_slist_free (context_classes);
+}
+
+static void
+read_sub_patterns_ (GtkSourceCacheReader *reader,
+		    ContextDefinition    *definition)
+{
+	guint n_sub_patterns, i;
+
+	n_sub_patterns = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_sub_patterns && !reader->failed; ++i)
+	{
+		SubPatternDefinition *sp_def;
+		gchar *id;
+
+		sp_def = g_slice_new0 (SubPatternDefinition);
+
+		id = _gtk_source_cache_read_string (reader);
+#ifdef NEED_DEBUG_ID
+		sp_def->id = id;
+#else
+		g_free (id);
+#endif
+		sp_def->style = _gtk_source_cache_read_string (reader);
+		sp_def->where = _gtk_source_cache_read_uint (reader);
+		sp_def->is_named = _gtk_source_cache_read_uint (reader) != 0;
+
+		if (sp_def->is_named)
+			sp_def->u.name = _gtk_source_cache_read_string (reader);
+		else
+			sp_def->u.num = _gtk_source_cache_read_uint (reader);
+
+		sp_def->context_classes = read_context_classes_ (reader);
+
+		if (sp_def->where > SUB_PATTERN_WHERE_END ||
+		    (sp_def->is_named && sp_def->u.name == NULL))
+			reader->failed = TRUE;
+
+		/* Freed with the definition even if reading failed. */
+		definition->sub_patterns = g_slist_append (definition->sub_patterns, sp_def);
+		sp_def->index = definition->n_sub_patterns++;
+	}
+}
+
+static ContextDefinition *
+read_definition_ (GtkSourceCacheReader *reader)
+{
+	ContextDefinition *definition = NULL;
+	gchar *id, *style, *match, *start, *end;
+	GSList *context_classes;
+	ContextType type;
+	guint flags;
+
+	id = _gtk_source_cache_read_string (reader);
+	type = _gtk_source_cache_read_uint (reader);
+	flags = _gtk_source_cache_read_uint (reader);
+	style = _gtk_source_cache_read_string (reader);
+	match = _gtk_source_cache_read_string (reader);
+	start = _gtk_source_cache_read_string (reader);
+	end = _gtk_source_cache_read_string (reader);
+	context_classes = read_context_classes_ (reader);
+
+	/* Do not let a damaged file trigger the checks in
+	 * context_definition_new(). */
+	if (!reader->failed && id != NULL &&
+	    ((type == CONTEXT_TYPE_SIMPLE && match != NULL && start == NULL && end == NULL) ||
+	     (type == CONTEXT_TYPE_CONTAINER && match == NULL && (end == NULL || start != NULL))))
+	{
+		GError *error = NULL;
+
+		/* The regexes still have to be compiled, GRegex can't
+		 * be saved. */
+		definition = context_definition_new (id, type, match, start, end,
+						     style, context_classes,
+						     flags, &error);
+
+		if (error != NULL)
+			g_error_free (error);
+	}
+
+	if (definition != NULL)
+		read_sub_patterns_ (reader, definition);
+	else
+		reader->failed = TRUE;
+
+	g_free (id);
+	g_free (style);
+	g_free (match);
+	g_free (start);
+	g_free (end);
+	free_context_classes_ (context_classes);
+
+	return definition;
+}
+
+static void
+read_children_ (GtkSourceCacheReader *reader,
+		ContextDefinition    *definition,
+		GPtrArray            *definitions)
+{
+	guint n_children, i;
+
+	n_children = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_children && !reader->failed; ++i)
+	{
+		DefinitionChild *child;
+		guint bits;
+
+		child = g_slice_new0 (DefinitionChild);
+		child->resolved = _gtk_source_cache_read_uint (reader) != 0;
+
+		if (child->resolved)
+		{
+			guint index = _gtk_source_cache_read_uint (reader);
+
+			if (index < definitions->len)
+			{
+				child->u.definition = g_ptr_array_index (definitions, index);
+			}
+			else
+			{
+				child->resolved = FALSE;
+				reader->failed = TRUE;
+			}
+		}
+		else
+		{
+			child->u.id = _gtk_source_cache_read_string (reader);
+		}
+
+		child->style = _gtk_source_cache_read_string (reader);
+
+		bits = _gtk_source_cache_read_uint (reader);
+		child->is_ref_all = (bits & CHILD_IS_REF_ALL) != 0;
+		child->override_style = (bits & CHILD_OVERRIDE_STYLE) != 0;
+		child->override_style_deep = (bits & CHILD_OVERRIDE_STYLE_DEEP) != 0;
+
+		definition->children = g_slist_append (definition->children, child);
+	}
+}
+
+/**
+ * _gtk_source_context_data_load:
+ *
+ * @ctx_data: empty #GtkSourceContextData.
+ * @reader: cache data written by _gtk_source_context_data_save().
+ *
+ * Fills @ctx_data with saved definitions. There is no need to call
+ * _gtk_source_context_data_finish_parse() afterwards.
+ *
+ * Returns: %TRUE on success, %FALSE if the data is damaged or a
+ * regex can't be compiled. @ctx_data is left empty then.
+ */
+gboolean
+_gtk_source_context_data_load (GtkSourceContextData *ctx_data,
+			       GtkSourceCacheReader *reader)
+{
+	GPtrArray *definitions;
+	ContextDefinition *main_definition;
+	guint n_definitions, n_ids, i;
+	gchar *root_id;
+	gboolean success;
+
+	g_return_val_if_fail (ctx_data != NULL, FALSE);
+	g_return_val_if_fail (ctx_data->lang != NULL, FALSE);
+	g_return_val_if_fail (g_hash_table_size (ctx_data->definitions) == 0, FALSE);
+	g_return_val_if_fail (reader != NULL, FALSE);
+
+	definitions = g_ptr_array_new ();
+	n_definitions = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_definitions && !reader->failed; ++i)
+	{
+		ContextDefinition *definition = read_definition_ (reader);
+
+		if (definition != NULL)
+			g_ptr_array_add (definitions, definition);
+	}
+
+	for (i = 0; i < definitions->len && !reader->failed; ++i)
+		read_children_ (reader, g_ptr_array_index (definitions, i), definitions);
+
+	n_ids = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_ids && !reader->failed; ++i)
+	{
+		gchar *id;
+		guint index;
+
+		id = _gtk_source_cache_read_string (reader);
+		index = _gtk_source_cache_read_uint (reader);
+
+		if (id == NULL || index >= definitions->len)
+		{
+			reader->failed = TRUE;
+			g_free (id);
+		}
+		else
+		{
+			g_hash_table_insert (ctx_data->definitions, id,
+					     context_definition_ref (g_ptr_array_index (definitions, index)));
+		}
+	}
+
+	/* Children do not hold references, so a definition which is
+	 * not in the table would be freed below while children still
+	 * point to it. Saved data never has such definitions. */
+	for (i = 0; i < definitions->len && !reader->failed; ++i)
+	{
+		ContextDefinition *definition = g_ptr_array_index (definitions, i);
+
+		if (definition->ref_count == 1)
+			reader->failed = TRUE;
+	}
+
+	root_id = g_strdup_printf ("%s:%s", ctx_data->lang->priv->id, ctx_data->lang->priv->id);
+	main_definition = reader->failed ? NULL : LOOKUP_DEFINITION (ctx_data, root_id);
+	success = main_definition != NULL;
+	g_free (root_id);
+
+	if (success)
+		precompile_regexes (main_definition);
+	else
+		g_hash_table_remove_all (ctx_data->definitions);
+
+	g_ptr_array_foreach (definitions, (GFunc) context_definition_unref, NULL);
+	g_ptr_array_free (definitions, TRUE);
+
+	return success;
+}
+
+
 /* DEBUG CODE ------------------------------------------------------------- */
 
 #ifdef ENABLE_CHECK_TREE
@@ -6860,8 +12479,9 @@ check_segment (GtkSourceContextEngine *ce,
 	Segment *child;
 
 	g_assert (segment != NULL);
+	segment_sync (ce, segment);
 	g_assert (segment->start_at <= segment->end_at);
-	g_assert (!segment->next || segment->next->start_at >= segment->end_at);
+	g_assert (!segment->next || segment_sync (ce, segment->next)->start_at >= segment->end_at);
 
 	if (SEGMENT_IS_INVALID (segment))
 		g_assert (g_slist_find (ce->priv->invalid, segment) != NULL);
@@ -6874,7 +12494,7 @@ check_segment (GtkSourceContextEngine *ce,
 	for (child = segment->children; child != NULL; child = child->next)
 	{
 		g_assert (child->parent == segment);
-		g_assert (child->start_at >= segment->start_at);
+		g_assert (segment_sync (ce, child)->start_at >= segment->start_at);
 		g_assert (child->end_at <= segment->end_at);
 		g_assert (child->prev || child == segment->children);
 		g_assert (child->next || child == segment->last_child);
@@ -6898,6 +12518,7 @@ check_context_hash_cb (const char *text,
 	g_assert (context != NULL);
 	g_assert (context->definition == data->definition);
 	g_assert (context->parent == data->parent);
+	g_assert (!context->idle == (context->ref_count != 0));
 }
 
 static void
@@ -6916,6 +12537,7 @@ check_context (Context *context)
 		else
 		{
 			struct CheckContextData data;
+			g_assert (g_queue_get_length (ptr->idle) <= CONTEXT_CACHE_MAX_IDLE);
 			data.parent = context;
 			data.definition = ptr->definition;
 			g_hash_table_foreach (ptr->u.hash,
@@ -6946,13 +12568,13 @@ check_regex (void)
 static void
 check_tree (GtkSourceContextEngine *ce)
 {
-	Segment *root = ce->priv->root_segment;
+	Segment *root = segment_sync (ce, ce->priv->root_segment);
 
 	check_regex ();
 
 	g_assert (root->start_at == 0);
 
-	if (ce->priv->invalid_region.empty)
+	if (ce->priv->invalid_region.empty && ce->priv->batch_ranges->len == 0)
 		g_assert (root->end_at == gtk_text_buffer_get_char_count (ce->priv->buffer));
 
 	g_assert (!root->parent);
@@ -6971,13 +12593,17 @@ check_segment_children (Segment *segment)
 	g_assert (segment != NULL);
 	check_segment_list (segment->parent);
 
+	/* Offsets can be compared only if they are synced to the
+	 * same edit, see segment_sync(). */
 	for (ch = segment->children; ch != NULL; ch = ch->next)
 	{
 		g_assert (ch->parent == segment);
+		g_assert (ch->stamp <= segment->stamp);
 		g_assert (ch->start_at <= ch->end_at);
-		g_assert (!ch->next || ch->next->start_at >= ch->end_at);
-		g_assert (ch->start_at >= segment->start_at);
-		g_assert (ch->end_at <= segment->end_at);
+		g_assert (!ch->next || ch->next->stamp != ch->stamp ||
+			  ch->next->start_at >= ch->end_at);
+		g_assert (ch->stamp != segment->stamp ||
+			  (ch->start_at >= segment->start_at && ch->end_at <= segment->end_at));
 		g_assert (ch->prev || ch == segment->children);
 		g_assert (ch->next || ch == segment->last_child);
 	}
@@ -6994,8 +12620,10 @@ check_segment_list (Segment *segment)
 	for (ch = segment->children; ch != NULL; ch = ch->next)
 	{
 		g_assert (ch->parent == segment);
+		g_assert (ch->stamp <= segment->stamp);
 		g_assert (ch->start_at <= ch->end_at);
-		g_assert (!ch->next || ch->next->start_at >= ch->end_at);
+		g_assert (!ch->next || ch->next->stamp != ch->stamp ||
+			  ch->next->start_at >= ch->end_at);
 		g_assert (ch->prev || ch == segment->children);
 		g_assert (ch->next || ch == segment->last_child);
 	}
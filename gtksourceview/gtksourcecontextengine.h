@@ -25,6 +25,7 @@
 
 #include <gtksourceview/gtksourceengine.h>
 #include <gtksourceview/gtksourcelanguage.h>
+#include "gtksourcelanguage-cache.h"
 
 G_BEGIN_DECLS
 
@@ -41,6 +42,7 @@ typedef struct _GtkSourceContextClass         GtkSourceContextClass;
 typedef struct _GtkSourceContextEngine        GtkSourceContextEngine;
 typedef struct _GtkSourceContextEngineClass   GtkSourceContextEngineClass;
 typedef struct _GtkSourceContextEnginePrivate GtkSourceContextEnginePrivate;
+typedef struct _GtkSourceContextEngineStats   GtkSourceContextEngineStats;
 
 struct _GtkSourceContextEngine
 {
@@ -55,6 +57,24 @@ struct _GtkSourceContextEngineClass
 	GtkSourceEngineClass parent_class;
 };
 
+/* Counters collected while GtkSourceContextEngine:profile is set,
+ * times are in seconds. */
+struct _GtkSourceContextEngineStats
+{
+	/* Lines analyzed in the main thread, and time it took. */
+	guint		 lines_analyzed;
+	gdouble		 analysis_time;
+	/* Idle callbacks run by the engine, and time spent in them. */
+	guint		 idle_slices;
+	gdouble		 idle_time;
+	/* Time spent applying syntax tags and context classes. */
+	gdouble		 tags_time;
+	/* Memory used by the syntax tree and by contexts, filled
+	 * by _gtk_source_context_engine_get_stats(). */
+	gsize		 tree_memory;
+	gsize		 context_memory;
+};
+
 typedef enum {
 	GTK_SOURCE_CONTEXT_EXTEND_PARENT	= 1 << 0,
 	GTK_SOURCE_CONTEXT_END_PARENT		= 1 << 1,
@@ -70,11 +90,23 @@ typedef enum {
 	GTK_SOURCE_CONTEXT_REF_ORIGINAL		= 1 << 2
 } GtkSourceContextRefOptions;
 
+/* Guards GtkSourceLanguage::ctx_data, which may be unset by
+ * _gtk_source_context_data_unref() in any thread. */
+G_LOCK_EXTERN (context_data);
+
 GType		 _gtk_source_context_engine_get_type	(void) G_GNUC_CONST;
 
 GtkSourceContextData *_gtk_source_context_data_new	(GtkSourceLanguage	*lang);
 GtkSourceContextData *_gtk_source_context_data_ref	(GtkSourceContextData	*data);
 void		 _gtk_source_context_data_unref		(GtkSourceContextData	*data);
+void		 _gtk_source_context_data_get_end_cache_stats
+							(GtkSourceContextData	*data,
+							 guint			*hits,
+							 guint			*misses);
+GArray		*_gtk_source_context_data_highlight_text
+							(GtkSourceContextData	*data,
+							 const gchar		*text,
+							 gint			 length);
 
 GtkSourceContextClass *
 		gtk_source_context_class_new		(gchar const *name,
@@ -83,6 +115,21 @@ GtkSourceContextClass *
 void		gtk_source_context_class_free		(GtkSourceContextClass *cclass);
 
 GtkSourceContextEngine *_gtk_source_context_engine_new  (GtkSourceContextData	*data);
+void		 _gtk_source_context_engine_get_context_cache_stats
+							(GtkSourceContextEngine	*ce,
+							 guint			*n_contexts,
+							 guint			*n_idle,
+							 guint			*n_reused,
+							 guint			*n_evicted);
+void		 _gtk_source_context_engine_get_stats	(GtkSourceContextEngine	*ce,
+							 GtkSourceContextEngineStats *stats);
+void		 _gtk_source_context_engine_reset_stats	(GtkSourceContextEngine	*ce);
+void		 _gtk_source_context_engine_print_stats	(GtkSourceContextEngine	*ce);
+gboolean	 _gtk_source_context_engine_get_definition_stats
+							(GtkSourceContextEngine	*ce,
+							 const gchar		*id,
+							 guint64		*matches,
+							 gdouble		*time);
 
 gboolean	 _gtk_source_context_data_define_context
 							(GtkSourceContextData	 *data,
@@ -123,6 +170,11 @@ gboolean	 _gtk_source_context_data_finish_parse	(GtkSourceContextData	 *data,
 							 GList                   *overrides,
 							 GError			**error);
 
+void		 _gtk_source_context_data_save		(GtkSourceContextData	 *data,
+							 GString		 *out);
+gboolean	 _gtk_source_context_data_load		(GtkSourceContextData	 *data,
+							 GtkSourceCacheReader	 *reader);
+
 /* Only for lang files version 1, do not use it */
 void		 _gtk_source_context_data_set_escape_char
 							(GtkSourceContextData	 *data,
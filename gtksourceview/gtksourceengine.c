@@ -78,6 +78,24 @@ _gtk_source_engine_text_deleted (GtkSourceEngine *engine,
 							    length);
 }
 
+void
+_gtk_source_engine_begin_batch (GtkSourceEngine *engine)
+{
+	g_return_if_fail (GTK_IS_SOURCE_ENGINE (engine));
+	g_return_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->begin_batch != NULL);
+
+	GTK_SOURCE_ENGINE_GET_CLASS (engine)->begin_batch (engine);
+}
+
+void
+_gtk_source_engine_end_batch (GtkSourceEngine *engine)
+{
+	g_return_if_fail (GTK_IS_SOURCE_ENGINE (engine));
+	g_return_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->end_batch != NULL);
+
+	GTK_SOURCE_ENGINE_GET_CLASS (engine)->end_batch (engine);
+}
+
 void
 _gtk_source_engine_update_highlight (GtkSourceEngine   *engine,
 				     const GtkTextIter *start,
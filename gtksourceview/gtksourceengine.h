@@ -56,6 +56,9 @@ struct _GtkSourceEngineClass
 				       gint                  offset,
 				       gint                  length);
 
+	void     (* begin_batch)      (GtkSourceEngine      *engine);
+	void     (* end_batch)        (GtkSourceEngine      *engine);
+
 	void     (* update_highlight) (GtkSourceEngine      *engine,
 				       const GtkTextIter    *start,
 				       const GtkTextIter    *end,
@@ -79,6 +82,8 @@ void        _gtk_source_engine_text_inserted	(GtkSourceEngine      *engine,
 void        _gtk_source_engine_text_deleted	(GtkSourceEngine      *engine,
 						 gint                  offset,
 						 gint                  length);
+void        _gtk_source_engine_begin_batch	(GtkSourceEngine      *engine);
+void        _gtk_source_engine_end_batch	(GtkSourceEngine      *engine);
 void        _gtk_source_engine_update_highlight	(GtkSourceEngine      *engine,
 						 const GtkTextIter    *start,
 						 const GtkTextIter    *end,
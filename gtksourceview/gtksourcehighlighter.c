@@ -0,0 +1,341 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/* gtksourcehighlighter.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+
+#include "gtksourcehighlighter.h"
+#include "gtksourcelanguage-private.h"
+#include "gtksourcecontextengine.h"
+#include "gtksourceview-i18n.h"
+
+/**
+ * SECTION:highlighter
+ * @Short_description: syntax highlighting without a buffer
+ * @Title: GtkSourceHighlighter
+ * @See_also: #GtkSourceLanguage, #GtkSourceBuffer
+ *
+ * A #GtkSourceHighlighter analyzes text with the rules of a
+ * #GtkSourceLanguage and tells which styles apply to which parts of
+ * it, without creating a #GtkTextBuffer or any #GtkTextTag. It is
+ * meant for rendering source code elsewhere than in a #GtkSourceView,
+ * e.g. to HTML.
+ *
+ * The language definition file is loaded when the highlighter is
+ * created, which must be done in the thread using the
+ * #GtkSourceLanguageManager. After that,
+ * gtk_source_highlighter_highlight_text() and
+ * gtk_source_highlighter_highlight_stream() may be called from any
+ * thread, and several threads may use the same highlighter at once.
+ */
+
+/* Size of pieces read from a stream. */
+#define STREAM_READ_SIZE	(64 * 1024)
+
+enum
+{
+	PROP_0,
+	PROP_LANGUAGE
+};
+
+struct _GtkSourceHighlighterPrivate
+{
+	GtkSourceLanguage	*language;
+	/* NULL if the language file could not be loaded. */
+	GtkSourceContextData	*ctx_data;
+};
+
+G_DEFINE_TYPE (GtkSourceHighlighter, gtk_source_highlighter, G_TYPE_OBJECT)
+
+static void
+gtk_source_highlighter_finalize (GObject *object)
+{
+	GtkSourceHighlighter *highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	if (highlighter->priv->ctx_data != NULL)
+		_gtk_source_context_data_unref (highlighter->priv->ctx_data);
+
+	if (highlighter->priv->language != NULL)
+		g_object_unref (highlighter->priv->language);
+
+	G_OBJECT_CLASS (gtk_source_highlighter_parent_class)->finalize (object);
+}
+
+static void
+gtk_source_highlighter_set_property (GObject      *object,
+				     guint         prop_id,
+				     const GValue *value,
+				     GParamSpec   *pspec)
+{
+	GtkSourceHighlighter *highlighter;
+
+	g_return_if_fail (GTK_IS_SOURCE_HIGHLIGHTER (object));
+
+	highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	switch (prop_id)
+	{
+		case PROP_LANGUAGE:
+			highlighter->priv->language = g_value_dup_object (value);
+
+			if (highlighter->priv->language != NULL)
+				highlighter->priv->ctx_data =
+					_gtk_source_language_get_context_data (highlighter->priv->language);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
+							   prop_id,
+							   pspec);
+	}
+}
+
+static void
+gtk_source_highlighter_get_property (GObject    *object,
+				     guint       prop_id,
+				     GValue     *value,
+				     GParamSpec *pspec)
+{
+	GtkSourceHighlighter *highlighter;
+
+	g_return_if_fail (GTK_IS_SOURCE_HIGHLIGHTER (object));
+
+	highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	switch (prop_id)
+	{
+		case PROP_LANGUAGE:
+			g_value_set_object (value, highlighter->priv->language);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
+							   prop_id,
+							   pspec);
+	}
+}
+
+static void
+gtk_source_highlighter_class_init (GtkSourceHighlighterClass *klass)
+{
+	GObjectClass *object_class;
+
+	object_class = G_OBJECT_CLASS (klass);
+
+	object_class->finalize = gtk_source_highlighter_finalize;
+	object_class->set_property = gtk_source_highlighter_set_property;
+	object_class->get_property = gtk_source_highlighter_get_property;
+
+	/**
+	 * GtkSourceHighlighter:language:
+	 *
+	 * The language whose rules are used to analyze text.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LANGUAGE,
+					 g_param_spec_object ("language",
+							      _("Language"),
+							      _("Language used to analyze text"),
+							      GTK_TYPE_SOURCE_LANGUAGE,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT_ONLY));
+
+	g_type_class_add_private (object_class, sizeof (GtkSourceHighlighterPrivate));
+}
+
+static void
+gtk_source_highlighter_init (GtkSourceHighlighter *highlighter)
+{
+	highlighter->priv = G_TYPE_INSTANCE_GET_PRIVATE (highlighter,
+							 GTK_TYPE_SOURCE_HIGHLIGHTER,
+							 GtkSourceHighlighterPrivate);
+}
+
+/**
+ * gtk_source_highlighter_new:
+ * @language: a #GtkSourceLanguage.
+ *
+ * Creates a new highlighter using the rules of @language, loading
+ * its definition file if needed.
+ *
+ * Return value: a new #GtkSourceHighlighter.
+ *
+ * Since: 3.0
+ **/
+GtkSourceHighlighter *
+gtk_source_highlighter_new (GtkSourceLanguage *language)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE (language), NULL);
+
+	return g_object_new (GTK_TYPE_SOURCE_HIGHLIGHTER,
+			     "language", language,
+			     NULL);
+}
+
+/**
+ * gtk_source_highlighter_get_language:
+ * @highlighter: a #GtkSourceHighlighter.
+ *
+ * Return value: (transfer none): the #GtkSourceLanguage of @highlighter.
+ *
+ * Since: 3.0
+ **/
+GtkSourceLanguage *
+gtk_source_highlighter_get_language (GtkSourceHighlighter *highlighter)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_HIGHLIGHTER (highlighter), NULL);
+
+	return highlighter->priv->language;
+}
+
+/**
+ * gtk_source_highlighter_highlight_text:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @text: UTF-8 text to analyze.
+ * @length: length of @text in bytes, or -1 if it is nul-terminated.
+ * @n_spans: (out): return location for the number of spans.
+ *
+ * Analyzes @text and returns the ids of the styles applied to it, the
+ * ids a #GtkSourceBuffer containing @text would look up in its
+ * #GtkSourceStyleScheme. A scheme may not define a style with such an
+ * id, e.g. "c:comment": then the buffer uses the style the id maps to
+ * in the language file, e.g. "def:comment", and so on. Spans are
+ * sorted by offset; spans may nest, e.g. a span of a comment may
+ * contain a span of a "TODO" note, and then the inner span comes
+ * after the outer one and takes precedence over it.
+ *
+ * This function may be called from any thread.
+ *
+ * Return value: (array length=n_spans) (transfer full): a newly
+ * allocated array of spans, free it with g_free(). %NULL if no style
+ * applies to @text, or if @text is not valid UTF-8.
+ *
+ * Since: 3.0
+ **/
+GtkSourceStyleSpan *
+gtk_source_highlighter_highlight_text (GtkSourceHighlighter *highlighter,
+				       const gchar          *text,
+				       gssize                length,
+				       guint                *n_spans)
+{
+	GArray *spans;
+
+	g_return_val_if_fail (GTK_IS_SOURCE_HIGHLIGHTER (highlighter), NULL);
+	g_return_val_if_fail (text != NULL, NULL);
+	g_return_val_if_fail (n_spans != NULL, NULL);
+
+	*n_spans = 0;
+
+	/* The engine relies on it, so check it even if checks are
+	 * disabled. */
+	if (!g_utf8_validate (text, length, NULL))
+	{
+		g_warning ("%s: the text is not valid UTF-8", G_STRFUNC);
+		return NULL;
+	}
+
+	if (highlighter->priv->ctx_data == NULL)
+		return NULL;
+
+	if (length < 0)
+		length = strlen (text);
+
+	spans = _gtk_source_context_data_highlight_text (highlighter->priv->ctx_data,
+							 text, length);
+	*n_spans = spans->len;
+
+	return (GtkSourceStyleSpan *) g_array_free (spans, spans->len == 0);
+}
+
+/**
+ * gtk_source_highlighter_highlight_stream:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @stream: a #GInputStream providing UTF-8 text.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @n_spans: (out): return location for the number of spans.
+ * @error: (allow-none): return location for a #GError, or %NULL.
+ *
+ * Reads @stream to the end and analyzes the text like
+ * gtk_source_highlighter_highlight_text() does. The whole text is
+ * kept in memory until it is analyzed, so this needs as much memory
+ * as reading the stream into a string first; it only saves doing that
+ * by hand.
+ *
+ * This function may be called from any thread.
+ *
+ * Return value: (array length=n_spans) (transfer full): a newly
+ * allocated array of spans, free it with g_free(). %NULL if no style
+ * applies to the text, or if an error occurred, in which case @error
+ * is set.
+ *
+ * Since: 3.0
+ **/
+GtkSourceStyleSpan *
+gtk_source_highlighter_highlight_stream (GtkSourceHighlighter  *highlighter,
+					 GInputStream          *stream,
+					 GCancellable          *cancellable,
+					 guint                 *n_spans,
+					 GError               **error)
+{
+	GByteArray *text;
+	GtkSourceStyleSpan *spans = NULL;
+	gssize n_read;
+
+	g_return_val_if_fail (GTK_IS_SOURCE_HIGHLIGHTER (highlighter), NULL);
+	g_return_val_if_fail (G_IS_INPUT_STREAM (stream), NULL);
+	g_return_val_if_fail (n_spans != NULL, NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	*n_spans = 0;
+
+	/* _gtk_source_context_data_highlight_text() takes the whole
+	 * text, so the stream is read to the end first. */
+	text = g_byte_array_new ();
+
+	do
+	{
+		guint len = text->len;
+
+		g_byte_array_set_size (text, len + STREAM_READ_SIZE);
+		n_read = g_input_stream_read (stream, text->data + len,
+					      STREAM_READ_SIZE,
+					      cancellable, error);
+		g_byte_array_set_size (text, len + MAX (n_read, 0));
+	}
+	while (n_read > 0);
+
+	if (n_read == 0)
+	{
+		if (!g_utf8_validate ((const gchar *) text->data, text->len, NULL))
+		{
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     _("The text is not valid UTF-8"));
+		}
+		else if (text->len > 0)
+		{
+			spans = gtk_source_highlighter_highlight_text (highlighter,
+								       (const gchar *) text->data,
+								       text->len,
+								       n_spans);
+		}
+	}
+
+	g_byte_array_free (text, TRUE);
+
+	return spans;
+}
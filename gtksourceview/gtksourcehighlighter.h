@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*-
+ * gtksourcehighlighter.h
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GTK_SOURCE_HIGHLIGHTER_H__
+#define __GTK_SOURCE_HIGHLIGHTER_H__
+
+#include <gio/gio.h>
+#include <gtksourceview/gtksourcelanguage.h>
+
+G_BEGIN_DECLS
+
+#define GTK_TYPE_SOURCE_HIGHLIGHTER             (gtk_source_highlighter_get_type ())
+#define GTK_SOURCE_HIGHLIGHTER(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), GTK_TYPE_SOURCE_HIGHLIGHTER, GtkSourceHighlighter))
+#define GTK_SOURCE_HIGHLIGHTER_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), GTK_TYPE_SOURCE_HIGHLIGHTER, GtkSourceHighlighterClass))
+#define GTK_IS_SOURCE_HIGHLIGHTER(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GTK_TYPE_SOURCE_HIGHLIGHTER))
+#define GTK_IS_SOURCE_HIGHLIGHTER_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), GTK_TYPE_SOURCE_HIGHLIGHTER))
+#define GTK_SOURCE_HIGHLIGHTER_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS ((obj), GTK_TYPE_SOURCE_HIGHLIGHTER, GtkSourceHighlighterClass))
+
+typedef struct _GtkSourceHighlighter		GtkSourceHighlighter;
+typedef struct _GtkSourceHighlighterClass	GtkSourceHighlighterClass;
+typedef struct _GtkSourceHighlighterPrivate	GtkSourceHighlighterPrivate;
+typedef struct _GtkSourceStyleSpan		GtkSourceStyleSpan;
+
+/**
+ * GtkSourceStyleSpan:
+ * @offset: offset of the first character of the span, in characters.
+ * @length: length of the span, in characters.
+ * @style_id: id of the style, e.g. "c:comment". It's an interned
+ *  string, see g_intern_string().
+ *
+ * A piece of text with a style, as found by
+ * gtk_source_highlighter_highlight_text().
+ *
+ * Since: 3.0
+ */
+struct _GtkSourceStyleSpan
+{
+	gint         offset;
+	gint         length;
+	const gchar *style_id;
+};
+
+struct _GtkSourceHighlighter
+{
+	GObject parent_instance;
+
+	GtkSourceHighlighterPrivate *priv;
+};
+
+struct _GtkSourceHighlighterClass
+{
+	GObjectClass parent_class;
+
+	/* Padding for future expansion */
+	void (*_gtk_source_reserved1) (void);
+	void (*_gtk_source_reserved2) (void);
+};
+
+GType			 gtk_source_highlighter_get_type	(void) G_GNUC_CONST;
+
+GtkSourceHighlighter	*gtk_source_highlighter_new		(GtkSourceLanguage    *language);
+
+GtkSourceLanguage	*gtk_source_highlighter_get_language	(GtkSourceHighlighter *highlighter);
+
+GtkSourceStyleSpan	*gtk_source_highlighter_highlight_text	(GtkSourceHighlighter *highlighter,
+								 const gchar          *text,
+								 gssize                length,
+								 guint                *n_spans);
+
+GtkSourceStyleSpan	*gtk_source_highlighter_highlight_stream
+								(GtkSourceHighlighter *highlighter,
+								 GInputStream         *stream,
+								 GCancellable         *cancellable,
+								 guint                *n_spans,
+								 GError              **error);
+
+G_END_DECLS
+
+#endif /* __GTK_SOURCE_HIGHLIGHTER_H__ */
@@ -0,0 +1,476 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*-
+ * gtksourcelanguage-cache.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gtksourcelanguage-cache.h"
+#include "gtksourcelanguage.h"
+#include "gtksourcelanguage-private.h"
+#include "gtksourcecontextengine.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Parsing a version 2 lang file means reading the XML of the file and
+ * of every file it refers to, expanding regexes and resolving context
+ * references. The result, the definitions in GtkSourceContextData and
+ * the styles, is stored in the user cache directory, and used instead
+ * of the files as long as none of them changed.
+ *
+ * The cache is specific to the machine, so values are stored in host
+ * byte order. A file looks like this:
+ *
+ *   "GSVC"  magic
+ *   uint    CACHE_BYTE_ORDER
+ *   uint    CACHE_FORMAT_VERSION
+ *   string  PACKAGE_VERSION, the parser may change with the library
+ *   string  language of translated style names
+ *   uint    number of lang files used, and for each of them:
+ *     string  language id
+ *     string  file name
+ *     uint64  modification time, in nanoseconds if known
+ *     uint64  size
+ *   uint    number of styles, and for each of them:
+ *     string  style id
+ *     string  name
+ *     string  map-to
+ *   definitions, see _gtk_source_context_data_save()
+ *
+ * A string is its length followed by its bytes without nul, NULL is
+ * stored as length G_MAXUINT32.
+ */
+
+#define CACHE_MAGIC		"GSVC"
+#define CACHE_BYTE_ORDER	0x01020304
+#define CACHE_FORMAT_VERSION	2
+#define CACHE_SUFFIX		".langcache"
+
+#define NULL_STRING		G_MAXUINT32
+
+void
+_gtk_source_cache_write_uint (GString *out,
+			      guint32  value)
+{
+	g_string_append_len (out, (const gchar *) &value, sizeof (value));
+}
+
+void
+_gtk_source_cache_write_uint64 (GString *out,
+				guint64  value)
+{
+	g_string_append_len (out, (const gchar *) &value, sizeof (value));
+}
+
+void
+_gtk_source_cache_write_string (GString     *out,
+				const gchar *string)
+{
+	if (string == NULL)
+	{
+		_gtk_source_cache_write_uint (out, NULL_STRING);
+	}
+	else
+	{
+		gsize len = strlen (string);
+
+		_gtk_source_cache_write_uint (out, len);
+		g_string_append_len (out, string, len);
+	}
+}
+
+static gboolean
+reader_take_ (GtkSourceCacheReader *reader,
+	      gpointer              dest,
+	      gsize                 size)
+{
+	if (reader->failed || (gsize) (reader->end - reader->pos) < size)
+	{
+		reader->failed = TRUE;
+		return FALSE;
+	}
+
+	/* The mapped data needs not be aligned. */
+	memcpy (dest, reader->pos, size);
+	reader->pos += size;
+
+	return TRUE;
+}
+
+guint32
+_gtk_source_cache_read_uint (GtkSourceCacheReader *reader)
+{
+	guint32 value;
+
+	if (!reader_take_ (reader, &value, sizeof (value)))
+		return 0;
+
+	return value;
+}
+
+guint64
+_gtk_source_cache_read_uint64 (GtkSourceCacheReader *reader)
+{
+	guint64 value;
+
+	if (!reader_take_ (reader, &value, sizeof (value)))
+		return 0;
+
+	return value;
+}
+
+gchar *
+_gtk_source_cache_read_string (GtkSourceCacheReader *reader)
+{
+	guint32 len;
+	gchar *string;
+
+	len = _gtk_source_cache_read_uint (reader);
+
+	if (reader->failed || len == NULL_STRING)
+		return NULL;
+
+	if ((gsize) (reader->end - reader->pos) < len)
+	{
+		reader->failed = TRUE;
+		return NULL;
+	}
+
+	string = g_strndup (reader->pos, len);
+	reader->pos += len;
+
+	return string;
+}
+
+static gchar *
+get_cache_file_name (GtkSourceLanguage *language)
+{
+	gchar *basename;
+	gchar *filename;
+
+	basename = g_strconcat (gtk_source_language_get_id (language),
+				CACHE_SUFFIX, NULL);
+	filename = g_build_filename (g_get_user_cache_dir (),
+				     "gtksourceview-3.0",
+				     "language-specs",
+				     basename,
+				     NULL);
+	g_free (basename);
+
+	return filename;
+}
+
+/* Seconds are not enough: a file saved twice in a second, with the
+ * same size, would look unchanged. */
+static guint64
+get_mtime (struct stat *buf)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	return (guint64) buf->st_mtime * G_GUINT64_CONSTANT (1000000000) +
+	       buf->st_mtim.tv_nsec;
+#else
+	return buf->st_mtime;
+#endif
+}
+
+static const gchar *
+get_locale (void)
+{
+	return g_get_language_names ()[0];
+}
+
+typedef struct
+{
+	GString			 *out;
+	GtkSourceLanguageManager *lm;
+	gboolean		  ok;
+} WriteDepsData;
+
+static void
+write_dependency (const gchar   *lang_id,
+		  G_GNUC_UNUSED gpointer value,
+		  WriteDepsData *data)
+{
+	GtkSourceLanguage *language;
+	struct stat buf;
+
+	if (!data->ok)
+		return;
+
+	language = gtk_source_language_manager_get_language (data->lm, lang_id);
+
+	if (language == NULL ||
+	    g_stat (language->priv->lang_file_name, &buf) != 0)
+	{
+		data->ok = FALSE;
+		return;
+	}
+
+	_gtk_source_cache_write_string (data->out, lang_id);
+	_gtk_source_cache_write_string (data->out, language->priv->lang_file_name);
+	_gtk_source_cache_write_uint64 (data->out, get_mtime (&buf));
+	_gtk_source_cache_write_uint64 (data->out, buf.st_size);
+}
+
+static void
+write_style (const gchar        *id,
+	     GtkSourceStyleInfo *info,
+	     GString            *out)
+{
+	_gtk_source_cache_write_string (out, id);
+	_gtk_source_cache_write_string (out, info->name);
+	_gtk_source_cache_write_string (out, info->map_to);
+}
+
+/**
+ * _gtk_source_language_cache_save:
+ *
+ * @language: a version 2 #GtkSourceLanguage.
+ * @ctx_data: definitions parsed from the lang file of @language.
+ * @styles: styles parsed from the lang files, maps ids to
+ * #GtkSourceStyleInfo.
+ * @loaded_lang_ids: ids of the languages whose files were parsed.
+ *
+ * Writes the cache file of @language. Failures are not reported,
+ * the lang file is parsed again next time.
+ */
+void
+_gtk_source_language_cache_save (GtkSourceLanguage    *language,
+				 GtkSourceContextData *ctx_data,
+				 GHashTable           *styles,
+				 GHashTable           *loaded_lang_ids)
+{
+	GtkSourceLanguageManager *lm;
+	GString *out;
+	gchar *filename;
+	gchar *dirname;
+	WriteDepsData data;
+
+	lm = _gtk_source_language_get_language_manager (language);
+
+	if (lm == NULL)
+		return;
+
+	out = g_string_new (NULL);
+
+	g_string_append_len (out, CACHE_MAGIC, 4);
+	_gtk_source_cache_write_uint (out, CACHE_BYTE_ORDER);
+	_gtk_source_cache_write_uint (out, CACHE_FORMAT_VERSION);
+	_gtk_source_cache_write_string (out, PACKAGE_VERSION);
+	_gtk_source_cache_write_string (out, get_locale ());
+
+	data.out = out;
+	data.lm = lm;
+	data.ok = TRUE;
+	_gtk_source_cache_write_uint (out, g_hash_table_size (loaded_lang_ids));
+	g_hash_table_foreach (loaded_lang_ids, (GHFunc) write_dependency, &data);
+
+	_gtk_source_cache_write_uint (out, g_hash_table_size (styles));
+	g_hash_table_foreach (styles, (GHFunc) write_style, out);
+
+	_gtk_source_context_data_save (ctx_data, out);
+
+	filename = get_cache_file_name (language);
+	dirname = g_path_get_dirname (filename);
+
+	/* The file is written to a temporary file and renamed, so other
+	 * processes see either the old contents or the new ones. */
+	if (data.ok && g_mkdir_with_parents (dirname, 0755) == 0)
+		g_file_set_contents (filename, out->str, out->len, NULL);
+
+	g_free (dirname);
+	g_free (filename);
+	g_string_free (out, TRUE);
+}
+
+static gboolean
+check_header (GtkSourceCacheReader *reader)
+{
+	gchar *package_version;
+	gchar *locale;
+	gboolean ok;
+
+	if (reader->end - reader->pos < 4 ||
+	    memcmp (reader->pos, CACHE_MAGIC, 4) != 0)
+		return FALSE;
+
+	reader->pos += 4;
+
+	if (_gtk_source_cache_read_uint (reader) != CACHE_BYTE_ORDER ||
+	    _gtk_source_cache_read_uint (reader) != CACHE_FORMAT_VERSION)
+		return FALSE;
+
+	package_version = _gtk_source_cache_read_string (reader);
+	locale = _gtk_source_cache_read_string (reader);
+
+	ok = !reader->failed &&
+	     g_strcmp0 (package_version, PACKAGE_VERSION) == 0 &&
+	     g_strcmp0 (locale, get_locale ()) == 0;
+
+	g_free (package_version);
+	g_free (locale);
+
+	return ok;
+}
+
+static gboolean
+check_dependencies (GtkSourceCacheReader     *reader,
+		    GtkSourceLanguage        *language,
+		    GtkSourceLanguageManager *lm)
+{
+	guint n_deps, i;
+	gboolean has_main = FALSE;
+
+	n_deps = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_deps && !reader->failed; ++i)
+	{
+		GtkSourceLanguage *dep;
+		gchar *lang_id;
+		gchar *filename;
+		guint64 mtime, size;
+		struct stat buf;
+		gboolean ok;
+
+		lang_id = _gtk_source_cache_read_string (reader);
+		filename = _gtk_source_cache_read_string (reader);
+		mtime = _gtk_source_cache_read_uint64 (reader);
+		size = _gtk_source_cache_read_uint64 (reader);
+
+		/* Another file may define the language now, e.g. a user
+		 * copy of a system file. */
+		dep = NULL;
+		if (lang_id != NULL)
+			dep = gtk_source_language_manager_get_language (lm, lang_id);
+
+		ok = !reader->failed &&
+		     dep != NULL &&
+		     filename != NULL &&
+		     strcmp (dep->priv->lang_file_name, filename) == 0 &&
+		     g_stat (filename, &buf) == 0 &&
+		     get_mtime (&buf) == mtime &&
+		     (guint64) buf.st_size == size;
+
+		if (dep == language)
+			has_main = TRUE;
+
+		g_free (lang_id);
+		g_free (filename);
+
+		if (!ok)
+			return FALSE;
+	}
+
+	return !reader->failed && has_main;
+}
+
+/**
+ * _gtk_source_language_cache_load:
+ *
+ * @language: a version 2 #GtkSourceLanguage.
+ * @ctx_data: empty #GtkSourceContextData of @language.
+ * @styles: table to store the styles of @language in.
+ *
+ * Reads the definitions and the styles of @language from its cache
+ * file, if it exists and none of the lang files it was made from
+ * changed since.
+ *
+ * Returns: %TRUE if @ctx_data and @styles were filled from the cache,
+ * %FALSE if the lang file must be parsed.
+ */
+gboolean
+_gtk_source_language_cache_load (GtkSourceLanguage    *language,
+				 GtkSourceContextData *ctx_data,
+				 GHashTable           *styles)
+{
+	GtkSourceLanguageManager *lm;
+	GtkSourceCacheReader reader;
+	GMappedFile *file;
+	GHashTable *loaded_styles;
+	gchar *filename;
+	gboolean success = FALSE;
+	guint n_styles, i;
+
+	lm = _gtk_source_language_get_language_manager (language);
+
+	if (lm == NULL)
+		return FALSE;
+
+	filename = get_cache_file_name (language);
+	file = g_mapped_file_new (filename, FALSE, NULL);
+	g_free (filename);
+
+	if (file == NULL)
+		return FALSE;
+
+	reader.pos = g_mapped_file_get_contents (file);
+	reader.end = reader.pos + g_mapped_file_get_length (file);
+	reader.failed = FALSE;
+
+	if (!check_header (&reader) ||
+	    !check_dependencies (&reader, language, lm))
+	{
+		g_mapped_file_unref (file);
+		return FALSE;
+	}
+
+	loaded_styles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					       (GDestroyNotify) _gtk_source_style_info_free);
+
+	n_styles = _gtk_source_cache_read_uint (&reader);
+
+	for (i = 0; i < n_styles && !reader.failed; ++i)
+	{
+		gchar *id, *name, *map_to;
+
+		id = _gtk_source_cache_read_string (&reader);
+		name = _gtk_source_cache_read_string (&reader);
+		map_to = _gtk_source_cache_read_string (&reader);
+
+		if (id != NULL)
+			g_hash_table_insert (loaded_styles, id,
+					     _gtk_source_style_info_new (name, map_to));
+
+		g_free (name);
+		g_free (map_to);
+	}
+
+	if (!reader.failed)
+		success = _gtk_source_context_data_load (ctx_data, &reader);
+
+	if (success)
+	{
+		GHashTableIter iter;
+		gpointer id, info;
+
+		g_hash_table_iter_init (&iter, loaded_styles);
+
+		while (g_hash_table_iter_next (&iter, &id, &info))
+		{
+			g_hash_table_iter_steal (&iter);
+			g_hash_table_insert (styles, id, info);
+		}
+	}
+
+	g_hash_table_destroy (loaded_styles);
+	g_mapped_file_unref (file);
+
+	return success;
+}
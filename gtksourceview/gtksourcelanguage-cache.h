@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*-
+ * gtksourcelanguage-cache.h
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GTK_SOURCE_LANGUAGE_CACHE_H__
+#define __GTK_SOURCE_LANGUAGE_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GtkSourceCacheReader GtkSourceCacheReader;
+
+/* Reads values written by the _gtk_source_cache_write_*() functions
+ * from a mapped cache file. Reading past the end sets failed, and
+ * then every read returns 0 or NULL. */
+struct _GtkSourceCacheReader
+{
+	const gchar	*pos;
+	const gchar	*end;
+	gboolean	 failed;
+};
+
+void		 _gtk_source_cache_write_uint		(GString		*out,
+							 guint32		 value);
+void		 _gtk_source_cache_write_uint64		(GString		*out,
+							 guint64		 value);
+void		 _gtk_source_cache_write_string		(GString		*out,
+							 const gchar		*string);
+
+guint32		 _gtk_source_cache_read_uint		(GtkSourceCacheReader	*reader);
+guint64		 _gtk_source_cache_read_uint64		(GtkSourceCacheReader	*reader);
+gchar		*_gtk_source_cache_read_string		(GtkSourceCacheReader	*reader);
+
+G_END_DECLS
+
+#endif  /* __GTK_SOURCE_LANGUAGE_CACHE_H__ */
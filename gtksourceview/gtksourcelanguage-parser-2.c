@@ -351,6 +351,149 @@ parse_classes (ParserState *parser_state)
 	return ret;
 }
 
+/**
+ * is_plain_keyword:
+ *
+ * Returns: whether @keyword is a word matching only itself.
+ */
+static gboolean
+is_plain_keyword (const gchar *keyword)
+{
+	if (*keyword == 0)
+		return FALSE;
+
+	for ( ; *keyword != 0; keyword++)
+		if (!g_ascii_isalnum (*keyword) && *keyword != '_')
+			return FALSE;
+
+	return TRUE;
+}
+
+static gint
+compare_keywords (gconstpointer a,
+		  gconstpointer b)
+{
+	return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/**
+ * append_keyword_trie:
+ *
+ * @regex: where to append the regex.
+ * @keywords: sorted array of keywords with the same first @depth characters.
+ * @n_keywords: number of keywords.
+ * @depth: length of the common prefix, already appended to @regex.
+ *
+ * Appends a regex matching the rest of @keywords, where common
+ * prefixes are matched only once, e.g. "int(?:eger)?|float".
+ */
+static void
+append_keyword_trie (GString      *regex,
+		     const gchar **keywords,
+		     gint          n_keywords,
+		     gint          depth)
+{
+	GString *branches;
+	gboolean optional = FALSE;
+	gint n_branches = 0;
+	gint i, j;
+
+	branches = g_string_new (NULL);
+
+	for (i = 0; i < n_keywords; i = j)
+	{
+		gchar c = keywords[i][depth];
+
+		j = i + 1;
+
+		/* The keyword ends here, it sorts before longer ones. */
+		if (c == 0)
+		{
+			optional = TRUE;
+			continue;
+		}
+
+		while (j < n_keywords && keywords[j][depth] == c)
+			j++;
+
+		if (n_branches++ > 0)
+			g_string_append_c (branches, '|');
+
+		g_string_append_c (branches, c);
+		append_keyword_trie (branches, keywords + i, j - i, depth + 1);
+	}
+
+	if (n_branches == 1 && !optional)
+	{
+		g_string_append (regex, branches->str);
+	}
+	else if (n_branches > 0)
+	{
+		g_string_append (regex, "(?:");
+		g_string_append (regex, branches->str);
+		g_string_append (regex, optional ? ")?" : ")");
+	}
+
+	g_string_free (branches, TRUE);
+}
+
+/**
+ * create_keywords_regex:
+ *
+ * @keywords: array of keywords.
+ * @prefix: regex to match before the keywords.
+ * @suffix: regex to match after the keywords.
+ *
+ * pcre tries the alternatives of "\b(foo|bar|...)\b" one by one at every
+ * word boundary, which is slow with long lists of keywords. If the keywords
+ * are plain words and @suffix requires a word boundary after the keyword, at
+ * most one keyword may match at a given position. Then the order in which
+ * they are tried does not matter, and the keywords are matched by a regex
+ * made out of a trie.
+ *
+ * Returns: the regex for the keywords.
+ */
+static gchar *
+create_keywords_regex (GPtrArray   *keywords,
+		       const gchar *prefix,
+		       const gchar *suffix)
+{
+	GString *regex;
+	gboolean plain;
+	guint i;
+
+	plain = g_str_has_prefix (suffix, "\\b");
+
+	for (i = 0; plain && i < keywords->len; i++)
+		plain = is_plain_keyword (g_ptr_array_index (keywords, i));
+
+	regex = g_string_new (prefix);
+	g_string_append (regex, "(");
+
+	if (plain)
+	{
+		g_ptr_array_sort (keywords, compare_keywords);
+		append_keyword_trie (regex,
+				     (const gchar **) keywords->pdata,
+				     keywords->len,
+				     0);
+	}
+	else
+	{
+		for (i = 0; i < keywords->len; i++)
+		{
+			if (i > 0)
+				g_string_append (regex, "|");
+			g_string_append (regex, g_ptr_array_index (keywords, i));
+		}
+	}
+
+	g_string_append (regex, ")");
+	g_string_append (regex, suffix);
+
+	return g_string_free (regex, FALSE);
+}
+
 static gboolean
 create_definition (ParserState *parser_state,
 		   gchar       *id,
@@ -361,11 +504,12 @@ create_definition (ParserState *parser_state,
 {
 	gchar *match = NULL, *start = NULL, *end = NULL;
 	gchar *prefix = NULL, *suffix = NULL;
+	gchar *keywords_prefix = NULL;
 	GtkSourceContextFlags flags;
 
 	xmlNode *context_node, *child;
 
-	GString *all_items = NULL;
+	GPtrArray *keywords = NULL;
 
 	GRegexCompileFlags match_flags = 0, start_flags = 0, end_flags = 0;
 
@@ -454,39 +598,30 @@ create_definition (ParserState *parser_state,
 			 * important, but would be nice (case-sensitive). */
 
 			/* <keyword> */
-			if (all_items == NULL)
+			if (keywords == NULL)
 			{
-				all_items = g_string_new (NULL);
+				keywords = g_ptr_array_new ();
 
 				if (prefix != NULL)
-					g_string_append (all_items, prefix);
+					keywords_prefix = g_strdup (prefix);
 				else
-					g_string_append (all_items,
-							 parser_state->opening_delimiter);
-
-				g_string_append (all_items, "(");
-				g_string_append (all_items, (gchar*) child->children->content);
-			}
-			else
-			{
-				g_string_append (all_items, "|");
-				g_string_append (all_items, (gchar*) child->children->content);
+					keywords_prefix = g_strdup (parser_state->opening_delimiter);
 			}
+
+			g_ptr_array_add (keywords, (gchar *) child->children->content);
 		}
 	}
 
-	if (all_items != NULL)
+	if (keywords != NULL)
 	{
-		g_string_append (all_items, ")");
-
-		if (suffix != NULL)
-			g_string_append (all_items, suffix);
-		else
-			g_string_append (all_items,
-					 parser_state->closing_delimiter);
-
-		match = g_string_free (all_items, FALSE);
+		match = create_keywords_regex (keywords,
+					       keywords_prefix,
+					       suffix != NULL ? suffix :
+					       parser_state->closing_delimiter);
 		match_flags = parser_state->regex_compile_flags;
+
+		g_ptr_array_free (keywords, TRUE);
+		g_free (keywords_prefix);
 	}
 
 	DEBUG (g_message ("start: '%s'", start ? start : "(null)"));
@@ -1122,13 +1257,18 @@ expand_regex_delimiters (ParserState *parser_state,
 	 */
 	const gchar *re = "(?<!\\\\)(\\\\\\\\)*\\\\%(\\[|\\])";
 	gchar *expanded_regex;
-	static GRegex *egg_re;
+	static volatile gsize egg_re_init = 0;
+	static GRegex *egg_re = NULL;
 
 	if (regex == NULL)
 		return NULL;
 
-	if (egg_re == NULL)
+	/* Lang files may be parsed in several threads at once */
+	if (g_once_init_enter (&egg_re_init))
+	{
 		egg_re = g_regex_new (re, G_REGEX_NEWLINE_LF | G_REGEX_OPTIMIZE, 0, NULL);
+		g_once_init_leave (&egg_re_init, 1);
+	}
 
 	expanded_regex = g_regex_replace_eval (egg_re, regex, len, 0, 0,
 					       replace_delimiter, parser_state, NULL);
@@ -1149,6 +1289,7 @@ expand_regex (ParserState *parser_state,
 {
 	gchar *tmp_regex;
 	GString *expanded_regex;
+	static volatile gsize backref_re_init = 0;
 	static GRegex *backref_re = NULL;
 
 	g_assert (parser_state != NULL);
@@ -1157,11 +1298,15 @@ expand_regex (ParserState *parser_state,
 	if (regex == NULL)
 		return NULL;
 
-	if (backref_re == NULL)
+	/* Lang files may be parsed in several threads at once */
+	if (g_once_init_enter (&backref_re_init))
+	{
 		backref_re = g_regex_new ("(?<!\\\\)(\\\\\\\\)*\\\\[0-9]",
 					  G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF,
 					  0,
 					  NULL);
+		g_once_init_leave (&backref_re_init, 1);
+	}
 
 	if (g_regex_match (backref_re, regex, 0, NULL))
 	{
@@ -1779,7 +1924,8 @@ steal_styles_mapping (gchar              *style_id,
 
 gboolean
 _gtk_source_language_file_parse_version2 (GtkSourceLanguage       *language,
-					  GtkSourceContextData    *ctx_data)
+					  GtkSourceContextData    *ctx_data,
+					  GHashTable              *language_styles)
 {
 	GHashTable *defined_regexes, *styles;
 	gboolean success;
@@ -1790,6 +1936,9 @@ _gtk_source_language_file_parse_version2 (GtkSourceLanguage       *language,
 
 	g_return_val_if_fail (ctx_data != NULL, FALSE);
 
+	if (_gtk_source_language_cache_load (language, ctx_data, language_styles))
+		return TRUE;
+
 	filename = language->priv->lang_file_name;
 
 	/* TODO: as an optimization tell the parser to merge CDATA
@@ -1820,10 +1969,14 @@ _gtk_source_language_file_parse_version2 (GtkSourceLanguage       *language,
 	if (success)
 		success = _gtk_source_context_data_finish_parse (ctx_data, replacements->head, &error);
 
+	if (success)
+		_gtk_source_language_cache_save (language, ctx_data,
+						 styles, loaded_lang_ids);
+
 	if (success)
 		g_hash_table_foreach_steal (styles,
 					    (GHRFunc) steal_styles_mapping,
-					    language->priv->styles);
+					    language_styles);
 
 	g_queue_foreach (replacements, (GFunc) _gtk_source_context_replace_free, NULL);
 	g_queue_free (replacements);
@@ -64,6 +64,11 @@ struct _GtkSourceLanguagePrivate
 };
 
 GtkSourceLanguage 	 *_gtk_source_language_new_from_file 		(const gchar		   *filename,
+									 GtkSourceLanguageManager  *lm,
+									 GString		   *index);
+
+GtkSourceLanguage 	 *_gtk_source_language_new_from_index 		(GtkSourceCacheReader	   *reader,
+									 const gchar		   *dirname,
 									 GtkSourceLanguageManager  *lm);
 
 GtkSourceLanguageManager *_gtk_source_language_get_language_manager 	(GtkSourceLanguage        *language);
@@ -79,10 +84,21 @@ gboolean 		  _gtk_source_language_file_parse_version1 	(GtkSourceLanguage
 									 GtkSourceContextData     *ctx_data);
 
 gboolean 		  _gtk_source_language_file_parse_version2	(GtkSourceLanguage        *language,
-									 GtkSourceContextData     *ctx_data);
+									 GtkSourceContextData     *ctx_data,
+									 GHashTable               *styles);
 
 GtkSourceEngine 	 *_gtk_source_language_create_engine		(GtkSourceLanguage	  *language);
 
+GtkSourceContextData	 *_gtk_source_language_get_context_data		(GtkSourceLanguage	  *language);
+
+gboolean		  _gtk_source_language_cache_load		(GtkSourceLanguage	  *language,
+									 GtkSourceContextData	  *ctx_data,
+									 GHashTable		  *styles);
+void			  _gtk_source_language_cache_save		(GtkSourceLanguage	  *language,
+									 GtkSourceContextData	  *ctx_data,
+									 GHashTable		  *styles,
+									 GHashTable		  *loaded_lang_ids);
+
 /* Utility functions for GtkSourceStyleInfo */
 GtkSourceStyleInfo 	 *_gtk_source_style_info_new 			(const gchar		  *name,
 									 const gchar              *map_to);
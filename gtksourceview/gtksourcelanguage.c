@@ -65,76 +65,185 @@ enum {
 
 G_DEFINE_TYPE (GtkSourceLanguage, gtk_source_language, G_TYPE_OBJECT)
 
-static GtkSourceLanguage *process_language_node (xmlTextReaderPtr	 reader,
+static GtkSourceLanguage *process_language_node (GHashTable		*attributes,
+						 GHashTable		*metadata,
 						 const gchar		*filename);
+static gboolean		  read_language_file	(const gchar		*filename,
+						 GHashTable		*attributes,
+						 GHashTable		*metadata);
 static gboolean		  force_styles		(GtkSourceLanguage	*language);
 
+static void
+set_language_manager (GtkSourceLanguage        *lang,
+		      GtkSourceLanguageManager *lm)
+{
+	lang->priv->language_manager = lm;
+	g_object_add_weak_pointer (G_OBJECT (lm),
+				   (gpointer) &lang->priv->language_manager);
+}
+
+static GHashTable *
+string_table_new (void)
+{
+	return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+write_string_table (GString    *out,
+		    GHashTable *table)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	_gtk_source_cache_write_uint (out, g_hash_table_size (table));
+
+	g_hash_table_iter_init (&iter, table);
+
+	while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+		_gtk_source_cache_write_string (out, key);
+		_gtk_source_cache_write_string (out, value);
+	}
+}
+
+static GHashTable *
+read_string_table (GtkSourceCacheReader *reader)
+{
+	GHashTable *table;
+	guint n_items, i;
+
+	table = string_table_new ();
+	n_items = _gtk_source_cache_read_uint (reader);
+
+	for (i = 0; i < n_items && !reader->failed; ++i)
+	{
+		gchar *key, *value;
+
+		key = _gtk_source_cache_read_string (reader);
+		value = _gtk_source_cache_read_string (reader);
+
+		if (key == NULL || value == NULL)
+		{
+			reader->failed = TRUE;
+			g_free (key);
+			g_free (value);
+		}
+		else
+		{
+			g_hash_table_insert (table, key, value);
+		}
+	}
+
+	return table;
+}
+
+/**
+ * _gtk_source_language_new_from_file:
+ *
+ * @filename: lang file.
+ * @lm: #GtkSourceLanguageManager.
+ * @index: (allow-none): language index to append an entry to.
+ *
+ * Reads the <language> element of @filename. If @index is not %NULL,
+ * the attributes and the metadata found are appended to it, so that
+ * _gtk_source_language_new_from_index() can later create the
+ * language without opening the file.
+ *
+ * Returns: a new #GtkSourceLanguage, or %NULL on error.
+ */
 GtkSourceLanguage *
 _gtk_source_language_new_from_file (const gchar              *filename,
-				    GtkSourceLanguageManager *lm)
+				    GtkSourceLanguageManager *lm,
+				    GString                  *index)
 {
 	GtkSourceLanguage *lang = NULL;
-	xmlTextReaderPtr reader = NULL;
-	gint ret;
-	gint fd;
+	GHashTable *attributes;
+	GHashTable *metadata;
 
 	g_return_val_if_fail (filename != NULL, NULL);
 	g_return_val_if_fail (lm != NULL, NULL);
 
-	/*
-	 * Use fd instead of filename so that it's utf8 safe on w32.
-	 */
-	fd = g_open (filename, O_RDONLY, 0);
-	if (fd != -1)
-		reader = xmlReaderForFd (fd, filename, NULL, 0);
+	attributes = string_table_new ();
+	metadata = string_table_new ();
 
-	if (reader != NULL)
+	if (read_language_file (filename, attributes, metadata))
+		lang = process_language_node (attributes, metadata, filename);
+
+	if (lang != NULL)
 	{
-        	ret = xmlTextReaderRead (reader);
+		set_language_manager (lang, lm);
 
-        	while (ret == 1)
+		if (index != NULL)
 		{
-			if (xmlTextReaderNodeType (reader) == 1)
-			{
-				xmlChar *name;
+			gchar *basename = g_path_get_basename (filename);
 
-				name = xmlTextReaderName (reader);
+			_gtk_source_cache_write_string (index, basename);
+			write_string_table (index, attributes);
+			write_string_table (index, metadata);
 
-				if (xmlStrcmp (name, BAD_CAST "language") == 0)
-				{
-					lang = process_language_node (reader, filename);
-					ret = 0;
-				}
+			g_free (basename);
+		}
+	}
 
-				xmlFree (name);
-			}
+	g_hash_table_destroy (attributes);
+	g_hash_table_destroy (metadata);
 
-			if (ret == 1)
-				ret = xmlTextReaderRead (reader);
-		}
+	return lang;
+}
+
+/**
+ * _gtk_source_language_new_from_index:
+ *
+ * @reader: language index, at an entry written by
+ * _gtk_source_language_new_from_file().
+ * @dirname: directory the index was made for.
+ * @lm: #GtkSourceLanguageManager.
+ *
+ * Creates the language of the next index entry, as if its lang file
+ * was read.
+ *
+ * Returns: a new #GtkSourceLanguage, or %NULL if the entry is damaged,
+ * in which case reader->failed is set.
+ */
+GtkSourceLanguage *
+_gtk_source_language_new_from_index (GtkSourceCacheReader     *reader,
+				     const gchar              *dirname,
+				     GtkSourceLanguageManager *lm)
+{
+	GtkSourceLanguage *lang = NULL;
+	GHashTable *attributes;
+	GHashTable *metadata;
+	gchar *basename;
 
-		xmlFreeTextReader (reader);
-		close (fd);
+	g_return_val_if_fail (reader != NULL, NULL);
+	g_return_val_if_fail (dirname != NULL, NULL);
+	g_return_val_if_fail (lm != NULL, NULL);
 
-		if (ret != 0)
-		{
-	            g_warning("Failed to parse '%s'", filename);
-		    return NULL;
-		}
-        }
-	else
-	{
-		g_warning("Unable to open '%s'", filename);
+	basename = _gtk_source_cache_read_string (reader);
+	attributes = read_string_table (reader);
+	metadata = read_string_table (reader);
 
-    	}
+	if (basename == NULL)
+		reader->failed = TRUE;
 
-	if (lang != NULL)
+	if (!reader->failed)
 	{
-		lang->priv->language_manager = lm;
-		g_object_add_weak_pointer (G_OBJECT (lm),
-					   (gpointer) &lang->priv->language_manager);
+		gchar *filename = g_build_filename (dirname, basename, NULL);
+
+		lang = process_language_node (attributes, metadata, filename);
+
+		if (lang != NULL)
+			set_language_manager (lang, lm);
+		else
+			reader->failed = TRUE;
+
+		g_free (filename);
 	}
 
+	g_free (basename);
+	g_hash_table_destroy (attributes);
+	g_hash_table_destroy (metadata);
+
 	return lang;
 }
 
@@ -285,8 +394,22 @@ string_to_bool (const gchar *string)
 }
 
 static void
-process_properties (xmlTextReaderPtr   reader,
-		    GtkSourceLanguage *language)
+read_attributes (xmlTextReaderPtr  reader,
+		 GHashTable       *attributes)
+{
+	while (xmlTextReaderMoveToNextAttribute (reader) == 1)
+	{
+		g_hash_table_insert (attributes,
+				     g_strdup ((gchar *) xmlTextReaderConstName (reader)),
+				     g_strdup ((gchar *) xmlTextReaderConstValue (reader)));
+	}
+
+	xmlTextReaderMoveToElement (reader);
+}
+
+static void
+read_metadata (xmlTextReaderPtr  reader,
+	       GHashTable       *metadata)
 {
 	xmlNodePtr child;
 	xmlNodePtr node = NULL;
@@ -330,7 +453,7 @@ process_properties (xmlTextReaderPtr   reader,
 		content = xmlNodeGetContent (child);
 
 		if (name != NULL && content != NULL)
-			g_hash_table_insert (language->priv->properties,
+			g_hash_table_insert (metadata,
 					     g_strdup ((gchar *) name),
 					     g_strdup ((gchar *) content));
 
@@ -339,47 +462,135 @@ process_properties (xmlTextReaderPtr   reader,
 	}
 }
 
+/**
+ * read_language_file:
+ *
+ * @filename: lang file.
+ * @attributes: table to store the attributes of <language> in.
+ * @metadata: table to store the metadata properties in.
+ *
+ * Returns: whether the <language> element was found.
+ */
+static gboolean
+read_language_file (const gchar *filename,
+		    GHashTable  *attributes,
+		    GHashTable  *metadata)
+{
+	xmlTextReaderPtr reader = NULL;
+	gboolean found = FALSE;
+	gint ret;
+	gint fd;
+
+	/*
+	 * Use fd instead of filename so that it's utf8 safe on w32.
+	 */
+	fd = g_open (filename, O_RDONLY, 0);
+	if (fd != -1)
+		reader = xmlReaderForFd (fd, filename, NULL, 0);
+
+	if (reader == NULL)
+	{
+		g_warning("Unable to open '%s'", filename);
+
+		if (fd != -1)
+			close (fd);
+
+		return FALSE;
+	}
+
+	ret = xmlTextReaderRead (reader);
+
+	while (ret == 1)
+	{
+		if (xmlTextReaderNodeType (reader) == 1)
+		{
+			xmlChar *name;
+
+			name = xmlTextReaderName (reader);
+
+			if (xmlStrcmp (name, BAD_CAST "language") == 0)
+			{
+				const gchar *version;
+
+				read_attributes (reader, attributes);
+
+				/* Only version 2 files have metadata. */
+				version = g_hash_table_lookup (attributes, "version");
+				if (g_strcmp0 (version, "2.0") == 0)
+					read_metadata (reader, metadata);
+
+				found = TRUE;
+				ret = 0;
+			}
+
+			xmlFree (name);
+		}
+
+		if (ret == 1)
+			ret = xmlTextReaderRead (reader);
+	}
+
+	xmlFreeTextReader (reader);
+	close (fd);
+
+	if (ret != 0)
+	{
+		g_warning("Failed to parse '%s'", filename);
+		return FALSE;
+	}
+
+	return found;
+}
+
+static void
+copy_property (const gchar       *name,
+	       const gchar       *value,
+	       GtkSourceLanguage *lang)
+{
+	g_hash_table_insert (lang->priv->properties,
+			     g_strdup (name),
+			     g_strdup (value));
+}
+
 static GtkSourceLanguage *
-process_language_node (xmlTextReaderPtr reader, const gchar *filename)
+process_language_node (GHashTable  *attributes,
+		       GHashTable  *metadata,
+		       const gchar *filename)
 {
-	xmlChar *version;
-	xmlChar *tmp;
-	xmlChar *untranslated_name;
+	const gchar *version;
+	const gchar *tmp;
+	const gchar *untranslated_name;
 	GtkSourceLanguage *lang;
 
 	lang = g_object_new (GTK_TYPE_SOURCE_LANGUAGE, NULL);
 
 	lang->priv->lang_file_name = g_strdup (filename);
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "translation-domain");
-	lang->priv->translation_domain = g_strdup ((gchar*) tmp);
-	xmlFree (tmp);
+	tmp = g_hash_table_lookup (attributes, "translation-domain");
+	lang->priv->translation_domain = g_strdup (tmp);
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "hidden");
+	tmp = g_hash_table_lookup (attributes, "hidden");
 	if (tmp != NULL)
-		lang->priv->hidden = string_to_bool ((gchar*) tmp);
+		lang->priv->hidden = string_to_bool (tmp);
 	else
 		lang->priv->hidden = FALSE;
-	xmlFree (tmp);
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "mimetypes");
+	tmp = g_hash_table_lookup (attributes, "mimetypes");
 	if (tmp != NULL)
 		g_hash_table_insert (lang->priv->properties,
 				     g_strdup ("mimetypes"),
-				     g_strdup ((char*) tmp));
-	xmlFree (tmp);
+				     g_strdup (tmp));
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "globs");
+	tmp = g_hash_table_lookup (attributes, "globs");
 	if (tmp != NULL)
 		g_hash_table_insert (lang->priv->properties,
 				     g_strdup ("globs"),
-				     g_strdup ((char*) tmp));
-	xmlFree (tmp);
+				     g_strdup (tmp));
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "_name");
+	tmp = g_hash_table_lookup (attributes, "_name");
 	if (tmp == NULL)
 	{
-		tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "name");
+		tmp = g_hash_table_lookup (attributes, "name");
 
 		if (tmp == NULL)
 		{
@@ -389,46 +600,41 @@ process_language_node (xmlTextReaderPtr reader, const gchar *filename)
 			return NULL;
 		}
 
-		lang->priv->name = g_strdup ((char*) tmp);
+		lang->priv->name = g_strdup (tmp);
 		untranslated_name = tmp;
 	}
 	else
 	{
-		lang->priv->name = _gtk_source_language_translate_string (lang, (gchar*) tmp);
+		lang->priv->name = _gtk_source_language_translate_string (lang, tmp);
 		untranslated_name = tmp;
 	}
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "id");
+	tmp = g_hash_table_lookup (attributes, "id");
 	if (tmp != NULL)
 	{
-		lang->priv->id = g_ascii_strdown ((gchar*) tmp, -1);
+		lang->priv->id = g_ascii_strdown (tmp, -1);
 	}
 	else
 	{
-		lang->priv->id = g_ascii_strdown ((gchar*) untranslated_name, -1);
+		lang->priv->id = g_ascii_strdown (untranslated_name, -1);
 	}
-	xmlFree (tmp);
-	xmlFree (untranslated_name);
 
-	tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "_section");
+	tmp = g_hash_table_lookup (attributes, "_section");
 	if (tmp == NULL)
 	{
-		tmp = xmlTextReaderGetAttribute (reader, BAD_CAST "section");
+		tmp = g_hash_table_lookup (attributes, "section");
 
 		if (tmp == NULL)
 			lang->priv->section = g_strdup (DEFAULT_SECTION);
 		else
-			lang->priv->section = g_strdup ((gchar *) tmp);
-
-		xmlFree (tmp);
+			lang->priv->section = g_strdup (tmp);
 	}
 	else
 	{
-		lang->priv->section = _gtk_source_language_translate_string (lang, (gchar*) tmp);
-		xmlFree (tmp);
+		lang->priv->section = _gtk_source_language_translate_string (lang, tmp);
 	}
 
-	version = xmlTextReaderGetAttribute (reader, BAD_CAST "version");
+	version = g_hash_table_lookup (attributes, "version");
 
 	if (version == NULL)
 	{
@@ -438,27 +644,24 @@ process_language_node (xmlTextReaderPtr reader, const gchar *filename)
 		return NULL;
 	}
 
-	if (xmlStrcmp (version , BAD_CAST "1.0") == 0)
+	if (strcmp (version, "1.0") == 0)
 	{
 		lang->priv->version = GTK_SOURCE_LANGUAGE_VERSION_1_0;
 	}
-	else if (xmlStrcmp (version, BAD_CAST "2.0") == 0)
+	else if (strcmp (version, "2.0") == 0)
 	{
 		lang->priv->version = GTK_SOURCE_LANGUAGE_VERSION_2_0;
 	}
 	else
 	{
 		g_warning ("Unsupported language spec version '%s' in file '%s'",
-			   (gchar*) version, filename);
-		xmlFree (version);
+			   version, filename);
 		g_object_unref (lang);
 		return NULL;
 	}
 
-	xmlFree (version);
-
 	if (lang->priv->version == GTK_SOURCE_LANGUAGE_VERSION_2_0)
-		process_properties (reader, lang);
+		g_hash_table_foreach (metadata, (GHFunc) copy_property, lang);
 
 	return lang;
 }
@@ -695,50 +898,127 @@ _gtk_source_language_define_language_styles (GtkSourceLanguage *lang)
 	}
 }
 
-/* returns new reference, which _must_ be unref'ed */
+static void
+merge_styles (GHashTable *styles,
+	      GHashTable *language_styles)
+{
+	GHashTableIter iter;
+	gpointer id, info;
+
+	/* Names of styles already there may have been returned by
+	 * gtk_source_language_get_style_name(), keep them. */
+	g_hash_table_iter_init (&iter, styles);
+
+	while (g_hash_table_iter_next (&iter, &id, &info))
+	{
+		if (g_hash_table_lookup (language_styles, id) == NULL)
+		{
+			g_hash_table_iter_steal (&iter);
+			g_hash_table_insert (language_styles, id, info);
+		}
+	}
+}
+
+/* returns new reference, which _must_ be unref'ed.
+ * Version 2 files may be parsed in any thread, see
+ * gtk_source_language_manager_preload_languages_async(). */
 static GtkSourceContextData *
 gtk_source_language_parse_file (GtkSourceLanguage *language)
 {
-	if (language->priv->ctx_data == NULL)
+	GtkSourceContextData *ctx_data = NULL;
+	GtkSourceContextData *other = NULL;
+	GHashTable *styles = NULL;
+	gboolean success = FALSE;
+
+	/* The data may be released by another thread, see
+	 * _gtk_source_context_data_unref(). */
+	G_LOCK (context_data);
+	if (language->priv->ctx_data != NULL)
+		ctx_data = _gtk_source_context_data_ref (language->priv->ctx_data);
+	G_UNLOCK (context_data);
+
+	if (ctx_data != NULL)
+		return ctx_data;
+
+	if (language->priv->language_manager == NULL)
 	{
-		gboolean success = FALSE;
-		GtkSourceContextData *ctx_data;
+		g_critical ("_gtk_source_language_create_engine() is called after "
+			    "language manager was finalized");
+		return NULL;
+	}
 
-		if (language->priv->language_manager == NULL)
-		{
-			g_critical ("_gtk_source_language_create_engine() is called after "
-				    "language manager was finalized");
-		}
-		else
-		{
-			ctx_data = _gtk_source_context_data_new	(language);
+	ctx_data = _gtk_source_context_data_new	(language);
 
-			switch (language->priv->version)
-			{
-				case GTK_SOURCE_LANGUAGE_VERSION_1_0:
-					success = _gtk_source_language_file_parse_version1 (language, ctx_data);
-					break;
+	switch (language->priv->version)
+	{
+		case GTK_SOURCE_LANGUAGE_VERSION_1_0:
+			success = _gtk_source_language_file_parse_version1 (language, ctx_data);
+			break;
+
+		case GTK_SOURCE_LANGUAGE_VERSION_2_0:
+			styles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+							(GDestroyNotify) _gtk_source_style_info_free);
+			success = _gtk_source_language_file_parse_version2 (language,
+									    ctx_data,
+									    styles);
+			break;
 
-				case GTK_SOURCE_LANGUAGE_VERSION_2_0:
-					success = _gtk_source_language_file_parse_version2 (language, ctx_data);
-					break;
+		default:
+			g_assert_not_reached ();
+	}
 
-				default:
-					g_assert_not_reached ();
-			}
+	if (!success)
+	{
+		if (styles != NULL)
+			g_hash_table_destroy (styles);
 
-			if (!success)
-				_gtk_source_context_data_unref (ctx_data);
-			else
-				language->priv->ctx_data = ctx_data;
-		}
+		_gtk_source_context_data_unref (ctx_data);
+		return NULL;
+	}
+
+	/* Keep the data parsed first if several threads did it. */
+	G_LOCK (context_data);
+	if (language->priv->ctx_data == NULL)
+	{
+		language->priv->ctx_data = ctx_data;
+
+		if (styles != NULL)
+			merge_styles (styles, language->priv->styles);
 	}
 	else
 	{
-		_gtk_source_context_data_ref (language->priv->ctx_data);
+		other = _gtk_source_context_data_ref (language->priv->ctx_data);
+	}
+	G_UNLOCK (context_data);
+
+	if (styles != NULL)
+		g_hash_table_destroy (styles);
+
+	if (other != NULL)
+	{
+		_gtk_source_context_data_unref (ctx_data);
+		ctx_data = other;
 	}
 
-	return language->priv->ctx_data;
+	return ctx_data;
+}
+
+/**
+ * _gtk_source_language_get_context_data:
+ *
+ * @language: a #GtkSourceLanguage.
+ *
+ * Parses the language file if needed.
+ *
+ * Returns: a new reference to the context data of @language,
+ * or %NULL if the file could not be parsed.
+ */
+GtkSourceContextData *
+_gtk_source_language_get_context_data (GtkSourceLanguage *language)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE (language), NULL);
+
+	return gtk_source_language_parse_file (language);
 }
 
 GtkSourceEngine *
@@ -786,9 +1066,11 @@ get_style_ids (GtkSourceLanguage *language)
 	data.language_id = g_strdup_printf ("%s:", language->priv->id);
 	data.ids_array = ids_array;
 
+	G_LOCK (context_data);
 	g_hash_table_foreach (language->priv->styles,
 			      (GHFunc) add_style_id,
 			      &data);
+	G_UNLOCK (context_data);
 
 	g_free (data.language_id);
 
@@ -863,7 +1145,9 @@ get_style_info (GtkSourceLanguage *language, const char *style_id)
 
 	g_return_val_if_fail (language->priv->styles != NULL, NULL);
 
+	G_LOCK (context_data);
 	info = g_hash_table_lookup (language->priv->styles, style_id);
+	G_UNLOCK (context_data);
 
 	return info;
 }
@@ -24,6 +24,11 @@
 #endif
 
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <libxml/parser.h>
 #include "gtksourceview-i18n.h"
 #include "gtksourcelanguage-private.h"
 #include "gtksourcelanguage.h"
@@ -63,10 +68,38 @@ struct _GtkSourceLanguageManagerPrivate
 	gchar		*rng_file;
 
 	gchar          **ids; /* Cache the IDs of the available languages */
+
+	/* See ensure_guess_index() */
+	GPtrArray	*globs;
+	GHashTable	*exact_globs;
+	GHashTable	*suffix_globs;
+	GArray		*suffix_lengths;
+	GSList		*wildcard_globs;
+	GArray		*mime_types;
+	GHashTable	*exact_mime_types;
+
+	/* Context data kept alive by
+	 * gtk_source_language_manager_preload_languages_async() */
+	GHashTable	*preloaded;
 };
 
+typedef struct
+{
+	guint		   seq;
+	gchar		  *pattern;
+	GtkSourceLanguage *lang;
+} GlobEntry;
+
+typedef struct
+{
+	gchar		  *mime_type;
+	GtkSourceLanguage *lang;
+} MimeEntry;
+
 G_DEFINE_TYPE (GtkSourceLanguageManager, gtk_source_language_manager, G_TYPE_OBJECT)
 
+static void free_guess_index (GtkSourceLanguageManager *lm);
+
 
 static void
 gtk_source_language_manager_set_property (GObject 	*object,
@@ -123,6 +156,12 @@ gtk_source_language_manager_finalize (GObject *object)
 
 	lm = GTK_SOURCE_LANGUAGE_MANAGER (object);
 
+	free_guess_index (lm);
+
+	/* The data refers to the languages */
+	if (lm->priv->preloaded != NULL)
+		g_hash_table_destroy (lm->priv->preloaded);
+
 	if (lm->priv->language_ids)
 		g_hash_table_destroy (lm->priv->language_ids);
 
@@ -175,6 +214,8 @@ gtk_source_language_manager_init (GtkSourceLanguageManager *lm)
 	lm->priv->ids = NULL;
 	lm->priv->lang_dirs = NULL;
 	lm->priv->rng_file = NULL;
+	lm->priv->globs = NULL;
+	lm->priv->preloaded = NULL;
 }
 
 /**
@@ -323,21 +364,238 @@ _gtk_source_language_manager_get_rng_file (GtkSourceLanguageManager *lm)
 	return lm->priv->rng_file;
 }
 
+/* Reading the <language> element of every lang file in the search
+ * path is what makes the first call to the language manager slow, so
+ * the attributes and metadata read from the files of a directory are
+ * stored in an index. An index is valid as long as the modification
+ * time of the directory did not change, that is as long as no lang
+ * file was added, removed or replaced. The full definitions are read
+ * from the lang files only when a language is used.
+ *
+ * The index of a directory is looked for in the directory itself,
+ * where it is written at install time, and then in the user cache
+ * directory, where it is written when a directory had no valid index.
+ * Values are stored in host byte order, an index written on another
+ * machine is ignored. An index looks like this:
+ *
+ *   "GSVI"  magic
+ *   uint    INDEX_BYTE_ORDER
+ *   uint    INDEX_FORMAT_VERSION
+ *   uint64  modification time of the directory
+ *   string  directory
+ *   uint    number of languages, and for each of them what
+ *           _gtk_source_language_new_from_file() appends
+ */
+
+#define INDEX_MAGIC		"GSVI"
+#define INDEX_BYTE_ORDER	0x01020304
+#define INDEX_FORMAT_VERSION	1
+#define INDEX_MTIME_OFFSET	12
+#define INDEX_FILE		"languages.index"
+#define INDEX_SUFFIX		".index"
+
+/* Set to write the index of each directory in the directory itself, see
+ * gtksourceview-update-language-index. */
+#define WRITE_INDEX_ENV		"GTKSOURCEVIEW_WRITE_LANGUAGE_INDEX"
+
+static gchar *
+get_cached_index_file_name (const gchar *dirname)
+{
+	gchar *checksum;
+	gchar *basename;
+	gchar *filename;
+
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, dirname, -1);
+	basename = g_strconcat (checksum, INDEX_SUFFIX, NULL);
+	filename = g_build_filename (g_get_user_cache_dir (),
+				     "gtksourceview-3.0",
+				     LANGUAGE_DIR,
+				     basename,
+				     NULL);
+	g_free (checksum);
+	g_free (basename);
+
+	return filename;
+}
+
 static void
-ensure_languages (GtkSourceLanguageManager *lm)
+add_language (GtkSourceLanguageManager  *lm,
+	      GtkSourceLanguage         *lang,
+	      GPtrArray                **ids_array)
 {
-	GSList *filenames, *l;
-	GPtrArray *ids_array = NULL;
+	if (g_hash_table_lookup (lm->priv->language_ids, lang->priv->id) == NULL)
+	{
+		g_hash_table_insert (lm->priv->language_ids,
+				     g_strdup (lang->priv->id),
+				     lang);
 
-	if (lm->priv->language_ids != NULL)
+		if (*ids_array == NULL)
+			*ids_array = g_ptr_array_new ();
+
+		g_ptr_array_add (*ids_array, g_strdup (lang->priv->id));
+	}
+	else
+	{
+		g_object_unref (lang);
+	}
+}
+
+static gboolean
+load_index (GtkSourceLanguageManager  *lm,
+	    const gchar               *dirname,
+	    const gchar               *filename,
+	    guint64                    mtime,
+	    gboolean                   check_dirname,
+	    GPtrArray                **ids_array)
+{
+	GMappedFile *file;
+	GtkSourceCacheReader reader;
+	GSList *languages = NULL;
+	gchar *indexed_dirname;
+	guint n_languages, i;
+
+	file = g_mapped_file_new (filename, FALSE, NULL);
+
+	if (file == NULL)
+		return FALSE;
+
+	reader.pos = g_mapped_file_get_contents (file);
+	reader.end = reader.pos + g_mapped_file_get_length (file);
+	reader.failed = FALSE;
+
+	if (reader.end - reader.pos < 4 ||
+	    memcmp (reader.pos, INDEX_MAGIC, 4) != 0)
+	{
+		g_mapped_file_unref (file);
+		return FALSE;
+	}
+
+	reader.pos += 4;
+
+	if (_gtk_source_cache_read_uint (&reader) != INDEX_BYTE_ORDER ||
+	    _gtk_source_cache_read_uint (&reader) != INDEX_FORMAT_VERSION ||
+	    _gtk_source_cache_read_uint64 (&reader) != mtime)
+	{
+		g_mapped_file_unref (file);
+		return FALSE;
+	}
+
+	/* An index in the directory itself may have been written in a
+	 * staging directory, what matters is that it is next to the files. */
+	indexed_dirname = _gtk_source_cache_read_string (&reader);
+	n_languages = _gtk_source_cache_read_uint (&reader);
+
+	if (reader.failed ||
+	    (check_dirname && g_strcmp0 (indexed_dirname, dirname) != 0))
+	{
+		g_free (indexed_dirname);
+		g_mapped_file_unref (file);
+		return FALSE;
+	}
+
+	g_free (indexed_dirname);
+
+	for (i = 0; i < n_languages && !reader.failed; ++i)
+	{
+		GtkSourceLanguage *lang;
+
+		lang = _gtk_source_language_new_from_index (&reader, dirname, lm);
+
+		if (lang != NULL)
+			languages = g_slist_prepend (languages, lang);
+	}
+
+	g_mapped_file_unref (file);
+
+	if (reader.failed)
+	{
+		g_slist_foreach (languages, (GFunc) g_object_unref, NULL);
+		g_slist_free (languages);
+		return FALSE;
+	}
+
+	languages = g_slist_reverse (languages);
+
+	while (languages != NULL)
+	{
+		add_language (lm, languages->data, ids_array);
+		languages = g_slist_delete_link (languages, languages);
+	}
+
+	return TRUE;
+}
+
+static void
+write_index (const gchar *dirname,
+	     const gchar *filename,
+	     guint64      mtime,
+	     guint        n_languages,
+	     GString     *entries)
+{
+	GString *out;
+	gchar *cache_dir;
+
+	out = g_string_sized_new (entries->len + 64);
+
+	g_string_append_len (out, INDEX_MAGIC, 4);
+	_gtk_source_cache_write_uint (out, INDEX_BYTE_ORDER);
+	_gtk_source_cache_write_uint (out, INDEX_FORMAT_VERSION);
+	_gtk_source_cache_write_uint64 (out, mtime);
+	_gtk_source_cache_write_string (out, dirname);
+	_gtk_source_cache_write_uint (out, n_languages);
+	g_string_append_len (out, entries->str, entries->len);
+
+	cache_dir = g_path_get_dirname (filename);
+
+	if (g_mkdir_with_parents (cache_dir, 0755) == 0)
+		g_file_set_contents (filename, out->str, out->len, NULL);
+
+	g_free (cache_dir);
+	g_string_free (out, TRUE);
+}
+
+/* Writing the index in a directory changes the modification time of
+ * the directory, store the new one. */
+static void
+update_index_mtime (const gchar *dirname,
+		    const gchar *filename)
+{
+	struct stat buf;
+	guint64 mtime;
+	FILE *file;
+
+	if (g_stat (dirname, &buf) != 0)
 		return;
 
-	lm->priv->language_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
-							g_free, g_object_unref);
+	mtime = buf.st_mtime;
 
-	filenames = _gtk_source_view_get_file_list ((gchar **)gtk_source_language_manager_get_search_path (lm),
-						    LANG_FILE_SUFFIX,
-						    TRUE);
+	file = g_fopen (filename, "r+b");
+
+	if (file == NULL)
+		return;
+
+	if (fseek (file, INDEX_MTIME_OFFSET, SEEK_SET) == 0)
+		fwrite (&mtime, sizeof (mtime), 1, file);
+
+	fclose (file);
+}
+
+static void
+scan_directory (GtkSourceLanguageManager  *lm,
+		const gchar               *dirname,
+		guint64                    mtime,
+		GPtrArray                **ids_array)
+{
+	gchar *dirs[2] = { (gchar *) dirname, NULL };
+	GSList *filenames, *l;
+	GString *entries;
+	guint n_languages = 0;
+	gboolean in_directory;
+	gchar *index_file;
+
+	entries = g_string_new (NULL);
+
+	filenames = _gtk_source_view_get_file_list (dirs, LANG_FILE_SUFFIX, TRUE);
 
 	for (l = filenames; l != NULL; l = l->next)
 	{
@@ -346,7 +604,7 @@ ensure_languages (GtkSourceLanguageManager *lm)
 
 		filename = l->data;
 
-		lang = _gtk_source_language_new_from_file (filename, lm);
+		lang = _gtk_source_language_new_from_file (filename, lm, entries);
 
 		if (lang == NULL)
 		{
@@ -354,21 +612,73 @@ ensure_languages (GtkSourceLanguageManager *lm)
 			continue;
 		}
 
-		if (g_hash_table_lookup (lm->priv->language_ids, lang->priv->id) == NULL)
-		{
-			g_hash_table_insert (lm->priv->language_ids,
-					     g_strdup (lang->priv->id),
-					     lang);
+		++n_languages;
+		add_language (lm, lang, ids_array);
+	}
 
-			if (ids_array == NULL)
-				ids_array = g_ptr_array_new ();
+	g_slist_foreach (filenames, (GFunc) g_free, NULL);
+	g_slist_free (filenames);
 
-			g_ptr_array_add (ids_array, g_strdup (lang->priv->id));
-		}
-		else
+	in_directory = g_getenv (WRITE_INDEX_ENV) != NULL;
+
+	if (in_directory)
+		index_file = g_build_filename (dirname, INDEX_FILE, NULL);
+	else
+		index_file = get_cached_index_file_name (dirname);
+
+	/* A file added in the same second as the directory was scanned
+	 * would not change its modification time. */
+	if (in_directory || (time_t) mtime < time (NULL) - 1)
+	{
+		write_index (dirname, index_file, mtime, n_languages, entries);
+
+		if (in_directory)
+			update_index_mtime (dirname, index_file);
+	}
+
+	g_free (index_file);
+	g_string_free (entries, TRUE);
+}
+
+static void
+ensure_languages (GtkSourceLanguageManager *lm)
+{
+	const gchar * const *dirs;
+	GPtrArray *ids_array = NULL;
+
+	if (lm->priv->language_ids != NULL)
+		return;
+
+	lm->priv->language_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, g_object_unref);
+
+	for (dirs = gtk_source_language_manager_get_search_path (lm);
+	     dirs != NULL && *dirs != NULL;
+	     ++dirs)
+	{
+		struct stat buf;
+		guint64 mtime;
+		gchar *index_file;
+		gboolean loaded;
+
+		if (g_stat (*dirs, &buf) != 0 || !S_ISDIR (buf.st_mode))
+			continue;
+
+		mtime = buf.st_mtime;
+
+		index_file = g_build_filename (*dirs, INDEX_FILE, NULL);
+		loaded = load_index (lm, *dirs, index_file, mtime, FALSE, &ids_array);
+		g_free (index_file);
+
+		if (!loaded)
 		{
-			g_object_unref (lang);
+			index_file = get_cached_index_file_name (*dirs);
+			loaded = load_index (lm, *dirs, index_file, mtime, TRUE, &ids_array);
+			g_free (index_file);
 		}
+
+		if (!loaded)
+			scan_directory (lm, *dirs, mtime, &ids_array);
 	}
 
 	if (ids_array != NULL)
@@ -377,9 +687,6 @@ ensure_languages (GtkSourceLanguageManager *lm)
 		g_ptr_array_add (ids_array, NULL);
 		lm->priv->ids = (gchar **)g_ptr_array_free (ids_array, FALSE);
 	}
-
-	g_slist_foreach (filenames, (GFunc) g_free, NULL);
-	g_slist_free (filenames);
 }
 
 
@@ -428,84 +735,227 @@ gtk_source_language_manager_get_language (GtkSourceLanguageManager *lm,
 	return g_hash_table_lookup (lm->priv->language_ids, id);
 }
 
-static GSList *
-pick_langs_for_filename (GtkSourceLanguageManager *lm,
-			 const gchar              *filename)
+static void
+glob_entry_free (GlobEntry *entry)
 {
-	char *filename_utf8;
-	const gchar* const * p;
-	GSList *langs = NULL;
+	g_free (entry->pattern);
+	g_slice_free (GlobEntry, entry);
+}
 
-	/* Use g_filename_display_name() instead of g_filename_to_utf8() because
-	 * g_filename_display_name() doesn't fail and replaces non-convertible
-	 * characters to unicode substitution symbol. */
-	filename_utf8 = g_filename_display_name (filename);
+static void
+add_glob_ (GHashTable  *table,
+	   const gchar *key,
+	   GlobEntry   *entry)
+{
+	GSList *entries;
 
-	for (p = gtk_source_language_manager_get_language_ids (lm);
-	     p != NULL && *p != NULL;
-	     p++)
+	/* The list is owned by the table, steal it to append to it. */
+	entries = g_hash_table_lookup (table, key);
+	g_hash_table_steal (table, key);
+	entries = g_slist_append (entries, entry);
+	g_hash_table_insert (table, (gpointer) key, entries);
+}
+
+static void
+add_suffix_length_ (GtkSourceLanguageManager *lm,
+		    guint                     length)
+{
+	guint i;
+
+	for (i = 0; i < lm->priv->suffix_lengths->len; ++i)
+		if (g_array_index (lm->priv->suffix_lengths, guint, i) == length)
+			return;
+
+	g_array_append_val (lm->priv->suffix_lengths, length);
+}
+
+/* Globs and mime types of the languages, so that guessing a language
+ * does not try every glob of every language. As with g_pattern_match_simple(),
+ * only '*' and '?' are wildcards. A glob without wildcards can only
+ * match the same string, and a glob made of '*' followed by no wildcard
+ * can only match strings ending with the rest of it. Only the few
+ * remaining globs need to be matched one by one.
+ *
+ * Each glob gets a sequence number in the order of the languages, so
+ * that matches can be returned in the same order as if all globs were
+ * tried. */
+static void
+ensure_guess_index (GtkSourceLanguageManager *lm)
+{
+	const gchar * const *ids;
+	guint seq = 0;
+
+	if (lm->priv->globs != NULL)
+		return;
+
+	lm->priv->globs = g_ptr_array_new ();
+	lm->priv->exact_globs = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       NULL,
+						       (GDestroyNotify) g_slist_free);
+	lm->priv->suffix_globs = g_hash_table_new_full (g_str_hash, g_str_equal,
+							NULL,
+							(GDestroyNotify) g_slist_free);
+	lm->priv->suffix_lengths = g_array_new (FALSE, FALSE, sizeof (guint));
+	lm->priv->wildcard_globs = NULL;
+	lm->priv->mime_types = g_array_new (FALSE, FALSE, sizeof (MimeEntry));
+	lm->priv->exact_mime_types = g_hash_table_new (g_str_hash, g_str_equal);
+
+	for (ids = gtk_source_language_manager_get_language_ids (lm);
+	     ids != NULL && *ids != NULL;
+	     ++ids)
 	{
 		GtkSourceLanguage *lang;
-		gchar **globs, **gptr;
+		gchar **globs, **mime_types;
+		gint i;
 
-		lang = gtk_source_language_manager_get_language (lm, *p);
+		lang = gtk_source_language_manager_get_language (lm, *ids);
 		globs = gtk_source_language_get_globs (lang);
 
-		for (gptr = globs; gptr != NULL && *gptr != NULL; gptr++)
+		for (i = 0; globs != NULL && globs[i] != NULL; ++i)
+		{
+			GlobEntry *entry;
+			const gchar *rest;
+
+			entry = g_slice_new (GlobEntry);
+			entry->seq = seq++;
+			entry->lang = lang;
+			/* Take the string from the array */
+			entry->pattern = globs[i];
+			g_ptr_array_add (lm->priv->globs, entry);
+
+			rest = entry->pattern[0] == '*' ? entry->pattern + 1 : NULL;
+
+			if (strpbrk (entry->pattern, "*?") == NULL)
+			{
+				add_glob_ (lm->priv->exact_globs, entry->pattern, entry);
+			}
+			else if (rest != NULL && strpbrk (rest, "*?") == NULL)
+			{
+				add_glob_ (lm->priv->suffix_globs, rest, entry);
+				add_suffix_length_ (lm, strlen (rest));
+			}
+			else
+			{
+				lm->priv->wildcard_globs =
+					g_slist_prepend (lm->priv->wildcard_globs, entry);
+			}
+		}
+
+		g_free (globs);
+
+		mime_types = gtk_source_language_get_mime_types (lang);
+
+		for (i = 0; mime_types != NULL && mime_types[i] != NULL; ++i)
 		{
-			/* FIXME g_pattern_match is wrong: there are no '[...]'
-			 * character ranges and '*' and '?' can not be escaped
-			 * to include them literally in a pattern.  */
-			if (g_pattern_match_simple (*gptr, filename_utf8))
+			MimeEntry entry;
+
+			entry.mime_type = mime_types[i];
+			entry.lang = lang;
+			g_array_append_val (lm->priv->mime_types, entry);
+
+			/* The first language wins */
+			if (g_hash_table_lookup (lm->priv->exact_mime_types,
+						 entry.mime_type) == NULL)
 			{
-				langs = g_slist_prepend (langs, lang);
+				g_hash_table_insert (lm->priv->exact_mime_types,
+						     entry.mime_type, lang);
 			}
 		}
 
-		g_strfreev (globs);
+		g_free (mime_types);
 	}
 
-	g_free (filename_utf8);
-	return langs;
+	lm->priv->wildcard_globs = g_slist_reverse (lm->priv->wildcard_globs);
 }
 
-static GtkSourceLanguage *
-pick_lang_for_mime_type_pass (GtkSourceLanguageManager *lm,
-			      const char               *mime_type,
-			      gboolean                  exact_match)
+static void
+free_guess_index (GtkSourceLanguageManager *lm)
+{
+	guint i;
+
+	if (lm->priv->globs == NULL)
+		return;
+
+	g_hash_table_destroy (lm->priv->exact_globs);
+	g_hash_table_destroy (lm->priv->suffix_globs);
+	g_array_free (lm->priv->suffix_lengths, TRUE);
+	g_slist_free (lm->priv->wildcard_globs);
+
+	g_ptr_array_foreach (lm->priv->globs, (GFunc) glob_entry_free, NULL);
+	g_ptr_array_free (lm->priv->globs, TRUE);
+
+	g_hash_table_destroy (lm->priv->exact_mime_types);
+
+	for (i = 0; i < lm->priv->mime_types->len; ++i)
+		g_free (g_array_index (lm->priv->mime_types, MimeEntry, i).mime_type);
+
+	g_array_free (lm->priv->mime_types, TRUE);
+}
+
+static gint
+compare_glob_entries_ (GlobEntry *entry1,
+		       GlobEntry *entry2)
+{
+	/* Last match first */
+	return (gint) entry2->seq - (gint) entry1->seq;
+}
+
+static GSList *
+pick_langs_for_filename (GtkSourceLanguageManager *lm,
+			 const gchar              *filename)
 {
-	const gchar* const * id_ptr;
+	char *filename_utf8;
+	GSList *matches = NULL;
+	GSList *langs = NULL;
+	GSList *l;
+	gsize len;
+	guint i;
+
+	ensure_guess_index (lm);
+
+	/* Use g_filename_display_name() instead of g_filename_to_utf8() because
+	 * g_filename_display_name() doesn't fail and replaces non-convertible
+	 * characters to unicode substitution symbol. */
+	filename_utf8 = g_filename_display_name (filename);
+	len = strlen (filename_utf8);
+
+	l = g_hash_table_lookup (lm->priv->exact_globs, filename_utf8);
+	matches = g_slist_concat (matches, g_slist_copy (l));
 
-	for (id_ptr = gtk_source_language_manager_get_language_ids (lm);
-	     id_ptr != NULL && *id_ptr != NULL;
-	     id_ptr++)
+	for (i = 0; i < lm->priv->suffix_lengths->len; ++i)
 	{
-		GtkSourceLanguage *lang;
-		gchar **mime_types, **mptr;
+		guint suffix_len;
 
-		lang = gtk_source_language_manager_get_language (lm, *id_ptr);
-		mime_types = gtk_source_language_get_mime_types (lang);
+		suffix_len = g_array_index (lm->priv->suffix_lengths, guint, i);
 
-		for (mptr = mime_types; mptr != NULL && *mptr != NULL; mptr++)
-		{
-			gboolean matches;
+		if (suffix_len > len)
+			continue;
 
-			if (exact_match)
-				matches = strcmp (mime_type, *mptr) == 0;
-			else
-				matches = g_content_type_is_a (mime_type, *mptr);
+		l = g_hash_table_lookup (lm->priv->suffix_globs,
+					 filename_utf8 + len - suffix_len);
+		matches = g_slist_concat (matches, g_slist_copy (l));
+	}
 
-			if (matches)
-			{
-				g_strfreev (mime_types);
-				return lang;
-			}
-		}
+	for (l = lm->priv->wildcard_globs; l != NULL; l = l->next)
+	{
+		GlobEntry *entry = l->data;
 
-		g_strfreev (mime_types);
+		/* FIXME g_pattern_match is wrong: there are no '[...]'
+		 * character ranges and '*' and '?' can not be escaped
+		 * to include them literally in a pattern.  */
+		if (g_pattern_match_simple (entry->pattern, filename_utf8))
+			matches = g_slist_prepend (matches, entry);
 	}
 
-	return NULL;
+	matches = g_slist_sort (matches, (GCompareFunc) compare_glob_entries_);
+
+	for (l = matches; l != NULL; l = l->next)
+		langs = g_slist_prepend (langs, ((GlobEntry *) l->data)->lang);
+
+	g_slist_free (matches);
+	g_free (filename_utf8);
+
+	return g_slist_reverse (langs);
 }
 
 static GtkSourceLanguage *
@@ -513,9 +963,22 @@ pick_lang_for_mime_type_real (GtkSourceLanguageManager *lm,
 			      const char               *mime_type)
 {
 	GtkSourceLanguage *lang;
-	lang = pick_lang_for_mime_type_pass (lm, mime_type, TRUE);
-	if (!lang)
-		lang = pick_lang_for_mime_type_pass (lm, mime_type, FALSE);
+	guint i;
+
+	ensure_guess_index (lm);
+
+	lang = g_hash_table_lookup (lm->priv->exact_mime_types, mime_type);
+
+	for (i = 0; lang == NULL && i < lm->priv->mime_types->len; ++i)
+	{
+		MimeEntry *entry;
+
+		entry = &g_array_index (lm->priv->mime_types, MimeEntry, i);
+
+		if (g_content_type_is_a (mime_type, entry->mime_type))
+			lang = entry->lang;
+	}
+
 	return lang;
 }
 
@@ -697,3 +1160,270 @@ gtk_source_language_manager_guess_language (GtkSourceLanguageManager *lm,
 
 	return lang;
 }
+
+/**
+ * gtk_source_language_manager_guess_languages:
+ * @lm: a #GtkSourceLanguageManager.
+ * @filenames: (array length=n_filenames): file names in Glib filename encoding.
+ * @n_filenames: the number of file names in @filenames.
+ * @languages: (out caller-allocates) (array length=n_filenames) (transfer none):
+ * an array of @n_filenames elements where to store the languages.
+ *
+ * Picks a #GtkSourceLanguage for each of @filenames, the one
+ * gtk_source_language_manager_guess_language() would pick given only
+ * the file name. This is meant for guessing the language of many
+ * files, e.g. when listing a directory. The element of @languages at
+ * the index of a file name is set to %NULL if there is no suitable
+ * language for it. Languages are owned by @lm and should not be freed.
+ *
+ * Since: 3.0
+ */
+void
+gtk_source_language_manager_guess_languages (GtkSourceLanguageManager  *lm,
+					     const gchar * const       *filenames,
+					     guint                      n_filenames,
+					     GtkSourceLanguage        **languages)
+{
+	guint i;
+
+	g_return_if_fail (GTK_IS_SOURCE_LANGUAGE_MANAGER (lm));
+	g_return_if_fail (filenames != NULL || n_filenames == 0);
+	g_return_if_fail (languages != NULL || n_filenames == 0);
+
+	ensure_languages (lm);
+	ensure_guess_index (lm);
+
+	for (i = 0; i < n_filenames; ++i)
+	{
+		GSList *langs = NULL;
+
+		if (filenames[i] != NULL && *filenames[i] != '\0')
+			langs = pick_langs_for_filename (lm, filenames[i]);
+
+		languages[i] = langs != NULL ? langs->data : NULL;
+
+		g_slist_free (langs);
+	}
+}
+
+typedef struct _PreloadData PreloadData;
+typedef struct _PreloadJob PreloadJob;
+
+struct _PreloadData
+{
+	GSimpleAsyncResult	*result;
+	GCancellable		*cancellable;
+	guint			 n_pending;
+};
+
+struct _PreloadJob
+{
+	PreloadData		*data;
+	GtkSourceLanguage	*language;
+	/* Set by the worker thread */
+	GtkSourceContextData	*ctx_data;
+};
+
+static void
+keep_context_data (GtkSourceLanguageManager *lm,
+		   GtkSourceLanguage        *language,
+		   GtkSourceContextData     *ctx_data)
+{
+	if (lm->priv->preloaded == NULL)
+		lm->priv->preloaded = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+							     (GDestroyNotify) _gtk_source_context_data_unref);
+
+	g_hash_table_replace (lm->priv->preloaded,
+			      g_strdup (gtk_source_language_get_id (language)),
+			      ctx_data);
+}
+
+static void
+preload_data_complete (PreloadData *data)
+{
+	GError *error = NULL;
+
+	if (g_cancellable_set_error_if_cancelled (data->cancellable, &error))
+	{
+		g_simple_async_result_set_from_error (data->result, error);
+		g_error_free (error);
+	}
+
+	g_simple_async_result_complete (data->result);
+
+	g_object_unref (data->result);
+	if (data->cancellable != NULL)
+		g_object_unref (data->cancellable);
+	g_slice_free (PreloadData, data);
+}
+
+/* Runs in a worker thread */
+static void
+preload_job_run (GSimpleAsyncResult *result,
+		 GObject            *object,
+		 GCancellable       *cancellable)
+{
+	PreloadJob *job;
+
+	job = g_simple_async_result_get_op_res_gpointer (result);
+
+	if (!g_cancellable_is_cancelled (cancellable))
+		job->ctx_data = _gtk_source_language_get_context_data (job->language);
+}
+
+static void
+preload_job_done (GObject      *object,
+		  GAsyncResult *result,
+		  gpointer      user_data)
+{
+	GtkSourceLanguageManager *lm = GTK_SOURCE_LANGUAGE_MANAGER (object);
+	PreloadJob *job = user_data;
+
+	if (job->ctx_data != NULL)
+		keep_context_data (lm, job->language, job->ctx_data);
+
+	if (--job->data->n_pending == 0)
+		preload_data_complete (job->data);
+
+	g_slice_free (PreloadJob, job);
+}
+
+/**
+ * gtk_source_language_manager_preload_languages_async:
+ * @lm: a #GtkSourceLanguageManager.
+ * @ids: (array zero-terminated=1): %NULL-terminated array of language ids.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the
+ * languages are loaded.
+ * @user_data: (closure): the data to pass to @callback.
+ *
+ * Loads the definitions of the languages identified by @ids, as setting
+ * them on a #GtkSourceBuffer would, so that setting them afterwards
+ * does not need to read lang files. The files are parsed and their
+ * regular expressions compiled in worker threads, several languages at
+ * once, if threads were initialized with g_thread_init(); otherwise
+ * they are loaded one after the other from the main loop. Languages in
+ * the old version 1 format are loaded before this function returns.
+ *
+ * The loaded definitions are kept as long as @lm exists. Unknown ids
+ * are ignored, and so are languages which fail to load, as when they
+ * are used.
+ *
+ * When the operation is finished, @callback is called in the thread
+ * default main context of the caller. Call
+ * gtk_source_language_manager_preload_languages_finish() from it to
+ * get the result of the operation.
+ *
+ * Since: 3.0
+ */
+void
+gtk_source_language_manager_preload_languages_async (GtkSourceLanguageManager  *lm,
+						     gchar                    **ids,
+						     GCancellable              *cancellable,
+						     GAsyncReadyCallback        callback,
+						     gpointer                   user_data)
+{
+	PreloadData *data;
+	gint i;
+
+	g_return_if_fail (GTK_IS_SOURCE_LANGUAGE_MANAGER (lm));
+	g_return_if_fail (ids != NULL);
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	data = g_slice_new0 (PreloadData);
+	data->result = g_simple_async_result_new (G_OBJECT (lm),
+						  callback,
+						  user_data,
+						  gtk_source_language_manager_preload_languages_async);
+	data->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+
+	/* Everything parsing needs from the manager must be ready before
+	 * other threads use it. */
+	ensure_languages (lm);
+	_gtk_source_language_manager_get_rng_file (lm);
+	xmlInitParser ();
+
+	for (i = 0; ids[i] != NULL; ++i)
+	{
+		GtkSourceLanguage *language;
+		GSimpleAsyncResult *job_result;
+		PreloadJob *job;
+
+		language = gtk_source_language_manager_get_language (lm, ids[i]);
+
+		if (language == NULL)
+			continue;
+
+		/* Parsing version 1 files changes shared state */
+		if (language->priv->version == GTK_SOURCE_LANGUAGE_VERSION_1_0)
+		{
+			GtkSourceContextData *ctx_data;
+
+			ctx_data = _gtk_source_language_get_context_data (language);
+
+			if (ctx_data != NULL)
+				keep_context_data (lm, language, ctx_data);
+
+			continue;
+		}
+
+		job = g_slice_new0 (PreloadJob);
+		job->data = data;
+		job->language = language;
+		++data->n_pending;
+
+		job_result = g_simple_async_result_new (G_OBJECT (lm),
+							preload_job_done,
+							job,
+							preload_job_run);
+		g_simple_async_result_set_op_res_gpointer (job_result, job, NULL);
+		g_simple_async_result_run_in_thread (job_result,
+						     preload_job_run,
+						     G_PRIORITY_DEFAULT,
+						     cancellable);
+		g_object_unref (job_result);
+	}
+
+	if (data->n_pending == 0)
+	{
+		g_simple_async_result_complete_in_idle (data->result);
+
+		g_object_unref (data->result);
+		if (data->cancellable != NULL)
+			g_object_unref (data->cancellable);
+		g_slice_free (PreloadData, data);
+	}
+}
+
+/**
+ * gtk_source_language_manager_preload_languages_finish:
+ * @lm: a #GtkSourceLanguageManager.
+ * @result: a #GAsyncResult.
+ * @error: (allow-none): return location for a #GError, or %NULL.
+ *
+ * Finishes an operation started with
+ * gtk_source_language_manager_preload_languages_async().
+ *
+ * Returns: %TRUE on success, %FALSE if the operation was cancelled,
+ * in which case @error is set. Languages loaded before it was
+ * cancelled are kept.
+ *
+ * Since: 3.0
+ */
+gboolean
+gtk_source_language_manager_preload_languages_finish (GtkSourceLanguageManager  *lm,
+						      GAsyncResult              *result,
+						      GError                   **error)
+{
+	GSimpleAsyncResult *simple;
+
+	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE_MANAGER (lm), FALSE);
+	g_return_val_if_fail (g_simple_async_result_is_valid (result,
+							      G_OBJECT (lm),
+							      gtk_source_language_manager_preload_languages_async),
+			      FALSE);
+
+	simple = G_SIMPLE_ASYNC_RESULT (result);
+
+	return !g_simple_async_result_propagate_error (simple, error);
+}
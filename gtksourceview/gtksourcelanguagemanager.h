@@ -22,6 +22,7 @@
 #ifndef __GTK_SOURCE_LANGUAGE_MANAGER_H__
 #define __GTK_SOURCE_LANGUAGE_MANAGER_H__
 
+#include <gio/gio.h>
 #include <gtksourceview/gtksourcelanguage.h>
 
 G_BEGIN_DECLS
@@ -79,6 +80,21 @@ GtkSourceLanguage	 *gtk_source_language_manager_guess_language		(GtkSourceLangua
 										 const gchar		  *filename,
 										 const gchar		  *content_type);
 
+void			  gtk_source_language_manager_guess_languages		(GtkSourceLanguageManager  *lm,
+										 const gchar * const       *filenames,
+										 guint                      n_filenames,
+										 GtkSourceLanguage        **languages);
+
+void			  gtk_source_language_manager_preload_languages_async	(GtkSourceLanguageManager  *lm,
+										 gchar                    **ids,
+										 GCancellable              *cancellable,
+										 GAsyncReadyCallback        callback,
+										 gpointer                   user_data);
+
+gboolean		  gtk_source_language_manager_preload_languages_finish	(GtkSourceLanguageManager  *lm,
+										 GAsyncResult              *result,
+										 GError                   **error);
+
 
 
 G_END_DECLS
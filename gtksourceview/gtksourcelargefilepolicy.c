@@ -0,0 +1,413 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/* gtksourcelargefilepolicy.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gtksourcelargefilepolicy.h"
+#include "gtksourceview-i18n.h"
+
+/**
+ * SECTION:largefilepolicy
+ * @Short_description: thresholds for handling big files
+ * @Title: GtkSourceLargeFilePolicy
+ * @See_also: #GtkSourceBuffer
+ *
+ * A #GtkSourceLargeFilePolicy tells a #GtkSourceBuffer when its text is
+ * too big for all features to stay responsive. Above the thresholds the
+ * buffer turns features off tier by tier and reports which ones through
+ * its #GtkSourceBuffer:large-file-tier property:
+ *
+ * <itemizedlist>
+ *   <listitem><para>
+ *     with more than #GtkSourceLargeFilePolicy:max-chars characters,
+ *     syntax tags are kept only near the visible text and the words
+ *     completion provider stops scanning the buffer;
+ *   </para></listitem>
+ *   <listitem><para>
+ *     with more than four times as many characters, context classes
+ *     are not applied and undo is limited to
+ *     #GtkSourceLargeFilePolicy:max-undo-levels levels, if that
+ *     property is set;
+ *   </para></listitem>
+ *   <listitem><para>
+ *     if a line is longer than #GtkSourceLargeFilePolicy:max-line-length
+ *     characters, matching brackets are not highlighted and context
+ *     classes are not applied.
+ *   </para></listitem>
+ * </itemizedlist>
+ *
+ * Buffers have no policy by default and keep all their features,
+ * set #GtkSourceBuffer:large-file-policy to turn this on.
+ */
+
+/* Default thresholds. */
+#define DEFAULT_MAX_CHARS		(8 * 1024 * 1024)
+#define DEFAULT_MAX_LINE_LENGTH		20000
+#define DEFAULT_MAX_UNDO_LEVELS		-1
+
+/* Buffers this many times bigger than max-chars lose some more. */
+#define HUGE_FACTOR			4
+
+enum
+{
+	PROP_0,
+	PROP_MAX_CHARS,
+	PROP_MAX_LINE_LENGTH,
+	PROP_MAX_UNDO_LEVELS
+};
+
+struct _GtkSourceLargeFilePolicyPrivate
+{
+	gint max_chars;
+	gint max_line_length;
+	gint max_undo_levels;
+};
+
+G_DEFINE_TYPE (GtkSourceLargeFilePolicy, gtk_source_large_file_policy, G_TYPE_OBJECT)
+
+static void
+gtk_source_large_file_policy_set_property (GObject      *object,
+					   guint         prop_id,
+					   const GValue *value,
+					   GParamSpec   *pspec)
+{
+	GtkSourceLargeFilePolicy *policy;
+
+	g_return_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (object));
+
+	policy = GTK_SOURCE_LARGE_FILE_POLICY (object);
+
+	switch (prop_id)
+	{
+		case PROP_MAX_CHARS:
+			gtk_source_large_file_policy_set_max_chars (policy,
+								    g_value_get_int (value));
+			break;
+		case PROP_MAX_LINE_LENGTH:
+			gtk_source_large_file_policy_set_max_line_length (policy,
+									  g_value_get_int (value));
+			break;
+		case PROP_MAX_UNDO_LEVELS:
+			gtk_source_large_file_policy_set_max_undo_levels (policy,
+									  g_value_get_int (value));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
+							   prop_id,
+							   pspec);
+	}
+}
+
+static void
+gtk_source_large_file_policy_get_property (GObject    *object,
+					   guint       prop_id,
+					   GValue     *value,
+					   GParamSpec *pspec)
+{
+	GtkSourceLargeFilePolicyPrivate *priv;
+
+	g_return_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (object));
+
+	priv = GTK_SOURCE_LARGE_FILE_POLICY (object)->priv;
+
+	switch (prop_id)
+	{
+		case PROP_MAX_CHARS:
+			g_value_set_int (value, priv->max_chars);
+			break;
+		case PROP_MAX_LINE_LENGTH:
+			g_value_set_int (value, priv->max_line_length);
+			break;
+		case PROP_MAX_UNDO_LEVELS:
+			g_value_set_int (value, priv->max_undo_levels);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
+							   prop_id,
+							   pspec);
+	}
+}
+
+static void
+gtk_source_large_file_policy_class_init (GtkSourceLargeFilePolicyClass *klass)
+{
+	GObjectClass *object_class;
+
+	object_class = G_OBJECT_CLASS (klass);
+
+	object_class->set_property = gtk_source_large_file_policy_set_property;
+	object_class->get_property = gtk_source_large_file_policy_get_property;
+
+	/**
+	 * GtkSourceLargeFilePolicy:max-chars:
+	 *
+	 * Number of characters above which a buffer is considered large.
+	 * -1 means no limit.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_MAX_CHARS,
+					 g_param_spec_int ("max-chars",
+							   _("Maximum Characters"),
+							   _("Number of characters above which "
+							     "a buffer is considered large"),
+							   -1,
+							   G_MAXINT,
+							   DEFAULT_MAX_CHARS,
+							   G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceLargeFilePolicy:max-line-length:
+	 *
+	 * Number of characters above which a line is considered long.
+	 * -1 means no limit.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_MAX_LINE_LENGTH,
+					 g_param_spec_int ("max-line-length",
+							   _("Maximum Line Length"),
+							   _("Number of characters above which "
+							     "a line is considered long"),
+							   -1,
+							   G_MAXINT,
+							   DEFAULT_MAX_LINE_LENGTH,
+							   G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceLargeFilePolicy:max-undo-levels:
+	 *
+	 * Number of undo levels kept by buffers with the
+	 * #GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO tier, or -1 to leave
+	 * undo alone. It only affects the default undo manager.
+	 *
+	 * Since: 3.0
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_MAX_UNDO_LEVELS,
+					 g_param_spec_int ("max-undo-levels",
+							   _("Maximum Undo Levels"),
+							   _("Number of undo levels for "
+							     "very large buffers"),
+							   -1,
+							   G_MAXINT,
+							   DEFAULT_MAX_UNDO_LEVELS,
+							   G_PARAM_READWRITE));
+
+	g_type_class_add_private (object_class, sizeof (GtkSourceLargeFilePolicyPrivate));
+}
+
+static void
+gtk_source_large_file_policy_init (GtkSourceLargeFilePolicy *policy)
+{
+	policy->priv = G_TYPE_INSTANCE_GET_PRIVATE (policy,
+						    GTK_TYPE_SOURCE_LARGE_FILE_POLICY,
+						    GtkSourceLargeFilePolicyPrivate);
+
+	policy->priv->max_chars = DEFAULT_MAX_CHARS;
+	policy->priv->max_line_length = DEFAULT_MAX_LINE_LENGTH;
+	policy->priv->max_undo_levels = DEFAULT_MAX_UNDO_LEVELS;
+}
+
+/**
+ * gtk_source_large_file_policy_new:
+ *
+ * Creates a new policy with the default thresholds.
+ *
+ * Return value: a new #GtkSourceLargeFilePolicy.
+ *
+ * Since: 3.0
+ **/
+GtkSourceLargeFilePolicy *
+gtk_source_large_file_policy_new (void)
+{
+	return g_object_new (GTK_TYPE_SOURCE_LARGE_FILE_POLICY, NULL);
+}
+
+/**
+ * gtk_source_large_file_policy_get_max_chars:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ *
+ * Return value: the number of characters above which a buffer is
+ * considered large, or -1.
+ *
+ * Since: 3.0
+ **/
+gint
+gtk_source_large_file_policy_get_max_chars (GtkSourceLargeFilePolicy *policy)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy), -1);
+
+	return policy->priv->max_chars;
+}
+
+/**
+ * gtk_source_large_file_policy_set_max_chars:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ * @max_chars: number of characters, or -1 for no limit.
+ *
+ * Sets the number of characters above which a buffer is considered
+ * large.
+ *
+ * Since: 3.0
+ **/
+void
+gtk_source_large_file_policy_set_max_chars (GtkSourceLargeFilePolicy *policy,
+					    gint                      max_chars)
+{
+	g_return_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy));
+	g_return_if_fail (max_chars >= -1);
+
+	if (policy->priv->max_chars != max_chars)
+	{
+		policy->priv->max_chars = max_chars;
+		g_object_notify (G_OBJECT (policy), "max-chars");
+	}
+}
+
+/**
+ * gtk_source_large_file_policy_get_max_line_length:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ *
+ * Return value: the number of characters above which a line is
+ * considered long, or -1.
+ *
+ * Since: 3.0
+ **/
+gint
+gtk_source_large_file_policy_get_max_line_length (GtkSourceLargeFilePolicy *policy)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy), -1);
+
+	return policy->priv->max_line_length;
+}
+
+/**
+ * gtk_source_large_file_policy_set_max_line_length:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ * @max_line_length: number of characters, or -1 for no limit.
+ *
+ * Sets the number of characters above which a line is considered long.
+ *
+ * Since: 3.0
+ **/
+void
+gtk_source_large_file_policy_set_max_line_length (GtkSourceLargeFilePolicy *policy,
+						  gint                      max_line_length)
+{
+	g_return_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy));
+	g_return_if_fail (max_line_length >= -1);
+
+	if (policy->priv->max_line_length != max_line_length)
+	{
+		policy->priv->max_line_length = max_line_length;
+		g_object_notify (G_OBJECT (policy), "max-line-length");
+	}
+}
+
+/**
+ * gtk_source_large_file_policy_get_max_undo_levels:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ *
+ * Return value: the number of undo levels kept by very large buffers,
+ * or -1.
+ *
+ * Since: 3.0
+ **/
+gint
+gtk_source_large_file_policy_get_max_undo_levels (GtkSourceLargeFilePolicy *policy)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy), -1);
+
+	return policy->priv->max_undo_levels;
+}
+
+/**
+ * gtk_source_large_file_policy_set_max_undo_levels:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ * @max_undo_levels: number of undo levels, or -1.
+ *
+ * Sets the number of undo levels kept by buffers with the
+ * #GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO tier. If @max_undo_levels
+ * is -1, which is the default, the number of undo levels is not
+ * changed.
+ *
+ * Since: 3.0
+ **/
+void
+gtk_source_large_file_policy_set_max_undo_levels (GtkSourceLargeFilePolicy *policy,
+						  gint                      max_undo_levels)
+{
+	g_return_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy));
+	g_return_if_fail (max_undo_levels >= -1);
+
+	if (policy->priv->max_undo_levels != max_undo_levels)
+	{
+		policy->priv->max_undo_levels = max_undo_levels;
+		g_object_notify (G_OBJECT (policy), "max-undo-levels");
+	}
+}
+
+/**
+ * gtk_source_large_file_policy_get_tier:
+ * @policy: a #GtkSourceLargeFilePolicy.
+ * @char_count: number of characters in the buffer.
+ * @long_lines: whether the buffer has a line longer than
+ * #GtkSourceLargeFilePolicy:max-line-length.
+ *
+ * Determines which features a buffer of the given size should
+ * turn off.
+ *
+ * Return value: the tier flags for such a buffer.
+ *
+ * Since: 3.0
+ **/
+GtkSourceLargeFileTier
+gtk_source_large_file_policy_get_tier (GtkSourceLargeFilePolicy *policy,
+				       gint                      char_count,
+				       gboolean                  long_lines)
+{
+	GtkSourceLargeFilePolicyPrivate *priv;
+	GtkSourceLargeFileTier tier = GTK_SOURCE_LARGE_FILE_TIER_NONE;
+
+	g_return_val_if_fail (GTK_IS_SOURCE_LARGE_FILE_POLICY (policy),
+			      GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	priv = policy->priv;
+
+	if (priv->max_chars >= 0 && char_count > priv->max_chars)
+	{
+		tier |= GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT |
+			GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS;
+
+		if (char_count / HUGE_FACTOR > priv->max_chars)
+		{
+			tier |= GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES |
+				GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO;
+		}
+	}
+
+	if (priv->max_line_length >= 0 && long_lines)
+	{
+		tier |= GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING |
+			GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES;
+	}
+
+	return tier;
+}
@@ -0,0 +1,111 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*-
+ * gtksourcelargefilepolicy.h
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GTK_SOURCE_LARGE_FILE_POLICY_H__
+#define __GTK_SOURCE_LARGE_FILE_POLICY_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define GTK_TYPE_SOURCE_LARGE_FILE_POLICY             (gtk_source_large_file_policy_get_type ())
+#define GTK_SOURCE_LARGE_FILE_POLICY(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), GTK_TYPE_SOURCE_LARGE_FILE_POLICY, GtkSourceLargeFilePolicy))
+#define GTK_SOURCE_LARGE_FILE_POLICY_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), GTK_TYPE_SOURCE_LARGE_FILE_POLICY, GtkSourceLargeFilePolicyClass))
+#define GTK_IS_SOURCE_LARGE_FILE_POLICY(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GTK_TYPE_SOURCE_LARGE_FILE_POLICY))
+#define GTK_IS_SOURCE_LARGE_FILE_POLICY_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), GTK_TYPE_SOURCE_LARGE_FILE_POLICY))
+#define GTK_SOURCE_LARGE_FILE_POLICY_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS ((obj), GTK_TYPE_SOURCE_LARGE_FILE_POLICY, GtkSourceLargeFilePolicyClass))
+
+typedef struct _GtkSourceLargeFilePolicy		GtkSourceLargeFilePolicy;
+typedef struct _GtkSourceLargeFilePolicyClass		GtkSourceLargeFilePolicyClass;
+typedef struct _GtkSourceLargeFilePolicyPrivate	GtkSourceLargeFilePolicyPrivate;
+
+/**
+ * GtkSourceLargeFileTier:
+ * @GTK_SOURCE_LARGE_FILE_TIER_NONE: the buffer is handled as usual.
+ * @GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT: syntax tags are kept
+ *  only on text near the region the view shows.
+ * @GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING: matching brackets
+ *  are not highlighted.
+ * @GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES: context classes are
+ *  not applied to the text.
+ * @GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO: the number of undo levels
+ *  is capped by #GtkSourceLargeFilePolicy:max-undo-levels.
+ * @GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS: the words completion
+ *  provider does not scan the buffer.
+ *
+ * Features a #GtkSourceBuffer turns off or restricts because of the
+ * size of its text, see #GtkSourceLargeFilePolicy.
+ *
+ * Since: 3.0
+ */
+typedef enum
+{
+	GTK_SOURCE_LARGE_FILE_TIER_NONE			= 0,
+	GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT	= 1 << 0,
+	GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING	= 1 << 1,
+	GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES	= 1 << 2,
+	GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO		= 1 << 3,
+	GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS	= 1 << 4
+} GtkSourceLargeFileTier;
+
+struct _GtkSourceLargeFilePolicy
+{
+	GObject parent_instance;
+
+	GtkSourceLargeFilePolicyPrivate *priv;
+};
+
+struct _GtkSourceLargeFilePolicyClass
+{
+	GObjectClass parent_class;
+
+	/* Padding for future expansion */
+	void (*_gtk_source_reserved1) (void);
+	void (*_gtk_source_reserved2) (void);
+};
+
+GType			 gtk_source_large_file_policy_get_type	(void) G_GNUC_CONST;
+
+GtkSourceLargeFilePolicy *gtk_source_large_file_policy_new	(void);
+
+gint			 gtk_source_large_file_policy_get_max_chars
+								(GtkSourceLargeFilePolicy *policy);
+void			 gtk_source_large_file_policy_set_max_chars
+								(GtkSourceLargeFilePolicy *policy,
+								 gint                      max_chars);
+
+gint			 gtk_source_large_file_policy_get_max_line_length
+								(GtkSourceLargeFilePolicy *policy);
+void			 gtk_source_large_file_policy_set_max_line_length
+								(GtkSourceLargeFilePolicy *policy,
+								 gint                      max_line_length);
+
+gint			 gtk_source_large_file_policy_get_max_undo_levels
+								(GtkSourceLargeFilePolicy *policy);
+void			 gtk_source_large_file_policy_set_max_undo_levels
+								(GtkSourceLargeFilePolicy *policy,
+								 gint                      max_undo_levels);
+
+GtkSourceLargeFileTier	 gtk_source_large_file_policy_get_tier	(GtkSourceLargeFilePolicy *policy,
+								 gint                      char_count,
+								 gboolean                  long_lines);
+
+G_END_DECLS
+
+#endif /* __GTK_SOURCE_LARGE_FILE_POLICY_H__ */
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/* gtksourceview-update-language-index.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Writes languages.index in the given directories of lang files, so
+ * that the language manager does not need to read every lang file the
+ * first time it is used. It must run again after the directories are
+ * modified, otherwise the index is ignored. */
+
+#include <stdio.h>
+#include <glib.h>
+#include "gtksourcelanguagemanager.h"
+
+int
+main (int argc, char *argv[])
+{
+	GtkSourceLanguageManager *lm;
+
+	if (argc < 2)
+	{
+		fprintf (stderr, "Usage: %s DIRECTORY...\n", argv[0]);
+		return 1;
+	}
+
+	g_type_init ();
+
+	/* The language manager writes the index of each directory it
+	 * reads, see ensure_languages(). */
+	g_setenv ("GTKSOURCEVIEW_WRITE_LANGUAGE_INDEX", "1", TRUE);
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, argv + 1);
+	gtk_source_language_manager_get_language_ids (lm);
+	g_object_unref (lm);
+
+	return 0;
+}
@@ -0,0 +1,1190 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <gtksourceview/gtksourcebuffer.h>
+#include <gtksourceview/gtksourcelanguagemanager.h>
+#include <gtksourceview/gtksourcelargefilepolicy.h>
+#include <gtksourceview/gtksourcestyleschememanager.h>
+
+static gchar *cache_dir = NULL;
+
+/* C with contexts spanning lines, so that edits change the highlighting
+ * of the text after them. */
+static const gchar *c_lines[] = {
+	"#include <stdio.h>",
+	"/* a comment",
+	"   spanning \"lines\" */",
+	"static int",
+	"foo (const char *s) /* %d */",
+	"{",
+	"\treturn printf (\"%s \\\" %d\\n\", s, 'x'); // done",
+	"}",
+	"#if 0",
+	"int bar;",
+	"#endif"
+};
+
+/* Inserted at random by random_edit() */
+static const gchar *edit_texts[] = {
+	"/*", "*/", "\"", "'", "\n", "//", "\\", "#if 0\n", "#endif\n", "x", " "
+};
+
+/* Every element name makes a context of its own, whose end regex is
+ * made from the start one. */
+static const gchar tags_lang[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<language id=\"tags\" _name=\"Tags\" version=\"2.0\" _section=\"Others\">\n"
+	"  <styles>\n"
+	"    <style id=\"element\" _name=\"Element\" map-to=\"def:keyword\"/>\n"
+	"    <style id=\"string\" _name=\"String\" map-to=\"def:string\"/>\n"
+	"  </styles>\n"
+	"  <definitions>\n"
+	"    <context id=\"string\" style-ref=\"string\" class=\"string\">\n"
+	"      <start>\"</start>\n"
+	"      <end>\"</end>\n"
+	"    </context>\n"
+	"    <context id=\"element\" style-ref=\"element\" class=\"element\">\n"
+	"      <start>&lt;([^ &gt;/]+)&gt;</start>\n"
+	"      <end>&lt;/\\%{1@start}&gt;</end>\n"
+	"      <include>\n"
+	"        <context ref=\"string\"/>\n"
+	"        <context ref=\"element\"/>\n"
+	"      </include>\n"
+	"    </context>\n"
+	"    <context id=\"tags\">\n"
+	"      <include>\n"
+	"        <context ref=\"string\"/>\n"
+	"        <context ref=\"element\"/>\n"
+	"      </include>\n"
+	"    </context>\n"
+	"  </definitions>\n"
+	"</language>\n";
+
+/* "a" is found quickly, but looking for the other alternative at
+ * every "b" backtracks a lot. */
+static const gchar slow_lang[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<language id=\"slow\" _name=\"Slow\" version=\"2.0\" _section=\"Others\">\n"
+	"  <styles>\n"
+	"    <style id=\"a\" _name=\"A\"/>\n"
+	"  </styles>\n"
+	"  <definitions>\n"
+	"    <context id=\"slow\">\n"
+	"      <include>\n"
+	"        <context id=\"a\" style-ref=\"a\" class=\"a\">\n"
+	"          <match>(b+)+c|a</match>\n"
+	"        </context>\n"
+	"      </include>\n"
+	"    </context>\n"
+	"  </definitions>\n"
+	"</language>\n";
+
+static void
+remove_dir (const gchar *dirname)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (dirname, 0, NULL);
+
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+	{
+		gchar *filename;
+
+		filename = g_build_filename (dirname, name, NULL);
+
+		if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+			remove_dir (filename);
+		else
+			g_unlink (filename);
+
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+	g_rmdir (dirname);
+}
+
+/* Languages of the tests are written to cache_dir by main() */
+static GtkSourceLanguage *
+get_language (const gchar *id)
+{
+	static GtkSourceLanguageManager *lm = NULL;
+	GtkSourceLanguage *language;
+
+	if (lm == NULL)
+	{
+		gchar *dirs[] = { TOP_SRCDIR "/data/language-specs", cache_dir, NULL };
+
+		lm = gtk_source_language_manager_new ();
+		gtk_source_language_manager_set_search_path (lm, dirs);
+	}
+
+	language = gtk_source_language_manager_get_language (lm, id);
+	g_assert (language != NULL);
+
+	return language;
+}
+
+static void
+write_language (const gchar *id,
+		const gchar *contents)
+{
+	gchar *filename;
+	gchar *basename;
+
+	basename = g_strdup_printf ("%s.lang", id);
+	filename = g_build_filename (cache_dir, basename, NULL);
+	g_assert (g_file_set_contents (filename, contents, -1, NULL));
+
+	g_free (basename);
+	g_free (filename);
+}
+
+static GtkSourceStyleScheme *
+get_style_scheme (void)
+{
+	static GtkSourceStyleSchemeManager *sm = NULL;
+	GtkSourceStyleScheme *scheme;
+
+	if (sm == NULL)
+	{
+		gchar *dirs[] = { TOP_SRCDIR "/data/styles", NULL };
+
+		sm = gtk_source_style_scheme_manager_new ();
+		gtk_source_style_scheme_manager_set_search_path (sm, dirs);
+	}
+
+	scheme = gtk_source_style_scheme_manager_get_scheme (sm, "classic");
+	g_assert (scheme != NULL);
+
+	return scheme;
+}
+
+static GtkSourceBuffer *
+new_buffer (const gchar *id,
+	    const gchar *text)
+{
+	GtkSourceBuffer *buffer;
+
+	buffer = gtk_source_buffer_new_with_language (get_language (id));
+	gtk_source_buffer_set_style_scheme (buffer, get_style_scheme ());
+	/* The tag would follow the cursor, which edits move */
+	gtk_source_buffer_set_highlight_matching_brackets (buffer, FALSE);
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text, -1);
+
+	return buffer;
+}
+
+/* Repeats c_lines until the text is @min_length bytes long */
+static gchar *
+make_c_text (gsize        min_length,
+	     const gchar *eol)
+{
+	GString *text;
+	guint i;
+
+	text = g_string_new (NULL);
+
+	while (text->len < min_length)
+	{
+		for (i = 0; i < G_N_ELEMENTS (c_lines); i++)
+		{
+			g_string_append (text, c_lines[i]);
+			g_string_append (text, eol);
+		}
+	}
+
+	return g_string_free (text, FALSE);
+}
+
+static void
+highlight_all (GtkSourceBuffer *buffer)
+{
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+}
+
+static void
+highlight_lines (GtkSourceBuffer *buffer,
+		 gint             first,
+		 gint             last)
+{
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, MAX (first, 0));
+
+	if (last + 1 < gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)))
+		gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &end, last + 1);
+	else
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+}
+
+static gint
+compare_strings (const gchar **a,
+		 const gchar **b)
+{
+	return strcmp (*a, *b);
+}
+
+/* Syntax tags have no names, so a tag is described by the style it
+ * applies, or by its context class. */
+static gchar *
+describe_tag (GtkTextTag *tag)
+{
+	GdkColor *color = NULL;
+	gboolean foreground_set;
+	PangoWeight weight;
+	PangoStyle style;
+	gchar *description;
+
+	g_object_get (tag,
+		      "foreground-set", &foreground_set,
+		      "foreground-gdk", &color,
+		      "weight", &weight,
+		      "style", &style,
+		      NULL);
+
+	if (foreground_set && color != NULL)
+		description = g_strdup_printf ("#%04x%04x%04x/%d/%d",
+					       color->red, color->green, color->blue,
+					       weight, style);
+	else
+		description = g_strdup_printf ("-/%d/%d", weight, style);
+
+	if (color != NULL)
+		gdk_color_free (color);
+
+	return description;
+}
+
+/* Returns the positions where tags toggle in lines @first to @last of
+ * @buffer, with the styles and the context classes there, one string
+ * per position. */
+static GPtrArray *
+get_tag_toggles_in_lines (GtkSourceBuffer *buffer,
+			  gint             first,
+			  gint             last)
+{
+	GPtrArray *toggles;
+	GtkTextIter iter, end;
+
+	toggles = g_ptr_array_new_with_free_func (g_free);
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, first);
+
+	if (last + 1 < gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)))
+		gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &end, last + 1);
+	else
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+
+	do
+	{
+		GString *str;
+		GPtrArray *names;
+		GSList *tags, *l;
+		gchar **classes;
+		guint i;
+
+		str = g_string_new (NULL);
+		g_string_printf (str, "%d:", gtk_text_iter_get_offset (&iter));
+
+		names = g_ptr_array_new_with_free_func (g_free);
+		tags = gtk_text_iter_get_tags (&iter);
+
+		for (l = tags; l != NULL; l = l->next)
+			g_ptr_array_add (names, describe_tag (l->data));
+
+		g_slist_free (tags);
+
+		classes = gtk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+
+		for (i = 0; classes[i] != NULL; i++)
+			g_ptr_array_add (names, g_strdup (classes[i]));
+
+		g_strfreev (classes);
+
+		qsort (names->pdata, names->len, sizeof (gchar *), (GCompareFunc) compare_strings);
+
+		for (i = 0; i < names->len; i++)
+			g_string_append_printf (str, " %s", (gchar *) g_ptr_array_index (names, i));
+
+		g_ptr_array_free (names, TRUE);
+		g_ptr_array_add (toggles, g_string_free (str, FALSE));
+	}
+	while (gtk_text_iter_forward_to_tag_toggle (&iter, NULL) &&
+	       gtk_text_iter_compare (&iter, &end) < 0);
+
+	return toggles;
+}
+
+static GPtrArray *
+get_tag_toggles (GtkSourceBuffer *buffer)
+{
+	return get_tag_toggles_in_lines (buffer, 0,
+					 gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)));
+}
+
+/* Frees both arrays */
+static void
+assert_toggles_equal (GPtrArray *toggles,
+		      GPtrArray *expected)
+{
+	guint i;
+
+	for (i = 0; i < MIN (toggles->len, expected->len); i++)
+		g_assert_cmpstr (g_ptr_array_index (toggles, i), ==,
+				 g_ptr_array_index (expected, i));
+
+	g_assert_cmpuint (toggles->len, ==, expected->len);
+
+	g_ptr_array_free (toggles, TRUE);
+	g_ptr_array_free (expected, TRUE);
+}
+
+/* Returns a new buffer with the text of @buffer, highlighted from
+ * scratch. */
+static GtkSourceBuffer *
+new_fresh_buffer (GtkSourceBuffer *buffer)
+{
+	GtkSourceBuffer *fresh;
+	GtkTextIter start, end;
+	gchar *text;
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	text = gtk_text_buffer_get_slice (GTK_TEXT_BUFFER (buffer), &start, &end, TRUE);
+
+	fresh = new_buffer (gtk_source_language_get_id (gtk_source_buffer_get_language (buffer)),
+			    text);
+	highlight_all (fresh);
+
+	g_free (text);
+
+	return fresh;
+}
+
+/* Checks that @buffer, edited since it was highlighted, gets the same
+ * tags as the same text analyzed from scratch. */
+static void
+assert_highlighting_is_fresh (GtkSourceBuffer *buffer)
+{
+	GtkSourceBuffer *fresh;
+
+	fresh = new_fresh_buffer (buffer);
+	highlight_all (buffer);
+
+	assert_toggles_equal (get_tag_toggles (buffer), get_tag_toggles (fresh));
+
+	g_object_unref (fresh);
+}
+
+/* Inserts or deletes some text at a random place, and returns the line
+ * of the edit. */
+static gint
+random_edit (GtkSourceBuffer *buffer,
+	     GRand           *rand)
+{
+	GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
+	GtkTextIter start, end;
+	gint offset;
+
+	offset = g_rand_int_range (rand, 0, gtk_text_buffer_get_char_count (text_buffer) + 1);
+	gtk_text_buffer_get_iter_at_offset (text_buffer, &start, offset);
+
+	if (g_rand_boolean (rand))
+	{
+		gtk_text_buffer_insert (text_buffer, &start,
+					edit_texts[g_rand_int_range (rand, 0, G_N_ELEMENTS (edit_texts))],
+					-1);
+	}
+	else
+	{
+		end = start;
+		gtk_text_iter_forward_chars (&end, g_rand_int_range (rand, 1, 10));
+		gtk_text_buffer_delete (text_buffer, &start, &end);
+	}
+
+	return gtk_text_iter_get_line (&start);
+}
+
+static void
+highlight_updated_cb (GtkSourceBuffer *buffer,
+		      GtkTextIter     *start,
+		      GtkTextIter     *end,
+		      gboolean        *whole)
+{
+	/* Without a view, only the tree built by the background thread
+	 * is refreshed all at once. The last line terminator is not
+	 * included. */
+	if (gtk_text_iter_is_start (start) &&
+	    gtk_text_iter_get_line (end) >=
+		gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)) - 2)
+	{
+		*whole = TRUE;
+	}
+}
+
+static gboolean
+timeout_cb (gpointer data)
+{
+	g_error ("the background analysis did not finish");
+	return FALSE;
+}
+
+static void
+check_background_analysis (const gchar *eol)
+{
+	GtkSourceBuffer *threaded, *sync;
+	GPtrArray *toggles_threaded;
+	gchar *text;
+	gboolean whole = FALSE;
+	guint timeout;
+
+	/* Enough for the engine to use a thread, see
+	 * BACKGROUND_ANALYSIS_MIN_CHARS */
+	text = make_c_text (3 << 20, eol);
+
+	/* Analyzed by the thread when the main loop runs */
+	threaded = new_buffer ("c", text);
+	g_signal_connect (threaded, "highlight-updated",
+			  G_CALLBACK (highlight_updated_cb), &whole);
+
+	timeout = g_timeout_add_seconds (120, timeout_cb, NULL);
+
+	while (!whole)
+		g_main_context_iteration (NULL, TRUE);
+
+	g_source_remove (timeout);
+
+	/* Analyzed right away in the main thread */
+	sync = new_fresh_buffer (threaded);
+
+	/* The tree is complete, this only applies the tags */
+	highlight_all (threaded);
+
+	toggles_threaded = get_tag_toggles (threaded);
+	g_assert_cmpuint (toggles_threaded->len, >, G_N_ELEMENTS (c_lines));
+	assert_toggles_equal (toggles_threaded, get_tag_toggles (sync));
+
+	g_object_unref (threaded);
+	g_object_unref (sync);
+	g_free (text);
+}
+
+static void
+test_background_analysis (void)
+{
+	check_background_analysis ("\n");
+}
+
+/* The text is split for several threads at line ends, see
+ * background_job_split(). */
+static void
+test_background_analysis_cr (void)
+{
+	check_background_analysis ("\r");
+}
+
+static void
+test_background_analysis_crlf (void)
+{
+	check_background_analysis ("\r\n");
+}
+
+static void
+test_background_edits (void)
+{
+	GtkTextBuffer *text_buffer;
+	GtkSourceBuffer *buffer, *fresh;
+	GtkTextIter iter;
+	gchar *text;
+	gboolean whole = FALSE;
+	guint timeout;
+	gint n_lines;
+
+	text = make_c_text (3 << 20, "\n");
+	buffer = new_buffer ("c", text);
+	text_buffer = GTK_TEXT_BUFFER (buffer);
+	g_signal_connect (buffer, "highlight-updated",
+			  G_CALLBACK (highlight_updated_cb), &whole);
+
+	/* Let the first update run and start the thread, which only
+	 * reports back when it's done */
+	while (g_main_context_pending (NULL))
+		g_main_context_iteration (NULL, FALSE);
+
+	n_lines = gtk_text_buffer_get_line_count (text_buffer);
+
+	/* The end of the buffer is analyzed from a bit before it, not
+	 * from the first invalid line */
+	fresh = new_fresh_buffer (buffer);
+	highlight_lines (buffer, n_lines - 20, n_lines - 1);
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, n_lines - 20, n_lines - 1),
+			      get_tag_toggles_in_lines (fresh, n_lines - 20, n_lines - 1));
+	g_object_unref (fresh);
+
+	/* Edits in the window and before it, made while the thread
+	 * analyzes the old text */
+	gtk_text_buffer_get_iter_at_line (text_buffer, &iter, n_lines - 30);
+	gtk_text_buffer_insert (text_buffer, &iter, "/*", -1);
+	gtk_text_buffer_get_iter_at_line (text_buffer, &iter, 10);
+	gtk_text_buffer_insert (text_buffer, &iter, "\"\n#if 0\n", -1);
+	n_lines = gtk_text_buffer_get_line_count (text_buffer);
+
+	fresh = new_fresh_buffer (buffer);
+	highlight_lines (buffer, n_lines - 40, n_lines - 1);
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, n_lines - 20, n_lines - 1),
+			      get_tag_toggles_in_lines (fresh, n_lines - 20, n_lines - 1));
+
+	/* Going back to the top starts another window */
+	highlight_lines (buffer, 0, 40);
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, 0, 40),
+			      get_tag_toggles_in_lines (fresh, 0, 40));
+	g_object_unref (fresh);
+
+	/* The tree of the thread replaces the windows, and the edits
+	 * are applied to it */
+	timeout = g_timeout_add_seconds (120, timeout_cb, NULL);
+
+	while (!whole)
+		g_main_context_iteration (NULL, TRUE);
+
+	g_source_remove (timeout);
+
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+static void
+test_profile (void)
+{
+	/* The engine prints its statistics when detached from the
+	 * buffer if GTKSOURCEVIEW_PROFILE is set. */
+	if (g_test_trap_fork (0, G_TEST_TRAP_SILENCE_STDOUT))
+	{
+		GtkSourceBuffer *buffer;
+
+		g_setenv ("GTKSOURCEVIEW_PROFILE", "1", TRUE);
+
+		buffer = new_buffer ("c", "int a; /* a */\n"
+				       "char *b = \"b\";\n"
+				       "#include <stdio.h>\n");
+		highlight_all (buffer);
+
+		gtk_source_buffer_set_language (buffer, NULL);
+		g_object_unref (buffer);
+
+		exit (0);
+	}
+
+	g_test_trap_assert_passed ();
+	g_test_trap_assert_stdout ("c: analyzed * lines in *");
+	g_test_trap_assert_stdout ("*definitions:*");
+	g_test_trap_assert_stdout ("*c:c *matches*");
+}
+
+static void
+test_lazy_offsets (void)
+{
+	GtkSourceBuffer *buffer;
+	GRand *rand;
+	gchar *text;
+	gint i;
+
+	rand = g_rand_new_with_seed (9);
+	text = make_c_text (20000, "\n");
+	buffer = new_buffer ("c", text);
+	highlight_all (buffer);
+
+	/* More edits than PENDING_EDITS_MAX without analysis in between,
+	 * so that they are composed into one */
+	for (i = 0; i < 300; i++)
+		random_edit (buffer, rand);
+
+	assert_highlighting_is_fresh (buffer);
+
+	/* Few pending edits at a time, and the tree analyzed only
+	 * around them */
+	for (i = 0; i < 300; i++)
+	{
+		gint line = random_edit (buffer, rand);
+
+		if (i % 3 == 0)
+			highlight_lines (buffer, line - 2, line + 2);
+	}
+
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+	g_rand_free (rand);
+}
+
+/* Checks that lines from @first to @last of @buffer get the same tags
+ * as the same text analyzed from scratch, without highlighting the
+ * rest of @buffer. */
+static void
+assert_lines_are_fresh (GtkSourceBuffer *buffer,
+			gint             first,
+			gint             last)
+{
+	GtkSourceBuffer *fresh;
+
+	fresh = new_fresh_buffer (buffer);
+	highlight_lines (buffer, first, last);
+
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, first, last),
+			      get_tag_toggles_in_lines (fresh, first, last));
+
+	g_object_unref (fresh);
+}
+
+static void
+test_checkpoints (void)
+{
+	GtkTextBuffer *text_buffer;
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	GRand *rand;
+	gchar *text, *inserted;
+	gint i, middle;
+
+	rand = g_rand_new_with_seed (2);
+	text = make_c_text (60000, "\n");
+	buffer = new_buffer ("c", text);
+	text_buffer = GTK_TEXT_BUFFER (buffer);
+	highlight_all (buffer);
+
+	middle = gtk_text_buffer_get_line_count (text_buffer) / 2;
+
+	/* Lines after the edit move by a number of lines which is not
+	 * a multiple of the checkpoint interval */
+	inserted = make_c_text (1000, "\n");
+	gtk_text_buffer_get_iter_at_line (text_buffer, &start, 30);
+	gtk_text_buffer_insert (text_buffer, &start, inserted, -1);
+	assert_lines_are_fresh (buffer, middle, middle + 40);
+
+	/* Deleted text spans several checkpoints */
+	gtk_text_buffer_get_iter_at_line (text_buffer, &start, 100);
+	gtk_text_buffer_get_iter_at_line (text_buffer, &end, 700);
+	gtk_text_buffer_delete (text_buffer, &start, &end);
+	middle = gtk_text_buffer_get_line_count (text_buffer) / 2;
+	assert_lines_are_fresh (buffer, middle, middle + 40);
+
+	/* Edits which change the context stack at line starts, with
+	 * the text after them analyzed in between */
+	for (i = 0; i < 20; i++)
+	{
+		gint line = random_edit (buffer, rand);
+
+		assert_lines_are_fresh (buffer, line, line + 200);
+	}
+
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (inserted);
+	g_free (text);
+	g_rand_free (rand);
+}
+
+typedef struct
+{
+	gint line;
+	guint outside;
+} TagChanges;
+
+static void
+tag_changed_cb (GtkTextBuffer *buffer,
+		GtkTextTag    *tag,
+		GtkTextIter   *start,
+		GtkTextIter   *end,
+		TagChanges    *changes)
+{
+	if (gtk_text_iter_get_line (end) < changes->line ||
+	    gtk_text_iter_get_line (start) > changes->line)
+		changes->outside++;
+}
+
+static void
+test_tag_diffing (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter, end;
+	TagChanges changes;
+	gchar *text;
+
+	text = make_c_text (5000, "\n");
+	buffer = new_buffer ("c", text);
+	highlight_all (buffer);
+
+	/* Text around a change that does not affect it keeps its tags,
+	 * "int bar;" is in the middle of "#if 0" */
+	changes.line = 10 * G_N_ELEMENTS (c_lines) + 9;
+	changes.outside = 0;
+
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &iter,
+						 changes.line, 6);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "x", -1);
+
+	g_signal_connect (buffer, "apply-tag", G_CALLBACK (tag_changed_cb), &changes);
+	g_signal_connect (buffer, "remove-tag", G_CALLBACK (tag_changed_cb), &changes);
+
+	highlight_all (buffer);
+	g_assert_cmpuint (changes.outside, ==, 0);
+
+	g_signal_handlers_disconnect_by_func (buffer, tag_changed_cb, &changes);
+	assert_highlighting_is_fresh (buffer);
+
+	/* The rest of the buffer becomes a comment and back */
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "/* ", -1);
+	assert_highlighting_is_fresh (buffer);
+
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	end = iter;
+	gtk_text_iter_forward_chars (&end, 3);
+	gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &iter, &end);
+	assert_highlighting_is_fresh (buffer);
+
+	/* A string left open at a line end */
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, 3);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "\"", -1);
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+static void
+assert_no_tags_in_lines (GtkSourceBuffer *buffer,
+			 gint             first,
+			 gint             last)
+{
+	GPtrArray *toggles;
+	gchar *expected;
+	GtkTextIter iter;
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, first);
+	expected = g_strdup_printf ("%d:", gtk_text_iter_get_offset (&iter));
+
+	toggles = get_tag_toggles_in_lines (buffer, first, last);
+	g_assert_cmpuint (toggles->len, ==, 1);
+	g_assert_cmpstr (g_ptr_array_index (toggles, 0), ==, expected);
+
+	g_ptr_array_free (toggles, TRUE);
+	g_free (expected);
+}
+
+static void
+test_viewport_tags (void)
+{
+	GtkSourceLargeFilePolicy *policy;
+	GtkSourceBuffer *buffer, *fresh;
+	gchar *text;
+	gint n_lines;
+
+	text = make_c_text (60000, "\n");
+	buffer = new_buffer ("c", text);
+	fresh = new_fresh_buffer (buffer);
+
+	policy = gtk_source_large_file_policy_new ();
+	gtk_source_large_file_policy_set_max_chars (policy, 1000);
+	gtk_source_buffer_set_large_file_policy (buffer, policy);
+	g_assert (gtk_source_buffer_get_large_file_tier (buffer) &
+		  GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT);
+
+	n_lines = gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer));
+	g_assert_cmpint (n_lines, >, 2000);
+
+	/* Only the text within TAGS_WINDOW_MARGIN_LINES lines of the
+	 * requested one keeps its tags */
+	highlight_lines (buffer, 0, 20);
+	highlight_lines (buffer, n_lines - 20, n_lines - 1);
+	assert_no_tags_in_lines (buffer, 0, n_lines - 521);
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, n_lines - 20, n_lines - 1),
+			      get_tag_toggles_in_lines (fresh, n_lines - 20, n_lines - 1));
+
+	/* Going back tags the text again, from the tree */
+	highlight_lines (buffer, 0, 20);
+	assert_no_tags_in_lines (buffer, 521, n_lines - 1);
+	assert_toggles_equal (get_tag_toggles_in_lines (buffer, 0, 20),
+			      get_tag_toggles_in_lines (fresh, 0, 20));
+
+	g_object_unref (policy);
+	g_object_unref (fresh);
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+/* Lets the engine analyze the buffer in idle time slices */
+static void
+run_main_loop (void)
+{
+	while (g_main_context_pending (NULL))
+		g_main_context_iteration (NULL, FALSE);
+}
+
+/* One line taking several INCREMENTAL_UPDATE_TIME_SLICE slices to
+ * analyze, but less than MAX_TIME_FOR_ONE_LINE */
+static gchar *
+make_long_line_text (void)
+{
+	GString *text;
+	gchar *tail;
+
+	text = g_string_new ("int a;\n");
+
+	while (text->len < 300000)
+		g_string_append (text, "foo (\"s\\\"t\", 'c', 1.5); /* x */ ");
+
+	g_string_append_c (text, '\n');
+
+	tail = make_c_text (2000, "\n");
+	g_string_append (text, tail);
+	g_free (tail);
+
+	return g_string_free (text, FALSE);
+}
+
+static void
+test_long_line_slices (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter;
+	gchar *text;
+	gint i;
+
+	text = make_long_line_text ();
+
+	/* The slices go on where the previous one stopped */
+	buffer = new_buffer ("c", text);
+	run_main_loop ();
+	assert_highlighting_is_fresh (buffer);
+	g_object_unref (buffer);
+
+	/* Editing the line in the middle of its analysis starts it
+	 * again */
+	buffer = new_buffer ("c", text);
+
+	for (i = 0; i < 3; i++)
+		g_main_context_iteration (NULL, FALSE);
+
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &iter, 1, 1000);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "\"", -1);
+
+	for (i = 0; i < 3; i++)
+		g_main_context_iteration (NULL, FALSE);
+
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &iter, 1, 150000);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "/* ", -1);
+
+	run_main_loop ();
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+/* @n_names elements with different names, nested in groups of three */
+static gchar *
+make_tags_text (gint n_names)
+{
+	GString *text;
+	gint i;
+
+	text = g_string_new (NULL);
+
+	for (i = 0; i < n_names; i++)
+	{
+		g_string_append_printf (text, "<t%d>a \"s\" ", i);
+
+		if (i % 3 == 2)
+			g_string_append_printf (text, "</t%d></t%d></t%d> z\n", i, i - 1, i - 2);
+	}
+
+	return g_string_free (text, FALSE);
+}
+
+static void
+test_context_cache (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	gchar *text;
+	gint line;
+
+	/* Many more contexts than CONTEXT_CACHE_MAX_IDLE */
+	text = make_tags_text (300);
+	buffer = new_buffer ("tags", text);
+	highlight_all (buffer);
+
+	/* All of them are released, and most evicted */
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "", -1);
+	highlight_all (buffer);
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text, -1);
+	assert_highlighting_is_fresh (buffer);
+
+	/* Elements going in and out of an unclosed one, which reuses
+	 * their released contexts */
+	for (line = 0; line < 20; line++)
+	{
+		gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, line * 5);
+		end = start;
+		gtk_text_iter_forward_chars (&end, 1);
+		gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+		highlight_all (buffer);
+
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &start, "<", -1);
+		highlight_all (buffer);
+
+		/* The ">" of the outer closing tag, the elements of the
+		 * next lines go into this one */
+		gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, line * 5 + 1);
+		gtk_text_iter_forward_to_line_end (&start);
+		gtk_text_iter_backward_chars (&start, 3);
+		end = start;
+		gtk_text_iter_forward_chars (&end, 1);
+		gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+		highlight_all (buffer);
+	}
+
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+static gboolean
+has_class_at_offset (GtkSourceBuffer *buffer,
+		     gint             offset,
+		     const gchar     *class)
+{
+	GtkTextIter iter;
+	gchar **classes;
+	gboolean found = FALSE;
+	guint i;
+
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, offset);
+	classes = gtk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+
+	for (i = 0; classes[i] != NULL; i++)
+		if (strcmp (classes[i], class) == 0)
+			found = TRUE;
+
+	g_strfreev (classes);
+
+	return found;
+}
+
+/* Checks lines made by make_end_regex_text() */
+static void
+check_end_regex_lines (GtkSourceBuffer *buffer)
+{
+	GtkTextIter iter;
+
+	highlight_all (buffer);
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+
+	do
+	{
+		GtkTextIter line_end = iter;
+		gint offset = gtk_text_iter_get_offset (&iter);
+		gchar *line;
+		gchar *x, *s, *z;
+
+		gtk_text_iter_forward_to_line_end (&line_end);
+		line = gtk_text_iter_get_slice (&iter, &line_end);
+
+		if (*line == '\0')
+		{
+			g_free (line);
+			break;
+		}
+
+		x = strchr (line, 'X');
+		s = strchr (line, 's');
+		z = strchr (line, 'z');
+		g_assert (x != NULL && s != NULL && z != NULL);
+
+		/* The end regex matches the name literally */
+		g_assert (has_class_at_offset (buffer, offset + (x - line), "element"));
+		g_assert (has_class_at_offset (buffer, offset + (s - line), "element"));
+		g_assert (has_class_at_offset (buffer, offset + (s - line), "string"));
+		g_assert (!has_class_at_offset (buffer, offset + (z - line), "element"));
+
+		g_free (line);
+	}
+	while (gtk_text_iter_forward_line (&iter));
+}
+
+/* Lines with an element whose name has a regex special character in
+ * it, followed by a closing tag matching the name as a regex. */
+static gchar *
+make_end_regex_text (gint     n_names,
+		     gboolean reversed)
+{
+	GString *text;
+	gint i;
+
+	text = g_string_new (NULL);
+
+	for (i = 0; i < n_names; i++)
+	{
+		gint n = reversed ? n_names - 1 - i : i;
+
+		g_string_append_printf (text, "<d%d.x>a</d%dXx> \"s\"</d%d.x> z\n", n, n, n);
+	}
+
+	return g_string_free (text, FALSE);
+}
+
+static void
+test_end_regex_cache (void)
+{
+	GtkSourceBuffer *buffer;
+	gchar *text;
+
+	/* More names than END_CACHE_MAX_SIZE */
+	text = make_end_regex_text (600, FALSE);
+	buffer = new_buffer ("tags", text);
+	check_end_regex_lines (buffer);
+	g_free (text);
+
+	/* The same names again, some of them are still cached */
+	text = make_end_regex_text (600, TRUE);
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text, -1);
+	check_end_regex_lines (buffer);
+	assert_highlighting_is_fresh (buffer);
+
+	g_object_unref (buffer);
+	g_free (text);
+}
+
+static void
+highlight_degraded_cb (GtkSourceBuffer *buffer,
+		       GtkTextIter     *start,
+		       GtkTextIter     *end,
+		       gint            *count)
+{
+	++*count;
+}
+
+static gboolean
+has_class_at_line (GtkSourceBuffer *buffer,
+		   gint             line,
+		   const gchar     *class)
+{
+	GtkTextIter iter;
+	gchar **classes;
+	gboolean found;
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, line);
+	classes = gtk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+	found = classes[0] != NULL && strcmp (classes[0], class) == 0;
+	g_strfreev (classes);
+
+	return found;
+}
+
+static void
+test_slow_line (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter;
+	GString *text;
+	gint count = 0;
+	gint i;
+
+	/* Far more than can be analyzed in MAX_TIME_FOR_ONE_LINE */
+	text = g_string_new ("a\n");
+
+	for (i = 0; i < 10000; i++)
+		g_string_append (text, "abbbbbbbbbbbbbbbbbbbb");
+
+	g_string_append (text, "\na\n");
+
+	buffer = new_buffer ("slow", text->str);
+	g_signal_connect (buffer, "highlight-degraded",
+			  G_CALLBACK (highlight_degraded_cb), &count);
+
+	highlight_all (buffer);
+	g_assert_cmpint (count, ==, 1);
+	g_assert_cmpuint (gtk_source_buffer_get_degraded_lines (buffer), ==, 1);
+
+	/* The lines around it are highlighted */
+	g_assert (has_class_at_line (buffer, 0, "a"));
+	g_assert (has_class_at_line (buffer, 2, "a"));
+
+	/* The line is not analyzed again until it is edited */
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "a", -1);
+	highlight_all (buffer);
+	g_assert_cmpint (count, ==, 1);
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, 1);
+	gtk_text_iter_forward_to_line_end (&iter);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "a", -1);
+	highlight_all (buffer);
+	g_assert_cmpint (count, ==, 2);
+	g_assert_cmpuint (gtk_source_buffer_get_degraded_lines (buffer), ==, 2);
+
+	g_object_unref (buffer);
+	g_string_free (text, TRUE);
+}
+
+int
+main (int argc, char** argv)
+{
+	gint ret;
+
+	/* The engine analyzes big buffers in a thread */
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	cache_dir = g_strdup_printf ("%s/test-contextengine-%d",
+				     g_get_tmp_dir (), (gint) getpid ());
+	g_assert (g_mkdir_with_parents (cache_dir, 0755) == 0);
+
+	/* Do not use the cache of the user */
+	g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+	write_language ("slow", slow_lang);
+	write_language ("tags", tags_lang);
+
+	gtk_test_init (&argc, &argv);
+
+	g_test_add_func ("/ContextEngine/background-analysis", test_background_analysis);
+	g_test_add_func ("/ContextEngine/background-analysis-cr", test_background_analysis_cr);
+	g_test_add_func ("/ContextEngine/background-analysis-crlf", test_background_analysis_crlf);
+	g_test_add_func ("/ContextEngine/background-edits", test_background_edits);
+	g_test_add_func ("/ContextEngine/profile", test_profile);
+	g_test_add_func ("/ContextEngine/slow-line", test_slow_line);
+	g_test_add_func ("/ContextEngine/lazy-offsets", test_lazy_offsets);
+	g_test_add_func ("/ContextEngine/checkpoints", test_checkpoints);
+	g_test_add_func ("/ContextEngine/tag-diffing", test_tag_diffing);
+	g_test_add_func ("/ContextEngine/viewport-tags", test_viewport_tags);
+	g_test_add_func ("/ContextEngine/long-line-slices", test_long_line_slices);
+	g_test_add_func ("/ContextEngine/context-cache", test_context_cache);
+	g_test_add_func ("/ContextEngine/end-regex-cache", test_end_regex_cache);
+
+	ret = g_test_run ();
+
+	remove_dir (cache_dir);
+	g_free (cache_dir);
+
+	return ret;
+}
@@ -0,0 +1,206 @@
+#include "config.h"
+#include <string.h>
+#include <unistd.h>
+
+#include <gtk/gtk.h>
+#include <gtksourceview/gtksourcelanguagemanager.h>
+#include <gtksourceview/gtksourcehighlighter.h>
+
+/* Measures how long loading each language takes, and how fast its
+ * rules analyze text, on the given files or on files of this tree.
+ * Run it before and after a change to the context engine. */
+
+typedef struct
+{
+	GtkSourceHighlighter	*highlighter;
+	guint			 n_files;
+	gsize			 n_bytes;
+	gdouble			 load_time;
+	gdouble			 highlight_time;
+} LanguageStats;
+
+static const gchar *default_files[] = {
+	"gtksourceview/gtksourcecontextengine.c",
+	"gtksourceview/gtksourcelanguage-parser-2.c",
+	"gtksourceview/gtksourceview.h",
+	"gtksourceview/Makefile.am",
+	"data/language-specs/c.lang",
+	"data/language-specs/language2.rng",
+	"data/language-specs/convert.py",
+	"data/language-specs/check-language.sh",
+	"tests/test-widget.py",
+	"configure.ac",
+	NULL
+};
+
+static void
+stats_free (LanguageStats *stats)
+{
+	g_object_unref (stats->highlighter);
+	g_slice_free (LanguageStats, stats);
+}
+
+static void
+measure_file (GtkSourceLanguageManager *lm,
+	      GHashTable               *languages,
+	      const gchar              *filename,
+	      gint                      iterations)
+{
+	GtkSourceLanguage *language;
+	LanguageStats *stats;
+	gchar *content_type;
+	gchar *text;
+	gsize length;
+	GTimer *timer;
+	gint i;
+
+	if (!g_file_get_contents (filename, &text, &length, NULL))
+	{
+		g_printerr ("Cannot read %s\n", filename);
+		return;
+	}
+
+	if (!g_utf8_validate (text, length, NULL))
+	{
+		g_printerr ("Skipping %s: not UTF-8\n", filename);
+		g_free (text);
+		return;
+	}
+
+	content_type = g_content_type_guess (filename, (const guchar *) text,
+					     length, NULL);
+	language = gtk_source_language_manager_guess_language (lm, filename,
+							       content_type);
+	g_free (content_type);
+
+	if (language == NULL)
+	{
+		g_printerr ("Skipping %s: no language\n", filename);
+		g_free (text);
+		return;
+	}
+
+	timer = g_timer_new ();
+
+	stats = g_hash_table_lookup (languages,
+				     gtk_source_language_get_id (language));
+
+	if (stats == NULL)
+	{
+		stats = g_slice_new0 (LanguageStats);
+
+		g_timer_start (timer);
+		stats->highlighter = gtk_source_highlighter_new (language);
+		stats->load_time = g_timer_elapsed (timer, NULL);
+
+		g_hash_table_insert (languages,
+				     (gpointer) gtk_source_language_get_id (language),
+				     stats);
+	}
+
+	g_timer_start (timer);
+
+	for (i = 0; i < iterations; ++i)
+	{
+		GtkSourceStyleSpan *spans;
+		guint n_spans;
+
+		spans = gtk_source_highlighter_highlight_text (stats->highlighter,
+							       text, length,
+							       &n_spans);
+		g_free (spans);
+	}
+
+	stats->highlight_time += g_timer_elapsed (timer, NULL);
+	stats->n_bytes += length * iterations;
+	stats->n_files++;
+
+	g_timer_destroy (timer);
+	g_free (text);
+}
+
+static void
+print_stats (const gchar   *id,
+	     LanguageStats *stats)
+{
+	gdouble speed = 0;
+
+	if (stats->highlight_time > 0)
+		speed = stats->n_bytes / stats->highlight_time / (1024 * 1024);
+
+	g_print ("%-16s %5u %10.1f %10.2f %10.2f\n",
+		 id, stats->n_files, stats->n_bytes / 1024.0,
+		 stats->load_time * 1000, speed);
+}
+
+int
+main (int argc, char *argv[])
+{
+	GtkSourceLanguageManager *lm;
+	GHashTable *languages;
+	gchar *builtin_lang_dirs[] = {TOP_SRCDIR "/data/language-specs", NULL};
+	gchar **files = NULL;
+	gint iterations = 10;
+	gboolean use_default_paths = FALSE;
+	gboolean no_cache = FALSE;
+	GOptionContext *context;
+	gint i;
+
+	GOptionEntry entries[] = {
+	  { "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Number of times each file is analyzed", "N"},
+	  { "default-paths", 'd', 0, G_OPTION_ARG_NONE, &use_default_paths, "Use default search paths", NULL},
+	  { "no-cache", 'n', 0, G_OPTION_ARG_NONE, &no_cache, "Do not use cached language definitions", NULL},
+	  { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, NULL, "[FILE...]"},
+	  { NULL }
+	};
+
+	context = g_option_context_new ("- measure syntax highlighting speed");
+	g_option_context_add_main_entries (context, entries, NULL);
+	g_option_context_parse (context, &argc, &argv, NULL);
+	g_option_context_free (context);
+
+	if (no_cache)
+	{
+		gchar *cache_dir;
+
+		cache_dir = g_strdup_printf ("%s/test-highlighter-speed-%d",
+					     g_get_tmp_dir (), (gint) getpid ());
+		g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+		g_free (cache_dir);
+	}
+
+	g_type_init ();
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, use_default_paths ? NULL : builtin_lang_dirs);
+
+	languages = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+					   (GDestroyNotify) stats_free);
+
+	if (files != NULL)
+	{
+		for (i = 0; files[i] != NULL; ++i)
+			measure_file (lm, languages, files[i], iterations);
+	}
+	else
+	{
+		for (i = 0; default_files[i] != NULL; ++i)
+		{
+			gchar *filename;
+
+			filename = g_build_filename (TOP_SRCDIR, default_files[i], NULL);
+			measure_file (lm, languages, filename, iterations);
+			g_free (filename);
+		}
+	}
+
+	g_print ("%-16s %5s %10s %10s %10s\n",
+		 "Language", "Files", "KiB", "Load (ms)", "MiB/s");
+	g_hash_table_foreach (languages, (GHFunc) print_stats, NULL);
+
+	g_hash_table_destroy (languages);
+	g_object_unref (lm);
+	g_strfreev (files);
+
+	return 0;
+}
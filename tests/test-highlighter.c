@@ -0,0 +1,501 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <gtksourceview/gtksourcelanguagemanager.h>
+#include <gtksourceview/gtksourcehighlighter.h>
+
+static gchar *lang_dir = NULL;
+
+static void
+remove_dir (const gchar *dirname)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (dirname, 0, NULL);
+
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+	{
+		gchar *filename;
+
+		filename = g_build_filename (dirname, name, NULL);
+
+		if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+			remove_dir (filename);
+		else
+			g_unlink (filename);
+
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+	g_rmdir (dirname);
+}
+
+/* Writes a language with a single context made of the elements in
+ * @definition, and returns a highlighter for it. */
+static GtkSourceHighlighter *
+new_highlighter_for_definition (const gchar *definition)
+{
+	static gint n_languages = 0;
+	GtkSourceLanguageManager *lm;
+	GtkSourceLanguage *language;
+	GtkSourceHighlighter *highlighter;
+	gchar *dirs[] = { lang_dir, TOP_SRCDIR "/data/language-specs", NULL };
+	gchar *id, *contents, *filename;
+
+	id = g_strdup_printf ("pattern%d", ++n_languages);
+	contents = g_strdup_printf (
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<language id=\"%s\" _name=\"%s\" version=\"2.0\" _section=\"Others\">\n"
+		"  <styles>\n"
+		"    <style id=\"match\" _name=\"Match\"/>\n"
+		"  </styles>\n"
+		"  <definitions>\n"
+		"    <context id=\"%s\">\n"
+		"      <include>\n"
+		"        <context id=\"match\" style-ref=\"match\">\n"
+		"          %s\n"
+		"        </context>\n"
+		"      </include>\n"
+		"    </context>\n"
+		"  </definitions>\n"
+		"</language>\n",
+		id, id, id, definition);
+
+	filename = g_strdup_printf ("%s/%s.lang", lang_dir, id);
+	g_assert (g_file_set_contents (filename, contents, -1, NULL));
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, dirs);
+
+	language = gtk_source_language_manager_get_language (lm, id);
+	g_assert (language != NULL);
+
+	highlighter = gtk_source_highlighter_new (language);
+
+	g_object_unref (lm);
+	g_free (filename);
+	g_free (contents);
+	g_free (id);
+
+	return highlighter;
+}
+
+/* Checks that the spans @highlighter finds in @text are the matches of
+ * @pattern one after another, as GRegex finds them. */
+static void
+check_spans (GtkSourceHighlighter *highlighter,
+	     const gchar          *pattern,
+	     const gchar          *text)
+{
+	GtkSourceStyleSpan *spans;
+	guint n_spans, n_matches = 0;
+	GRegex *regex;
+	GMatchInfo *match_info;
+
+	spans = gtk_source_highlighter_highlight_text (highlighter, text, -1,
+						       &n_spans);
+
+	regex = g_regex_new (pattern, 0, 0, NULL);
+	g_assert (regex != NULL);
+	g_regex_match (regex, text, 0, &match_info);
+
+	while (g_match_info_matches (match_info))
+	{
+		gint start, end;
+
+		g_match_info_fetch_pos (match_info, 0, &start, &end);
+
+		g_assert_cmpuint (n_matches, <, n_spans);
+		g_assert_cmpint (spans[n_matches].offset, ==,
+				 g_utf8_pointer_to_offset (text, text + start));
+		g_assert_cmpint (spans[n_matches].length, ==,
+				 g_utf8_pointer_to_offset (text + start, text + end));
+
+		n_matches++;
+		g_match_info_next (match_info, NULL);
+	}
+
+	g_assert_cmpuint (n_matches, ==, n_spans);
+
+	g_match_info_free (match_info);
+	g_regex_unref (regex);
+	g_free (spans);
+}
+
+/* Checks that a context matching @pattern finds its matches in @text */
+static void
+check_pattern (const gchar *pattern,
+	       const gchar *text)
+{
+	GtkSourceHighlighter *highlighter;
+	gchar *escaped, *definition;
+
+	escaped = g_markup_escape_text (pattern, -1);
+	definition = g_strdup_printf ("<match>%s</match>", escaped);
+
+	highlighter = new_highlighter_for_definition (definition);
+	check_spans (highlighter, pattern, text);
+
+	g_object_unref (highlighter);
+	g_free (definition);
+	g_free (escaped);
+}
+
+/* Checks that a keyword context finds the same words in @text as the
+ * plain alternation of @keywords */
+static void
+check_keywords (const gchar **keywords,
+		const gchar  *text)
+{
+	GtkSourceHighlighter *highlighter;
+	GString *definition;
+	gchar *joined, *pattern;
+	guint i;
+
+	definition = g_string_new (NULL);
+
+	for (i = 0; keywords[i] != NULL; i++)
+		g_string_append_printf (definition, "<keyword>%s</keyword>", keywords[i]);
+
+	joined = g_strjoinv ("|", (gchar **) keywords);
+	pattern = g_strdup_printf ("\\b(?:%s)\\b", joined);
+
+	highlighter = new_highlighter_for_definition (definition->str);
+	check_spans (highlighter, pattern, text);
+
+	g_object_unref (highlighter);
+	g_free (pattern);
+	g_free (joined);
+	g_string_free (definition, TRUE);
+}
+
+static void
+test_keyword_trie (void)
+{
+	/* Prefixes of each other, unsorted, and a duplicate */
+	const gchar *keywords[] = {
+		"int", "i", "integer", "if", "in", "float", "for",
+		"foreach", "in", "f", "do", "double", NULL
+	};
+	/* Only one keyword */
+	const gchar *keyword[] = { "while", NULL };
+
+	check_keywords (keywords,
+			"i if in int integer intx iff fo for foreach foreachx "
+			"f float do double doubl x_if if_ 1if (int)i;");
+	check_keywords (keyword, "while whiles awhile while_ (while)");
+}
+
+static void
+test_prefilter (void)
+{
+	check_pattern ("foo|bar", "a foo, a bar, a baz");
+	check_pattern ("[a-c]+x", "aax ddx cx");
+	check_pattern ("\\d+|\\s#", "abc 12 # d");
+	check_pattern ("(?:ab)?c", "xxc xabc");
+	check_pattern ("[[:digit:]]+", "abc 123");
+	check_pattern ("[[:^digit:]]", "12a");
+	check_pattern ("x$", "axbx");
+}
+
+static void
+test_prefilter_posix_class (void)
+{
+	/* "[:" without ":]" is not a posix class: '[' is a
+	 * character of the class. */
+	check_pattern ("[[:]x", "a[x :x");
+	check_pattern ("[[:]x|:]y", "a[x :x :]y");
+	check_pattern ("[[:]", "a:b");
+}
+
+static void
+test_prefilter_start_anchor (void)
+{
+	/* \G matches where the search starts: skipping characters
+	 * which can't start a match would make it match elsewhere. */
+	check_pattern ("\\Gfoo", "xfoo");
+	check_pattern ("\\Gfoo", "foofoo xfoo");
+}
+
+static void
+test_prefilter_caseless (void)
+{
+	/* U+212A KELVIN SIGN and U+017F LATIN SMALL LETTER LONG S
+	 * match 'k' and 's' without case, whatever pcre thinks about
+	 * it the highlighter must find the same matches. */
+	check_pattern ("(?i)k", "a\xe2\x84\xaa k K");
+	check_pattern ("(?i)[k]", "a\xe2\x84\xaa k K");
+	check_pattern ("(?i)[j-l]x", "a\xe2\x84\xaax");
+	check_pattern ("(?i)s", "a\xc5\xbf s S");
+	check_pattern ("(?i)\\x{212a}", "a k K \xe2\x84\xaa");
+	check_pattern ("(?i)[\\x{17f}]", "a s S \xc5\xbf");
+}
+
+static const gchar *c_text =
+	"int x; /* note */\n"
+	"char *s = \"str\";\n";
+
+static GtkSourceHighlighter *
+new_c_highlighter (void)
+{
+	GtkSourceLanguageManager *lm;
+	GtkSourceLanguage *language;
+	GtkSourceHighlighter *highlighter;
+	gchar *dirs[] = { TOP_SRCDIR "/data/language-specs", NULL };
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, dirs);
+
+	language = gtk_source_language_manager_get_language (lm, "c");
+	g_assert (language != NULL);
+
+	highlighter = gtk_source_highlighter_new (language);
+	g_assert (gtk_source_highlighter_get_language (highlighter) == language);
+
+	g_object_unref (lm);
+
+	return highlighter;
+}
+
+static gboolean
+has_span (GtkSourceStyleSpan *spans,
+	  guint               n_spans,
+	  gint                offset,
+	  gint                length,
+	  const gchar        *style_id)
+{
+	guint i;
+
+	for (i = 0; i < n_spans; ++i)
+		if (spans[i].offset == offset &&
+		    spans[i].length == length &&
+		    strcmp (spans[i].style_id, style_id) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void
+test_highlight_text (void)
+{
+	GtkSourceHighlighter *highlighter;
+	GtkSourceStyleSpan *spans;
+	guint n_spans, i;
+
+	highlighter = new_c_highlighter ();
+	spans = gtk_source_highlighter_highlight_text (highlighter, c_text, -1,
+						       &n_spans);
+
+	g_assert (spans != NULL);
+	g_assert (has_span (spans, n_spans, 0, 3, "c:type"));
+	g_assert (has_span (spans, n_spans, 7, 10, "c:comment"));
+	g_assert (has_span (spans, n_spans, 28, 5, "c:string"));
+
+	for (i = 1; i < n_spans; ++i)
+		g_assert_cmpint (spans[i - 1].offset, <=, spans[i].offset);
+
+	g_free (spans);
+
+	/* Nothing to highlight */
+	spans = gtk_source_highlighter_highlight_text (highlighter, "", 0,
+						       &n_spans);
+	g_assert (spans == NULL);
+	g_assert_cmpuint (n_spans, ==, 0);
+
+	g_object_unref (highlighter);
+}
+
+static void
+test_highlight_stream (void)
+{
+	GtkSourceHighlighter *highlighter;
+	GtkSourceStyleSpan *spans, *text_spans;
+	GInputStream *stream;
+	guint n_spans, n_text_spans, i;
+	GError *error = NULL;
+
+	highlighter = new_c_highlighter ();
+
+	stream = g_memory_input_stream_new_from_data (c_text, -1, NULL);
+	spans = gtk_source_highlighter_highlight_stream (highlighter, stream, NULL,
+							 &n_spans, &error);
+	g_assert_no_error (error);
+	g_object_unref (stream);
+
+	text_spans = gtk_source_highlighter_highlight_text (highlighter, c_text, -1,
+							    &n_text_spans);
+
+	g_assert_cmpuint (n_spans, ==, n_text_spans);
+
+	for (i = 0; i < n_spans; ++i)
+	{
+		g_assert_cmpint (spans[i].offset, ==, text_spans[i].offset);
+		g_assert_cmpint (spans[i].length, ==, text_spans[i].length);
+		g_assert_cmpstr (spans[i].style_id, ==, text_spans[i].style_id);
+	}
+
+	g_free (spans);
+	g_free (text_spans);
+
+	stream = g_memory_input_stream_new_from_data ("int \xff;", -1, NULL);
+	spans = gtk_source_highlighter_highlight_stream (highlighter, stream, NULL,
+							 &n_spans, &error);
+	g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+	g_assert (spans == NULL);
+	g_assert_cmpuint (n_spans, ==, 0);
+	g_error_free (error);
+	g_object_unref (stream);
+
+	g_object_unref (highlighter);
+}
+
+static void
+test_highlight_invalid_text (void)
+{
+	GtkSourceHighlighter *highlighter;
+
+	highlighter = new_c_highlighter ();
+
+	/* Invalid text is refused even if checks are disabled. */
+	if (g_test_trap_fork (0, G_TEST_TRAP_SILENCE_STDERR))
+	{
+		GtkSourceStyleSpan *spans;
+		guint n_spans;
+
+		g_log_set_always_fatal (G_LOG_LEVEL_CRITICAL);
+		spans = gtk_source_highlighter_highlight_text (highlighter,
+							       "int \xff;", -1,
+							       &n_spans);
+		g_assert (spans == NULL);
+		g_assert_cmpuint (n_spans, ==, 0);
+		exit (0);
+	}
+	g_test_trap_assert_passed ();
+	g_test_trap_assert_stderr ("*not valid UTF-8*");
+
+	g_object_unref (highlighter);
+}
+
+typedef struct
+{
+	GtkSourceHighlighter	*highlighter;
+	const gchar		*text;
+	GtkSourceStyleSpan	*spans;
+	guint			 n_spans;
+} HighlightData;
+
+static gpointer
+highlight_thread (HighlightData *data)
+{
+	gint i;
+
+	/* Keep only the last result, they must all be the same. */
+	for (i = 0; i < 5; ++i)
+	{
+		g_free (data->spans);
+		data->spans = gtk_source_highlighter_highlight_text (data->highlighter,
+								     data->text, -1,
+								     &data->n_spans);
+	}
+
+	return NULL;
+}
+
+static void
+test_highlight_threads (void)
+{
+	GtkSourceHighlighter *highlighter;
+	GtkSourceStyleSpan *spans;
+	HighlightData data[4];
+	GThread *threads[4];
+	GString *text;
+	guint n_spans;
+	guint i, j;
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 500; ++i)
+		g_string_append (text, c_text);
+
+	highlighter = new_c_highlighter ();
+	spans = gtk_source_highlighter_highlight_text (highlighter, text->str, -1,
+						       &n_spans);
+	g_assert_cmpuint (n_spans, >, 0);
+
+	/* The same highlighter is used by all the threads at once. */
+	for (i = 0; i < G_N_ELEMENTS (threads); ++i)
+	{
+		data[i].highlighter = highlighter;
+		data[i].text = text->str;
+		data[i].spans = NULL;
+		data[i].n_spans = 0;
+
+		threads[i] = g_thread_create ((GThreadFunc) highlight_thread,
+					      &data[i], TRUE, NULL);
+		g_assert (threads[i] != NULL);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (threads); ++i)
+	{
+		g_thread_join (threads[i]);
+
+		g_assert_cmpuint (data[i].n_spans, ==, n_spans);
+
+		for (j = 0; j < n_spans; ++j)
+		{
+			g_assert_cmpint (data[i].spans[j].offset, ==, spans[j].offset);
+			g_assert_cmpint (data[i].spans[j].length, ==, spans[j].length);
+			g_assert (data[i].spans[j].style_id == spans[j].style_id);
+		}
+
+		g_free (data[i].spans);
+	}
+
+	g_free (spans);
+	g_string_free (text, TRUE);
+	g_object_unref (highlighter);
+}
+
+int
+main (int argc, char** argv)
+{
+	gint ret;
+
+	/* Highlighters are used from several threads */
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	lang_dir = g_strdup_printf ("%s/test-highlighter-%d",
+				    g_get_tmp_dir (), (gint) getpid ());
+	g_assert (g_mkdir_with_parents (lang_dir, 0755) == 0);
+
+	/* Do not use the cache of the user */
+	g_setenv ("XDG_CACHE_HOME", lang_dir, TRUE);
+
+	gtk_test_init (&argc, &argv);
+
+	g_test_add_func ("/Highlighter/highlight-text", test_highlight_text);
+	g_test_add_func ("/Highlighter/highlight-stream", test_highlight_stream);
+	g_test_add_func ("/Highlighter/highlight-invalid-text", test_highlight_invalid_text);
+	g_test_add_func ("/Highlighter/highlight-threads", test_highlight_threads);
+	g_test_add_func ("/Highlighter/keyword-trie", test_keyword_trie);
+	g_test_add_func ("/Highlighter/prefilter", test_prefilter);
+	g_test_add_func ("/Highlighter/prefilter-posix-class", test_prefilter_posix_class);
+	g_test_add_func ("/Highlighter/prefilter-start-anchor", test_prefilter_start_anchor);
+	g_test_add_func ("/Highlighter/prefilter-caseless", test_prefilter_caseless);
+
+	ret = g_test_run ();
+
+	remove_dir (lang_dir);
+	g_free (lang_dir);
+
+	return ret;
+}
@@ -1,8 +1,40 @@
 #include "config.h"
 #include <string.h>
+#include <unistd.h>
 
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <gtksourceview/gtksourcelanguagemanager.h>
+#include <gtksourceview/gtksourcehighlighter.h>
+
+static void
+remove_dir (const gchar *dirname)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (dirname, 0, NULL);
+
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+	{
+		gchar *filename;
+
+		filename = g_build_filename (dirname, name, NULL);
+
+		if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+			remove_dir (filename);
+		else
+			g_unlink (filename);
+
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+	g_rmdir (dirname);
+}
 
 static void
 test_get_default (void)
@@ -109,14 +141,333 @@ test_guess_language (void)
 	g_assert_cmpstr (gtk_source_language_get_id (l), ==, "xslt");
 }
 
+static void
+test_guess_languages (void)
+{
+	GtkSourceLanguageManager *lm;
+	const gchar *filenames[] = {
+		"foo.c",		/* extension */
+		"GNUmakefile",		/* whole name */
+		"ChangeLog.old",	/* wildcard */
+		"test.Rout.save",	/* longer suffix */
+		"foo.nosuchlanguage",
+		""
+	};
+	const gchar *expected[] = {
+		"c", "makefile", "changelog", "r", NULL, NULL
+	};
+	GtkSourceLanguage *languages[G_N_ELEMENTS (filenames)];
+	guint i;
+
+	lm = gtk_source_language_manager_get_default ();
+
+	gtk_source_language_manager_guess_languages (lm, filenames,
+						     G_N_ELEMENTS (filenames),
+						     languages);
+
+	for (i = 0; i < G_N_ELEMENTS (filenames); ++i)
+	{
+		const gchar *id = NULL;
+
+		if (languages[i] != NULL)
+			id = gtk_source_language_get_id (languages[i]);
+
+		g_assert_cmpstr (id, ==, expected[i]);
+
+		if (*filenames[i] != '\0')
+			g_assert (languages[i] ==
+				  gtk_source_language_manager_guess_language (lm, filenames[i], NULL));
+	}
+}
+
+static GtkSourceLanguageManager *
+new_manager (void)
+{
+	GtkSourceLanguageManager *lm;
+	gchar *dirs[] = { TOP_SRCDIR "/data/language-specs", NULL };
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, dirs);
+
+	return lm;
+}
+
+static GtkSourceStyleSpan *
+highlight_with_new_manager (const gchar *text,
+			    guint       *n_spans)
+{
+	GtkSourceLanguageManager *lm;
+	GtkSourceLanguage *l;
+	GtkSourceHighlighter *highlighter;
+	GtkSourceStyleSpan *spans;
+
+	lm = new_manager ();
+
+	l = gtk_source_language_manager_get_language (lm, "c");
+	g_assert (l != NULL);
+
+	highlighter = gtk_source_highlighter_new (l);
+	spans = gtk_source_highlighter_highlight_text (highlighter, text, -1, n_spans);
+
+	g_object_unref (highlighter);
+	g_object_unref (lm);
+
+	return spans;
+}
+
+static void
+test_language_cache (void)
+{
+	const gchar *text =
+		"#include <stdio.h>\n"
+		"/* TODO: say more */\n"
+		"int\n"
+		"main (void)\n"
+		"{\n"
+		"\tprintf (\"%d\\n\", 0x2a); // answer\n"
+		"\treturn 0;\n"
+		"}\n";
+	GtkSourceStyleSpan *fresh, *cached;
+	guint n_fresh, n_cached, i;
+	gchar *cache_file;
+	struct stat written, used;
+
+	cache_file = g_build_filename (g_get_user_cache_dir (),
+				       "gtksourceview-3.0",
+				       "language-specs",
+				       "c.langcache",
+				       NULL);
+	g_unlink (cache_file);
+
+	/* The first manager parses the lang files and writes the cache,
+	 * the second one reads it. */
+	fresh = highlight_with_new_manager (text, &n_fresh);
+	g_assert (g_stat (cache_file, &written) == 0);
+
+	cached = highlight_with_new_manager (text, &n_cached);
+
+	/* The cache is written to a new file which replaces the old
+	 * one, so the file would be another one if the second manager
+	 * had to parse the lang files. */
+	g_assert (g_stat (cache_file, &used) == 0);
+	g_assert (written.st_ino == used.st_ino);
+	g_assert (written.st_mtime == used.st_mtime);
+
+	g_assert_cmpuint (n_fresh, >, 0);
+	g_assert_cmpuint (n_fresh, ==, n_cached);
+
+	for (i = 0; i < n_fresh; ++i)
+	{
+		g_assert_cmpint (fresh[i].offset, ==, cached[i].offset);
+		g_assert_cmpint (fresh[i].length, ==, cached[i].length);
+		g_assert_cmpstr (fresh[i].style_id, ==, cached[i].style_id);
+	}
+
+	g_free (fresh);
+	g_free (cached);
+	g_free (cache_file);
+}
+
+static void
+test_language_index (void)
+{
+	GtkSourceLanguageManager *lm1, *lm2;
+	const gchar * const *ids1;
+	const gchar * const *ids2;
+	gchar *checksum;
+	gchar *basename;
+	gchar *index_file;
+	guint i;
+
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5,
+						  TOP_SRCDIR "/data/language-specs",
+						  -1);
+	basename = g_strconcat (checksum, ".index", NULL);
+	index_file = g_build_filename (g_get_user_cache_dir (),
+				       "gtksourceview-3.0",
+				       "language-specs",
+				       basename,
+				       NULL);
+	g_unlink (index_file);
+
+	/* The first manager reads the lang files and writes the index,
+	 * the second one reads it. */
+	lm1 = new_manager ();
+	ids1 = gtk_source_language_manager_get_language_ids (lm1);
+	g_assert (g_file_test (index_file, G_FILE_TEST_IS_REGULAR));
+
+	lm2 = new_manager ();
+	ids2 = gtk_source_language_manager_get_language_ids (lm2);
+
+	g_assert_cmpuint (g_strv_length ((gchar **) ids1), ==,
+			  g_strv_length ((gchar **) ids2));
+
+	for (i = 0; ids1[i] != NULL; ++i)
+	{
+		GtkSourceLanguage *l1, *l2;
+		gchar **globs1, **globs2;
+		gchar **mime1, **mime2;
+		gchar *joined1, *joined2;
+
+		g_assert_cmpstr (ids1[i], ==, ids2[i]);
+
+		l1 = gtk_source_language_manager_get_language (lm1, ids1[i]);
+		l2 = gtk_source_language_manager_get_language (lm2, ids2[i]);
+
+		g_assert_cmpstr (gtk_source_language_get_name (l1), ==,
+				 gtk_source_language_get_name (l2));
+		g_assert_cmpstr (gtk_source_language_get_section (l1), ==,
+				 gtk_source_language_get_section (l2));
+		g_assert (gtk_source_language_get_hidden (l1) ==
+			  gtk_source_language_get_hidden (l2));
+
+		globs1 = gtk_source_language_get_globs (l1);
+		globs2 = gtk_source_language_get_globs (l2);
+		joined1 = globs1 ? g_strjoinv (";", globs1) : NULL;
+		joined2 = globs2 ? g_strjoinv (";", globs2) : NULL;
+		g_assert_cmpstr (joined1, ==, joined2);
+		g_free (joined1);
+		g_free (joined2);
+		g_strfreev (globs1);
+		g_strfreev (globs2);
+
+		mime1 = gtk_source_language_get_mime_types (l1);
+		mime2 = gtk_source_language_get_mime_types (l2);
+		joined1 = mime1 ? g_strjoinv (";", mime1) : NULL;
+		joined2 = mime2 ? g_strjoinv (";", mime2) : NULL;
+		g_assert_cmpstr (joined1, ==, joined2);
+		g_free (joined1);
+		g_free (joined2);
+		g_strfreev (mime1);
+		g_strfreev (mime2);
+	}
+
+	g_object_unref (lm1);
+	g_object_unref (lm2);
+	g_free (checksum);
+	g_free (basename);
+	g_free (index_file);
+}
+
+static void
+preload_done (GObject      *object,
+	      GAsyncResult *result,
+	      gpointer      user_data)
+{
+	GMainLoop *loop = user_data;
+	GError *error = NULL;
+
+	g_assert (gtk_source_language_manager_preload_languages_finish (GTK_SOURCE_LANGUAGE_MANAGER (object),
+									result,
+									&error));
+	g_assert_no_error (error);
+
+	g_main_loop_quit (loop);
+}
+
+static void
+test_preload_languages (void)
+{
+	GtkSourceLanguageManager *lm;
+	GMainLoop *loop;
+	const gchar *files[] = { "c.lang", "gtk-doc.lang", "def.lang",
+				 "python.lang", "language2.rng", NULL };
+	gchar *ids[] = { "c", "python", "nosuchlanguage", NULL };
+	gchar *dirs[] = { NULL, NULL };
+	gint i;
+
+	/* Use a copy of the files needed, so that they can be removed
+	 * after the languages are preloaded: then the languages can
+	 * only be used if they were really loaded. */
+	dirs[0] = g_strdup_printf ("%s/test-languagemanager-preload-%d",
+				   g_get_tmp_dir (), (gint) getpid ());
+	g_assert (g_mkdir_with_parents (dirs[0], 0755) == 0);
+
+	for (i = 0; files[i] != NULL; ++i)
+	{
+		gchar *src, *dest, *contents;
+		gsize length;
+
+		src = g_build_filename (TOP_SRCDIR, "data", "language-specs",
+					files[i], NULL);
+		dest = g_build_filename (dirs[0], files[i], NULL);
+
+		g_assert (g_file_get_contents (src, &contents, &length, NULL));
+		g_assert (g_file_set_contents (dest, contents, length, NULL));
+
+		g_free (contents);
+		g_free (src);
+		g_free (dest);
+	}
+
+	lm = gtk_source_language_manager_new ();
+	gtk_source_language_manager_set_search_path (lm, dirs);
+	loop = g_main_loop_new (NULL, FALSE);
+
+	gtk_source_language_manager_preload_languages_async (lm, ids, NULL,
+							     preload_done, loop);
+	g_main_loop_run (loop);
+
+	/* The cached definitions are not valid anymore either, since
+	 * they depend on the files. */
+	for (i = 0; files[i] != NULL; ++i)
+	{
+		gchar *filename;
+
+		filename = g_build_filename (dirs[0], files[i], NULL);
+		g_assert (g_unlink (filename) == 0);
+		g_free (filename);
+	}
+
+	g_rmdir (dirs[0]);
+
+	for (i = 0; i < 2; ++i)
+	{
+		GtkSourceLanguage *l;
+		gchar **style_ids;
+
+		l = gtk_source_language_manager_get_language (lm, ids[i]);
+		g_assert (l != NULL);
+
+		style_ids = gtk_source_language_get_style_ids (l);
+		g_assert (style_ids != NULL);
+		g_strfreev (style_ids);
+	}
+
+	g_main_loop_unref (loop);
+	g_object_unref (lm);
+	g_free (dirs[0]);
+}
+
 int
 main (int argc, char** argv)
 {
+	gchar *cache_dir;
+	gint ret;
+
+	/* Languages are preloaded in threads */
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	/* Do not use the cache of the user */
+	cache_dir = g_strdup_printf ("%s/test-languagemanager-%d",
+				     g_get_tmp_dir (), (gint) getpid ());
+	g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
 	gtk_test_init (&argc, &argv);
 
 	g_test_add_func ("/LanguageManager/get-default", test_get_default);
 	g_test_add_func ("/LanguageManager/get-language", test_get_language);
 	g_test_add_func ("/LanguageManager/guess-language", test_guess_language);
+	g_test_add_func ("/LanguageManager/guess-languages", test_guess_languages);
+	g_test_add_func ("/LanguageManager/language-cache", test_language_cache);
+	g_test_add_func ("/LanguageManager/language-index", test_language_index);
+	g_test_add_func ("/LanguageManager/preload-languages", test_preload_languages);
+
+	ret = g_test_run ();
+
+	remove_dir (cache_dir);
+	g_free (cache_dir);
 
-	return g_test_run();
+	return ret;
 }
@@ -0,0 +1,257 @@
+#include "config.h"
+#include <string.h>
+
+#include <gtk/gtk.h>
+#include <gtksourceview/gtksourcebuffer.h>
+#include <gtksourceview/gtksourcelargefilepolicy.h>
+
+#define LARGE_TIER (GTK_SOURCE_LARGE_FILE_TIER_VIEWPORT_HIGHLIGHT | \
+		    GTK_SOURCE_LARGE_FILE_TIER_DEFERRED_WORDS)
+#define HUGE_TIER (GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES | \
+		   GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO)
+#define LONG_LINES_TIER (GTK_SOURCE_LARGE_FILE_TIER_NO_BRACKET_MATCHING | \
+			 GTK_SOURCE_LARGE_FILE_TIER_NO_CONTEXT_CLASSES)
+
+static GtkSourceBuffer *
+new_buffer (gint max_chars,
+	    gint max_line_length,
+	    gint max_undo_levels)
+{
+	GtkSourceLargeFilePolicy *policy;
+	GtkSourceBuffer *buffer;
+
+	policy = gtk_source_large_file_policy_new ();
+	gtk_source_large_file_policy_set_max_chars (policy, max_chars);
+	gtk_source_large_file_policy_set_max_line_length (policy, max_line_length);
+	gtk_source_large_file_policy_set_max_undo_levels (policy, max_undo_levels);
+
+	buffer = gtk_source_buffer_new (NULL);
+	gtk_source_buffer_set_large_file_policy (buffer, policy);
+	g_object_unref (policy);
+
+	return buffer;
+}
+
+static void
+delete_line (GtkSourceBuffer *buffer,
+	     gint             line)
+{
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, line);
+	end = start;
+	gtk_text_iter_forward_line (&end);
+	gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+}
+
+static gint
+count_undo_levels (GtkSourceBuffer *buffer)
+{
+	gint levels = 0;
+
+	while (gtk_source_buffer_can_undo (buffer))
+	{
+		gtk_source_buffer_undo (buffer);
+		++levels;
+	}
+
+	return levels;
+}
+
+static void
+test_tier_thresholds (void)
+{
+	GtkSourceLargeFilePolicy *policy;
+
+	policy = gtk_source_large_file_policy_new ();
+	gtk_source_large_file_policy_set_max_chars (policy, 100);
+	gtk_source_large_file_policy_set_max_line_length (policy, 10);
+
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 100, FALSE), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 101, FALSE), ==,
+			 LARGE_TIER);
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 403, FALSE), ==,
+			 LARGE_TIER);
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 404, FALSE), ==,
+			 LARGE_TIER | HUGE_TIER);
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 0, TRUE), ==,
+			 LONG_LINES_TIER);
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, 101, TRUE), ==,
+			 LARGE_TIER | LONG_LINES_TIER);
+
+	/* -1 turns a threshold off */
+	gtk_source_large_file_policy_set_max_chars (policy, -1);
+	gtk_source_large_file_policy_set_max_line_length (policy, -1);
+
+	g_assert_cmpint (gtk_source_large_file_policy_get_tier (policy, G_MAXINT, TRUE), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	g_object_unref (policy);
+}
+
+static void
+test_no_default_policy (void)
+{
+	GtkSourceBuffer *buffer;
+	GString *text;
+
+	/* Buffers keep all their features unless asked otherwise */
+	buffer = gtk_source_buffer_new (NULL);
+	g_assert (gtk_source_buffer_get_large_file_policy (buffer) == NULL);
+
+	text = g_string_new (NULL);
+	while (text->len < 100000)
+		g_string_append_c (text, 'a');
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static void
+test_buffer_transitions (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter, start, end;
+
+	buffer = new_buffer (20, 5, -1);
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "ab\ncd\n", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	/* Two long lines */
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "0123456\n0123456\n", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LARGE_TIER | LONG_LINES_TIER);
+
+	/* Shortening the first one leaves the other */
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &start, 2, 3);
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &end, 2, 7);
+	gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LONG_LINES_TIER);
+
+	/* Removing the other one, no long lines are left */
+	delete_line (buffer, 3);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	/* Deleting several lines at once, one of them long */
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "ab\n0123456\ncd\n", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LONG_LINES_TIER);
+
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &start, 0, 1);
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &end, 2, 1);
+	gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	/* Joining two lines makes a long one */
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "abc\ndef", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, 1);
+	gtk_text_buffer_backspace (GTK_TEXT_BUFFER (buffer), &iter, FALSE, TRUE);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LONG_LINES_TIER);
+
+	/* Growing past both character thresholds and back */
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "", -1);
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "abcd\nabcd\nabcd\nabcd\nabcd\n", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LARGE_TIER);
+
+	while (gtk_text_buffer_get_char_count (GTK_TEXT_BUFFER (buffer)) / 4 <= 20)
+	{
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &iter);
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "abcd\n", -1);
+	}
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LARGE_TIER | HUGE_TIER);
+
+	delete_line (buffer, 0);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LARGE_TIER);
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "abcd\n", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	/* Without a policy nothing is turned off */
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "0123456789", -1);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 LONG_LINES_TIER);
+	gtk_source_buffer_set_large_file_policy (buffer, NULL);
+	g_assert_cmpint (gtk_source_buffer_get_large_file_tier (buffer), ==,
+			 GTK_SOURCE_LARGE_FILE_TIER_NONE);
+
+	g_object_unref (buffer);
+}
+
+static void
+fill_with_undo_levels (GtkSourceBuffer *buffer,
+		       gint             levels)
+{
+	GtkTextIter iter;
+	gint i;
+
+	for (i = 0; i < levels; ++i)
+	{
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &iter);
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "ab\n", -1);
+	}
+
+	g_assert (gtk_source_buffer_get_large_file_tier (buffer) &
+		  GTK_SOURCE_LARGE_FILE_TIER_LIMITED_UNDO);
+}
+
+static void
+test_undo_levels (void)
+{
+	GtkSourceLargeFilePolicy *policy;
+	GtkSourceBuffer *buffer;
+
+	/* By default a huge buffer keeps all its undo levels */
+	policy = gtk_source_large_file_policy_new ();
+	g_assert_cmpint (gtk_source_large_file_policy_get_max_undo_levels (policy), ==, -1);
+	g_object_unref (policy);
+
+	buffer = new_buffer (2, -1, -1);
+	fill_with_undo_levels (buffer, 30);
+	g_assert_cmpint (count_undo_levels (buffer), ==, 30);
+	g_object_unref (buffer);
+
+	buffer = new_buffer (2, -1, 5);
+	fill_with_undo_levels (buffer, 30);
+	g_assert_cmpint (count_undo_levels (buffer), ==, 5);
+	g_object_unref (buffer);
+
+	/* The buffer's own limit wins when it is lower */
+	buffer = new_buffer (2, -1, 5);
+	gtk_source_buffer_set_max_undo_levels (buffer, 3);
+	fill_with_undo_levels (buffer, 30);
+	g_assert_cmpint (count_undo_levels (buffer), ==, 3);
+	g_object_unref (buffer);
+}
+
+int
+main (int argc, char** argv)
+{
+	gtk_test_init (&argc, &argv);
+
+	g_test_add_func ("/LargeFilePolicy/tier-thresholds", test_tier_thresholds);
+	g_test_add_func ("/LargeFilePolicy/no-default-policy", test_no_default_policy);
+	g_test_add_func ("/LargeFilePolicy/buffer-transitions", test_buffer_transitions);
+	g_test_add_func ("/LargeFilePolicy/undo-levels", test_undo_levels);
+
+	return g_test_run();
+}